@@ -0,0 +1,84 @@
+#!/bin/sh
+# BENCHMARK DRIVER (make bench)
+# Usage: ./bench.sh [ops]
+#   Builds one image per shape below with mkimage.x, runs OPS (default 200)
+#   of each operation against a fresh copy through fatperf.x (fat.x built
+#   with -DFAT_PERF) in batch mode, and prints the per-command latencies
+#   from its perf report as CSV, one line per shape and command:
+#     shape,command,calls,avg_us,p50_us,p99_us,max_us
+#   p50 and p99 are the upper bounds of power-of-two microsecond buckets.
+
+OPS=${1:-200}
+WORK=${TMPDIR:-/tmp}/fatbench.$$
+mkdir -p "$WORK" || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# SHAPES -- name, then mkimage.x options: fanout (-d), levels (-l) and files
+# per directory (-f) also decide the paths the operations use
+SHAPES="
+small -m 64 -d 4 -l 2 -f 16 -z 4096
+wide -m 256 -d 1 -l 1 -f 4000 -z 1024
+deep -m 128 -d 2 -l 6 -f 8 -z 2048
+bigcluster -m 256 -c 8 -d 4 -l 2 -f 64 -z 1000-65536
+fragmented -m 128 -d 4 -l 2 -f 32 -z 32768 -F 50
+"
+
+# Commands for one shape, on stdout. Work happens in the first-level
+# directories (the root when there are none), new files named Nnnnnn.DAT
+# and copies Cnnnnn.DAT
+script()
+{
+  awk -v ops="$OPS" -v fanout="$1" -v levels="$2" -v files="$3" \
+      -v size="$4" 'BEGIN {
+    dirs = (levels > 0 && fanout > 0) ? fanout : 0
+    for (i = 0; i < ops; i++) {
+      dir[i] = (dirs > 0) ? sprintf("D%03d/", i % dirs) : ""
+      new[i] = sprintf("%sN%05d.DAT", dir[i], i)
+      copy[i] = sprintf("%sC%05d.DAT", dir[i], i)
+      old[i] = sprintf("%sF%05d.DAT", dir[0], i % files)
+    }
+    for (i = 0; i < ops; i++) printf "ls %s\n", (dir[i] == "") ? "." : dir[i]
+    for (i = 0; i < ops; i++)
+      if (dir[i] != "") printf "cd %s\ncd /\n", dir[i]
+    for (i = 0; i < ops; i++) printf "creat %s\n", new[i]
+    for (i = 0; i < ops; i++)
+      printf "open %s rw\nwrite %s 4096 \"x\"\nclose %s\n", new[i], new[i],
+             new[i]
+    if (files > 0)
+      for (i = 0; i < ops; i++)
+        printf "open %s r\nread %s %d\nclose %s\n", old[i], old[i], size,
+               old[i]
+    if (files > 0)
+      for (i = 0; i < ops; i++) printf "cp %s %s\n", old[i], copy[i]
+    for (i = 0; i < ops; i++) printf "rm %s\n", new[i]
+    if (files > 0)
+      for (i = 0; i < ops; i++) printf "rm %s\n", copy[i]
+    print "perf"
+  }'
+}
+
+echo "shape,command,calls,avg_us,p50_us,p99_us,max_us"
+echo "$SHAPES" | while read -r name options; do
+  [ -n "$name" ] || continue
+  set -- $options
+  fanout=4; levels=2; files=16; size=4096
+  while [ $# -gt 1 ]; do
+    case $1 in
+      -d) fanout=$2 ;;
+      -l) levels=$2 ;;
+      -f) files=$2 ;;
+      -z) size=${2%%-*} ;;
+    esac
+    shift 2
+  done
+
+  ./mkimage.x $options "$WORK/$name.img" > /dev/null || exit 1
+  script "$fanout" "$levels" "$files" "$size" > "$WORK/$name.cmd"
+  ./fatperf.x -b "$WORK/$name.cmd" "$WORK/$name.img" > "$WORK/$name.out" \
+    2> /dev/null
+  awk -v shape="$name" '
+    $1 == "COMMAND" && $2 == "CALLS" { table = 1; next }
+    table && NF == 6 { printf "%s,%s,%s,%s,%s,%s,%s\n", shape, $1, $2, $3,
+                       $4, $5, $6 }' "$WORK/$name.out"
+  rm -f "$WORK/$name.img"
+done
@@ -1,7 +1,22 @@
+#define _GNU_SOURCE // pread/pwrite, pthread rwlocks
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
 
 //----------------------------STRUCT DECLARATIONS-------------------------------
 
@@ -51,7 +66,6 @@ typedef struct{
 
 // DIRECTORY ENTRY STRUCTURE
 // Refer to pages 23-24 of Microsoft FAT Specification document
-// NOTE: Does not support long directory names
 typedef struct {
 
   uint8_t DIR_Name[11]; // offset 0
@@ -71,7 +85,7 @@ typedef struct {
 
 // LONG NAME DIRECTORY ENTRY STRUCTURE
 // Refer to pages 30-31 of Microsoft FAT Specification document
-// NOTE: Does not support long directory names
+// NOTE: Up to 20 of these precede a DIR_ENTRY, last part of the name first
 typedef struct {
 
   uint8_t LDIR_Ord; // offset 0
@@ -85,80 +99,756 @@ typedef struct {
 
 } __attribute__((packed)) LDIR_ENTRY; // NOTE: Fixed Size of 32B
 
+#define LFN_MAX 255 // UTF-16 units in a long name
+#define LFN_SLOTS_MAX 20 // LDIR_ENTRYs needed for LFN_MAX units, 13 each
+#define NAME_BUFFER (LFN_MAX * 3 + 1) // Long name as UTF-8 (plus /0)
+#define INVALID_NAME "Invalid filename. Up to 255 characters, none of " \
+                     "\\/:*?\"<>| supported.\n"
+
+// NAMED ENTRY -- a live DIR_ENTRY with the name it is known by: its long
+// name when a valid set of LDIR_ENTRYs precedes it, else its 8.3 name
+typedef struct{
+
+  DIR_ENTRY entry;
+  char* name; // UTF-8, malloc'd (see FreeDirectory())
+  uint32_t slot; // position of the DIR_ENTRY in its directory, in entries
+  int long_slots; // LDIR_ENTRYs directly before it
+  off_t offset; // IMAGEFILE offset of the DIR_ENTRY
+} NAMED_ENTRY;
+
+// DIRECTORY INDEX -- case-insensitive hash of one directory's names, long
+// and 8.3 alike. Built on first lookup, dropped when an entry is added,
+// removed or renamed (see FindEntry())
+#define DIR_INDEX_BUCKETS 256
+#define DIR_INDEX_MAX 1024 // Indexes held before the whole cache is emptied
+typedef struct DIR_INDEX{
+
+  uint32_t cluster_no; // first cluster of the directory
+  NAMED_ENTRY* entries;
+  int count, capacity;
+  int* table; // entry no. + 1 per slot, 0 if empty (linear probing)
+  uint32_t table_size; // power of two, kept above twice the no. of keys
+  uint32_t keys; // names hashed into table (up to two per entry)
+  struct DIR_INDEX* next; // next index in the same hash bucket
+} DIR_INDEX;
+
 // OPENFILE STRUCTURE -- USED IN GLOBAL OPENFILE_LIST
 typedef struct{
 
-  char file[12]; // filename (plus /0 terminator)
+  char file[NAME_BUFFER]; // filename (plus /0 terminator)
+  off_t entry; // IMAGEFILE offset of its DIR_ENTRY, 0 if unallocated --
+               // what identifies the file, whatever name or case it is
+               // given by
   int first_cluster; // firs cluster no.
-  char m[2]; // mode -- r, w, rw, or wr
+  char m[3]; // mode -- r, w, rw, or wr (plus /0 terminator)
   int offset; // offset (must be <= file size)
+  pthread_mutex_t lock; // per-handle lock, guards offset during read/write
 } OPENFILE;
 
+// DIRECTORY LOCK -- ONE READER-WRITER LOCK PER DIRECTORY CLUSTER
+// Created on first use and kept in a small hash table keyed by the
+// directory's first cluster (see DirLock())
+typedef struct DIR_LOCK{
+
+  uint32_t cluster_no; // first cluster of the directory
+  pthread_rwlock_t lock;
+  struct DIR_LOCK* next; // next lock in the same hash bucket
+} DIR_LOCK;
+
+enum { DIR_LOCK_READ = 1, DIR_LOCK_WRITE = 2 };
+#define DIR_LOCK_MULTI 4 // Command flag: locks more than one directory,
+                         // so it runs under NAMESPACE_LOCK
+#define COMMAND_WRITES 8 // Command flag: changes the image though it only
+                         // reads its directory, refused under --ro
+#define COMMAND_SNAPSHOT 16 // Command flag: runs alone against the image,
+                            // with every command that changes it drained
+
+// ALLOCATION POLICY -- where the search for free clusters starts (see
+// AllocationStart()). The goal is the cluster new data should sit near: the
+// parent directory for a file's first cluster, the previous cluster when a
+// chain grows, DirectoryGoal() for a new directory's table
+typedef enum{
+
+  ALLOC_FIRST_FIT, // lowest free cluster, goal ignored
+  ALLOC_NEAR, // first free cluster at or after the goal
+  ALLOC_GROUP // as near, and each new directory starts in a group of its own
+} ALLOC_POLICY_KIND;
+#define ALLOC_GROUPS 64 // Allocation groups the data region is split into
+#define ALLOC_GROUP_MIN 1024 // Smallest group, in clusters
+
+// PERF COUNTERS -- I/O, allocation and command latency, kept only in builds
+// with -DFAT_PERF (make perf); otherwise the PERF_ macros compile to nothing
+enum { PERF_RESERVED, PERF_FAT, PERF_DIRECTORY, PERF_DATA, PERF_REGIONS };
+#define PERF_BUCKETS 32 // Latency bucket k counts [2^k, 2^k+1) microseconds
+#define PERF_COMMANDS_MAX 128 // Latency slots, one per COMMAND_TABLE entry
+typedef struct{
+
+  unsigned long long reads[PERF_REGIONS], writes[PERF_REGIONS]; // device
+                                                   // calls, by region
+  unsigned long long bytes_read[PERF_REGIONS], bytes_written[PERF_REGIONS];
+  unsigned long long seeks[PERF_REGIONS]; // accesses not starting where
+                                          // the previous one ended
+  unsigned long long cache_hits, cache_misses; // BLOCK_CACHE blocks
+  unsigned long long fat_walked; // FAT entries looked up
+  unsigned long long allocated, freed; // clusters
+} PERF_COUNTERS;
+
+typedef struct{
+
+  unsigned long long calls, total_ns, max_ns;
+  unsigned long long histogram[PERF_BUCKETS];
+} PERF_LATENCY;
+
+#ifdef FAT_PERF
+#define PERF_ADD(counter, n) \
+  __atomic_fetch_add(&PERF.counter, (n), __ATOMIC_RELAXED)
+#define PERF_IO(write, size, offset) PerfIO((write), (size), (offset))
+#define PERF_FILE_DATA \
+  __attribute__((cleanup(PerfLeaveFileData))) int perf_scope = \
+  PerfEnterFileData() // Data region I/O in this scope is file data
+#define PERF_TIMER(start) \
+  struct timespec start; \
+  clock_gettime(CLOCK_MONOTONIC, &start)
+#define PERF_COMMAND(command, start) PerfCommand((command), &(start))
+#else
+#define PERF_ADD(counter, n) ((void) 0)
+#define PERF_IO(write, size, offset) ((void) 0)
+#define PERF_FILE_DATA ((void) 0)
+#define PERF_TIMER(start) ((void) 0)
+#define PERF_COMMAND(command, start) ((void) 0)
+#endif
+
+// PATH CACHE ENTRY -- a directory path already resolved (see WalkPath())
+#define PATH_CACHE_SLOTS 1024 // Direct-mapped by hash of start and path
+typedef struct{
+
+  uint32_t start; // cluster the path is relative to (root if absolute)
+  char* path; // as typed, no trailing '/', NULL if the slot is empty
+  uint32_t cluster_no; // directory the path leads to
+  unsigned long generation; // PATH_GENERATION when it was resolved
+} PATH_CACHE_ENTRY;
+
+// BLOCK CACHE ENTRY -- one CACHE_BLOCK_SIZE piece of IMAGEFILE
+#define CACHE_BLOCK_SIZE 4096 // bytes per cached block
+#define CACHE_BLOCKS 4096 // blocks held (16 MB), direct-mapped by block no.
+#define CACHE_BYPASS (64 * 1024) // reads this large go straight to IMAGEFILE
+typedef struct{
+
+  off_t block_no; // IMAGEFILE offset / CACHE_BLOCK_SIZE, -1 if empty
+  int length; // valid bytes (short only for the last block of IMAGEFILE)
+  char data[CACHE_BLOCK_SIZE];
+} CACHE_BLOCK;
+
+// COMMAND STATUS CODES -- set by Error(), reported per command in batch mode
+enum {
+  STATUS_OK = 0,
+  STATUS_USAGE = 1, // wrong number or form of arguments
+  STATUS_NOT_FOUND = 2, // file or directory does not exist
+  STATUS_EXISTS = 3, // name already in use, file already open
+  STATUS_INVALID = 4, // wrong type, mode, offset or state
+  STATUS_NO_SPACE = 5, // out of clusters or open file slots
+  STATUS_UNKNOWN = 6, // command not found
+  STATUS_IO = 7 // IMAGEFILE could not be read or written
+};
+
+// BATCH READER -- command lines from a script file (mapped whole) or from
+// a non-interactive stdin (read in large chunks), never one byte at a time
+typedef struct{
+
+  int fd; // stdin when streaming, -1 once EOF is reached or when mapped
+  char* data; // mapped script, or the read buffer
+  size_t length; // valid bytes in data
+  size_t position; // start of the next line in data
+  size_t capacity; // size of the read buffer, 0 when mapped
+  char* line; // NUL-terminated copy of the current line
+  size_t line_capacity;
+} BATCH_READER;
+
+// IMPORT NODE -- one host file or directory found by the import pre-pass
+typedef struct IMPORT_NODE{
+
+  char* name; // host name, becomes the long name
+  uint8_t short_name[11]; // 8.3 alias, unique among its siblings
+  int long_slots; // LDIR_ENTRYs written before its DIR_ENTRY
+  char* path; // host path
+  int is_dir;
+  off_t size; // file size in bytes
+  uint32_t count; // directories: number of children
+  uint32_t clusters; // clusters to preallocate (data or directory table)
+  uint32_t first_cluster; // start of the preallocated chain, 0 if none
+  int failed; // not created (metadata stage only)
+  int copy_failed; // created, but its data could not be copied (workers)
+  struct IMPORT_NODE* child; // first child (directories)
+  struct IMPORT_NODE* next; // next sibling
+} IMPORT_NODE;
+
+// IMPORT QUEUE -- one per worker. The owner takes jobs from the tail, idle
+// workers steal from the head
+typedef struct{
+
+  IMPORT_NODE** jobs;
+  int head, tail;
+  pthread_mutex_t lock;
+} IMPORT_QUEUE;
+
+// IMPORT STATE -- shared by the metadata stage and the copy workers
+typedef struct{
+
+  IMPORT_QUEUE* queues;
+  int workers;
+  int next_queue; // round-robin target for the next job
+  int available; // jobs queued and not yet taken
+  int producing; // metadata stage still running
+  pthread_mutex_t lock; // guards available and producing
+  pthread_cond_t ready;
+} IMPORT_STATE;
+
+// TAR STREAM -- export-tar output pipeline. A reader thread walks the tree
+// and fills fixed slots with headers and file data; the command's thread
+// writes full slots out. Memory stays at TAR_SLOTS * TAR_SLOT_SIZE
+#define TAR_SLOT_SIZE (1 << 20)
+#define TAR_SLOTS 4
+#define TAR_PATH_MAX 4096 // Longest member path walked. ustar holds 255,
+                          // longer ones go in a pax extended header
+typedef struct{
+
+  char* slots[TAR_SLOTS];
+  int length[TAR_SLOTS]; // bytes used in each slot
+  long produced, consumed; // slots published / written, ever
+  int fill; // bytes in the slot being filled (reader side)
+  int done; // reader finished
+  int failed; // output failed, reader should stop
+  int files, dirs; // exported so far
+  char** skipped; // paths too deep to walk, reported once written
+  int skipped_count;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  uint32_t root; // directory being exported
+} TAR_STREAM;
+
+// TREE WALK -- a subtree read by a pool of workers. Directories still to be
+// read wait on a shared stack; each worker reads one, reports its entries
+// to the visitor and pushes the subdirectories it found
+#define WALK_WORKERS_MAX 16
+#define WALK_PATH_MAX 4096 // Longest path walked, deeper entries are skipped
+typedef struct WALK_DIR{
+
+  uint32_t cluster_no; // first cluster of the directory
+  char* path; // relative to the walk's root, "" for the root
+  struct WALK_DIR* next; // next directory on the stack
+} WALK_DIR;
+
+typedef void (*WALK_VISIT)(const char* path, NAMED_ENTRY* entry,
+                           uint32_t dir, int worker, void* arg); // Called
+                           // once per entry found in directory dir, path
+                           // is relative to the root, worker the caller's
+                           // index
+
+typedef struct{
+
+  WALK_DIR* pending; // directories not yet read
+  int busy; // workers reading a directory (and so maybe pushing more)
+  WALK_VISIT visit;
+  void* arg; // passed on to visit
+  pthread_mutex_t lock; // guards pending and busy
+  pthread_cond_t ready;
+} WALK_STATE;
+
+typedef struct{
+
+  WALK_STATE* state;
+  int self; // index passed to visit
+} WALK_WORKER_ARG;
+
+// SUBTREE SIZE -- what lies below one directory, kept up to date in the
+// sidecar size index (IMAGEFILE.du) so du does not walk the tree
+typedef struct{
+
+  uint32_t cluster_no; // first cluster of the directory, 0 if slot empty
+  uint32_t parent; // first cluster of its parent, the root is its own
+  uint32_t table; // clusters of the directory's own table
+  uint32_t files, dirs; // entries below it, at any depth
+  uint64_t bytes; // file data below it
+  uint64_t clusters; // file chains and directory tables below it
+} SUBTREE_SIZE;
+
+// SIZE INDEX FILE -- header of IMAGEFILE.du, followed by count SUBTREE_SIZEs.
+// Valid only while IMAGEFILE's mtime is the one saved with it: any write
+// to the image after the index was saved, by this program or another,
+// changes it
+#define SIZE_INDEX_MAGIC "FATSIZE1"
+typedef struct{
+
+  char magic[8];
+  int64_t image_mtime_sec, image_mtime_nsec; // IMAGEFILE's generation
+  int64_t image_size;
+  uint32_t count;
+} SIZE_INDEX_HEADER;
+
+// BLOCK DEVICE -- where IMAGEFILE's bytes live: the image file itself, a
+// --overlay delta over it, memory (--ram) or a shared read-only mapping
+// (--ro). Ranges are in bytes; every caller already works in whole sectors
+// or clusters
+typedef struct{
+
+  const char* name;
+  ssize_t (*read)(void* buffer, size_t size, off_t offset); // bytes read,
+                                                 // short at end of image
+  int (*write)(const void* buffer, size_t size, off_t offset); // 0 or -1
+  int (*flush)(void); // Make every write so far durable, 0 or -1
+  int (*discard)(off_t offset, off_t size); // Contents no longer needed,
+                                            // read back as zeros; 0 or -1
+} BLOCK_DEVICE;
+
+// OVERLAY DELTA FILE -- header of a --overlay delta. A presence map of one
+// bit per OVERLAY_SECTOR of the base follows at OVERLAY_MAP_START, then the
+// sectors themselves at their base offset plus OVERLAY_DATA, leaving holes
+// where nothing was written. Valid only for the base as it was when the
+// delta was started (see OpenOverlay())
+#define OVERLAY_MAGIC "FATDELT1"
+#define OVERLAY_SECTOR 512 // Fixed, so the map is known before BOOT is read
+#define OVERLAY_MAP_START 4096
+enum { OVERLAY_MOUNT, OVERLAY_COMMIT, OVERLAY_DISCARD }; // OpenOverlay()
+typedef struct{
+
+  char magic[8];
+  int64_t base_mtime_sec, base_mtime_nsec; // base image's generation
+  int64_t base_size;
+} OVERLAY_HEADER;
+
+// CHECK PROBLEM -- one inconsistency found by check(), kept per worker
+#define CHECK_REPORT_MAX 20 // Problems listed per kind, the rest counted
+enum {
+  CHECK_FAT_COPY, // A FAT copy differs from FAT 1 (repaired: copied over)
+  CHECK_BAD_NEXT, // Chain leads to a free or invalid cluster (repaired: ends)
+  CHECK_BAD_ENTRY, // DIR_ENTRY starts at a free or invalid cluster
+  CHECK_CROSS_LINK, // Cluster on more than one chain
+  CHECK_LOOP, // Directory chain that never ends
+  CHECK_SHORT, // File size beyond its chain (repaired: size cut)
+  CHECK_LONG, // Chain beyond the file size (repaired: chain cut)
+  CHECK_LOST, // Allocated, on no chain (repaired: freed)
+  CHECK_KINDS
+};
+typedef struct{
+
+  int kind;
+  uint32_t cluster; // where it was found (first of a run for counts)
+  uint32_t count; // clusters in the chain, links, or entries affected
+  uint32_t size; // DIR_FileSize, FAT copy no. for CHECK_FAT_COPY
+  uint32_t dir; // directory holding the entry
+  off_t offset; // IMAGEFILE offset of the DIR_ENTRY, 0 if none
+  char* path; // entry concerned, NULL if none (malloc'd)
+} CHECK_PROBLEM;
+
+typedef struct{
+
+  _Alignas(64) CHECK_PROBLEM* problems; // Own line, workers append at once
+  int count, capacity;
+  uint32_t allocated; // clusters in use in the worker's FAT range
+} CHECK_LIST;
+
+typedef struct{
+
+  uint32_t* fat; // FAT_CACHE, or FAT 1 read for the check
+  uint32_t entries; // entries in one FAT
+  uint32_t clusters; // ClusterLimit()
+  uint8_t* links; // per cluster: FAT entries and DIR_ENTRYs pointing at it
+  uint8_t* reached; // per cluster: on the chain of some entry
+  int phase; // 0 FAT scan, 2 lost and cross-linked clusters (1 is the walk)
+  int workers;
+  CHECK_LIST lists[WALK_WORKERS_MAX];
+} CHECK_STATE;
+
+typedef struct{
+
+  CHECK_STATE* state;
+  int self; // this worker's list and range of the FAT
+} CHECK_WORKER_ARG;
+
+// DEFRAG FILE -- a file defrag may move, found by a walk (see defrag())
+typedef struct{
+
+  char* path; // relative to where defrag started (malloc'd)
+  uint32_t dir; // directory holding its DIR_ENTRY
+  off_t offset; // IMAGEFILE offset of the DIR_ENTRY
+  uint32_t first_cluster;
+  uint32_t clusters; // chain length
+  uint32_t extents; // runs of consecutive clusters, 1 if contiguous
+} DEFRAG_FILE;
+
+typedef struct{
+
+  DEFRAG_FILE* files[WALK_WORKERS_MAX];
+  int count[WALK_WORKERS_MAX], capacity[WALK_WORKERS_MAX];
+} DEFRAG_STATE;
+
+// FREE RUN -- consecutive free clusters, from the free map at defrag start
+typedef struct{
+
+  uint32_t start, length;
+} FREE_RUN;
+
+// STATS -- per worker share of the file layout walk (see stats()), padded
+// so workers do not share a cache line
+#define STATS_BUCKETS 33 // Histogram bucket k counts values in [2^k, 2^k+1)
+#define STATS_TOP 10 // Most fragmented files listed
+typedef struct{
+
+  char* path;
+  uint32_t extents, clusters;
+} STATS_FILE;
+
+typedef struct{
+
+  _Alignas(64) unsigned long files, dirs;
+  unsigned long long extents; // over every file with a chain
+  unsigned long extent_histogram[STATS_BUCKETS]; // files by extent count
+  STATS_FILE top[STATS_TOP]; // most extents first
+  int top_count;
+} STATS_TOTALS;
+
+// STATS FREE SPACE -- totals of the FAT pass (see StatsScan()), which loads
+// FAT_VECTOR_LANES entries at once with GCC vector extensions: SSE2/AVX or
+// NEON instructions whatever the optimization level
+#define FAT_VECTOR_LANES 4 // 16 bytes, a register on every target
+typedef uint32_t FAT_VECTOR __attribute__((vector_size(16), aligned(4)));
+typedef int32_t FAT_VECTOR_MASK __attribute__((vector_size(16)));
+                         // Lanes of a comparison: -1 true, 0 false
+typedef uint64_t FAT_VECTOR_PAIRS __attribute__((vector_size(16)));
+typedef struct{
+
+  FAT_VECTOR free_lanes, bad_lanes; // per lane counts, summed at the end
+  uint32_t free_count, bad; // entries counted one at a time
+  uint32_t run, largest; // free run still open, longest closed one
+  unsigned long extents;
+  unsigned long histogram[STATS_BUCKETS]; // free extents by length
+} STATS_FREE;
+
+// ALLOC BENCH -- one policy's run of allocbench (see AllocBench()). Seeks
+// model a disk head: every cluster not right after the one before is a seek
+typedef struct{
+
+  double build, sequential, listing; // seconds per phase
+  unsigned long sequential_seeks, listing_seeks;
+  unsigned long long sequential_distance, listing_distance; // in clusters
+  unsigned long extents, files;
+} ALLOC_BENCH_RESULT;
+
+// LOAD -- one run of the load command (see load()). Clients work in their
+// own directories, on a fixed set of file slots each
+#define LOAD_CLIENTS_MAX 64 // Each holds one OPENFILE at a time
+#define LOAD_FILES_MAX 9999 // Slot names are CnnFnnnn
+enum { LOAD_CREATE, LOAD_APPEND, LOAD_READ, LOAD_DELETE, LOAD_OPS };
+typedef struct{
+
+  int clients, ops, rounds, files; // ops per round, over all clients
+  int mix[LOAD_OPS]; // relative weights, by LOAD_ op
+  int min_size, max_size; // bytes written by a create
+  int log_sizes; // sizes log-uniform (many small files), else uniform
+  int append; // bytes added by an append
+  unsigned seed;
+  int keep; // leave LOADWORK in place afterwards
+} LOAD_SPEC;
+
+typedef struct{
+
+  LOAD_SPEC* spec;
+  int id;
+  uint32_t cwd; // LOADWORK/Cnn
+  unsigned seed; // rand_r() state, so runs repeat
+  int* sizes; // bytes per file slot, -1 when the slot is empty
+  int ops; // this round
+  unsigned long long* ns; // latency of every op, whole run
+  unsigned char* kind; // LOAD_ op of every op
+  long done; // entries used in ns and kind
+  unsigned long failures;
+} LOAD_CLIENT;
+
+// SESSION -- one client connected to the daemon (see Serve())
+typedef struct{
+
+  int fd; // connected Unix socket
+  uint32_t cwd; // this client's current working directory cluster
+} SESSION;
+
+// TRACE RECORD -- one command line of a --record trace (see Replay()).
+// Output is kept as its length and hash, not its bytes
+typedef struct{
+
+  char* line; // command as typed, quoted so get_tokens() splits it back
+  unsigned long long start_ns, latency_ns; // since recording started
+  int session; // 0 for the shell or batch, daemon clients from 1
+  int status; // STATUS_ code
+  size_t length; // bytes of output
+  uint64_t hash; // FNV-1a of output
+} TRACE_RECORD;
+
 //------------------------------GLOBAL VARIABLES--------------------------------
 
-FILE* IMAGEFILE; // Given in argv[1]
+int IMAGE_FD; // Given in argv[1], accessed ONLY through positional I/O
+              // (pread/pwrite) so no stream position is shared by threads
+BLOCK_DEVICE* DEVICE; // Backend chosen by MountImage()
+const char* OVERLAY_PATH; // --overlay: IMAGE_FD is then the read-only base
+int OVERLAY_FD = -1; // Delta file, -1 when writes go to IMAGEFILE itself
+uint8_t* OVERLAY_MAP; // Presence map, one bit per base sector
+int64_t OVERLAY_SIZE; // Bytes in the base, the most the image can hold
+off_t OVERLAY_DATA; // Delta offset of base offset 0
+pthread_rwlock_t OVERLAY_LOCK = PTHREAD_RWLOCK_INITIALIZER; // Shared by
+                            // reads, exclusive for writes (partial sectors
+                            // are copied up first)
+int RAM_MODE = 0; // --ram: IMAGEFILE loaded whole into RAM_IMAGE
+int RO_MODE = 0; // --ro: IMAGEFILE mapped shared and read-only at
+                 // RAM_IMAGE, commands that would change it refused
+char* RAM_IMAGE; // The image, hugepage-backed where the kernel allows
+size_t RAM_SIZE, RAM_MAPPED; // Image bytes, and mapping length
+const char* RAM_PATH; // Written back here (via RAM_PATH.tmp) by flush
+int RAM_DIRTY = 0; // Written since loaded or last flushed
 BPB BOOT; // Reading in BPB struct, Boot Info, Size consistent at 90 bytes
 int FIRST_CLUSTER; // Clusters 0 and 1 are reserved, data starts at 2
 
-int MAX_STACK_SIZE = 50; // Maximum directories supported in stack
-int CURRENT_STACK_SIZE = 0; // Current size valid of DIR_STACK entries
-int DIR_STACK[51]; // DIR_STACK to keep track of traversing directories
+_Thread_local FILE* OUT; // Command output: stdout for the shell, a memory
+                         // stream per command for daemon sessions
+_Thread_local int COMMAND_STATUS; // STATUS_ code of the running command
 
 OPENFILE OPENFILE_LIST[101]; // List of OPENFILEs for reading or writing
 int OPENFILE_LIST_SIZE = 0; // No. of valid entries in OPENFILE_LIST
 
+// LOCKING -- lock order is: SNAPSHOT_LOCK, directory locks (parent before
+// child), then OPENFILE_LIST_LOCK, then an OPENFILE handle lock, then
+// ALLOC_LOCK
+#define DIR_LOCK_BUCKETS 64
+DIR_LOCK* DIR_LOCK_TABLE[DIR_LOCK_BUCKETS]; // Directory locks by cluster_no
+pthread_mutex_t DIR_LOCK_TABLE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ALLOC_LOCK = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+                            // Guards FAT updates and FREE_CLUSTER_HINT
+pthread_mutex_t OPENFILE_LIST_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t DIR_INDEX_LOCK = PTHREAD_MUTEX_INITIALIZER; // Guards
+                            // DIR_INDEX_TABLE, never held across I/O
+pthread_mutex_t NAMESPACE_LOCK = PTHREAD_MUTEX_INITIALIZER; // Taken before
+                            // any directory lock by DIR_LOCK_MULTI commands
+                            // so at most one thread holds two at once
+pthread_rwlock_t SNAPSHOT_LOCK = PTHREAD_RWLOCK_INITIALIZER; // Shared by
+                            // every command that changes the image (nested
+                            // ones too: readers are preferred), exclusive
+                            // for COMMAND_SNAPSHOT ones such as sync
+uint32_t FREE_CLUSTER_HINT; // Free map: no free cluster exists below this
+ALLOC_POLICY_KIND ALLOC_POLICY = ALLOC_FIRST_FIT; // Set by -a or alloc
+const char* ALLOC_POLICY_NAMES[] = { "first", "near", "group" };
+uint32_t ALLOC_GROUP_ROTOR = 0; // Group the next new directory tries first,
+                                // under ALLOC_LOCK
+PERF_COUNTERS PERF; // Updated with relaxed atomics (FAT_PERF builds)
+PERF_LATENCY PERF_COMMANDS[PERF_COMMANDS_MAX]; // By COMMAND_TABLE index
+off_t PERF_NEXT_OFFSET; // Where the last device access ended
+_Thread_local int PERF_IN_FILE_DATA; // Depth of PERF_FILE_DATA scopes
+const char* PERF_PATH; // -p: JSON dump written here on exit
+FILE* TRACE; // --record: every command appended here, NULL when off
+pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER; // Guards TRACE
+struct timespec TRACE_START; // Recording start, record times count from it
+struct timespec TRACE_WALL; // Wall clock at TRACE_START, in the trace header
+_Thread_local time_t TRACE_NOW; // Recording or replaying: the wall-clock
+                                // second the command started, which
+                                // FatTime() reports instead of the time
+int TRACE_SESSIONS = 0; // Daemon sessions started, for session ids
+_Thread_local int TRACE_SESSION; // This thread's session id, 0 for shell
+_Thread_local int TRACE_ACTIVE; // Inside a recorded command: commands it
+                                // runs itself (allocbench) are not recorded
+
+// CACHES -- filled at mount, kept warm for the life of the process
+uint32_t* FAT_CACHE; // Copy of the first FAT, NULL if too large to hold
+uint32_t FAT_CACHE_ENTRIES; // No. of entries in FAT_CACHE
+CACHE_BLOCK* BLOCK_CACHE; // Write-through cache of IMAGEFILE blocks
+DIR_INDEX* DIR_INDEX_TABLE[DIR_INDEX_BUCKETS]; // Name indexes by cluster_no
+int DIR_INDEX_COUNT = 0; // No. of indexes in DIR_INDEX_TABLE
+PATH_CACHE_ENTRY PATH_CACHE[PATH_CACHE_SLOTS]; // Resolved directory paths
+unsigned long PATH_GENERATION = 0; // Bumped when a directory is removed or
+                                   // moved, expiring every cached path
+pthread_mutex_t PATH_CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t BLOCK_CACHE_LOCKS[64]; // Striped by cache slot
+SUBTREE_SIZE* SIZE_INDEX; // Open-addressed by cluster_no, NULL if the
+                          // image has no size index
+uint32_t SIZE_INDEX_CAPACITY; // Slots in SIZE_INDEX, a power of two
+uint32_t SIZE_INDEX_COUNT; // Directories in SIZE_INDEX
+char* SIZE_INDEX_PATH; // IMAGEFILE.du
+pthread_mutex_t SIZE_INDEX_LOCK = PTHREAD_MUTEX_INITIALIZER; // Never held
+                                                           // across I/O
+
 //---------------------------PARSER.C DECLARATIONS------------------------------
 // PROVIDED CODE FOR PARSING
 
+// Tokens are carved out of the input line itself, which serves as the
+// arena: no copies and no heap allocations per command
+#define MAX_TOKENS 64
+
 typedef struct {
 int size;
-char **items;
+char *items[MAX_TOKENS + 1]; // NULL terminated, point into the input line
 } tokenlist;
 
 char *get_input(void);
-tokenlist *get_tokens(char *input);
-tokenlist *new_tokenlist(void);
-void add_token(tokenlist *tokens, char *item);
-void free_tokens(tokenlist *tokens);
+int get_tokens(char *input, tokenlist *tokens); // -1 if over MAX_TOKENS,
+                         // reported as the command's result, so callers
+                         // only skip the line
+
+// COMMAND TABLE ENTRY -- looked up through a perfect hash of the name
+typedef struct {
+  const char* name;
+  int min_tokens, max_tokens; // Valid token counts, command name included
+  int lock_mode; // DIR_LOCK_WRITE if the command may add, remove or rewrite
+                 // a DIR_ENTRY in its directory, else DIR_LOCK_READ
+                 // (plus DIR_LOCK_MULTI, see NAMESPACE_LOCK, and
+                 // COMMAND_WRITES)
+  int path_arg; // Token holding the path of the entry worked on, 0 if none
+                // (or PATH_ARG_LAST). Its directory is the one locked and
+                // passed to run(), and the token is cut to the last component
+  int (*run)(tokenlist* tokens, uint32_t dir, uint32_t* CWD); // dir: where
+                // the path_arg entry lives (else the CWD). Returns 1 on exit
+  const char* usage;
+} COMMAND;
+
+#define COMMAND_SLOTS 128 // Power of two, well above the number of commands
+#define PATH_ARG_LAST -1 // path_arg: the last token, unless it is an option
+
+// LS OPTIONS -- listing format and order (see ls_CWD())
+enum {
+  LS_LONG = 1, // -l: size, attributes, clusters and time per entry
+  LS_SORT_NAME = 2, // --sort=name
+  LS_SORT_SIZE = 4, // --sort=size, largest first
+  LS_SORT_CLUSTER = 8 // --sort=cluster, by first cluster
+};
 
 //--------------------------FUNCTION DECLARATIONS-------------------------------
 
 // HELPER FUNCTIONS-----------------------------------------------
 
+// POSITIONAL I/O (thread-safe, no shared file position)
+int FullRead(int fd, void* buffer, size_t size, off_t offset); // pread
+                         // until size bytes arrive, 0 success, -1 error
+int FullWrite(int fd, const void* buffer, size_t size, off_t offset);
+                         // pwrite all size bytes, 0 success, -1 error
+int DeviceRead(void* buffer, size_t size, off_t offset); // pread straight
+                         // from IMAGEFILE, bypassing the block cache
+int DeviceWrite(const void* buffer, size_t size, off_t offset); // pwrite
+                         // straight to IMAGEFILE
+int ReadImage(void* buffer, size_t size, off_t offset); // pread size bytes
+                         // at byte offset of IMAGEFILE, 0 success, -1 error
+int WriteImage(const void* buffer, size_t size, off_t offset); // pwrite
+                         // size bytes at byte offset, 0 success, -1 error
+
+// CACHES
+void LoadFATCache(void); // Read the first FAT into FAT_CACHE
+void InitBlockCache(void); // Allocate an empty BLOCK_CACHE
+void InvalidateBlockCache(off_t offset, off_t size); // Drop cached blocks
+                         // of a range written without WriteImage()
+
+// LOCKING
+DIR_LOCK* Find_DIR_LOCK(uint32_t cluster_no); // Get (or create) the rwlock
+                         // of the directory starting at cluster_no
+void DirLock(uint32_t cluster_no, int mode); // Take directory rwlock for
+                         // reading or writing, re-entrant for this thread
+void DirUnlock(uint32_t cluster_no); // Release lock taken by DirLock()
+
 // TRAVERSING THE FAT
 int ClusterNo_to_FATOffset(uint32_t cluster_no); // Return IMAGEFILE offset in
                                              // FAT refered to by cluster_no
+int WriteFAT(const void* entries, size_t size, uint32_t cluster_no); //
+                                  // Write FAT entries to every FAT copy
 uint32_t NextClusterNo(uint32_t cluster_no); // Retern next cluster as specified
                                              // in IMAGEFILE's FAT
 uint32_t Get_Child_Cluster_No(DIR_ENTRY dir); // Return cluster_no of file/dir
                                               // within DIR_ENTRY struct
-uint32_t Find_Free_Cluster(void); // Returns first free cluster no.
+uint32_t ClusterLimit(void); // One past the last cluster of the data region
+uint32_t Find_Free_Cluster(uint32_t goal); // Returns first free cluster no.
+                                           // the policy finds from goal
+uint32_t AllocateChain(uint32_t count, uint32_t goal); // Claim and link count
+                         // free clusters, return the first, -1 if not enough
+uint32_t AllocationStart(uint32_t goal); // First cluster to search from
+uint32_t DirectoryGoal(uint32_t parent); // Goal for a new directory's table
+uint32_t AllocGroupSize(void); // Clusters per allocation group
+int ParseAllocPolicy(const char* name); // ALLOC_ value of a name, -1 if none
 
 // TRAVERSING THE DATA REGION
-int ClusterNo_To_DataOffset(uint32_t cluster_no); // Returns offset in data
+off_t ClusterNo_To_DataOffset(uint32_t cluster_no); // Returns offset in data
                              // region of IMAGEFILE refered to by cluster_no
 DIR_ENTRY Get_DIR_ENTRY(char* entry, uint32_t cluster_no); // Given filename
                              // & CWD cluster_no, return DIR_ENTRY struct
-int Get_DIR_ENTRY_Offset (char* entry, uint32_t cluster_no); // Given filename
+off_t Get_DIR_ENTRY_Offset (char* entry, uint32_t cluster_no); // Given filename
               // & CWD, return offset of DIR_ENTRY in data region of IMAGEFILE
-int GetFreeEntryOffset(uint32_t cluster_no); // Get data offset in IMAGEFILE
-                             // of first empty DIR_ENTRY in a cluster
+off_t SlotOffset(uint32_t cluster_no, uint32_t slot); // IMAGEFILE offset
+                             // of the slot-th entry of a directory
+int FindFreeSlots(uint32_t cluster_no, int count, off_t* offsets); // Find
+                             // count free entries in a row, growing the
+                             // directory if needed, 0 success, -1 error
 int DirAlreadyExists(char* dir, uint32_t cluster_no); // Check if directory
                              // exists within CWD cluster of IMAGEFILE
 int IsDirEmpty(char* dir, uint32_t cluster_no); // Check if a dir is empty
+int ReadDirectory(uint32_t cluster_no, NAMED_ENTRY** entries); // All live
+                             // entries of a directory (no ., .., LDIRs)
+                             // with their names, returns count
+void FreeDirectory(NAMED_ENTRY* entries, int count); // Free ReadDirectory()
+DIR_ENTRY* ReadDirectoryTable(uint32_t cluster_no, uint32_t** chain,
+                              uint32_t* clusters); // Every slot of a
+                             // directory and its chain, NULL on I/O error
 char* ReadToBuffer(char* buffer, int buffer_size, uint32_t cluster_no);
 // Convert cluster no to its data region offset, read to buffer for size bytes
-
+int ReadFileData(uint32_t first_cluster, int offset, char* buffer, int size);
+// Read size bytes at offset of the chain starting at first_cluster into
+// buffer, thread-safe, returns bytes read
+int WriteFileData(uint32_t first_cluster, int offset, const char* buffer,
+                  int size); // Write size bytes at offset of the chain
+                             // starting at first_cluster, growing the chain
+
+
+// LONG FILENAMES
+uint8_t ShortNameChecksum(const uint8_t* short_name); // LDIR_Chksum of an
+                             // 11 byte DIR_Name
+void ShortNameString(const uint8_t* short_name, char* name); // DIR_Name
+                             // as "NAME.EXT", name must hold 13 chars
+int ValidName(const char* name); // 1 if name can be given to a new entry
+int NameToUnits(const char* name, uint16_t* units); // UTF-8 to UTF-16,
+                             // returns no. of units, -1 if invalid or long
+void UnitsToName(const uint16_t* units, int count, char* name); // UTF-16
+                             // to UTF-8, name must hold NAME_BUFFER chars
+int MakeShortName(const char* name, uint8_t* short_name,
+                  int (*taken)(const char* name, void* arg), void* arg);
+                             // Unique 8.3 alias of name, returns 1 if a
+                             // long name is needed, -1 if none is free
+int MakeLongEntries(const char* name, const uint8_t* short_name,
+                    LDIR_ENTRY* slots); // LDIR_ENTRYs holding name, in
+                             // on-disk order, returns count
+int NameTakenIn(const char* name, void* cluster_no); // MakeShortName()
+                             // check against a directory of IMAGEFILE
+uint32_t HashName(const char* name); // Case-insensitive hash of a name
+
+// DIRECTORY INDEX
+void IndexAdd(DIR_INDEX* index, NAMED_ENTRY* entry); // Append entry and
+                             // hash its long and 8.3 names
+NAMED_ENTRY* IndexFind(DIR_INDEX* index, const char* name); // Entry named
+                             // name in any case, or NULL
+DIR_INDEX* BuildDirIndex(uint32_t cluster_no); // Read and index directory
+void FreeDirIndex(DIR_INDEX* index);
+int FindEntry(const char* name, uint32_t cluster_no, NAMED_ENTRY* found,
+              char* long_name); // Look name up in a directory, 1 if found.
+                             // long_name (NAME_BUFFER chars) may be NULL
+void InvalidateDirIndex(uint32_t cluster_no); // Drop a directory's index
 
 // IMAGEFILE MANIPULATION
 void rm_DIR_ENTRY(char* file, uint32_t cluster_no); // Remove DIR_ENTRY in CWD
                                                     // cluster of imagefile
+void DeallocateEntries(uint32_t cluster_no, NAMED_ENTRY* entries, int count);
+              // rm_DIR_ENTRY() for many entries, each cluster written once
 DIR_ENTRY create_newfile(char* file); // Create a new DIR_ENTRY of name file
+void FatTime(uint16_t* date, uint16_t* clock); // Current local time in
+                                // the FAT date and time formats
 void UpdateFileSize(char* file, uint32_t cluster_no, int new_size);
               // Update DIR_ENTRYs file size in CWD data region of IMAGEFILE
 void UpdateClusterInFAT(uint32_t cluster_no, uint32_t next_cluster);
                              // Update the next cluster a cluster points to in
                                                  // the IMAGEFILE's FAT Region
+void FreeChain(uint32_t first_cluster); // Mark every cluster of a chain free
+void FreeChains(uint32_t* first_clusters, int count); // Free many file
+              // chains, each FAT sector written once
+void WriteFATSectors(const uint8_t* dirty, uint32_t sectors); // Write the
+              // FAT_CACHE sectors flagged dirty, in runs (ALLOC_LOCK held)
 void AllocateClusterToEmptyFile(DIR_ENTRY current, int offset,
                                   uint32_t cluster_no);
               // Given a free cluster, change a DIR_ENTRY in IMAGEFILE's data
@@ -168,21 +858,40 @@ DIR_ENTRY UpdateTwoDotDirectory(DIR_ENTRY entry, uint32_t parent_cluster_no);
               // Update .. DIR_ENTRY to point to parent cluster no.
 
 // OPENFILE_LIST FUNCS
-int Get_OPENFILE_Entry(char* filename); // Return index of OPENFILE list entry
-void AddToList(uint32_t first_cluster, char* filename, char* mode, int offset);
+int Get_OPENFILE_Entry(off_t entry); // Return index of OPENFILE list entry
+                                    // for the DIR_ENTRY at entry, or -1
+void AddToList(uint32_t first_cluster, off_t entry, char* filename,
+               char* mode, int offset);
                                         // Add new entry to OEPNFILE_LIST
-int RemoveFromList(char* filename); // If valid filename, remove from list
+int RemoveFromList(off_t entry); // If entry is open, remove from list
+void MoveOpenFile(off_t from, off_t to); // DIR_ENTRY moved within IMAGEFILE
 void PrintList(void); // Print func for debugging
 
-// DIR_STACK HELPER FUNCS
-void DIR_push(uint32_t cluster_no); // Push directory cluster_no onto stack
-int DIR_pop(void);  // Pop cluster_no from stack
-int DIR_peek(void); // Peek at second to last entry of DIR_STACK
-                    // Looking at PREVIOUS dir, not current dir
+// PATH RESOLUTION
+int ResolvePath(char* path, uint32_t cwd, uint32_t* dir, char** name);
+                    // Split path into the cluster of its directory and its
+                    // last component (cut in place), 0 success, -1 error
+int WalkPath(char* path, uint32_t start, uint32_t* cluster_no); // Follow
+                    // every component of path from start to a directory
+uint32_t PathCacheSlot(uint32_t start, const char* path); // PATH_CACHE
+                    // slot of a path
+int PathCacheFind(uint32_t start, const char* path, uint32_t* cluster_no);
+                    // 1 and the directory if path is cached and current
+void PathCacheStore(uint32_t start, const char* path, uint32_t cluster_no,
+                    unsigned long generation); // Remember a resolved path
+void ExpirePaths(void); // Invalidate every cached path
+int IsPattern(const char* name); // Name holds a glob character (*?[)
+int MultiTarget(tokenlist* tokens, int end); // Tokens 1 to end-1 name
+                    // more than one entry or hold a pattern
+int ExpandTargets(tokenlist* tokens, int end, uint32_t dir, uint32_t cwd,
+                  NAMED_ENTRY** matched); // Entries of dir named or
+                    // matched by tokens 1 to end-1, in one pass
+
+// COMMAND STATUS
+void Error(int status, const char* format, ...); // Print an error message
+                         // and record status as the command's result
 
 // STRING UTILITIES
-char* RemoveWhiteSpaces(char* name); // Remove white spaces in strings for
-                                     // proper comparisons
 int ModeCheck(char* mode); // Check for valid mode when opening file
 
 // DEBUGGING
@@ -190,56 +899,600 @@ void Print_DIR(DIR_ENTRY current); // Print func for debugging
 void Print_LDIR(LDIR_ENTRY long_entry); // Print func for debugging
 
 // MAIN FUNCTIONS----------------------------------------------
+// NOTE: Commands sharing a name with a POSIX call (open, read, mkdir, ...)
+// carry a fat_ prefix so <unistd.h> can be included for pread/pwrite
 void info(void); // Parse boot sector & print relevant info
 void size(char* file, uint32_t cluster_no); // Print size in bytes of FILE file
-void ls_CWD(uint32_t cluster_no); // List contents of CWD
-void ls_dirname(char* dirname, uint32_t cluster_no); // List contents of DIRNAME
+void ls_CWD(uint32_t cluster_no, int options); // List contents of CWD
+void ls_dirname(char* dirname, uint32_t cluster_no, int options); // List
+                                // contents of DIRNAME
+int CompareName(const void* a, const void* b); // qsort NAMED_ENTRYs by name
+int CompareSize(const void* a, const void* b); // Largest first
+int CompareFirstCluster(const void* a, const void* b); // Disk order
+void AttrString(uint8_t attr, char* text); // "d---a" style attributes
+void FormatFatTime(uint16_t date, uint16_t time, char* text); // FAT date
+                                // and time as "YYYY-MM-DD HH:MM"
 int cd(char* dir, uint32_t cluster_no); // Change CWD to DIRNAME, 0 return for
                                 // failure, For success -- return new cluster_no
-void creat(char* file, uint32_t cluster_no, DIR_ENTRY NewFile);
+                                // (.. is read from disk, root is its own)
+void fat_creat(char* file, uint32_t cluster_no, DIR_ENTRY NewFile);
                                 // Create FILE file in CWD, size 0 bytes
-void mkdir(char* dir, uint32_t cluster_no); // Make directory DIRNAME in CWD
-void mv(char* dir1, char* dir2, uint32_t cluster_no); // Move file or dir --
-                                                      // mv FROM TO
+void fat_mkdir(char* dir, uint32_t cluster_no); // Make directory DIRNAME in CWD
+void mv(char* dir1, uint32_t cluster_no, char* dir2, uint32_t to_cluster_no);
+                            // Move file or dir -- mv FROM TO, each name
+                            // given with the directory it is relative to
 void mv_rename(char* oldName, char* newName); // Rename file or dir
-void open(char* file, char* mode, uint32_t cluster_no); // Opens FILE file in
+void fat_open(char* file, char* mode, uint32_t cluster_no); // Opens FILE file in
                // CWD -- open in modes r (read-only), w (write-only), rw, or wr
-void close(char* file, uint32_t cluster_no); // Close FILE file
-void lseek(char* file, int offset, uint32_t cluster_no); // Set offset of FILE
+void fat_close(char* file, uint32_t cluster_no); // Close FILE file
+void fat_lseek(char* file, int offset, uint32_t cluster_no); // Set offset of FILE
                                                          // file in bytes
-void read(char* file, int size, uint32_t cluster_no); // Read data from FILE
+void fat_read(char* file, int size, uint32_t cluster_no); // Read data from FILE
                // file starting at stored offset in open file list and for size
                // bytes and print to screen
-void write(char* file, int size, char* string, uint32_t cluster_no);
+void fat_write(char* file, int size, char* string, uint32_t cluster_no);
                // Write "string" to FILE file in CWD at offset
 void rm(char* file, uint32_t cluster_no); // Remove FILE file in CWD
-void cp(char* file, char* dir, uint32_t cluster_no); // Copy FILE file to a
-               // given directory or copy file contents to a new file
+void rm_many(NAMED_ENTRY* targets, int count, uint32_t cluster_no); //
+               // Remove files of one directory as one batch
+uint32_t CopyFileData(uint32_t first_cluster, uint32_t size, uint32_t goal);
+               // Copy a chain to a new one placed near goal, returns its
+               // first cluster, -1 on error
+void cp(char* file, uint32_t cluster_no, char* dir, uint32_t to_cluster_no);
+               // Copy FILE file to a given directory or copy file contents
+               // to a new file, each name given with its directory
 
 // EXTRA CREDIT FUNCTION
-void rmdir(char* dir, uint32_t cluster_no); // Remove dir DIRNAME from CWD
+void fat_rmdir(char* dir, uint32_t cluster_no); // Remove dir DIRNAME from CWD
+
+// HOST TRANSFER
+off_t CopyRange(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+                off_t size); // Copy between two fds, in kernel if possible
+off_t CopyChain(uint32_t first_cluster, int host_fd, off_t size,
+                int to_image); // Move size bytes between a cluster chain
+                         // and host_fd, one call per contiguous extent
+void put(char* hostpath, char* file, uint32_t cluster_no); // Copy host file
+                         // HOSTPATH into new FILE file in CWD
+void get(char* file, char* hostpath, uint32_t cluster_no); // Copy FILE file
+                         // in CWD out to host file HOSTPATH
+
+// BULK IMPORT
+IMPORT_NODE* ScanHostTree(const char* path, const char* name, int* files,
+                          int* dirs); // Pre-pass: host tree with sizes
+void FreeImportTree(IMPORT_NODE* node); // Free a ScanHostTree() result
+int AssignShortNames(IMPORT_NODE* dir); // 8.3 aliases for the children
+                         // of dir, returns entries their names need
+int ImportNameTaken(const char* name, void* index); // MakeShortName()
+                         // check against the siblings named so far
+uint32_t DirClusters(uint32_t entries); // Clusters for a directory table
+void QueueImportJob(IMPORT_STATE* state, IMPORT_NODE* file); // Hand a file
+                         // to the copy workers
+IMPORT_NODE* TakeImportJob(IMPORT_STATE* state, int self); // Own job, or
+                         // one stolen from another worker, NULL if none
+void* ImportWorker(void* arg); // Copy worker (thread body)
+void ImportEntries(IMPORT_NODE* dir, uint32_t cluster_no,
+                   uint32_t parent_cluster, IMPORT_STATE* state,
+                   int existing); // Metadata stage for one directory
+void ReportImport(IMPORT_NODE* dir, uint32_t cluster_no, int* files,
+                  int* dirs, off_t* bytes); // Remove files whose data could
+                         // not be copied, and count the rest
+
+// TAR EXPORT
+char* TarSpace(TAR_STREAM* tar, int* room); // Free space in the slot being
+                         // filled, waiting for the writer if all are full
+void TarCommit(TAR_STREAM* tar, int size); // Account for size bytes put
+                         // at TarSpace(), publish the slot once full
+void TarEmit(TAR_STREAM* tar, const void* data, int size); // Append bytes
+const char* UstarSplit(const char* path); // Where ustar splits path into
+                         // prefix and name (path itself if it fits the
+                         // name field), NULL if it cannot hold it
+void TarBlock(TAR_STREAM* tar, const char* path, char type, int mode,
+              long long size, long long mtime); // One ustar header block
+void TarHeader(TAR_STREAM* tar, const char* path, DIR_ENTRY* entry); // A
+                         // member's header, after a pax one for long paths
+void TarFile(TAR_STREAM* tar, DIR_ENTRY* entry); // File data, extent by
+                         // extent in chain order, padded to 512 bytes
+void TarDirectory(TAR_STREAM* tar, uint32_t cluster_no, char* path); //
+                         // Headers and data of a directory's subtree
+void* TarReader(void* arg); // Tree walk for export_tar (thread body)
+void export_tar(char* dir, char* hostpath, uint32_t cluster_no); // Write
+                         // DIR (default CWD) as a ustar stream
+void import(char* hostdir, char* dir, uint32_t cluster_no); // Import host
+                         // tree HOSTDIR into DIR (default CWD)
+
+// TREE WALK
+int WalkTree(uint32_t cluster_no, WALK_VISIT visit, void* arg); // Visit
+                         // every entry below a directory from a worker
+                         // pool, returns the number of workers used
+void* WalkWorker(void* arg); // Read directories off the stack (thread body)
+void FindVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+               int worker, void* arg); // Keep the paths whose name matches
+void find(char* dir, char* pattern, uint32_t cluster_no); // Print entries
+                         // under DIR (default CWD) whose name matches
+void DuVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir, int worker,
+             void* arg); // Add an entry to the worker's totals
+void du(char* dir, uint32_t cluster_no); // Print space used under DIR
+
+// SUBTREE SIZE INDEX
+SUBTREE_SIZE* SizeIndexSlot(uint32_t cluster_no, int insert); // Entry of a
+                         // directory, NULL if absent and not inserting
+                         // (SIZE_INDEX_LOCK held)
+void SizeIndexAdd(uint32_t cluster_no, SUBTREE_SIZE* delta, int sign);
+                         // Add delta to a directory and every ancestor
+void SizeIndexEntry(uint32_t cluster_no, DIR_ENTRY* entry, int sign); //
+                         // Account for an entry added to (1) or removed
+                         // from (-1) a directory
+void SizeIndexFile(uint32_t cluster_no, uint32_t old_size, uint32_t new_size);
+                         // Account for a file in a directory changing size
+void SizeIndexDirectory(uint32_t cluster_no, uint32_t parent, int clusters);
+                         // New directory (parent set), or clusters added
+                         // to an existing one's table
+void SizeVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+               int worker, void* arg); // Add an entry to its directory
+void BuildSizeIndex(void); // Fill SIZE_INDEX from a walk of the whole tree
+int LoadSizeIndex(const char* image_path, int create); // Use IMAGEFILE.du
+                         // if present (or create), rebuilt if stale
+void SaveSizeIndex(void); // Write IMAGEFILE.du for the image as it is now
+
+// DIRECTORY COMPACTION
+int CompactDirectory(uint32_t cluster_no, int* slots, uint32_t* clusters);
+                         // Rewrite live entries contiguously and free the
+                         // unused tail of the chain, -1 on I/O error
+void compact(char* dir, uint32_t cluster_no); // Compact DIR (default CWD)
+
+// CONSISTENCY CHECK
+void CheckReport(CHECK_LIST* list, int kind, uint32_t cluster, uint32_t count,
+                 uint32_t size, uint32_t dir, off_t offset, const char* path);
+                         // Add a problem to a worker's list
+void* CheckWorker(void* arg); // FAT scan or lost cluster scan over one
+                         // range of clusters (thread body)
+void CheckRanges(CHECK_STATE* state, int phase); // Run a phase on every
+                         // worker and wait for it
+void CheckVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+                int worker, void* arg); // Follow one entry's chain
+int CompareProblems(const void* a, const void* b); // By kind, then cluster
+int CheckRepair(CHECK_STATE* state, CHECK_PROBLEM* problem); // Fix one
+                         // problem if it can be, 1 if fixed
+int check(int repair); // Check the FAT and every chain, print problems,
+                         // repair the ones that can be; returns the number
+                         // left unrepaired
+
+// DEFRAGMENTATION
+uint32_t ChainExtents(uint32_t first_cluster, uint32_t* clusters); // Runs
+                         // of consecutive clusters in a chain
+void DefragVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+                 int worker, void* arg); // Keep each fragmented file
+int FindFreeRuns(FREE_RUN** runs); // Free space as runs, in disk order
+int CompareDefragFiles(const void* a, const void* b); // By first cluster
+int RelocateFile(DEFRAG_FILE* file, FREE_RUN* runs, int run_count); // Move
+                         // a file's data into one free run, 1 if moved
+void defrag(char* target, long budget_mb, uint32_t cluster_no); // Make
+                         // the files of FILE, DIR or (-a) the volume
+                         // contiguous, moving at most budget_mb MB
+
+// SPACE STATISTICS
+int StatsBucket(uint32_t value); // Histogram bucket of a value (>= 1)
+void StatsEndRun(STATS_FREE* space); // Count the open free run, if any
+void StatsScan(const uint32_t* fat, uint32_t n, STATS_FREE* space); // Add
+                         // n consecutive FAT entries to the free totals
+void StatsVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+                int worker, void* arg); // Count a file's extents
+void JsonString(const char* text); // Print text as a quoted JSON string
+void PrintHistogram(const char* name, unsigned long* histogram, int json);
+                         // Non-empty buckets, as text rows or a JSON array
+void stats(int json); // Report free space and fragmentation
+
+// ALLOCATION BENCHMARK
+int BenchCommand(uint32_t* cwd, const char* format, ...); // Run one command
+                         // with output discarded, returns its STATUS_ code
+void BenchSeeks(uint32_t cluster_no, uint32_t* last, unsigned long* seeks,
+                unsigned long long* distance); // Add a chain's reads to the
+                         // seek model
+int AllocBench(int dirs, int files, int clusters, uint32_t cluster_no,
+               ALLOC_BENCH_RESULT* result); // Build, read and remove the
+                         // benchmark tree under the current policy
+void allocbench(int dirs, int files, int clusters, uint32_t cluster_no);
+                         // Run AllocBench() under every policy, print table
+
+// LOAD GENERATOR
+int ParseLoadSpec(tokenlist* tokens, LOAD_SPEC* spec); // Options to spec,
+                         // 0 on success
+int LoadSize(LOAD_CLIENT* client); // Draw a create size
+int LoadOp(LOAD_CLIENT* client, int op, int slot); // Run one operation,
+                         // returns its STATUS_ code
+void* LoadClient(void* arg); // One round of one client (thread body)
+void LoadLayout(LOAD_CLIENT* clients, int count, unsigned long* files,
+                unsigned long* extents, unsigned long* free_extents);
+                         // Fragmentation of the working set and free space
+void LoadRow(const char* name, unsigned long long* ns, long count,
+             double seconds); // Ops/s and tail latencies, sorts ns
+void load(LOAD_SPEC* spec, uint32_t cluster_no); // Run the mixed workload
+
+// INSTRUMENTATION (bodies only in FAT_PERF builds)
+void PerfIO(int write, size_t size, off_t offset); // Count one device
+                         // access against its region
+int PerfEnterFileData(void); // PERF_FILE_DATA scope start
+void PerfLeaveFileData(int* scope); // and end (cleanup handler)
+void PerfCommand(COMMAND* command, struct timespec* start); // Record one
+                         // command's latency
+unsigned long long PerfPercentile(PERF_LATENCY* latency, double fraction);
+                         // Upper bound, in microseconds, of a percentile
+void perf(int json); // Print counters and latencies
+void PerfDump(void); // Write the JSON report to PERF_PATH, if set
+
+// MOUNTING AND DISPATCH
+int MountImage(const char* path, int size_index); // Open IMAGEFILE, read
+                         // BPB, warm caches, load (or create) size index
+int ExecuteCommand(tokenlist* tokens, uint32_t* CWD); // Run one command
+                         // in CWD, returns 1 on exit
+uint32_t HashCommand(const char* name, uint32_t seed); // Slot of name in
+                         // COMMAND_INDEX for a given seed
+void InitCommandTable(void); // Find a seed giving every command its own slot
+COMMAND* FindCommand(const char* name); // Table entry of name, or NULL
+int CommandWrites(COMMAND* command, tokenlist* tokens); // Would change
+                         // the image, from the table and the options
+
+// COMMAND HANDLERS -- check arguments already done by ExecuteCommand
+int Run_exit(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_info(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_size(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_ls(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_cd(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_creat(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_mkdir(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_mv(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_open(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_close(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_lseek(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_read(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_write(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_rm(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_cp(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_rmdir(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_stress(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_put(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_get(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_import(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_export_tar(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_find(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_du(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_compact(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_check(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_defrag(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_stats(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_alloc(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_allocbench(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_perf(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_load(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_sync(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+int Run_trim(tokenlist* tokens, uint32_t dir, uint32_t* CWD);
+
+// BATCH MODE
+int OpenBatch(BATCH_READER* reader, const char* script); // Map script, or
+                         // stream stdin when script is NULL, 0 on success
+char* NextBatchLine(BATCH_READER* reader); // Next command line, NULL at EOF
+int RunBatch(BATCH_READER* reader, int stop_on_error); // Run every command
+                         // without prompting, report status per command
+
+// DAEMON MODE
+int Serve(const char* socket_path); // Accept clients on a Unix socket
+void* SessionMain(void* arg); // Serve one client's commands (thread body)
+void SendResponse(int fd, const char* output, size_t length); // Send one
+                         // length-prefixed response frame
+void bread(tokenlist* tokens, uint32_t cluster_no); // Raw read of a file
+                         // range into the response frame
+void bwrite(tokenlist* tokens, char* data, uint32_t cluster_no); // Raw
+                         // write of data received after the command line
+
+// TRACE RECORD AND REPLAY
+int OpenTrace(const char* path); // Start --record, 0 on success
+uint64_t HashOutput(const char* data, size_t length); // FNV-1a, 64 bit
+char* TraceLine(tokenlist* tokens); // Rebuild the command line (malloc),
+                         // quoting tokens get_tokens() would split
+int TraceCommand(tokenlist* tokens, uint32_t* CWD); // Run and record one
+                         // command, returns ExecuteCommand()'s result
+long LoadTrace(const char* path, TRACE_RECORD** records,
+               struct timespec* wall); // Parse a trace and its wall clock
+                         // base (0 if not recorded), returns the record
+                         // count or -1
+time_t TraceClock(const struct timespec* wall, unsigned long long start_ns);
+                         // Wall-clock second of a record's start
+int CompareLatency(const void* a, const void* b); // qsort, ascending
+void PrintLatencies(const char* name, unsigned long long* ns, long count,
+                    double seconds); // Throughput and percentile row
+int Replay(const char* trace, const char* path, int pace); // Run a trace
+                         // against a copy of IMAGEFILE, 0 if outputs match
+
+// BLOCK DEVICES
+int AttachDevice(const char* path); // Open IMAGEFILE and pick DEVICE for
+                         // --overlay, --ram or neither, 0 on success
+ssize_t FileRead(void* buffer, size_t size, off_t offset); // IMAGE_FD
+int FileWrite(const void* buffer, size_t size, off_t offset);
+int FileFlush(void); // fdatasync
+int FileDiscard(off_t offset, off_t size); // Punch a hole
+int OverlayFlush(void); // fdatasync the delta
+int OverlayDiscard(off_t offset, off_t size); // Unsupported, -1
+int LoadRam(const char* path); // Read IMAGE_FD into RAM_IMAGE
+ssize_t RamRead(void* buffer, size_t size, off_t offset);
+int RamWrite(const void* buffer, size_t size, off_t offset);
+int RamFlush(void); // Write back, atomically, if anything changed
+int RamDiscard(off_t offset, off_t size); // Zero the range
+int MapImage(void); // Map IMAGE_FD shared, read-only, at RAM_IMAGE
+int MappedWrite(const void* buffer, size_t size, off_t offset); // EROFS
+int MappedFlush(void); // Nothing to write
+int MappedDiscard(off_t offset, off_t size); // EROFS
+int FlushDevice(void); // DEVICE->flush(), reporting a failure
+void trim(void); // Discard every free cluster
+
+// OVERLAY
+int OpenOverlay(const char* path, int mode); // Open (or create) the delta
+                         // for the base in IMAGE_FD, 0 on success
+int ResetOverlay(void); // Empty the delta, matching the base as it is now
+int OverlayPresent(uint64_t sector); // Sector is in the delta
+ssize_t OverlayRead(void* buffer, size_t size, off_t offset); // Merged
+                         // read, short at the end of the base
+int OverlayWrite(const void* buffer, size_t size, off_t offset); // Write
+                         // into the delta, 0 success, -1 error
+int FinishOverlay(const char* base_path, int commit); // --commit copies the
+                         // delta into the base, --discard drops it
+
+// CONCURRENCY
+void stress(char* file, int max_threads, uint32_t cluster_no); // Read FILE
+               // from 1..max_threads threads at once, print throughput
 
 //------------------------------------------------------------------------------
 //------------------------------------MAIN--------------------------------------
 
 int main(int argc, const char * argv[])
 {
+  OUT = stdout; // Shell output goes to the terminal
+  InitCommandTable();
+
+  // PREFIXES -- ./fat.x [--record trace] [--overlay delta | --ram | --ro]
+  //             [any form below]
+  while (argc > 2)
+  {
+    int used = 2;
+    if (strcmp(argv[1], "--ram") == 0 && OVERLAY_PATH == NULL && !RO_MODE)
+    {
+      RAM_MODE = 1; // Whole image in memory, written back on exit or sync
+      used = 1;
+    }
+    else if (argc > 3 && strcmp(argv[1], "--overlay") == 0 && !RAM_MODE &&
+             !RO_MODE)
+      OVERLAY_PATH = argv[2]; // Base opened read-only, writes to delta
+    else if (strcmp(argv[1], "--ro") == 0 && OVERLAY_PATH == NULL && !RAM_MODE)
+    {
+      RO_MODE = 1; // Shared read-only mapping, mutating commands refused
+      used = 1;
+    }
+    else if (argc > 3 && strcmp(argv[1], "--record") == 0)
+    {
+      if (OpenTrace(argv[2]) != 0)
+      {
+        fprintf(OUT, "Cannot write trace %s\n", argv[2]);
+        return 1;
+      }
+    }
+    else
+      break;
+    argc -= used;
+    argv += used;
+  }
+
+  // DAEMON MODE -- ./fat.x --serve SOCKET imagename
+  if (argc == 4 && strcmp(argv[1], "--serve") == 0)
+  {
+    if (MountImage(argv[3], 0) != 0) // Size index used if present
+      return 1;
+    return Serve(argv[2]);
+  }
+
+  // BATCH OPTIONS -- ./fat.x [-b script] [-e] [-s] [-a policy] [-p json]
+  //                  imagename
+  //                  ./fat.x --check [-r] imagename
+  //                  ./fat.x --replay trace [--pace] imagename
+  //                  ./fat.x --overlay delta --commit|--discard imagename
+  const char* script = NULL; // NULL: stdin
+  const char* replay = NULL;
+  int stop_on_error = 0;
+  int size_index = 0;
+  int check_only = 0, repair = 0, pace = 0;
+  int commit = 0, discard = 0;
+  int arg = 1;
+  while (arg < argc - 1)
+  {
+    if (strcmp(argv[arg], "-b") == 0 && arg + 2 < argc)
+    {
+      script = argv[arg + 1];
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-e") == 0)
+    {
+      stop_on_error = 1; // Stop at the first command that fails
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-s") == 0)
+    {
+      size_index = 1; // Create the size index if the image has none
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-a") == 0 && arg + 2 < argc &&
+             ParseAllocPolicy(argv[arg + 1]) >= 0)
+    {
+      ALLOC_POLICY = ParseAllocPolicy(argv[arg + 1]); // first, near, group
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-p") == 0 && arg + 2 < argc)
+    {
+      PERF_PATH = argv[arg + 1]; // perf --json written here on exit
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "--check") == 0)
+    {
+      check_only = 1; // Check the image and exit, 1 if problems remain
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-r") == 0 && check_only)
+    {
+      repair = 1;
+      arg++;
+    }
+    else if (strcmp(argv[arg], "--replay") == 0 && arg + 2 < argc)
+    {
+      replay = argv[arg + 1]; // Run a --record trace, compare outputs
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "--pace") == 0 && replay != NULL)
+    {
+      pace = 1; // Keep the recorded gaps between commands
+      arg++;
+    }
+    else if (strcmp(argv[arg], "--commit") == 0 && OVERLAY_PATH != NULL)
+    {
+      commit = 1; // Fold the delta into the image, then empty it
+      arg++;
+    }
+    else if (strcmp(argv[arg], "--discard") == 0 && OVERLAY_PATH != NULL)
+    {
+      discard = 1; // Empty the delta
+      arg++;
+    }
+    else
+      break;
+  }
+
   // CHECK FOR VALID USAGE
-  if (argc != 2)
+  if (arg != argc - 1 || (commit && discard) || (repair && RO_MODE))
   {
-    printf("Usage: ./main.x imagename\n");
+    fprintf(OUT, "Usage: ./main.x [--record trace] imagename\n");
+    fprintf(OUT, "       ./main.x [--record trace] [-b script] [-e] [-s] "
+            "[-a first|near|group] [-p json] imagename\n");
+    fprintf(OUT, "       ./main.x --check [-r] imagename\n");
+    fprintf(OUT, "       ./main.x [--record trace] --serve socketpath "
+            "imagename\n");
+    fprintf(OUT, "       ./main.x --replay trace [--pace] imagename\n");
+    fprintf(OUT, "       ./main.x --overlay delta|--ram|--ro [any form above] "
+            "imagename\n");
+    fprintf(OUT, "       ./main.x --overlay delta --commit|--discard "
+            "imagename\n");
     return 1; // Program failure
   }
 
-  // OPEN UP IMAGEFILE
-  IMAGEFILE=fopen(argv[1],"r+");
-  if (IMAGEFILE == NULL){
-    printf("Can't Read. Invalid File\n");
+  // OVERLAY MAINTENANCE -- nothing is mounted
+  if (commit || discard)
+    return FinishOverlay(argv[arg], commit);
+
+  // REPLAY MODE -- mounts its own copy of the image
+  if (replay != NULL)
+    return Replay(replay, argv[arg], pace);
+
+  if (MountImage(argv[arg], size_index) != 0)
     return 1;
+
+  // CHECK MODE -- report (and with -r repair) problems, then exit
+  if (check_only)
+  {
+    int left = check(repair);
+    int flushed = FlushDevice();
+    if (flushed == 0) // Else the index may be ahead of the file
+      SaveSizeIndex();
+    PerfDump();
+    close(IMAGE_FD);
+    return (left > 0 || flushed != 0) ? 1 : 0;
+  }
+
+  // BATCH MODE -- a script was given, or commands are piped in
+  if (script != NULL || !isatty(STDIN_FILENO))
+  {
+    BATCH_READER reader;
+    if (OpenBatch(&reader, script) != 0)
+    {
+      fprintf(stderr, "Cannot read script %s\n", script);
+      close(IMAGE_FD);
+      return 1;
+    }
+    int status = RunBatch(&reader, stop_on_error);
+    if (FlushDevice() != 0)
+    {
+      if (status == 0)
+        status = STATUS_IO;
+    }
+    else
+      SaveSizeIndex();
+    PerfDump();
+    close(IMAGE_FD);
+    return status;
   }
 
+  // POSITION OURSELVES IN THE FIRST USABLE CLUSTER OF FAT
+  // KEEP CWD_Cluster_No UPDATED TO KNOW WHERE WE ARE IN FAT & CORRESPONDING
+  // DATA REGION
+  uint32_t CWD_Cluster_No = FIRST_CLUSTER;
+
+  // USER INPUT LOOP
+  while(1)
+  {
+    // READ AND PARSE USER INPUT
+    fprintf(OUT, "> ");
+    /* input contains the whole command
+       tokens contains substrings from input split by spaces */
+    char *input = get_input();
+    if (input == NULL)
+    {
+      fprintf(OUT, "\n");
+      break; // EOF (Ctrl-D) exits like the exit command
+    }
+    tokenlist tokens;
+    if (get_tokens(input, &tokens) != 0) // Too long, already reported
+      continue;
+
+    if (tokens.size==0){		// Makes sure no input won't crash program
+		continue;
+    }
+
+    int exit_requested = ExecuteCommand(&tokens, &CWD_Cluster_No);
+
+    if (exit_requested)
+      break; // break from loop
+  } // END OF USER INPUT LOOP
+
+  // EXIT TRIGGERED -- under --ram this is when the image is written back
+  int flushed = FlushDevice();
+  if (flushed == 0)
+    SaveSizeIndex();
+  PerfDump();
+  close(IMAGE_FD); // close imagefile
+  return (flushed != 0) ? 1 : 0;
+}
+
+int MountImage(const char* path, int size_index)
+// Open IMAGEFILE, read the boot sector and load the FAT once, shared by the
+// shell and by every daemon session
+{
+  // OPEN UP IMAGEFILE
+  if (AttachDevice(path) != 0)
+    return 1;
+
   // SET UP BOOT BLOCK
-  fread(&BOOT, sizeof(BPB), 1, IMAGEFILE);
+  if (ReadImage(&BOOT, sizeof(BPB), 0) != 0){
+    fprintf(OUT, "Can't Read. Invalid File\n");
+    return 1;
+  }
+
+  // SET UP LOCKS AND FREE MAP
+  for (int i = 0; i < 101; i++)
+    pthread_mutex_init(&OPENFILE_LIST[i].lock, NULL);
+  FREE_CLUSTER_HINT = BOOT.BPB_RootClus;
+  FIRST_CLUSTER = BOOT.BPB_RootClus;
+
+  // WARM THE CACHES -- whole FAT in memory, empty block cache
+  LoadFATCache();
+  if (!RO_MODE) // The shared mapping already is the cache
+    InitBlockCache();
+  if (OVERLAY_PATH == NULL) // The base's mtime says nothing of the delta
+    LoadSizeIndex(path, size_index && !RO_MODE); // du walks the tree
+                         // without it, and --ro never builds it
 
   // INFO FOR TRAVERSING THE FAT------------------------------
   int FirstFATSector = BOOT.BPB_RsvdSecCnt;
@@ -273,1948 +1526,8033 @@ int main(int argc, const char * argv[])
   // Offset = FirstDataSector + (N - 2) * BootInfo.BPB_SecPerClus;
   //-----------------------------------------------------------
 
-  // POSITION OURSELVES IN THE FIRST USABLE CLUSTER OF FAT
-  // KEEP CWD_Cluster_No UPDATED TO KNOW WHERE WE ARE IN FAT & CORRESPONDING
-  // DATA REGION
-  FIRST_CLUSTER = BOOT.BPB_RootClus;
-  uint32_t CWD_Cluster_No = FIRST_CLUSTER;
+  return 0;
+}
 
-  // USER INPUT LOOP
-  while(1)
+int ExecuteCommand(tokenlist* tokens, uint32_t* CWD)
+// Run one parsed command line against *CWD (updated by cd). Returns 1 when
+// the command was exit
+{
+  if (TRACE != NULL && !TRACE_ACTIVE)
+    return TraceCommand(tokens, CWD); // Calls back here to run it
+
+  COMMAND_STATUS = STATUS_OK;
+
+  COMMAND* command = FindCommand(tokens->items[0]);
+  if (command == NULL)                               // Invalid entry
   {
-    // READ AND PARSE USER INPUT
-    printf("> ");
-    /* input contains the whole command
-       tokens contains substrings from input split by spaces */
-    char *input = get_input();
-    tokenlist *tokens = get_tokens(input);
+    Error(STATUS_UNKNOWN, "%s: Command not found.\n", tokens->items[0]);
+    return 0;
+  }
+  if (tokens->size < command->min_tokens ||
+      tokens->size > command->max_tokens)            // Invalid usage
+  {
+    Error(STATUS_USAGE, "Usage: %s\n", command->usage);
+    return 0;
+  }
+  if (RO_MODE && CommandWrites(command, tokens)) // Refused up front
+  {
+    Error(STATUS_INVALID, "Error. %s would change the image, which is "
+          "mounted read-only.\n", command->name);
+    return 0;
+  }
 
-    if (tokens->size==0){		// Makes sure no input won't crash program
-		continue;
-    }
+  // A snapshot (sync writing back a --ram image) waits for every command
+  // changing the image to finish, and holds off new ones, so it never sees
+  // half of one: a chain with no entry yet, or one FAT copy updated
+  int snapshot = (command->lock_mode & COMMAND_SNAPSHOT) != 0;
+  int writes = !snapshot && !RO_MODE && CommandWrites(command, tokens);
+  if (snapshot)
+    pthread_rwlock_wrlock(&SNAPSHOT_LOCK);
+  else if (writes)
+    pthread_rwlock_rdlock(&SNAPSHOT_LOCK);
+
+  // Resolve the path the command works on to its directory, and hold that
+  // directory's lock for the whole command (shared for commands that only
+  // read it). Commands locking a second directory go one at a time. Under
+  // --ro nothing changes, so nothing is locked
+  int multi = (command->lock_mode & DIR_LOCK_MULTI) != 0 && !RO_MODE;
+  if (multi)
+    pthread_mutex_lock(&NAMESPACE_LOCK);
+
+  int exit_requested = 0;
+  uint32_t dir = *CWD;
+  int path_arg = command->path_arg;
+  if (path_arg == PATH_ARG_LAST) // Options come first, the path last
+    path_arg = (tokens->items[tokens->size - 1][0] == '-') ? 0
+                                                         : tokens->size - 1;
+  if (path_arg == 0 || path_arg >= tokens->size ||
+      ResolvePath(tokens->items[path_arg], *CWD, &dir,
+                  &tokens->items[path_arg]) == 0)
+  {
+    DirLock(dir, command->lock_mode & (DIR_LOCK_READ | DIR_LOCK_WRITE));
+    PERF_TIMER(start);
+    exit_requested = command->run(tokens, dir, CWD);
+    PERF_COMMAND(command, start);
+    DirUnlock(dir);
+  }
 
-    // COMMAND EXECUTION--------------------------------------------
-    // SIMULATES BUILT-IN COMMANDS OF FAT32 MANIPULATION UTILITY
+  if (multi)
+    pthread_mutex_unlock(&NAMESPACE_LOCK);
+  if (snapshot || writes)
+    pthread_rwlock_unlock(&SNAPSHOT_LOCK);
+  return exit_requested;
+}
 
-    if (strcmp(tokens->items[0], "exit") == 0)         // exit program
-    {
-      fclose(IMAGEFILE); // close imagefile
+//--------------------------------COMMAND TABLE---------------------------------
+
+COMMAND COMMAND_TABLE[] = {
+  { "exit",   1, 1, DIR_LOCK_READ,  0, Run_exit,   "exit" },
+  { "info",   1, 1, DIR_LOCK_READ,  0, Run_info,   "info" },
+  { "size",   2, MAX_TOKENS, DIR_LOCK_READ, 1, Run_size,
+    "size [filename|pattern]..." },
+  { "ls",     1, 4, DIR_LOCK_READ,  PATH_ARG_LAST, Run_ls,
+    "ls [-l] [--sort=name|size|cluster] [dirname]" },
+  { "cd",     1, 2, DIR_LOCK_READ,  1, Run_cd,     "cd [dirname]" },
+  { "creat",  2, 2, DIR_LOCK_WRITE, 1, Run_creat,  "creat [filename]" },
+  { "mkdir",  2, 2, DIR_LOCK_WRITE, 1, Run_mkdir,  "mkdir [dirname]" },
+  { "mv",     3, MAX_TOKENS, DIR_LOCK_WRITE | DIR_LOCK_MULTI, 1, Run_mv,
+    "mv [FROM]... [TO]" },
+  { "open",   3, MAX_TOKENS, DIR_LOCK_READ, 1, Run_open,
+    "open [filename|pattern]... [mode]" },
+  { "close",  2, 2, DIR_LOCK_READ,  1, Run_close,  "close [filename]" },
+  { "lseek",  3, 3, DIR_LOCK_READ,  1, Run_lseek,
+    "lseek [filename] [offset]" },
+  { "read",   3, 3, DIR_LOCK_READ,  1, Run_read,   "read [filename] [size]" },
+  { "write",  4, 4, DIR_LOCK_WRITE, 1, Run_write,
+    "write [filename] [size] [\"string\"]" },
+  { "rm",     2, MAX_TOKENS, DIR_LOCK_WRITE, 1, Run_rm,
+    "rm [filename|pattern]..." },
+  { "cp",     3, MAX_TOKENS, DIR_LOCK_WRITE | DIR_LOCK_MULTI, 1, Run_cp,
+    "cp [filename|pattern]... [to]" },
+  { "rmdir",  2, 2, DIR_LOCK_WRITE, 1, Run_rmdir,  "rmdir [dir]" },
+  { "stress", 2, 3, DIR_LOCK_READ,  1, Run_stress,
+    "stress [filename] [max threads]" },
+  { "put",    3, 3, DIR_LOCK_WRITE, 2, Run_put,
+    "put [hostpath] [filename]" },
+  { "get",    3, 3, DIR_LOCK_READ,  1, Run_get,
+    "get [filename] [hostpath]" },
+  { "import", 2, 3, DIR_LOCK_WRITE | DIR_LOCK_MULTI, 2, Run_import,
+    "import [hostdir] [dir]" },
+  { "export-tar", 1, 3, DIR_LOCK_READ | DIR_LOCK_MULTI, 1, Run_export_tar,
+    "export-tar [dir] [hostpath]" },
+  { "find",   3, 4, DIR_LOCK_READ | DIR_LOCK_MULTI, 1, Run_find,
+    "find [dir] -name [pattern]" },
+  { "du",     1, 2, DIR_LOCK_READ | DIR_LOCK_MULTI, 1, Run_du,   "du [dir]" },
+  { "compact", 1, 2, DIR_LOCK_WRITE | DIR_LOCK_MULTI, 1, Run_compact,
+    "compact [dir]" },
+  { "check",  1, 2, DIR_LOCK_READ | DIR_LOCK_MULTI, 0, Run_check,
+    "check [-r]" },
+  { "defrag", 2, 3, DIR_LOCK_READ | DIR_LOCK_MULTI | COMMAND_WRITES, 1,
+    Run_defrag,
+    "defrag [file|dir|-a] [budget MB]" },
+  { "stats",  1, 2, DIR_LOCK_READ | DIR_LOCK_MULTI, 0, Run_stats,
+    "stats [--json]" },
+  { "alloc",  1, 2, DIR_LOCK_READ,  0, Run_alloc,  "alloc [first|near|group]" },
+  { "allocbench", 1, 4, DIR_LOCK_WRITE, 0, Run_allocbench,
+    "allocbench [dirs] [files] [clusters]" },
+  { "perf",   1, 2, DIR_LOCK_READ,  0, Run_perf,   "perf [--json|reset]" },
+  { "load",   1, MAX_TOKENS, DIR_LOCK_WRITE, 0, Run_load,
+    "load [-c clients] [-n ops] [-r rounds] [-w files] [-m c:a:r:d] "
+    "[-z min[-max]] [-u] [-A append] [-s seed] [-k]" },
+  { "sync",   1, 1, DIR_LOCK_READ | COMMAND_SNAPSHOT, 0, Run_sync, "sync" },
+  { "trim",   1, 1, DIR_LOCK_READ | COMMAND_WRITES, 0, Run_trim, "trim" },
+};
+
+#define COMMAND_COUNT (sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]))
+
+COMMAND* COMMAND_INDEX[COMMAND_SLOTS]; // Perfect hash: one command per slot
+uint32_t COMMAND_SEED; // Seed that makes HashCommand collision free
+
+uint32_t HashCommand(const char* name, uint32_t seed)
+{
+  // FNV-1a started from seed
+  uint32_t hash = seed;
+  for (; *name != '\0'; name++)
+    hash = (hash ^ (uint8_t) *name) * 16777619u;
+  // Low bits of a product only depend on low bits of the seed, so fold the
+  // high bits in or only COMMAND_SLOTS seeds would ever differ
+  return (hash ^ (hash >> 16)) & (COMMAND_SLOTS - 1);
+}
 
-      free(input); // Free malloc'd input and tokens
-      free_tokens(tokens);
-      break; // break from loop
-    }
-    else if (strcmp(tokens->items[0], "info") == 0)    // Print boot info
-    {
-      info();
-    }
-    else if (strcmp(tokens->items[0], "size") == 0)    // Print file size
-    {
-      if (tokens->size == 2)
-        size(tokens->items[1], CWD_Cluster_No);
-      else  // Invaid usage
-        printf("Usage: size [filename]\n");
-    }
-    else if (strcmp(tokens->items[0], "ls") == 0)      // list dir contents
-    {
-      if (tokens->size == 1)
-        ls_CWD(CWD_Cluster_No); // list current working directory
-      else if (tokens->size == 2)
-        ls_dirname(tokens->items[1], CWD_Cluster_No); // list child/parent dir
-      else  // Invalid usage
-        printf("Usage: ls [dirname]\n");
-    }
-    else if (strcmp(tokens->items[0], "cd") == 0)      // change directory
-    {
-      if (tokens->size == 1) // cd
-      {
-        CWD_Cluster_No = FIRST_CLUSTER; // set CWD back to root
-        CURRENT_STACK_SIZE = 0; // Update DIR_STACK size
-      }
-      else if (tokens->size == 2) // cd [dirname]
-        CWD_Cluster_No = cd(tokens->items[1], CWD_Cluster_No);
-      else  // Invalid usage
-        printf("Usage: cd [dirname]\n");
-    }
-    else if (strcmp(tokens->items[0], "creat") == 0)   // create file
-    {
-      if (tokens->size==2)
-      {
-        creat(tokens->items[1], CWD_Cluster_No,
-          create_newfile(tokens->items[1]));
-      }
-      else // Invalid usage
-        printf("Usage: creat [filename]\n");
-    }
-    else if (strcmp(tokens->items[0], "mkdir") == 0)   // mk new directory
-    {
-      if (tokens->size==2)
-        mkdir(tokens->items[1], CWD_Cluster_No);
-      else // Invalid usage
-        printf("Usage: mkdir [dirname]\n");
-    }
-    else if (strcmp(tokens->items[0], "mv") == 0)      // move file/ rename
-    {
-      if (tokens->size == 3)
-        mv(tokens->items[1], tokens->items[2], CWD_Cluster_No);
-      else // Invalid usage
-        printf("Usage: open [FROM] [TO]\n");
-    }
-    else if (strcmp(tokens->items[0], "open") == 0)    // open file
-    {
-      if (tokens->size == 3)
-        open(tokens->items[1], tokens->items[2], CWD_Cluster_No);
-      else  // Invalid usage
-        printf("Usage: open [filename] [mode]\n");
-    }
-    else if (strcmp(tokens->items[0], "close") == 0)   // close file
-    {
-      if (tokens->size == 2)
-        close(tokens->items[1], CWD_Cluster_No);
-      else  // Invalid usage
-        printf("Usage: close [filename]\n");
-    }
-    else if (strcmp(tokens->items[0], "lseek") == 0)   // change file offset
-    {
-      if (tokens->size == 3)
-      {
-        int i;
-        sscanf(tokens->items[2], "%d", &i); // convert offset string to int
-        lseek(tokens->items[1], i, CWD_Cluster_No);
-      }
-      else  // Invalid usage
-        printf("Usage: lseek [filename] [offset]\n");
-    }
-    else if (strcmp(tokens->items[0], "read") == 0)    // read from file
+void InitCommandTable(void)
+{
+  // Try seeds until no two commands share a slot. With COMMAND_SLOTS well
+  // above COMMAND_COUNT this takes a few dozen tries, once per process
+  for (COMMAND_SEED = 2166136261u; ; COMMAND_SEED++)
+  {
+    memset(COMMAND_INDEX, 0, sizeof(COMMAND_INDEX));
+    int i;
+    for (i = 0; i < COMMAND_COUNT; i++)
     {
-      if (tokens->size == 3)
-      {
-        int i;
-        sscanf(tokens->items[2], "%d", &i); // convert size string to int
-        read(tokens->items[1], i, CWD_Cluster_No);
-      }
-      else  // Invalid usage
-        printf("Usage: read [filename] [size]\n");
+      uint32_t slot = HashCommand(COMMAND_TABLE[i].name, COMMAND_SEED);
+      if (COMMAND_INDEX[slot] != NULL)
+        break; // Collision, next seed
+      COMMAND_INDEX[slot] = &COMMAND_TABLE[i];
     }
-    else if (strcmp(tokens->items[0], "write") == 0)   // write to file
-    {
-      if (tokens->size >= 4)
-      {
-        int i;
-        sscanf(tokens->items[2], "%d", &i); // convert size string to int
+    if (i == COMMAND_COUNT)
+      return;
+  }
+}
 
-        // CONVERT ALL TOKENS AFTER tokens->items[3] TO ONE GIANT STRING
-        //--------------------------------------------------------------
-        int len = 0; // string length
+COMMAND* FindCommand(const char* name)
+{
+  // One hash and one strcmp, whatever the number of commands
+  COMMAND* command = COMMAND_INDEX[HashCommand(name, COMMAND_SEED)];
+  if (command != NULL && strcmp(command->name, name) == 0)
+    return command;
+  return NULL;
+}
 
-        // Iterate through tokens to find desired string length
-        for (int j = 3; j < tokens->size; j++)
-        {
-          // If > 4 tokens, we need to append a space to end of each string
-          if ((tokens->size) > 4 && (j != (tokens->size - 1)))
-            len += 1; // Need extra char to append space
+int CommandWrites(COMMAND* command, tokenlist* tokens)
+{
+  if ((command->lock_mode & (DIR_LOCK_WRITE | COMMAND_WRITES)) != 0)
+    return 1;
+  const char* last = tokens->items[tokens->size - 1];
+  if (command->run == Run_check) // check -r repairs
+    return tokens->size == 2 && strcmp(last, "-r") == 0;
+  if (command->run == Run_open) // The mode comes last
+    return strchr(last, 'w') != NULL;
+  return 0;
+}
 
-          // Update total string length
-          len += strlen(tokens->items[j]);
-        }
+//-------------------------------COMMAND HANDLERS-------------------------------
 
-        // Allocate char array of size len - 1
-        len -= 1; // (removing 2 quote chars & adding 1 '/0' char to terminate)
-        char string[len];
-        //printf("Length of string: %i\n", len);
+// exit program
+int Run_exit(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  return 1; // caller closes the shell or session
+}
 
-        int counter = 0;
-        for (int k = 3; k < tokens->size; k++) // Iterate through tokens
-        {
-          for (int l = 0; l < strlen(tokens->items[k]); l++) // Iterate through
-          {                                                  // characters
-            if (k == 3 && l == 0) // DO NOT ADD FIRST QUOTE TO STRING
-            {
-              counter--;
-              continue;
-            }
-            if (k == (tokens->size - 1) && l == (strlen(tokens->items[k]) - 1))
-              continue; // DO NOT ADD LAST QUOTE TO STRING
-
-            string[l + counter] = tokens->items[k][l];
-          }
+// Print boot info
+int Run_info(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  info();
+  return 0;
+}
 
-          counter += strlen(tokens->items[k]);
-          if (((tokens->size) > 4) && (k != (tokens->size - 1)))
-          {
-            string[counter] = ' ';
-            counter++;
-          }
-        }
-        string[len - 1] = '\0';
-        //---------------------------------------------------------------
+// Print file size
+int Run_size(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  if (MultiTarget(tokens, tokens->size)) // size NAME|PATTERN ...
+  {
+    NAMED_ENTRY* targets;
+    int count = ExpandTargets(tokens, tokens->size, dir, *CWD, &targets);
+    for (int i = 0; i < count; i++)
+      if (targets[i].entry.DIR_Attr & 0x10)
+        Error(STATUS_INVALID, "Error. %s is a Directory.\n", targets[i].name);
+      else
+        fprintf(OUT, "%s: %u bytes\n", targets[i].name,
+                targets[i].entry.DIR_FileSize);
+    FreeDirectory(targets, count);
+    return 0;
+  }
+  size(tokens->items[1], dir);
+  return 0;
+}
 
-        // Finally, call write function passing in this giant string
-        write(tokens->items[1], i, string, CWD_Cluster_No);
-      }
-      else  // Invalid usage
-        printf("Usage: read [filename] [size] [\"string\"]\n");
-    }
-    else if (strcmp(tokens->items[0], "rm") == 0)      // rm file
-    {
-      if (tokens->size == 2)
-        rm(tokens->items[1], CWD_Cluster_No);
-      else  // Invalid usage
-        printf("Usage: rm [filename]\n");
-    }
-    else if (strcmp(tokens->items[0], "cp") == 0)      // copy file
-    {
-      if (tokens->size == 3)
-        cp(tokens->items[1], tokens->items[2], CWD_Cluster_No);
-      else  // Invalid usage
-        printf("Usage: cp [filename] [to]\n");
-    }
-    else if (strcmp(tokens->items[0], "rmdir") == 0)      // rm directory
-    {
-      if (tokens->size == 2)
-        rmdir(tokens->items[1], CWD_Cluster_No);
-      else  // Invalid usage
-        printf("Usage: rmdir [dir]\n");
-      continue;
-    }
-    else                                               // Invalid entry
+// list dir contents
+int Run_ls(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  int options = 0;
+  char* dirname = NULL;
+  for (int i = 1; i < tokens->size; i++)
+  {
+    char* item = tokens->items[i];
+    if (item[0] != '-' && i == tokens->size - 1)
+      dirname = item;
+    else if (strcmp(item, "-l") == 0)
+      options |= LS_LONG;
+    else if (strcmp(item, "--sort=name") == 0)
+      options |= LS_SORT_NAME;
+    else if (strcmp(item, "--sort=size") == 0)
+      options |= LS_SORT_SIZE;
+    else if (strcmp(item, "--sort=cluster") == 0)
+      options |= LS_SORT_CLUSTER;
+    else
     {
-      printf("%s: Command not found.\n", tokens->items[0]);
+      Error(STATUS_USAGE, "Usage: %s\n", FindCommand("ls")->usage);
+      return 0;
     }
+  }
 
-    free(input); // Free malloc'd input and tokens
-    free_tokens(tokens);
-  } // END OF USER INPUT LOOP
-
-  // EXIT TRIGGERED
+  if (dirname == NULL)
+    ls_CWD(dir, options); // list current working directory
+  else
+    ls_dirname(dirname, dir, options); // list child/parent dir
   return 0;
 }
 
-//---------------------------FUNCTION DEFINITIONS-------------------------------
-
-//---------------------------parser.c DEFINITIONS-------------------------------
-// PROVIDED CODE FOR PARSING
-
-tokenlist *new_tokenlist(void)
+// change directory
+int Run_cd(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  tokenlist *tokens = (tokenlist *) malloc(sizeof(tokenlist));
-  tokens->size = 0;
-  tokens->items = (char **) malloc(sizeof(char *));
-  tokens->items[0] = NULL; /* make NULL terminated */
-  return tokens;
+  if (tokens->size == 1) // cd
+    *CWD = FIRST_CLUSTER; // set CWD back to root
+  else // cd [path]
+  {
+    uint32_t new_cluster_no = cd(tokens->items[1], dir);
+    if (new_cluster_no != 0)
+      *CWD = new_cluster_no;
+  }
+  return 0;
 }
 
-void add_token(tokenlist *tokens, char *item)
+// create file
+int Run_creat(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  int i = tokens->size;
-
-  tokens->items = (char **) realloc(tokens->items, (i + 2) * sizeof(char *));
-  tokens->items[i] = (char *) malloc(strlen(item) + 1);
-  tokens->items[i + 1] = NULL;
-  strcpy(tokens->items[i], item);
-
-  tokens->size += 1;
+  fat_creat(tokens->items[1], dir, create_newfile(tokens->items[1]));
+  return 0;
 }
 
-char *get_input(void)
+// mk new directory
+int Run_mkdir(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  char *buffer = NULL;
-  int bufsize = 0;
-
-  char line[5];
-  while (fgets(line, 5, stdin) != NULL) {
-    int addby = 0;
-    char *newln = strchr(line, '\n');
-    if (newln != NULL)
-      addby = newln - line;
-    else
-      addby = 5 - 1;
-      buffer = (char *) realloc(buffer, bufsize + addby);
-      memcpy(&buffer[bufsize], line, addby);
-      bufsize += addby;
-
-    if (newln != NULL)
-      break;
+  fat_mkdir(tokens->items[1], dir);
+  return 0;
 }
 
-  buffer = (char *) realloc(buffer, bufsize + 1);
-  buffer[bufsize] = 0;
+// move file/ rename
+int Run_mv(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  // TO is relative to the CWD, not to FROM's directory
+  uint32_t to_dir;
+  char* to_name;
+  int last = tokens->size - 1;
+  if (!MultiTarget(tokens, last))
+  {
+    if (ResolvePath(tokens->items[last], *CWD, &to_dir, &to_name) == 0)
+      mv(tokens->items[1], dir, to_name, to_dir);
+    return 0;
+  }
 
-  return buffer;
+  // mv FROM... DIR -- every match moves into DIR
+  NAMED_ENTRY* targets;
+  int count = ExpandTargets(tokens, last, dir, *CWD, &targets);
+  if (count > 0 &&
+      ResolvePath(tokens->items[last], *CWD, &to_dir, &to_name) == 0)
+  {
+    if (cd(to_name, to_dir) != 0) // Prints the error if not a directory
+      for (int i = 0; i < count; i++)
+        mv(targets[i].name, dir, to_name, to_dir);
+  }
+  FreeDirectory(targets, count);
+  return 0;
 }
 
-tokenlist *get_tokens(char *input)
+// open file
+int Run_open(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  char *buf = (char *) malloc(strlen(input) + 1);
-  strcpy(buf, input);
-
-  tokenlist *tokens = new_tokenlist();
-
-  char *tok = strtok(buf, " ");
-  while (tok != NULL) {
-    add_token(tokens, tok);
-    tok = strtok(NULL, " ");
+  char* mode = tokens->items[tokens->size - 1];
+  if (!MultiTarget(tokens, tokens->size - 1))
+  {
+    fat_open(tokens->items[1], mode, dir);
+    return 0;
   }
 
-  free(buf);
-  return tokens;
+  NAMED_ENTRY* targets; // open FILE... MODE
+  int count = ExpandTargets(tokens, tokens->size - 1, dir, *CWD, &targets);
+  for (int i = 0; i < count; i++)
+    fat_open(targets[i].name, mode, dir);
+  FreeDirectory(targets, count);
+  return 0;
 }
 
-void free_tokens(tokenlist *tokens)
+// close file
+int Run_close(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  for (int i = 0; i < tokens->size; i++)
-    free(tokens->items[i]);
-  free(tokens->items);
-  free(tokens);
+  fat_close(tokens->items[1], dir);
+  return 0;
 }
 
-//------------------------------------------------------------------------------
-//-----------------------------HELPER FUNCTIONS---------------------------------
-
-//----------------------------TRAVERSING THE FAT--------------------------------
-
-int ClusterNo_to_FATOffset(uint32_t cluster_no)
+// change file offset
+int Run_lseek(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  // First usable sector
-  int FirstFATSector = BOOT.BPB_RsvdSecCnt;
-
-  // Calculate offest
-  int FAT_Offset = (FirstFATSector * BOOT.BPB_BytsPerSec +
-                   cluster_no * 4); // Offset in IMAGEFILE
+  int i = 0;
+  sscanf(tokens->items[2], "%d", &i); // convert offset string to int
+  fat_lseek(tokens->items[1], i, dir);
+  return 0;
+}
 
-  return FAT_Offset; // return byte offset
+// read from file
+int Run_read(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  int i = 0;
+  sscanf(tokens->items[2], "%d", &i); // convert size string to int
+  fat_read(tokens->items[1], i, dir);
+  return 0;
 }
 
-uint32_t NextClusterNo(uint32_t cluster_no) // Traverse the FAT to find the next
-                                  // cluster, slides 11-12 BPB & commands PPT
+// write to file
+int Run_write(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  int offset = (BOOT.BPB_RsvdSecCnt * BOOT.BPB_BytsPerSec) +
-               (cluster_no * 4); // offset in FAT region
+  // The tokenizer already joined the quoted string into items[3]
+  int i = 0;
+  sscanf(tokens->items[2], "%d", &i); // convert size string to int
+  fat_write(tokens->items[1], i, tokens->items[3], dir);
+  return 0;
+}
 
-  uint32_t entry = 0;
-  fseek(IMAGEFILE, offset, SEEK_SET);
-  fread(&entry, sizeof(entry), 1, IMAGEFILE); // Read in next cluster_no
+// rm file
+int Run_rm(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  if (!MultiTarget(tokens, tokens->size))
+  {
+    rm(tokens->items[1], dir);
+    return 0;
+  }
 
-  return entry;
+  NAMED_ENTRY* targets; // rm FILE|PATTERN ...
+  int count = ExpandTargets(tokens, tokens->size, dir, *CWD, &targets);
+  rm_many(targets, count, dir);
+  FreeDirectory(targets, count);
+  return 0;
 }
 
-uint32_t Get_Child_Cluster_No(DIR_ENTRY current)
+// copy file
+int Run_cp(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  // Get cluster_no for child directory
-  char low[5];
-  char high[5];
-
-  sprintf(low, "%04x", current.DIR_FstClusLO);  // Read in high and low
-  sprintf(high, "%04x", current.DIR_FstClusHI); // bytes in hex format
+  uint32_t to_dir;
+  char* to_name;
+  int last = tokens->size - 1;
+  if (!MultiTarget(tokens, last))
+  {
+    if (ResolvePath(tokens->items[last], *CWD, &to_dir, &to_name) == 0)
+      cp(tokens->items[1], dir, to_name, to_dir);
+    return 0;
+  }
 
-  char child_cluster[11] = "0x"; // Concatenate bytes to string
-  strcat(child_cluster, high);
-  strcat(child_cluster, low);
-  //printf("%s\n", child_cluster);
+  // cp FILE... DIR -- every match is copied into DIR
+  NAMED_ENTRY* targets;
+  int count = ExpandTargets(tokens, last, dir, *CWD, &targets);
+  if (count > 0 &&
+      ResolvePath(tokens->items[last], *CWD, &to_dir, &to_name) == 0)
+  {
+    if (cd(to_name, to_dir) != 0) // Prints the error if not a directory
+      for (int i = 0; i < count; i++)
+        cp(targets[i].name, dir, to_name, to_dir);
+  }
+  FreeDirectory(targets, count);
+  return 0;
+}
 
-  uint32_t child_cluster_no = 0; // Convert hex string to int
-  sscanf(child_cluster, "%x", &child_cluster_no);
-  //printf("Located at cluster no. %i\n", child_cluster_no);
+// rm directory
+int Run_rmdir(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  fat_rmdir(tokens->items[1], dir);
+  return 0;
+}
 
-  return child_cluster_no;
+// concurrent reads
+int Run_stress(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  int i = 8; // default maximum thread count
+  if (tokens->size == 3)
+    sscanf(tokens->items[2], "%d", &i); // convert count string to int
+  stress(tokens->items[1], i, dir);
+  return 0;
 }
 
-uint32_t Find_Free_Cluster(void) // Returns first free cluster no.
+// import host file
+int Run_put(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  uint32_t cluster_no = BOOT.BPB_RootClus; // Root, first usable cluster no.
+  put(tokens->items[1], tokens->items[2], dir);
+  return 0;
+}
 
-  // Size of one FAT
-  int FirstFATSizeInBytes = BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec;
+// export to host file
+int Run_get(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  get(tokens->items[1], tokens->items[2], dir);
+  return 0;
+}
 
-  // Calculate FAT_Offset of Root
-  int FAT_Offset = ClusterNo_to_FATOffset(BOOT.BPB_RootClus);
+// import host tree
+int Run_import(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  import(tokens->items[1], (tokens->size == 3) ? tokens->items[2] : NULL,
+         dir);
+  return 0;
+}
 
-  //printf("FAT Size: %d\n", BOOT.BPB_FATSz32);
-  //printf("Start iterating FAT at offset: %x\n", FAT_Offset);
-  fseek(IMAGEFILE, FAT_Offset, SEEK_SET); // Position at offset
-  uint32_t cluster; // Read in cluster_no to uint32_t cluster
+// tree as tar stream
+int Run_export_tar(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  export_tar((tokens->size >= 2) ? tokens->items[1] : NULL,
+             (tokens->size == 3) ? tokens->items[2] : NULL, dir);
+  return 0;
+}
 
-  // Iterate through FAT until free cluster found
-  for (int i = 0; i < FirstFATSizeInBytes; i++)
+// search a tree by name
+int Run_find(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  if (strcmp(tokens->items[tokens->size - 2], "-name") != 0)
   {
-    fread(&cluster, sizeof(cluster), 1, IMAGEFILE);
-    if (cluster == 0x0) // If free cluster found, return cluster_no
-    {
-      // In case any prior data exists within this cluster, set cluster to 0
-      int data_offset = ClusterNo_To_DataOffset(cluster_no);
-      uint8_t empty_cluster[BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus];
-      for (int i = 0; i < (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus); i++)
-        empty_cluster[i] = 0x00;
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fwrite(&empty_cluster, sizeof(empty_cluster), 1, IMAGEFILE);
-
-      return cluster_no;
-    }
-
-    cluster_no++;
+    Error(STATUS_USAGE, "Usage: %s\n", FindCommand("find")->usage);
+    return 0;
   }
-
-  printf("Out of memory. Sectors per FAT (BPB_FATSz32) set to: ");
-  printf("%i (%i bytes).\n", BOOT.BPB_FATSz32, FirstFATSizeInBytes);
-  return -1; // NO FREE CLUSTERS LEFT! Return -1
+  find((tokens->size == 4) ? tokens->items[1] : NULL,
+       tokens->items[tokens->size - 1], dir);
+  return 0;
 }
 
-//-------------------------TRAVERSING THE DATA REGION---------------------------
+// space used by a tree
+int Run_du(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  du((tokens->size == 2) ? tokens->items[1] : NULL, dir);
+  return 0;
+}
 
-int ClusterNo_To_DataOffset(uint32_t cluster_no)
-// Returns offset in data region refered to by cluster_no
+// squeeze out deleted directory slots
+int Run_compact(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  int FirstDataSector = BOOT.BPB_RsvdSecCnt +
-                       (BOOT.BPB_NumFATs * BOOT.BPB_FATSz32);
-  int Offset = FirstDataSector + (cluster_no - 2) *
-                    BOOT.BPB_SecPerClus;
-  return(Offset * BOOT.BPB_BytsPerSec); // return byte offset
+  compact((tokens->size == 2) ? tokens->items[1] : NULL, dir);
+  return 0;
 }
 
-DIR_ENTRY Get_DIR_ENTRY(char* entry, uint32_t cluster_no)
+// consistency check, -r repairs
+int Run_check(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
 {
-  DIR_ENTRY current;
-  LDIR_ENTRY long_entry;
-  int iteration = 0; // How many CLUSTERS traversed, for debugging
+  if (tokens->size == 2 && strcmp(tokens->items[1], "-r") != 0)
+  {
+    Error(STATUS_USAGE, "Usage: %s\n", FindCommand("check")->usage);
+    return 0;
+  }
+  check(tokens->size == 2);
+  return 0;
+}
 
-  // ITERATE THROUGH DIRECTORY
-  do {
-    iteration++;
+// make files contiguous
+int Run_defrag(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  long budget = 0; // 0: no limit
+  if (tokens->size == 3 && (sscanf(tokens->items[2], "%ld", &budget) != 1 ||
+                            budget < 1))
+  {
+    Error(STATUS_USAGE, "Usage: %s\n", FindCommand("defrag")->usage);
+    return 0;
+  }
+  defrag(tokens->items[1], budget, dir);
+  return 0;
+}
 
-    // FIND OFFSET OF CLUSTER IN THE DATA REGION
-    int data_offset = ClusterNo_To_DataOffset(cluster_no);
-    int starting_offset = data_offset;
+// space and fragmentation report
+int Run_stats(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  if (tokens->size == 2 && strcmp(tokens->items[1], "--json") != 0)
+  {
+    Error(STATUS_USAGE, "Usage: %s\n", FindCommand("stats")->usage);
+    return 0;
+  }
+  stats(tokens->size == 2);
+  return 0;
+}
 
-    // CHECK FOR . and .. ENTRIES
-    if ((cluster_no != FIRST_CLUSTER) && (iteration == 1))
+// show or set the allocation policy
+int Run_alloc(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  if (tokens->size == 2)
+  {
+    int policy = ParseAllocPolicy(tokens->items[1]);
+    if (policy < 0)
     {
-      DIR_ENTRY OneDot, TwoDots; // dir entries for . and .. have NOT longentry
-                                // preceding them
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-      if (strcmp(entry, ".") == 0) // If match found
-        return OneDot;
-      data_offset += sizeof(OneDot);
-
-      fread(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-      if (strcmp(entry, "..") == 0) // If match found
-        return TwoDots;
-      data_offset += sizeof(TwoDots);
+      Error(STATUS_USAGE, "Usage: %s\n", FindCommand("alloc")->usage);
+      return 0;
     }
+    ALLOC_POLICY = policy;
+  }
+  fprintf(OUT, "Allocation policy: %s\n", ALLOC_POLICY_NAMES[ALLOC_POLICY]);
+  return 0;
+}
 
-    // READ IN DIR_ENTRY VALUES UNTIL ALL CLUSTER SPACE HAS BEEN READ IN
-    // (Very likely empty space will exist for additional DIR_ENTRYs)
-    while (data_offset < ((starting_offset + BOOT.BPB_BytsPerSec)
-                                           * BOOT.BPB_SecPerClus)) {
+// compare allocation policies
+int Run_allocbench(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  int counts[3] = { 8, 8, 16 }; // default dirs, files per dir, clusters
+  for (int i = 1; i < tokens->size; i++)
+    sscanf(tokens->items[i], "%d", &counts[i - 1]);
+  allocbench(counts[0], counts[1], counts[2], dir);
+  return 0;
+}
 
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
+// I/O and latency counters
+int Run_perf(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+#ifdef FAT_PERF
+  if (tokens->size == 1)
+    perf(0);
+  else if (strcmp(tokens->items[1], "--json") == 0)
+    perf(1);
+  else if (strcmp(tokens->items[1], "reset") == 0)
+  {
+    memset(&PERF, 0, sizeof(PERF));
+    memset(PERF_COMMANDS, 0, sizeof(PERF_COMMANDS));
+  }
+  else
+    Error(STATUS_USAGE, "Usage: %s\n", FindCommand("perf")->usage);
+#else
+  Error(STATUS_INVALID, "Error. Built without instrumentation (make perf).\n");
+#endif
+  return 0;
+}
 
-      int additional_offset = sizeof(long_entry);
+// Mixed workload from concurrent clients
+int Run_load(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  LOAD_SPEC spec;
+  if (ParseLoadSpec(tokens, &spec) != 0)
+    Error(STATUS_USAGE, "Usage: %s\n", FindCommand("load")->usage);
+  else
+    load(&spec, dir);
+  return 0;
+}
 
-      if (long_entry.LDIR_Ord == 0x00) // The remainder of the cluster is empty
-        break;
+// Make every write durable; under --ram, write the image back
+int Run_sync(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  if (FlushDevice() == 0) // The file now holds this image: stamp the index
+    SaveSizeIndex();      // with it
+  return 0;
+}
 
-      // IGNORE LONG DIRECTORY NAME ENTRIES
-      while (long_entry.LDIR_Ord != 65)
-                             // If the last LDIR entry is the first,
-                             // it should equal 0x1 & 0x40 = 0x41 (or int 65)
-                             // If ignoring LDIR entries indicating long
-                             // filename impexitlementation, we will skip ahead
-                             // until this field == 65
-      {
-        fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-        additional_offset += sizeof(long_entry);
-
-        if ((long_entry.LDIR_Ord == 65) && (long_entry.LDIR_Attr != 0xf))
-        // NOTE: LDIR_Attr must be set to the following for LDIR entries:
-        // ( ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID ) =
-        // ( 0x01 | 0x02 | 0x04 | 0x08 ) = 0xf     (equivalent to 15)
-                  // In the rare instance we come across an entry whose first
-                  // stored value is 65 and who does NOT have an attr equal to
-                  // 0xf, it is a actually a DIR_ENTRY starting w/ an "A"
-                  // and not an LDIR entry at all
-                  // --> "A" = 65 in ASCII code value
-                  // This comparison works bc Attr values are stored in offset
-                  // 11 on both DIR and LDIR entries; in this case, continue on
-        {
-          continue;
-        }
-      }
+// Discard free clusters on the device
+int Run_trim(tokenlist* tokens, uint32_t dir, uint32_t* CWD)
+{
+  trim();
+  return 0;
+}
 
-      fread(&current, sizeof(current), 1, IMAGEFILE); // Read in new DIR_ENTRY
+//---------------------------FUNCTION DEFINITIONS-------------------------------
 
-      if (current.DIR_Name[0] == 0xE5) // If dir_entry is deallocated, skip
-      {
-        data_offset += (sizeof(current) + additional_offset); // update data_off
-        continue;
-      }
+//---------------------------parser.c DEFINITIONS-------------------------------
+// PROVIDED CODE FOR PARSING
 
-      char* temp = RemoveWhiteSpaces(current.DIR_Name);
-      if (strcmp(temp, entry) == 0) // If match found
-        return current;
+char *get_input(void)
+{
+  // One line buffer for the whole shell, grown by getline as needed
+  static char *buffer = NULL;
+  static size_t bufsize = 0;
 
-        data_offset += (sizeof(current) + additional_offset); // update data_off
-      } // END OF INSIDE WHILE LOOP -- cluster fully read
+  ssize_t length = getline(&buffer, &bufsize, stdin);
+  if (length < 0)
+    return NULL; // EOF
 
-      cluster_no = NextClusterNo(cluster_no);
-    } while(cluster_no < 0x0FFFFFF6); // End loop if final cluster
+  if (length > 0 && buffer[length - 1] == '\n')
+    buffer[--length] = 0;
 
-    // IF UNSUCCESSFUL
-    current.DIR_Name[0] = 0x00;
-    return current;
+  return buffer;
 }
 
-int Get_DIR_ENTRY_Offset(char* entry, uint32_t cluster_no)
+int get_tokens(char *input, tokenlist *tokens)
 {
-  DIR_ENTRY current;
-  LDIR_ENTRY long_entry;
-  int iteration = 0; // How many CLUSTERS traversed, for debugging
-
-  // ITERATE THROUGH DIRECTORY
-  do {
-    iteration++;
-
-    // FIND OFFSET OF CLUSTER IN THE DATA REGION
-    int data_offset = ClusterNo_To_DataOffset(cluster_no);
-    int starting_offset = data_offset;
-
-    // CHECK FOR . and .. ENTRIES
-    if ((cluster_no != FIRST_CLUSTER) && (iteration == 1))
-    {
-      DIR_ENTRY OneDot, TwoDots; // dir entries for . and .. have NOT longentry
-                                // preceding them
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-      if (strcmp(entry, ".") == 0) // If match found
-        return data_offset;
-      data_offset += sizeof(OneDot);
+  // Single pass over input, compacting tokens in place. A token starting
+  // with a quote runs to the closing quote, spaces included, and loses
+  // both quotes
+  char *read = input, *write = input;
+  tokens->size = 0;
 
-      fread(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-      if (strcmp(entry, "..") == 0) // If match found
-        return data_offset;
-      data_offset += sizeof(TwoDots);
+  while (1) {
+    while (*read == ' ' || *read == '\t')
+      read++;
+    if (*read == '\0')
+      break;
+    if (tokens->size == MAX_TOKENS) { // Cut short, a command would run
+      tokens->items[tokens->size] = NULL; // on the wrong arguments
+      COMMAND_STATUS = STATUS_OK;
+      Error(STATUS_USAGE, "Error. Commands take at most %d words.\n",
+            MAX_TOKENS);
+      return -1;
     }
 
-    // READ IN DIR_ENTRY VALUES UNTIL ALL CLUSTER SPACE HAS BEEN READ IN
-    // (Very likely empty space will exist for additional DIR_ENTRYs)
-    while (data_offset < ((starting_offset + BOOT.BPB_BytsPerSec)
-                                           * BOOT.BPB_SecPerClus)) {
-
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-
-      int additional_offset = sizeof(long_entry);
-
-      if (long_entry.LDIR_Ord == 0x00) // The remainder of the cluster is empty
-        break;
-
-      // IGNORE LONG DIRECTORY NAME ENTRIES
-      while (long_entry.LDIR_Ord != 65)
-                             // THIS LOOP IS EXPLAINED IN Get_DIR_ENTRY() func
-      {
-        fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-        additional_offset += sizeof(long_entry);
+    tokens->items[tokens->size++] = write;
+    if (*read == '"') {
+      read++;
+      while (*read != '\0' && *read != '"')
+        *write++ = *read++;
+      if (*read == '"')
+        read++;
+    }
+    else {
+      while (*read != '\0' && *read != ' ' && *read != '\t')
+        *write++ = *read++;
+    }
 
-        if ((long_entry.LDIR_Ord == 65) && (long_entry.LDIR_Attr != 0xf))
-          continue;
-      }
+    // write never passes read, so ending the token cannot clobber
+    // anything still unread other than the separator itself
+    char next = *read;
+    *write++ = '\0';
+    if (next == '\0')
+      break;
+    if (next == ' ' || next == '\t')
+      read++;
+  }
 
-      fread(&current, sizeof(current), 1, IMAGEFILE); // Read in new DIR_ENTRY
+  tokens->items[tokens->size] = NULL;
+  return 0;
+}
 
-      if (current.DIR_Name[0] == 0xE5) // If dir_entry is deallocated, skip
-      {
-        data_offset += (sizeof(current) + additional_offset); // update data_off
-        continue;
-      }
+//------------------------------------------------------------------------------
+//-----------------------------HELPER FUNCTIONS---------------------------------
 
-      char* temp = RemoveWhiteSpaces(current.DIR_Name);
-      if (strcmp(temp, entry) == 0) // If match found
-        return (data_offset + additional_offset);
+//-------------------------------POSITIONAL I/O---------------------------------
 
-      data_offset += (sizeof(current) + additional_offset); // update data_off
-      } // END OF INSIDE WHILE LOOP -- cluster fully read
+// Every access to IMAGEFILE names its own byte offset (pread/pwrite), so
+// threads never race on a shared stream position
+int FullRead(int fd, void* buffer, size_t size, off_t offset)
+{
+  char* dest = buffer;
+  while (size > 0)
+  {
+    ssize_t n = pread(fd, dest, size, offset);
+    if (n < 0 && errno == EINTR) // interrupted, retry
+      continue;
+    if (n <= 0) // error or end of IMAGEFILE
+      return -1;
+    dest += n;
+    offset += n;
+    size -= n;
+  }
+  return 0;
+}
 
-      cluster_no = NextClusterNo(cluster_no);
-    } while(cluster_no < 0x0FFFFFF6); // End loop if final cluster
+int FullWrite(int fd, const void* buffer, size_t size, off_t offset)
+{
+  const char* src = buffer;
+  while (size > 0)
+  {
+    ssize_t n = pwrite(fd, src, size, offset);
+    if (n < 0 && errno == EINTR) // interrupted, retry
+      continue;
+    if (n <= 0)
+      return -1;
+    src += n;
+    offset += n;
+    size -= n;
+  }
+  return 0;
+}
 
-    // IF UNSUCCESSFUL
-    return 0x0;
+int DeviceRead(void* buffer, size_t size, off_t offset)
+{
+  PERF_IO(0, size, offset);
+  return (DEVICE->read(buffer, size, offset) == (ssize_t) size) ? 0 : -1;
 }
 
-int GetFreeEntryOffset(uint32_t cluster_no)
+int DeviceWrite(const void* buffer, size_t size, off_t offset)
 {
-  //printf("Cluster no. inside GetFreeEntryOffset(): %i\n", cluster_no);
+  PERF_IO(1, size, offset);
+  return DEVICE->write(buffer, size, offset);
+}
 
-  DIR_ENTRY current;
-  LDIR_ENTRY long_entry;
-  int iteration = 0; // How many CLUSTERS traversed, for debugging
+// Small reads (directory entries, FAT sectors) are served from BLOCK_CACHE.
+// The cache is write-through, so IMAGEFILE itself is always up to date and
+// large reads can bypass it safely
+int ReadImage(void* buffer, size_t size, off_t offset)
+{
+  if (BLOCK_CACHE == NULL || size >= CACHE_BYPASS)
+    return DeviceRead(buffer, size, offset);
 
-  // ITERATE THROUGH DIRECTORY
-  do {
-    iteration++;
-    //printf("do/while iteration: %i\n", iteration);
-    //printf("cluster_no in do/while: %i\n", cluster_no);
+  char* dest = buffer;
+  while (size > 0)
+  {
+    off_t block_no = offset / CACHE_BLOCK_SIZE;
+    int within = offset % CACHE_BLOCK_SIZE; // position inside the block
+    int n = CACHE_BLOCK_SIZE - within;
+    if (n > size)
+      n = size;
 
-    // FIND OFFSET OF CLUSTER IN THE DATA REGION
-    int data_offset = ClusterNo_To_DataOffset(cluster_no);
-    int starting_offset = data_offset;
+    int slot = block_no % CACHE_BLOCKS;
+    CACHE_BLOCK* block = &BLOCK_CACHE[slot];
+    pthread_mutex_lock(&BLOCK_CACHE_LOCKS[slot % 64]);
 
-    // CHECK FOR . and .. ENTRIES
-    if ((cluster_no != FIRST_CLUSTER) && (iteration == 1))
+    if (block->block_no != block_no) // Miss, fill slot from IMAGEFILE
     {
-      DIR_ENTRY OneDot, TwoDots; // dir entries for . and .. have NOT longentry
-                                // preceding them
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-      data_offset += sizeof(OneDot);
+      PERF_ADD(cache_misses, 1);
+      PERF_IO(0, CACHE_BLOCK_SIZE, block_no * CACHE_BLOCK_SIZE);
+      ssize_t length = DEVICE->read(block->data, CACHE_BLOCK_SIZE,
+                                    block_no * CACHE_BLOCK_SIZE);
+      block->block_no = (length > 0) ? block_no : -1;
+      block->length = (length > 0) ? length : 0;
+    }
+    else
+      PERF_ADD(cache_hits, 1);
 
-      fread(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-      data_offset += sizeof(TwoDots);
+    if (block->block_no != block_no || within + n > block->length)
+    {
+      pthread_mutex_unlock(&BLOCK_CACHE_LOCKS[slot % 64]);
+      return -1; // Past the end of IMAGEFILE
     }
+    memcpy(dest, &block->data[within], n);
+    pthread_mutex_unlock(&BLOCK_CACHE_LOCKS[slot % 64]);
 
-    // READ IN DIR_ENTRY VALUES UNTIL ALL CLUSTER SPACE HAS BEEN READ IN
-    // (Very likely empty space will exist for additional DIR_ENTRYs)
+    dest += n;
+    offset += n;
+    size -= n;
+  }
+  return 0;
+}
 
-    while (data_offset < ((starting_offset + BOOT.BPB_BytsPerSec)
-                                           * BOOT.BPB_SecPerClus)) {
+int WriteImage(const void* buffer, size_t size, off_t offset)
+{
+  if (DeviceWrite(buffer, size, offset) != 0)
+    return -1;
+  if (BLOCK_CACHE == NULL)
+    return 0;
+
+  // Update any cached copy of the blocks just written
+  const char* src = buffer;
+  while (size > 0)
+  {
+    off_t block_no = offset / CACHE_BLOCK_SIZE;
+    int within = offset % CACHE_BLOCK_SIZE;
+    int n = CACHE_BLOCK_SIZE - within;
+    if (n > size)
+      n = size;
+
+    int slot = block_no % CACHE_BLOCKS;
+    CACHE_BLOCK* block = &BLOCK_CACHE[slot];
+    pthread_mutex_lock(&BLOCK_CACHE_LOCKS[slot % 64]);
+    if (block->block_no == block_no)
+    {
+      if (within + n <= block->length)
+        memcpy(&block->data[within], src, n);
+      else
+        block->block_no = -1; // IMAGEFILE grew under this block, refetch
+    }
+    pthread_mutex_unlock(&BLOCK_CACHE_LOCKS[slot % 64]);
 
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
+    src += n;
+    offset += n;
+    size -= n;
+  }
+  return 0;
+}
 
-      int additional_offset = 0;
-      int long_offset = sizeof(long_entry);
+//--------------------------------BLOCK DEVICES---------------------------------
 
-      if (long_entry.LDIR_Ord == 0x0){ // The remainder of the cluster is empty
-        //printf("Cluster no is now %d and offset is ", cluster_no);
-        //printf("%d\n", data_offset);
-        return data_offset;
-	    }
+BLOCK_DEVICE FILE_DEVICE = { "file", FileRead, FileWrite, FileFlush,
+                             FileDiscard };
+BLOCK_DEVICE OVERLAY_DEVICE = { "overlay", OverlayRead, OverlayWrite,
+                                OverlayFlush, OverlayDiscard };
+BLOCK_DEVICE RAM_DEVICE = { "ram", RamRead, RamWrite, RamFlush, RamDiscard };
+BLOCK_DEVICE MAPPED_DEVICE = { "read-only", RamRead, MappedWrite,
+                               MappedFlush, MappedDiscard };
 
-      // IGNORE LONG DIRECTORY NAME ENTRIES
-      while (long_entry.LDIR_Ord != 65)
-      // THIS LOOP IS EXPLAINED IN Get_DIR_ENTRY() func
-      {
-        fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-        additional_offset += sizeof(long_entry);
-
-        if ((long_entry.LDIR_Ord == 65) && (long_entry.LDIR_Attr != 0xf))
-          continue;
-      }
-
-      fread(&current, sizeof(current), 1, IMAGEFILE); // Read in new DIR_ENTRY
-
-      if (current.DIR_Name[0] == 0xE5) { // If dir_entry is deallocated, return
-        //printf("Cluster no is now %d and offset is ", cluster_no);
-        //printf("%d\n", data_offset + additional_offset);
-        return (data_offset + additional_offset);
-      }
-
-      // Update data_offset
-      data_offset += (sizeof(current) + additional_offset + long_offset);
+#define RAM_HUGE_PAGE (2 << 20) // RAM_IMAGE is mapped in multiples of this
+#define RAM_CHUNK (1 << 20) // Write back unit; all-zero chunks stay holes
 
-    } // END OF INSIDE WHILE LOOP -- cluster fully read
-
-    cluster_no = NextClusterNo(cluster_no);
-  } while(cluster_no < 0x0FFFFFF6); //
-
-
-  return -999;	//didn't get a free cluster
-}
-
-int DirAlreadyExists(char* dir, uint32_t cluster_no)
+int AttachDevice(const char* path)
+// IMAGEFILE is opened read-only under an overlay (writes go to the delta),
+// in RAM (written back by replacing the file) and of course with --ro
 {
-  if (strcmp(dir, ".") == 0 || strcmp(dir, "..") == 0)
-    return 2; // File exists, special case
-
-  DIR_ENTRY current = Get_DIR_ENTRY(dir, cluster_no);
-  if (current.DIR_Name[0] != 0x00) // File exists in CWD
+  int read_only = OVERLAY_PATH != NULL || RAM_MODE || RO_MODE;
+  IMAGE_FD = open(path, read_only ? O_RDONLY : O_RDWR);
+  if (IMAGE_FD < 0){
+    fprintf(OUT, "Can't Read. Invalid File\n");
     return 1;
+  }
 
-  return 0; // File does not yet exist
+  DEVICE = &FILE_DEVICE;
+  if (OVERLAY_PATH != NULL)
+  {
+    if (OpenOverlay(OVERLAY_PATH, OVERLAY_MOUNT) != 0)
+      return 1;
+    DEVICE = &OVERLAY_DEVICE;
+  }
+  else if (RAM_MODE)
+  {
+    if (LoadRam(path) != 0)
+    {
+      fprintf(OUT, "Cannot load %s into memory\n", path);
+      return 1;
+    }
+    DEVICE = &RAM_DEVICE;
+  }
+  else if (RO_MODE)
+  {
+    if (MapImage() != 0)
+    {
+      fprintf(OUT, "Cannot map %s\n", path);
+      return 1;
+    }
+    DEVICE = &MAPPED_DEVICE;
+  }
+  return 0;
 }
 
-int IsDirEmpty(char* dir, uint32_t cluster_no)
+ssize_t FileRead(void* buffer, size_t size, off_t offset)
 {
-  DIR_ENTRY current;
-  LDIR_ENTRY long_entry;
-
-  // START TO ITERATE THROUGH DIRECTORY
-  // FIND OFFSET OF CLUSTER IN THE DATA REGION
-  int data_offset = ClusterNo_To_DataOffset(cluster_no);
-  int starting_offset = data_offset;
-
-  if (cluster_no != BOOT.BPB_RootClus)
+  char* dest = buffer;
+  size_t done = 0;
+  while (done < size)
   {
-    // CHECK FOR . and .. ENTRIES
-    DIR_ENTRY OneDot, TwoDots; // dir entries for . and .. have NOT longentry
-                                  // preceding them
-    fseek(IMAGEFILE, data_offset, SEEK_SET);
-    fread(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-    data_offset += sizeof(OneDot);
-
-    fread(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-    data_offset += sizeof(TwoDots);
+    ssize_t n = pread(IMAGE_FD, &dest[done], size - done, offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break; // End of IMAGEFILE
+    done += n;
   }
-
-  // READ NEXT ENTRY
-  fseek(IMAGEFILE, data_offset, SEEK_SET);
-  fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-  fseek(IMAGEFILE, data_offset, SEEK_SET);
-  fread(&current, sizeof(current), 1, IMAGEFILE);
-
-  if (long_entry.LDIR_Ord == 0x00) // The remainder of the cluster is empty
-      return 0; // TRUE -- DIR IS EMPTY
-  else
-    return 1; // FALSE -- DIR IS NOT EMPTY
+  return done;
 }
 
-char* ReadToBuffer(char* buffer, int buffer_size, uint32_t cluster_no)
-// Convert cluster no to its data region offset, read to buffer for size bytes
+int FileWrite(const void* buffer, size_t size, off_t offset)
 {
-  // Position data_offset at file cluster in data region, read for new_size
-  // bytes into buffer
-  int data_offset = ClusterNo_To_DataOffset(cluster_no);
-  fseek(IMAGEFILE, data_offset, SEEK_SET);
+  return FullWrite(IMAGE_FD, buffer, size, offset);
+}
 
-  int new_size = buffer_size;
-  int offset = 0; // Offset for reading into buffer
+int FileFlush(void)
+{
+  return fdatasync(IMAGE_FD);
+}
 
-  // ITERATE THROUGH CLUSTERS AND READ INTO BUFFER
-  while (new_size > (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus))
-  // WHILE MORE THAN ONE CLUSTER LEFT TO BE READ
-  {
-    // READ TO END OF CLUSTER AND PRINT
-    int size_to_read = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
-    fread(&buffer[offset], size_to_read, 1, IMAGEFILE);
+int FileDiscard(off_t offset, off_t size)
+// The file keeps its size; the range becomes a hole reading as zeros
+{
+  return fallocate(IMAGE_FD, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   offset, size);
+}
 
-    //printf("\n\nBuffer on iteration %i: %s\n\n\n", iteration, buffer);
+int OverlayFlush(void)
+{
+  return fdatasync(OVERLAY_FD);
+}
 
-    // THEN ADVANCE CLUSTER
-    cluster_no = NextClusterNo(cluster_no);
-    data_offset = ClusterNo_To_DataOffset(cluster_no);
-    fseek(IMAGEFILE, data_offset, SEEK_SET);
+int OverlayDiscard(off_t offset, off_t size)
+// The delta cannot say "zero" for a sector, and the base is read-only
+{
+  return -1;
+}
 
-    // UPDATE NEW_SIZE and OFFSET
-    new_size -= (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
-    offset += size_to_read;
+int LoadRam(const char* path)
+// Only the image's data extents are read (SEEK_DATA/SEEK_HOLE), so a
+// sparse image loads in the time its data takes and its holes stay
+// untouched zero pages
+{
+  struct stat info;
+  if (fstat(IMAGE_FD, &info) != 0)
+    return -1;
+  RAM_PATH = path;
+  RAM_SIZE = info.st_size;
+  RAM_MAPPED = (RAM_SIZE + RAM_HUGE_PAGE - 1) & ~(size_t) (RAM_HUGE_PAGE - 1);
+  if (RAM_MAPPED == 0)
+    RAM_MAPPED = RAM_HUGE_PAGE;
+
+  // Reserved huge pages if the system has them, else transparent ones
+  RAM_IMAGE = mmap(NULL, RAM_MAPPED, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (RAM_IMAGE == MAP_FAILED)
+  {
+    RAM_IMAGE = mmap(NULL, RAM_MAPPED, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (RAM_IMAGE == MAP_FAILED)
+      return -1;
+    madvise(RAM_IMAGE, RAM_MAPPED, MADV_HUGEPAGE);
   }
 
-  // READ AND PRINT REMAINING (Final cluster)
-  fread(&buffer[offset], new_size, 1, IMAGEFILE);
-  buffer[buffer_size] = '\0';
-
-  //printf("\n\n\nBuffer before write function: %s\n\n\n", buffer);
+  off_t data = 0;
+  while (data < (off_t) RAM_SIZE &&
+         (data = lseek(IMAGE_FD, data, SEEK_DATA)) >= 0)
+  {
+    off_t hole = lseek(IMAGE_FD, data, SEEK_HOLE);
+    if (hole < 0 || hole > (off_t) RAM_SIZE)
+      hole = RAM_SIZE;
+    if (FullRead(IMAGE_FD, &RAM_IMAGE[data], hole - data, data) != 0)
+      return -1;
+    data = hole;
+  }
+  if (data < 0 && errno != ENXIO) // No SEEK_DATA here: read it all
+    return FullRead(IMAGE_FD, RAM_IMAGE, RAM_SIZE, 0);
+  return 0;
 }
 
-//---------------------------IMAGEFILE MANIPULATION-----------------------------
-
-void rm_DIR_ENTRY(char* file, uint32_t cluster_no)
+ssize_t RamRead(void* buffer, size_t size, off_t offset)
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  if (offset >= (off_t) RAM_SIZE)
+    return 0;
+  if (size > RAM_SIZE - offset)
+    size = RAM_SIZE - offset;
+  memcpy(buffer, &RAM_IMAGE[offset], size);
+  return size;
+}
 
-  // Delete the DIR_ENTRY in the current directory----------------------
+int RamWrite(const void* buffer, size_t size, off_t offset)
+{
+  if (offset + size > RAM_SIZE)
+    return -1; // The image does not grow
+  memcpy(&RAM_IMAGE[offset], buffer, size);
+  __atomic_store_n(&RAM_DIRTY, 1, __ATOMIC_RELAXED);
+  return 0;
+}
 
-  // Get data_offset of DIR_ENTRY
-  int data_offset = Get_DIR_ENTRY_Offset(file, cluster_no);
-  if (data_offset == 0x0)
+int RamFlush(void)
+// Written to IMAGEFILE.tmp, synced and renamed over IMAGEFILE, so the
+// image on disk is always the old one or the new one, never half of each.
+// IMAGE_FD is then reopened on the new file, whose mtime the size index
+// records. sync runs it with every command that changes the image drained
+// (COMMAND_SNAPSHOT), so the copy is of a consistent image
+{
+  if (!__atomic_exchange_n(&RAM_DIRTY, 0, __ATOMIC_RELAXED))
+    return 0;
+
+  struct stat info;
+  fstat(IMAGE_FD, &info);
+  char* temporary = malloc(strlen(RAM_PATH) + 5);
+  sprintf(temporary, "%s.tmp", RAM_PATH);
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC,
+                info.st_mode & 07777);
+  int status = (fd >= 0 && ftruncate(fd, RAM_SIZE) == 0) ? 0 : -1;
+  for (size_t offset = 0; offset < RAM_SIZE && status == 0;
+       offset += RAM_CHUNK)
   {
-    printf("Error in rm_DIR_ENTRY function.\n");
-    return;
+    size_t n = (RAM_SIZE - offset < RAM_CHUNK) ? RAM_SIZE - offset
+                                               : RAM_CHUNK;
+    const char* chunk = &RAM_IMAGE[offset];
+    if (chunk[0] != 0 || memcmp(chunk, chunk + 1, n - 1) != 0)
+      status = FullWrite(fd, chunk, n, offset);
+  }
+  if (status == 0)
+    status = fsync(fd);
+  if (fd >= 0)
+    close(fd);
+  if (status == 0)
+    status = rename(temporary, RAM_PATH);
+  if (status != 0)
+  {
+    unlink(temporary);
+    __atomic_store_n(&RAM_DIRTY, 1, __ATOMIC_RELAXED);
   }
-
-  // Postion IMAGEFILE at offset + size of current DIR_ENTRY
-  fseek(IMAGEFILE, data_offset + sizeof(current), SEEK_SET);
-
-  // Check if this DIR_ENTRY is the last entry in cluster
-  LDIR_ENTRY next;
-  fread(&next, sizeof(next), 1, IMAGEFILE);
-  if(next.LDIR_Ord = 0x00) // If no more entries afterward
-    current.DIR_Name[0] = 0x0; // Set entry to empty
   else
-    current.DIR_Name[0] = 0xE5; // Otherwise mark as deallocated
-
-  fseek(IMAGEFILE, data_offset, SEEK_SET);
-  fwrite(&current, sizeof(current), 1, IMAGEFILE);
+  {
+    int reopened = open(RAM_PATH, O_RDONLY);
+    if (reopened >= 0)
+    {
+      close(IMAGE_FD);
+      IMAGE_FD = reopened;
+    }
+  }
+  free(temporary);
+  return status;
 }
 
-DIR_ENTRY create_newfile(char* file)
+int RamDiscard(off_t offset, off_t size)
 {
-  // Set all necessary fields for program operation
-  // As well as all fields that must be set to a specific value
-  // According to FAT32 specs
-	DIR_ENTRY NewFile;
-	NewFile.DIR_FileSize=0;
-	NewFile.DIR_FstClusHI=0;
-	NewFile.DIR_FstClusLO=0;
-  NewFile.DIR_Attr=0x20;
-  NewFile.DIR_NTRes=0;
-	strcpy(NewFile.DIR_Name,file);
-  //printf("%c\n",NewFile.DIR_Name[0]);
-
-  return NewFile;
+  if (offset + size > (off_t) RAM_SIZE)
+    return -1;
+  memset(&RAM_IMAGE[offset], 0, size);
+  __atomic_store_n(&RAM_DIRTY, 1, __ATOMIC_RELAXED);
+  return 0;
 }
 
-void UpdateFileSize(char* file, uint32_t cluster_no, int new_size)
+int FlushDevice(void)
 {
-  // Get current DIR_ENTRY and its offset
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  int update_offset = Get_DIR_ENTRY_Offset(file, cluster_no);
-
-  // Change current file size and write back to data region of IMAGEFILE
-  current.DIR_FileSize = new_size;
-  fseek(IMAGEFILE, update_offset, SEEK_SET);
-  fwrite(&current, sizeof(current), 1, IMAGEFILE);
+  if (DEVICE->flush() == 0)
+    return 0;
+  Error(STATUS_IO, "Error. Cannot flush the %s device: %s\n", DEVICE->name,
+        strerror(errno));
+  return -1;
 }
 
-void UpdateClusterInFAT(uint32_t cluster_no, uint32_t next_cluster)
+int MapImage(void)
+// Every --ro process maps the same page cache pages, so the FAT and the
+// directories are held in memory once however many readers there are
 {
-  // Position IMAGEFILE to current cluster in FAT Region
-  int FAT_Offset = ClusterNo_to_FATOffset(cluster_no);
-  //printf("FAT Offset of current cluster: %x\n", FAT_Offset);
-  fseek(IMAGEFILE, FAT_Offset, SEEK_SET);
-
-  // Write next cluster in current cluster's FAT sector
-  fwrite(&next_cluster, sizeof(next_cluster), 1, IMAGEFILE);
+  struct stat info;
+  if (fstat(IMAGE_FD, &info) != 0 || info.st_size == 0)
+    return -1;
+  RAM_SIZE = RAM_MAPPED = info.st_size;
+  RAM_IMAGE = mmap(NULL, RAM_MAPPED, PROT_READ, MAP_SHARED, IMAGE_FD, 0);
+  return (RAM_IMAGE == MAP_FAILED) ? -1 : 0;
 }
 
-void AllocateClusterToEmptyFile(DIR_ENTRY current, int offset,
-                                  uint32_t cluster_no)
-// Given a free cluster, change a DIR_ENTRY in IMAGEFILE's data
-// region to point to said cluster, change cluster_no in IMAGEFILE
-// FAT Region to point to last cluster in a list (0xFFFFFFFF)
+int MappedWrite(const void* buffer, size_t size, off_t offset)
 {
-  // Allocate char arrays for 8 bit byte, high 4 bits and low 4 bits
-  char byte[9];
-  char low[5];
-  char high[5];
-
-  // write cluster number in 8 bit hex format into string byte, null terminate
-  sprintf(byte, "%08x", cluster_no);
-  byte[8] = '\0';
-  //printf("%s\n", byte);
-
-  // Now that bytes string is set, write 4 high bits to high string
-  for (int i = 0; i < 4; i++)
-    high[i] = byte[i];
-  high[4] = '\0';
-  // And write four low bits to low string
-  for (int j = 4; j < 8; j++)
-    low[j - 4] = byte[j];
-  low[4] = '\0';
-  //printf("%s %s\n", high, low);
-
-  // Declare 16 bit integers for high and low
-  uint16_t high_clus;
-  uint16_t low_clus;
-
-  // Convert high and low bit strings to ints, write into current DIR_ENTRY
-  sscanf(high, "%x", &high_clus);
-  sscanf(low, "%x", &low_clus);
-  //printf("High Clus: %i\n", high_clus);
-  //printf("Low Clus: %i\n", low_clus);
-  current.DIR_FstClusHI = high_clus;
-  current.DIR_FstClusLO = low_clus;
-
-  // Re-write DIR_ENTRY over old version of DIR_ENTRY in IMAGEFILE data region
-  fseek(IMAGEFILE, offset, SEEK_SET);
-  fwrite(&current, sizeof(current), 1, IMAGEFILE);
-  UpdateClusterInFAT(cluster_no, 0xFFFFFFFF); // Set new cluster to last in list
-  //printf("Cluster No. %i set to 0xFFFFFFFF in FAT Region\n", cluster_no);
+  errno = EROFS;
+  return -1;
 }
 
-DIR_ENTRY UpdateTwoDotDirectory(DIR_ENTRY entry, uint32_t parent_cluster_no)
-// Update .. DIR_ENTRY to point to parent cluster no.
+int MappedFlush(void)
 {
-  // Allocate char arrays for 8 bit byte, high 4 bits and low 4 bits
-  char byte[9], low[5], high[5];
-  uint16_t high_clus, low_clus;
-
-  // write cluster number in 8 bit hex format into string byte, null terminate
-  sprintf(byte, "%08x", parent_cluster_no);
-  byte[8] = '\0';
-
-  // Now that bytes string is set, write 4 high bits to high string
-  for (int i = 0; i < 4; i++)
-    high[i] = byte[i];
-  high[4] = '\0';
-  // And write four low bits to low string
-  for (int j = 4; j < 8; j++)
-    low[j - 4] = byte[j];
-  low[4] = '\0';
-
-  // Convert high and low bit strings to ints, write into current DIR_ENTRY
-  sscanf(high, "%x", &high_clus);
-  sscanf(low, "%x", &low_clus);
-  entry.DIR_FstClusHI = high_clus;
-  entry.DIR_FstClusLO = low_clus;
+  return 0;
 }
 
-//-----------------------------OPENFILE_LIST FUNCS------------------------------
+int MappedDiscard(off_t offset, off_t size)
+{
+  errno = EROFS;
+  return -1;
+}
 
-int Get_OPENFILE_Entry(char* filename) // Return array index of openfile
+void trim(void)
+// Holding ALLOC_LOCK, no cluster can be allocated (and written) between
+// the FAT saying it is free and its range being discarded
 {
-  // Iterate through list
-  for (int i = 0; i < 100; i++)
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t limit = ClusterLimit();
+  unsigned long clusters = 0, extents = 0;
+  int status = 0;
+
+  pthread_mutex_lock(&ALLOC_LOCK);
+  for (uint32_t cluster = 2; cluster < limit && status == 0; )
   {
-    if(strcmp(OPENFILE_LIST[i].file, filename) == 0)
-      return i; // return entry index
+    if (NextClusterNo(cluster) != 0)
+    {
+      cluster++;
+      continue;
+    }
+    uint32_t run = 1;
+    while (cluster + run < limit && NextClusterNo(cluster + run) == 0)
+      run++;
+    off_t offset = ClusterNo_To_DataOffset(cluster);
+    status = DEVICE->discard(offset, (off_t) run * cluster_size);
+    InvalidateBlockCache(offset, (off_t) run * cluster_size);
+    clusters += run;
+    extents++;
+    cluster += run;
   }
+  pthread_mutex_unlock(&ALLOC_LOCK);
 
-  return -1; // if no index, return -1
+  if (status != 0)
+    Error(STATUS_INVALID, "Error. The %s device cannot discard.\n",
+          DEVICE->name);
+  else
+    fprintf(OUT, "Discarded %lu free clusters in %lu extents.\n", clusters,
+            extents);
 }
 
-void AddToList(uint32_t first_cluster, char* filename, char* mode, int offset)
-// Add new entry to OEPNFILE_LIST
+//-----------------------------------OVERLAY------------------------------------
+
+#define OVERLAY_CHUNK (1 << 20) // Most copied at once by a commit
+
+int OpenOverlay(const char* path, int mode)
+// A delta whose header does not match the base (the base changed, or the
+// delta belongs to another image) is not mounted. Committing only needs the
+// size to match, so a commit cut short can simply be run again
 {
-  // UPDATE OPENFILE_LIST
-  if (OPENFILE_LIST_SIZE == 100)
+  struct stat base;
+  if (fstat(IMAGE_FD, &base) != 0)
+    return -1;
+  OVERLAY_SIZE = base.st_size;
+  int64_t sectors = (OVERLAY_SIZE + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR;
+  size_t map_size = (sectors + 7) / 8;
+  OVERLAY_DATA = (OVERLAY_MAP_START + map_size + (1 << 20) - 1) &
+                 ~(off_t) ((1 << 20) - 1); // Sectors start 1 MB aligned
+  OVERLAY_MAP = calloc(map_size > 0 ? map_size : 1, 1);
+
+  OVERLAY_FD = open(path, O_RDWR | O_CREAT, 0644);
+  if (OVERLAY_FD < 0)
   {
-    printf("Program set to allow 100 maximum open files. ");
-    printf("Readjust program code to continue.\n");
-    return;
+    fprintf(OUT, "Cannot open overlay %s\n", path);
+    return -1;
   }
 
-  // Iterate through list
-  for (int i = 0; i < 100; i++)
+  OVERLAY_HEADER header;
+  ssize_t got = pread(OVERLAY_FD, &header, sizeof(header), 0);
+  if (got == 0 || mode == OVERLAY_DISCARD) // New delta
+    return ResetOverlay();
+  if (got != sizeof(header) ||
+      memcmp(header.magic, OVERLAY_MAGIC, 8) != 0 ||
+      header.base_size != base.st_size ||
+      (mode == OVERLAY_MOUNT &&
+       (header.base_mtime_sec != base.st_mtim.tv_sec ||
+        header.base_mtime_nsec != base.st_mtim.tv_nsec)))
   {
-    if(OPENFILE_LIST[i].first_cluster == 0 &&
-        ModeCheck(OPENFILE_LIST[i].m) == 1) // If not allocated
-    {
-      // Allocate and set struct fields w/ given function parameters
-      OPENFILE_LIST[i].first_cluster = first_cluster;
-      strcpy(OPENFILE_LIST[i].m, mode);
-      OPENFILE_LIST[i].offset = offset;
-      strcpy(OPENFILE_LIST[i].file, filename);
-      OPENFILE_LIST_SIZE++;
-      return;
-    }
+    fprintf(OUT, "Overlay %s does not match its base image (changed since, "
+            "or another image). Use --discard to start it again.\n", path);
+    close(OVERLAY_FD);
+    OVERLAY_FD = -1;
+    return -1;
   }
+  // Map bytes past the end of the delta were never written: all zero
+  FullRead(OVERLAY_FD, OVERLAY_MAP, map_size, OVERLAY_MAP_START);
+  return 0;
 }
 
-int RemoveFromList(char* filename)
-// If valid entry, remove from list
+int ResetOverlay(void)
+// Truncating frees every sector at once, however large the delta grew
 {
-  // Iterate through list
-  for (int i = 0; i < 100; i++)
-  {
-    if(strcmp(OPENFILE_LIST[i].file, filename) == 0)
-    {
-      // Deallocate list entry, return to default settings
-      OPENFILE_LIST[i].first_cluster = 0;
-      strcpy(OPENFILE_LIST[i].m, "");
-      OPENFILE_LIST[i].offset = 0;
-      strcpy(OPENFILE_LIST[i].file, "");
-      OPENFILE_LIST_SIZE--;
-      return 0;
-    }
-  }
+  struct stat base;
+  if (fstat(IMAGE_FD, &base) != 0 || ftruncate(OVERLAY_FD, 0) != 0)
+    return -1;
+  int64_t sectors = (OVERLAY_SIZE + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR;
+  memset(OVERLAY_MAP, 0, (sectors + 7) / 8);
+
+  OVERLAY_HEADER header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, OVERLAY_MAGIC, 8);
+  header.base_mtime_sec = base.st_mtim.tv_sec;
+  header.base_mtime_nsec = base.st_mtim.tv_nsec;
+  header.base_size = base.st_size;
+  return FullWrite(OVERLAY_FD, &header, sizeof(header), 0);
+}
 
-  // If not found anywhere in list
-  return 1;
+int OverlayPresent(uint64_t sector)
+{
+  return (OVERLAY_MAP[sector / 8] >> (sector % 8)) & 1;
 }
 
-void PrintList(void) // For debugging
+ssize_t OverlayRead(void* buffer, size_t size, off_t offset)
+// Runs of sectors from the same side are read in one pread
 {
-  // Iterate through list
-  for (int i = 0; i < 100; i++)
+  if (offset >= OVERLAY_SIZE)
+    return 0;
+  if (size > OVERLAY_SIZE - offset)
+    size = OVERLAY_SIZE - offset;
+
+  pthread_rwlock_rdlock(&OVERLAY_LOCK);
+  char* dest = buffer;
+  size_t done = 0;
+  while (done < size)
   {
-    if(ModeCheck(OPENFILE_LIST[i].m) == 0) // If valid mode, a valid entry must
-    {                                      // exist
-      printf("Entry at index[%i]:\n", i);
-      printf("Filename: %s\n", OPENFILE_LIST[i].file);
-      printf("First cluster: %i\n", OPENFILE_LIST[i].first_cluster);
-      printf("Mode: %s\n", OPENFILE_LIST[i].m);
-      printf("Offset: %i\n\n", OPENFILE_LIST[i].offset);
+    uint64_t sector = (offset + done) / OVERLAY_SECTOR;
+    int present = OverlayPresent(sector);
+    size_t run = (sector + 1) * OVERLAY_SECTOR - (offset + done);
+    while (done + run < size && OverlayPresent(++sector) == present)
+      run += OVERLAY_SECTOR;
+    if (run > size - done)
+      run = size - done;
+
+    if (FullRead(present ? OVERLAY_FD : IMAGE_FD, &dest[done], run,
+                 offset + done + (present ? OVERLAY_DATA : 0)) != 0)
+    {
+      pthread_rwlock_unlock(&OVERLAY_LOCK);
+      return -1;
     }
+    done += run;
   }
+  pthread_rwlock_unlock(&OVERLAY_LOCK);
+  return done;
 }
 
-//---------------------------DIRECTORY STACK FUNCS------------------------------
-
-// Very simple stack implementation
-void DIR_push(uint32_t cluster_no) // Push directory cluster_no onto stack
+int OverlayWrite(const void* buffer, size_t size, off_t offset)
+// A sector only partly written is first copied up from the base. Map bits
+// are set, in memory and then in the delta, only once the data is there
 {
-  if (CURRENT_STACK_SIZE == MAX_STACK_SIZE)
-    printf("Error. Directory stack only supports up to 50 entries.\n");
-  else
+  if (size == 0)
+    return 0;
+  if (offset + (off_t) size > OVERLAY_SIZE)
+    return -1; // The base cannot grow
+
+  pthread_rwlock_wrlock(&OVERLAY_LOCK);
+  uint64_t first = offset / OVERLAY_SECTOR;
+  uint64_t last = (offset + size - 1) / OVERLAY_SECTOR;
+  int status = 0;
+  uint64_t ends[2] = { first, last };
+  for (int k = 0; k < 2 && status == 0; k++)
+  {
+    off_t start = ends[k] * OVERLAY_SECTOR;
+    int whole = offset <= start &&
+                offset + (off_t) size >= start + OVERLAY_SECTOR;
+    if (whole || OverlayPresent(ends[k]) || (k == 1 && first == last))
+      continue;
+    char sector[OVERLAY_SECTOR];
+    size_t length = (OVERLAY_SIZE - start < OVERLAY_SECTOR)
+                    ? OVERLAY_SIZE - start : OVERLAY_SECTOR;
+    status = FullRead(IMAGE_FD, sector, length, start) |
+             FullWrite(OVERLAY_FD, sector, length, OVERLAY_DATA + start);
+  }
+  if (status == 0)
+    status = FullWrite(OVERLAY_FD, buffer, size, OVERLAY_DATA + offset);
+
+  if (status == 0)
   {
-    DIR_STACK[CURRENT_STACK_SIZE] = cluster_no; // push to stack
-    CURRENT_STACK_SIZE++; // increment stack size
+    for (uint64_t sector = first; sector <= last; sector++)
+      OVERLAY_MAP[sector / 8] |= 1 << (sector % 8);
+    status = FullWrite(OVERLAY_FD, &OVERLAY_MAP[first / 8],
+                       last / 8 - first / 8 + 1, OVERLAY_MAP_START + first / 8);
   }
+  pthread_rwlock_unlock(&OVERLAY_LOCK);
+  return status;
 }
 
-int DIR_pop(void) // Pop cluster_no from stack, return the stored cluster_no
+int FinishOverlay(const char* base_path, int commit)
+// Commit writes every present sector into the base, syncs it, and only
+// then empties the delta, so a crash part way leaves the delta to commit
+// again
 {
-  if (CURRENT_STACK_SIZE == 0)
-    return FIRST_CLUSTER;
-  else if (CURRENT_STACK_SIZE == 1)
+  IMAGE_FD = open(base_path, commit ? O_RDWR : O_RDONLY);
+  if (IMAGE_FD < 0)
   {
-    CURRENT_STACK_SIZE--; // decrement stack size
-    return FIRST_CLUSTER;
+    fprintf(OUT, "Can't Read. Invalid File\n");
+    return 1;
   }
-  else
+  if (OpenOverlay(OVERLAY_PATH, commit ? OVERLAY_COMMIT : OVERLAY_DISCARD)
+      != 0)
   {
-    CURRENT_STACK_SIZE--; // decrement stack size
-    int cluster_no = DIR_STACK[CURRENT_STACK_SIZE - 1];
-    return cluster_no; // Return PREVIOUS directory's cluster no
+    close(IMAGE_FD);
+    return 1;
   }
-}
 
-int DIR_peek(void) // Peek at second to last entry of DIR_STACK
-                   // Looking at PREVIOUS dir, not current dir
-{
-  if (CURRENT_STACK_SIZE == 0 || CURRENT_STACK_SIZE - 1 == 0) // Return root
-    return FIRST_CLUSTER;
-  else  // Return PREVIOUS directory's cluster no
-    return DIR_STACK[CURRENT_STACK_SIZE - 2];
+  int64_t sectors = (OVERLAY_SIZE + OVERLAY_SECTOR - 1) / OVERLAY_SECTOR;
+  int64_t copied = 0;
+  int status = 0;
+  char* buffer = malloc(OVERLAY_CHUNK);
+  for (int64_t sector = 0; commit && sector < sectors && status == 0; )
+  {
+    if (!OverlayPresent(sector))
+    {
+      sector++;
+      continue;
+    }
+    int64_t run = 1; // Present sectors from here, at most a buffer full
+    while (sector + run < sectors && OverlayPresent(sector + run) &&
+           (run + 1) * OVERLAY_SECTOR <= OVERLAY_CHUNK)
+      run++;
+    off_t start = sector * OVERLAY_SECTOR;
+    size_t length = (OVERLAY_SIZE - start < run * OVERLAY_SECTOR)
+                    ? OVERLAY_SIZE - start : run * OVERLAY_SECTOR;
+    status = FullRead(OVERLAY_FD, buffer, length, OVERLAY_DATA + start) |
+             FullWrite(IMAGE_FD, buffer, length, start);
+    copied += run;
+    sector += run;
+  }
+  free(buffer);
+  if (commit && (status != 0 || fsync(IMAGE_FD) != 0))
+  {
+    fprintf(OUT, "Error. Commit to %s failed, the delta is kept.\n",
+            base_path);
+    close(IMAGE_FD);
+    return 1;
+  }
+
+  status = ResetOverlay();
+  if (commit)
+    fprintf(OUT, "Committed %lld sectors (%lld bytes) to %s.\n",
+            (long long) copied, (long long) copied * OVERLAY_SECTOR,
+            base_path);
+  else
+    fprintf(OUT, "Discarded %s.\n", OVERLAY_PATH);
+  close(OVERLAY_FD);
+  close(IMAGE_FD);
+  return (status == 0) ? 0 : 1;
 }
 
-//-------------------------------STRING UTILITES--------------------------------
+//-----------------------------------CACHES-------------------------------------
 
-char* RemoveWhiteSpaces(char* name)
+void LoadFATCache(void)
 {
-  // REMOVE TRAILING SPACES AFTER current.DIR_Name -- necessary for comparison
-  // Derived from code at:
-  // https://www.geeksforgeeks.org/remove-spaces-from-a-given-string/
-  int counter = 0;
-  char temp[11];
-  strcpy(temp, name);
+  FAT_CACHE = NULL;
+  FAT_CACHE_ENTRIES = BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec / 4;
 
-  for (int i = 0; i < 11; i++) {
-    if (temp[i] != ' ')
-        temp[counter++] = temp[i];
+  // Under --ro the shared mapping is the cache, whatever the size. The FAT
+  // is never written then, so FAT_CACHE can point straight into it
+  if (RO_MODE)
+  {
+    off_t offset = ClusterNo_to_FATOffset(0);
+    if (offset + (off_t) FAT_CACHE_ENTRIES * 4 <= (off_t) RAM_SIZE)
+    {
+      FAT_CACHE = (uint32_t*) &RAM_IMAGE[offset];
+      madvise(&RAM_IMAGE[offset & ~(off_t) 4095],
+              (size_t) FAT_CACHE_ENTRIES * 4 + (offset & 4095),
+              MADV_WILLNEED);
+    }
+    return;
   }
-  temp[counter] = '\0';
-  name = temp;
-  return name;
-}
 
-int ModeCheck(char* mode) // Check for valid mode when opening file
-{
+  // Very large volumes fall back to reading the FAT from IMAGEFILE
+  if ((size_t) FAT_CACHE_ENTRIES * 4 > (size_t) 512 * 1024 * 1024)
+    return;
+
+  uint32_t* fat = malloc((size_t) FAT_CACHE_ENTRIES * 4);
+  if (fat == NULL)
+    return;
+  if (DeviceRead(fat, (size_t) FAT_CACHE_ENTRIES * 4,
+                 ClusterNo_to_FATOffset(0)) != 0)
+  {
+    free(fat);
+    return;
+  }
+  FAT_CACHE = fat;
+}
+
+void InitBlockCache(void)
+{
+  BLOCK_CACHE = malloc(sizeof(CACHE_BLOCK) * CACHE_BLOCKS);
+  if (BLOCK_CACHE == NULL) // No cache, every read goes to IMAGEFILE
+    return;
+
+  for (int i = 0; i < CACHE_BLOCKS; i++)
+    BLOCK_CACHE[i].block_no = -1;
+  for (int i = 0; i < 64; i++)
+    pthread_mutex_init(&BLOCK_CACHE_LOCKS[i], NULL);
+}
+
+void InvalidateBlockCache(off_t offset, off_t size)
+{
+  if (BLOCK_CACHE == NULL || size <= 0)
+    return;
+
+  off_t first = offset / CACHE_BLOCK_SIZE;
+  off_t last = (offset + size - 1) / CACHE_BLOCK_SIZE;
+  if (last - first >= CACHE_BLOCKS) // Range covers every slot
+    last = first + CACHE_BLOCKS - 1;
+
+  for (off_t block_no = first; block_no <= last; block_no++)
+  {
+    int slot = block_no % CACHE_BLOCKS;
+    pthread_mutex_lock(&BLOCK_CACHE_LOCKS[slot % 64]);
+    BLOCK_CACHE[slot].block_no = -1;
+    pthread_mutex_unlock(&BLOCK_CACHE_LOCKS[slot % 64]);
+  }
+}
+
+//-----------------------------------LOCKING------------------------------------
+
+// Locks this thread currently holds, so nested helpers (e.g. fat_creat()
+// inside cp()) can take the same directory lock again without deadlocking
+typedef struct{
+
+  uint32_t cluster_no;
+  int mode; // DIR_LOCK_READ or DIR_LOCK_WRITE
+  int depth; // times taken by this thread
+} HELD_LOCK;
+
+_Thread_local HELD_LOCK HELD_LOCKS[8];
+_Thread_local int HELD_LOCK_COUNT = 0;
+
+DIR_LOCK* Find_DIR_LOCK(uint32_t cluster_no) // Get or create lock
+{
+  int bucket = cluster_no % DIR_LOCK_BUCKETS;
+
+  pthread_mutex_lock(&DIR_LOCK_TABLE_LOCK);
+  DIR_LOCK* current = DIR_LOCK_TABLE[bucket];
+  while (current != NULL && current->cluster_no != cluster_no)
+    current = current->next;
+
+  if (current == NULL) // First use of this directory, create its lock
+  {
+    current = malloc(sizeof(DIR_LOCK));
+    current->cluster_no = cluster_no;
+    pthread_rwlock_init(&current->lock, NULL);
+    current->next = DIR_LOCK_TABLE[bucket];
+    DIR_LOCK_TABLE[bucket] = current;
+  }
+  pthread_mutex_unlock(&DIR_LOCK_TABLE_LOCK);
+
+  return current;
+}
+
+void DirLock(uint32_t cluster_no, int mode)
+{
+  if (RO_MODE)
+    return; // No writers, so readers need no lock
+  // Already held by this thread -- only count the nesting
+  for (int i = 0; i < HELD_LOCK_COUNT; i++)
+  {
+    if (HELD_LOCKS[i].cluster_no != cluster_no)
+      continue;
+
+    if (mode == DIR_LOCK_WRITE && HELD_LOCKS[i].mode == DIR_LOCK_READ)
+    {
+      // Upgrade: rwlocks cannot upgrade in place, so drop and re-take
+      DIR_LOCK* dir = Find_DIR_LOCK(cluster_no);
+      pthread_rwlock_unlock(&dir->lock);
+      pthread_rwlock_wrlock(&dir->lock);
+      HELD_LOCKS[i].mode = DIR_LOCK_WRITE;
+    }
+    HELD_LOCKS[i].depth++;
+    return;
+  }
+
+  if (HELD_LOCK_COUNT == 8)
+  {
+    Error(STATUS_INVALID, "Error. Too many directory locks held.\n");
+    return;
+  }
+
+  DIR_LOCK* dir = Find_DIR_LOCK(cluster_no);
+  if (mode == DIR_LOCK_WRITE)
+    pthread_rwlock_wrlock(&dir->lock);
+  else
+    pthread_rwlock_rdlock(&dir->lock);
+
+  HELD_LOCKS[HELD_LOCK_COUNT].cluster_no = cluster_no;
+  HELD_LOCKS[HELD_LOCK_COUNT].mode = mode;
+  HELD_LOCKS[HELD_LOCK_COUNT].depth = 1;
+  HELD_LOCK_COUNT++;
+}
+
+void DirUnlock(uint32_t cluster_no)
+{
+  if (RO_MODE)
+    return;
+  for (int i = 0; i < HELD_LOCK_COUNT; i++)
+  {
+    if (HELD_LOCKS[i].cluster_no != cluster_no)
+      continue;
+
+    if (--HELD_LOCKS[i].depth == 0) // Outermost holder, really release
+    {
+      pthread_rwlock_unlock(&Find_DIR_LOCK(cluster_no)->lock);
+      HELD_LOCKS[i] = HELD_LOCKS[--HELD_LOCK_COUNT];
+    }
+    return;
+  }
+}
+
+//----------------------------TRAVERSING THE FAT--------------------------------
+
+int ClusterNo_to_FATOffset(uint32_t cluster_no)
+{
+  // First usable sector
+  int FirstFATSector = BOOT.BPB_RsvdSecCnt;
+
+  // Calculate offest
+  int FAT_Offset = (FirstFATSector * BOOT.BPB_BytsPerSec +
+                   cluster_no * 4); // Offset in IMAGEFILE
+
+  return FAT_Offset; // return byte offset
+}
+
+int WriteFAT(const void* entries, size_t size, uint32_t cluster_no)
+// FAT 1 is the one read; the copies after it are kept identical so a tool
+// falling back to them (or check) sees the same volume
+{
+  off_t fat_size = (off_t) BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec;
+  int status = 0;
+  for (int i = 0; i < BOOT.BPB_NumFATs; i++)
+    if (WriteImage(entries, size, ClusterNo_to_FATOffset(cluster_no) +
+                   i * fat_size) != 0)
+      status = -1;
+  return status;
+}
+
+uint32_t NextClusterNo(uint32_t cluster_no) // Traverse the FAT to find the next
+                                  // cluster, slides 11-12 BPB & commands PPT
+{
+  PERF_ADD(fat_walked, 1);
+  int offset = (BOOT.BPB_RsvdSecCnt * BOOT.BPB_BytsPerSec) +
+               (cluster_no * 4); // offset in FAT region
+
+  if (FAT_CACHE != NULL) // Served from memory once mounted
+    return (cluster_no < FAT_CACHE_ENTRIES) ? FAT_CACHE[cluster_no]
+                                            : 0xFFFFFFFF;
+
+  uint32_t entry = 0;
+  ReadImage(&entry, sizeof(entry), offset); // Read in next cluster_no
+
+  return entry;
+}
+
+uint32_t Get_Child_Cluster_No(DIR_ENTRY current)
+{
+  // Get cluster_no for child directory
+  char low[5];
+  char high[5];
+
+  sprintf(low, "%04x", current.DIR_FstClusLO);  // Read in high and low
+  sprintf(high, "%04x", current.DIR_FstClusHI); // bytes in hex format
+
+  char child_cluster[11] = "0x"; // Concatenate bytes to string
+  strcat(child_cluster, high);
+  strcat(child_cluster, low);
+  //printf("%s\n", child_cluster);
+
+  uint32_t child_cluster_no = 0; // Convert hex string to int
+  sscanf(child_cluster, "%x", &child_cluster_no);
+  //printf("Located at cluster no. %i\n", child_cluster_no);
+
+  return child_cluster_no;
+}
+
+uint32_t ClusterLimit(void)
+{
+  // Entries in one FAT, limited to clusters that actually exist in the
+  // data region
+  uint32_t FAT_Entries = BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec / 4;
+  uint32_t DataClusters = (BOOT.BPB_TotSec32 - ClusterNo_To_DataOffset(2) /
+                    BOOT.BPB_BytsPerSec) / BOOT.BPB_SecPerClus + 2;
+  if (DataClusters < FAT_Entries)
+    FAT_Entries = DataClusters;
+  return FAT_Entries;
+}
+
+uint32_t Find_Free_Cluster(uint32_t goal) // Returns first free cluster no.
+// Claims the cluster (marks it last in list) under ALLOC_LOCK, so two threads
+// can never be handed the same cluster
+{
+  uint32_t FAT_Entries = ClusterLimit();
+
+  pthread_mutex_lock(&ALLOC_LOCK);
+
+  // Start where the policy says, then wrap around to the free map hint: no
+  // cluster below the hint is free
+  uint32_t start = AllocationStart(goal);
+  uint32_t hint = FREE_CLUSTER_HINT;
+  if (hint < BOOT.BPB_RootClus)
+    hint = BOOT.BPB_RootClus;
+
+  // Iterate through FAT one sector at a time until free cluster found
+  uint32_t sector[BOOT.BPB_BytsPerSec / 4];
+  int per_sector = BOOT.BPB_BytsPerSec / 4;
+  for (int pass = 0; pass < 2; pass++)
+  {
+    uint32_t cluster_no = (pass == 0) ? start : hint;
+    uint32_t end = (pass == 0) ? FAT_Entries : start;
+    int from_hint = (pass == 1 || start == hint); // Hint may move forward
+    while (cluster_no < end)
+    {
+      int first = cluster_no % per_sector; // position of cluster_no in sector
+      if (FAT_CACHE != NULL) // Scan the cached FAT instead of IMAGEFILE
+        memcpy(sector, &FAT_CACHE[cluster_no - first], sizeof(sector));
+      else
+        ReadImage(sector, sizeof(sector),
+                  ClusterNo_to_FATOffset(cluster_no - first));
+
+      for (int i = first; i < per_sector && cluster_no < end; i++)
+      {
+        if (sector[i] == 0x0) // If free cluster found, claim and return it
+        {
+          UpdateClusterInFAT(cluster_no, 0xFFFFFFFF);
+          PERF_ADD(allocated, 1);
+          if (from_hint)
+            FREE_CLUSTER_HINT = cluster_no + 1;
+          pthread_mutex_unlock(&ALLOC_LOCK);
+
+          // In case any prior data exists within this cluster, set cluster to 0
+          off_t data_offset = ClusterNo_To_DataOffset(cluster_no);
+          uint8_t empty_cluster[BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus];
+          memset(empty_cluster, 0x00, sizeof(empty_cluster));
+          WriteImage(empty_cluster, sizeof(empty_cluster), data_offset);
+
+          return cluster_no;
+        }
+        cluster_no++;
+      }
+    }
+  }
+
+  FREE_CLUSTER_HINT = FAT_Entries; // Nothing free from the hint up
+  pthread_mutex_unlock(&ALLOC_LOCK);
+
+  Error(STATUS_NO_SPACE,
+        "Out of memory. Sectors per FAT (BPB_FATSz32) set to: ");
+  fprintf(OUT, "%i (%i bytes).\n", BOOT.BPB_FATSz32,
+         BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec);
+  return -1; // NO FREE CLUSTERS LEFT! Return -1
+}
+
+uint32_t AllocateChain(uint32_t count, uint32_t goal)
+// Claim count free clusters in one pass over the free map and link them in
+// order, so a file whose size is known up front gets its whole chain (as
+// contiguous as the free space allows) without a FAT lookup per cluster.
+// Clusters are not zeroed: the caller is about to fill them. Returns the
+// first cluster, 0 for count 0, -1 if the volume runs out (nothing claimed)
+{
+  if (count == 0)
+    return 0;
+
+  uint32_t FAT_Entries = ClusterLimit();
+  pthread_mutex_lock(&ALLOC_LOCK);
+
+  // From the policy's start to the end, then from the hint up to the start
+  uint32_t start = AllocationStart(goal);
+  uint32_t hint = FREE_CLUSTER_HINT;
+  if (hint < BOOT.BPB_RootClus)
+    hint = BOOT.BPB_RootClus;
+
+  uint32_t first = 0, previous = 0, claimed = 0;
+  uint32_t low = FAT_Entries, high = 0; // FAT_CACHE range changed, written
+                                        // back once
+  for (int pass = 0; pass < 2 && claimed < count; pass++)
+  {
+    uint32_t cluster_no = (pass == 0) ? start : hint;
+    uint32_t end = (pass == 0) ? FAT_Entries : start;
+    for (; cluster_no < end && claimed < count; cluster_no++)
+    {
+      if (NextClusterNo(cluster_no) != 0x0)
+        continue;
+
+      if (FAT_CACHE != NULL) // Link in memory, write the FAT range at the end
+      {
+        FAT_CACHE[cluster_no] = 0xFFFFFFFF;
+        if (previous != 0)
+          FAT_CACHE[previous] = cluster_no;
+        low = (cluster_no < low) ? cluster_no : low;
+        high = (cluster_no > high) ? cluster_no : high;
+      }
+      else
+      {
+        UpdateClusterInFAT(cluster_no, 0xFFFFFFFF);
+        if (previous != 0)
+          UpdateClusterInFAT(previous, cluster_no);
+      }
+
+      if (first == 0)
+        first = cluster_no;
+      previous = cluster_no;
+      claimed++;
+    }
+    if (pass == 1 || start == hint)
+      FREE_CLUSTER_HINT = cluster_no; // Every free cluster passed was claimed
+  }
+
+  if (FAT_CACHE != NULL && claimed > 0)
+    WriteFAT(&FAT_CACHE[low], (size_t) (high - low + 1) * 4, low);
+  pthread_mutex_unlock(&ALLOC_LOCK);
+  PERF_ADD(allocated, claimed);
+
+  if (claimed < count) // Give back the partial chain
+  {
+    if (first != 0)
+      FreeChain(first);
+    Error(STATUS_NO_SPACE, "Out of memory. %u more clusters needed.\n",
+          count - claimed);
+    return -1;
+  }
+  return first;
+}
+
+uint32_t AllocationStart(uint32_t goal)
+// Called under ALLOC_LOCK. First fit always starts at the free map hint;
+// the other policies start at the goal unless nothing above the hint is
+// free there anyway
+{
+  uint32_t start = FREE_CLUSTER_HINT;
+  if (start < BOOT.BPB_RootClus)
+    start = BOOT.BPB_RootClus;
+  if (ALLOC_POLICY != ALLOC_FIRST_FIT && goal > start && goal < ClusterLimit())
+    start = goal;
+  return start;
+}
+
+uint32_t AllocGroupSize(void)
+{
+  uint32_t size = (ClusterLimit() - 2) / ALLOC_GROUPS;
+  return (size < ALLOC_GROUP_MIN) ? ALLOC_GROUP_MIN : size;
+}
+
+uint32_t DirectoryGoal(uint32_t parent)
+// Near keeps a new directory next to its parent. Group hands each new
+// directory the next allocation group (round robin) that is at least half
+// free, so the files later created in it have room to stay together
+{
+  if (ALLOC_POLICY == ALLOC_NEAR)
+    return parent;
+  if (ALLOC_POLICY != ALLOC_GROUP)
+    return 0;
+
+  uint32_t limit = ClusterLimit(), size = AllocGroupSize();
+  uint32_t groups = (limit - 2 + size - 1) / size;
+  uint32_t goal = parent;
+  pthread_mutex_lock(&ALLOC_LOCK);
+  for (uint32_t tried = 0; tried < groups; tried++)
+  {
+    uint32_t group = ALLOC_GROUP_ROTOR++ % groups;
+    uint32_t low = 2 + group * size;
+    uint32_t high = (low + size < limit) ? low + size : limit;
+    uint32_t free_count = 0;
+    for (uint32_t c = low; c < high; c++)
+      free_count += (NextClusterNo(c) == 0x0);
+    if (free_count * 2 >= high - low)
+    {
+      goal = low;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ALLOC_LOCK);
+  return goal;
+}
+
+int ParseAllocPolicy(const char* name)
+{
+  for (int i = 0; i < 3; i++)
+    if (strcmp(name, ALLOC_POLICY_NAMES[i]) == 0)
+      return i;
+  return -1;
+}
+
+//-------------------------TRAVERSING THE DATA REGION---------------------------
+
+off_t ClusterNo_To_DataOffset(uint32_t cluster_no)
+// Returns offset in data region refered to by cluster_no (64-bit, so files
+// past the first 2 GB of IMAGEFILE are reachable)
+{
+  off_t FirstDataSector = BOOT.BPB_RsvdSecCnt +
+                       (BOOT.BPB_NumFATs * BOOT.BPB_FATSz32);
+  off_t Offset = FirstDataSector + (off_t) (cluster_no - 2) *
+                    BOOT.BPB_SecPerClus;
+  return(Offset * BOOT.BPB_BytsPerSec); // return byte offset
+}
+
+DIR_ENTRY Get_DIR_ENTRY(char* entry, uint32_t cluster_no)
+{
+  NAMED_ENTRY found;
+  if (FindEntry(entry, cluster_no, &found, NULL))
+    return found.entry;
+
+  // IF UNSUCCESSFUL
+  found.entry.DIR_Name[0] = 0x00;
+  return found.entry;
+}
+
+off_t Get_DIR_ENTRY_Offset(char* entry, uint32_t cluster_no)
+{
+  NAMED_ENTRY found;
+  if (FindEntry(entry, cluster_no, &found, NULL))
+    return found.offset;
+
+  // IF UNSUCCESSFUL
+  return 0x0;
+}
+
+off_t SlotOffset(uint32_t cluster_no, uint32_t slot)
+{
+  uint32_t per_cluster = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus /
+                         sizeof(DIR_ENTRY);
+  for (uint32_t i = 0; i < slot / per_cluster; i++)
+    cluster_no = NextClusterNo(cluster_no);
+  return ClusterNo_To_DataOffset(cluster_no) +
+         (slot % per_cluster) * sizeof(DIR_ENTRY);
+}
+
+int FindFreeSlots(uint32_t cluster_no, int count, off_t* offsets)
+// A long name needs its LDIR_ENTRYs and DIR_ENTRY in one run of free (0x00
+// or 0xE5) entries. The run may cross into the next cluster of the chain;
+// if no run is long enough the directory grows by zeroed clusters
+{
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  int per_cluster = cluster_size / sizeof(DIR_ENTRY);
+  DIR_ENTRY* cluster = malloc(cluster_size);
+  uint32_t first_cluster = cluster_no;
+  uint32_t last_cluster = cluster_no;
+  int run = 0; // free entries in a row so far, their offsets in offsets[]
+
+  while (cluster_no >= 2 && cluster_no < 0x0FFFFFF6)
+  {
+    off_t data_offset = ClusterNo_To_DataOffset(cluster_no);
+    if (ReadImage(cluster, cluster_size, data_offset) != 0)
+    {
+      free(cluster);
+      Error(STATUS_IO, "Error. Cannot read directory.\n");
+      return -1;
+    }
+
+    for (int i = 0; i < per_cluster; i++)
+    {
+      if (cluster[i].DIR_Name[0] != 0x00 && cluster[i].DIR_Name[0] != 0xE5)
+      {
+        run = 0;
+        continue;
+      }
+      offsets[run++] = data_offset + i * sizeof(DIR_ENTRY);
+      if (run == count)
+      {
+        free(cluster);
+        return 0;
+      }
+    }
+    last_cluster = cluster_no;
+    cluster_no = NextClusterNo(cluster_no);
+  }
+  free(cluster);
+
+  // Directory full: add clusters (Find_Free_Cluster() zeroes them)
+  while (run < count)
+  {
+    uint32_t new_cluster = Find_Free_Cluster(last_cluster);
+    if (new_cluster == -1) // NO MORE MEMORY
+      return -1;
+    UpdateClusterInFAT(last_cluster, new_cluster);
+    UpdateClusterInFAT(new_cluster, 0xFFFFFFFF);
+    SizeIndexDirectory(first_cluster, 0, 1);
+
+    off_t data_offset = ClusterNo_To_DataOffset(new_cluster);
+    for (int i = 0; i < per_cluster && run < count; i++)
+      offsets[run++] = data_offset + i * sizeof(DIR_ENTRY);
+    last_cluster = new_cluster;
+  }
+  return 0;
+}
+
+int DirAlreadyExists(char* dir, uint32_t cluster_no)
+{
+  if (strcmp(dir, ".") == 0 || strcmp(dir, "..") == 0)
+    return 2; // File exists, special case
+
+  DIR_ENTRY current = Get_DIR_ENTRY(dir, cluster_no);
+  if (current.DIR_Name[0] != 0x00) // File exists in CWD
+    return 1;
+
+  return 0; // File does not yet exist
+}
+
+int IsDirEmpty(char* dir, uint32_t cluster_no)
+{
+  NAMED_ENTRY* entries;
+  int count = ReadDirectory(cluster_no, &entries);
+  FreeDirectory(entries, count);
+
+  if (count == 0)
+    return 0; // TRUE -- DIR IS EMPTY
+  else
+    return 1; // FALSE -- DIR IS NOT EMPTY
+}
+
+int ReadDirectory(uint32_t cluster_no, NAMED_ENTRY** entries)
+// Read a directory one cluster at a time and keep its live entries. A run
+// of LDIR_ENTRYs (attribute 0xf) counting down from a 0x40-flagged order
+// byte to 1, all with the checksum of the DIR_ENTRY that follows, gives
+// that entry its long name; anything else falls back to the 8.3 name.
+// A first byte of 0x00 ends the directory, as in the FAT spec
+{
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  DIR_ENTRY* cluster = malloc(cluster_size);
+  int per_cluster = cluster_size / sizeof(DIR_ENTRY);
+  int count = 0, capacity = 16;
+  *entries = malloc(capacity * sizeof(NAMED_ENTRY));
+
+  uint16_t units[LFN_SLOTS_MAX * 13]; // Long name being collected
+  int expected = 0; // LDIR_Ord wanted next, 0 when no long name is open
+  int long_slots = 0; // LDIR_ENTRYs collected
+  int complete = 0; // Every part down to order 1 seen
+  uint8_t checksum = 0;
+  uint32_t slot = 0; // Position in the directory, in entries
+  char name[NAME_BUFFER];
+
+  while (cluster_no >= 2 && cluster_no < 0x0FFFFFF6)
+  {
+    off_t data_offset = ClusterNo_To_DataOffset(cluster_no);
+    if (ReadImage(cluster, cluster_size, data_offset) != 0)
+      break;
+
+    for (int i = 0; i < per_cluster; i++, slot++)
+    {
+      DIR_ENTRY* current = &cluster[i];
+      if (current->DIR_Name[0] == 0x00) // End of directory
+      {
+        free(cluster);
+        return count;
+      }
+      if (current->DIR_Name[0] == 0xE5) // Deallocated, breaks any long name
+      {
+        expected = complete = 0;
+        continue;
+      }
+
+      if ((current->DIR_Attr & 0x3f) == 0xf) // LDIR entry
+      {
+        LDIR_ENTRY* long_entry = (LDIR_ENTRY*) current;
+        int order = long_entry->LDIR_Ord & ~0x40;
+        if (long_entry->LDIR_Ord & 0x40) // Last part, comes first on disk
+        {
+          if (order < 1 || order > LFN_SLOTS_MAX)
+          {
+            expected = complete = 0;
+            continue;
+          }
+          expected = order;
+          checksum = long_entry->LDIR_Chksum;
+          long_slots = complete = 0;
+        }
+        else if (expected == 0 || order != expected ||
+                 long_entry->LDIR_Chksum != checksum)
+        {
+          expected = complete = 0; // Orphaned or out of order
+          continue;
+        }
+
+        uint16_t* part = &units[(order - 1) * 13];
+        memcpy(&part[0], long_entry->LDIR_Name1, 5 * sizeof(uint16_t));
+        memcpy(&part[5], long_entry->LDIR_Name2, 6 * sizeof(uint16_t));
+        memcpy(&part[11], long_entry->LDIR_Name3, 2 * sizeof(uint16_t));
+        long_slots++;
+        expected--;
+        complete = (expected == 0);
+        continue;
+      }
+
+      int has_long = complete &&
+                     ShortNameChecksum(current->DIR_Name) == checksum;
+      expected = complete = 0;
+      if ((current->DIR_Attr & 0x08) || // Volume label
+          current->DIR_Name[0] == '.')  // . and ..
+        continue;
+
+      if (has_long)
+        UnitsToName(units, long_slots * 13, name);
+      else
+        ShortNameString(current->DIR_Name, name);
+
+      if (count == capacity)
+      {
+        capacity *= 2;
+        *entries = realloc(*entries, capacity * sizeof(NAMED_ENTRY));
+      }
+      NAMED_ENTRY* named = &(*entries)[count++];
+      named->entry = *current;
+      named->name = strdup(name);
+      named->slot = slot;
+      named->long_slots = has_long ? long_slots : 0;
+      named->offset = data_offset + i * sizeof(DIR_ENTRY);
+    }
+    cluster_no = NextClusterNo(cluster_no);
+  }
+
+  free(cluster);
+  return count;
+}
+
+void FreeDirectory(NAMED_ENTRY* entries, int count)
+{
+  for (int i = 0; i < count; i++)
+    free(entries[i].name);
+  free(entries);
+}
+
+DIR_ENTRY* ReadDirectoryTable(uint32_t cluster_no, uint32_t** chain,
+                              uint32_t* clusters)
+// The whole table in memory, for commands that rewrite many slots of it;
+// (*chain)[i] is where its i-th cluster lives. Caller frees both
+{
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  int per_cluster = cluster_size / sizeof(DIR_ENTRY);
+  uint32_t count = 0, limit = ClusterLimit();
+  for (uint32_t n = cluster_no; n >= 2 && n < 0x0FFFFFF6 && count < limit;
+       n = NextClusterNo(n))
+    count++;
+
+  *chain = malloc(count * sizeof(uint32_t));
+  DIR_ENTRY* table = malloc((size_t) count * cluster_size);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    (*chain)[i] = (i == 0) ? cluster_no : NextClusterNo((*chain)[i - 1]);
+    if (ReadImage(&table[i * per_cluster], cluster_size,
+                  ClusterNo_To_DataOffset((*chain)[i])) != 0)
+    {
+      free(*chain);
+      free(table);
+      return NULL;
+    }
+  }
+  *clusters = count;
+  return table;
+}
+
+char* ReadToBuffer(char* buffer, int buffer_size, uint32_t cluster_no)
+// Convert cluster no to its data region offset, read to buffer for size bytes
+{
+  ReadFileData(cluster_no, 0, buffer, buffer_size);
+  buffer[buffer_size] = '\0';
+
+  //printf("\n\n\nBuffer before write function: %s\n\n\n", buffer);
+  return buffer;
+}
+
+int ReadFileData(uint32_t first_cluster, int offset, char* buffer, int size)
+// Read size bytes starting offset bytes into the chain at first_cluster.
+// Only positional reads are used, so any number of threads may call this
+// at once on the same or different files
+{
+  PERF_FILE_DATA;
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t cluster = first_cluster;
+
+  // While offset is at or past the end of a cluster, advance clusters
+  while (offset >= cluster_size && cluster < 0x0FFFFFF6)
+  {
+    cluster = NextClusterNo(cluster);
+    offset -= cluster_size;
+  }
+
+  int size_read = 0;
+  while (size_read < size && cluster >= 2 && cluster < 0x0FFFFFF6)
+  {
+    // READ TO END OF CLUSTER (or until size satisfied)
+    int size_to_read = cluster_size - offset;
+    if (size_to_read > size - size_read)
+      size_to_read = size - size_read;
+
+    if (ReadImage(&buffer[size_read], size_to_read,
+                  ClusterNo_To_DataOffset(cluster) + offset) != 0)
+      break;
+
+    // THEN ADVANCE CLUSTER, OFFSET WILL BE 0 AFTER 1ST ITERATION
+    size_read += size_to_read;
+    offset = 0;
+    if (size_read < size)
+      cluster = NextClusterNo(cluster);
+  }
+
+  return size_read;
+}
+
+int WriteFileData(uint32_t first_cluster, int offset, const char* buffer,
+                  int size)
+// Write size bytes starting offset bytes into the chain at first_cluster,
+// linking in free clusters whenever the chain ends first. Returns bytes
+// written (short only when out of memory)
+{
+  PERF_FILE_DATA;
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t cluster = first_cluster;
+  int size_written = 0;
+
+  while (1)
+  {
+    if (offset < cluster_size) // Offset lands in this cluster, write to it
+    {
+      int bytes_to_write = cluster_size - offset;
+      if (bytes_to_write > size - size_written)
+        bytes_to_write = size - size_written;
+
+      WriteImage(&buffer[size_written], bytes_to_write,
+                 ClusterNo_To_DataOffset(cluster) + offset);
+      size_written += bytes_to_write;
+      offset = cluster_size; // OFFSET WILL BE 0 IN THE NEXT CLUSTER
+    }
+    if (size_written == size)
+      return size_written;
+
+    // Advance cluster, extending the chain if this was the last one
+    uint32_t next_cluster = NextClusterNo(cluster);
+    if (next_cluster >= 0x0FFFFFF6)
+    {
+      next_cluster = Find_Free_Cluster(cluster);
+      if (next_cluster == -1) // NO MORE MEMORY
+        return size_written;
+      UpdateClusterInFAT(cluster, next_cluster);
+    }
+    cluster = next_cluster;
+    offset -= cluster_size;
+  }
+}
+
+//-------------------------------LONG FILENAMES---------------------------------
+
+uint8_t ShortNameChecksum(const uint8_t* short_name)
+// Refer to page 31 of Microsoft FAT Specification document
+{
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++)
+    sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + short_name[i];
+  return sum;
+}
+
+void ShortNameString(const uint8_t* short_name, char* name)
+{
+  // Entries from older versions of this program hold a /0 terminated name
+  // instead of a padded one, read those up to the terminator
+  if (memchr(short_name, '\0', 11) != NULL)
+  {
+    int length = 0;
+    for (int i = 0; i < 11 && short_name[i] != '\0'; i++)
+      if (short_name[i] != ' ')
+        name[length++] = short_name[i];
+    name[length] = '\0';
+    return;
+  }
+
+  int length = 0;
+  for (int i = 0; i < 8 && short_name[i] != ' '; i++)
+    name[length++] = short_name[i];
+  if (short_name[0] == 0x05) // 0xE5 as a first character (FAT spec)
+    name[0] = (char) 0xE5;
+  if (short_name[8] != ' ')
+  {
+    name[length++] = '.';
+    for (int i = 8; i < 11 && short_name[i] != ' '; i++)
+      name[length++] = short_name[i];
+  }
+  name[length] = '\0';
+}
+
+int ValidName(const char* name)
+{
+  if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    return 0;
+  for (const char* c = name; *c != '\0'; c++)
+    if ((unsigned char) *c < 0x20 || strchr("\"*/:<>?\\|", *c) != NULL)
+      return 0;
+
+  uint16_t units[LFN_MAX];
+  return NameToUnits(name, units) > 0;
+}
+
+int NameToUnits(const char* name, uint16_t* units)
+{
+  const unsigned char* c = (const unsigned char*) name;
+  int count = 0;
+  while (*c != '\0')
+  {
+    // Decode one UTF-8 sequence
+    uint32_t code;
+    int extra;
+    if (*c < 0x80)
+      code = *c, extra = 0;
+    else if ((*c & 0xE0) == 0xC0)
+      code = *c & 0x1F, extra = 1;
+    else if ((*c & 0xF0) == 0xE0)
+      code = *c & 0x0F, extra = 2;
+    else if ((*c & 0xF8) == 0xF0)
+      code = *c & 0x07, extra = 3;
+    else
+      return -1;
+    c++;
+    for (int i = 0; i < extra; i++, c++)
+    {
+      if ((*c & 0xC0) != 0x80)
+        return -1;
+      code = (code << 6) | (*c & 0x3F);
+    }
+    if (code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+      return -1;
+
+    // Encode as one UTF-16 unit, or a surrogate pair past the BMP
+    if (code >= 0x10000)
+    {
+      if (count + 2 > LFN_MAX)
+        return -1;
+      code -= 0x10000;
+      units[count++] = 0xD800 | (code >> 10);
+      units[count++] = 0xDC00 | (code & 0x3FF);
+    }
+    else
+    {
+      if (count + 1 > LFN_MAX)
+        return -1;
+      units[count++] = code;
+    }
+  }
+  return count;
+}
+
+void UnitsToName(const uint16_t* units, int count, char* name)
+{
+  int length = 0;
+  for (int i = 0; i < count && units[i] != 0x0000; i++)
+  {
+    uint32_t code = units[i];
+    if (code >= 0xD800 && code <= 0xDBFF && i + 1 < count &&
+        units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF)
+      code = 0x10000 + ((code - 0xD800) << 10) + (units[++i] - 0xDC00);
+    else if (code >= 0xD800 && code <= 0xDFFF)
+      code = '?'; // Unpaired surrogate
+
+    if (code < 0x80)
+      name[length++] = code;
+    else if (code < 0x800)
+    {
+      name[length++] = 0xC0 | (code >> 6);
+      name[length++] = 0x80 | (code & 0x3F);
+    }
+    else if (code < 0x10000)
+    {
+      name[length++] = 0xE0 | (code >> 12);
+      name[length++] = 0x80 | ((code >> 6) & 0x3F);
+      name[length++] = 0x80 | (code & 0x3F);
+    }
+    else
+    {
+      name[length++] = 0xF0 | (code >> 18);
+      name[length++] = 0x80 | ((code >> 12) & 0x3F);
+      name[length++] = 0x80 | ((code >> 6) & 0x3F);
+      name[length++] = 0x80 | (code & 0x3F);
+    }
+  }
+  name[length] = '\0';
+}
+
+int MakeShortName(const char* name, uint8_t* short_name,
+                  int (*taken)(const char* name, void* arg), void* arg)
+// Basis name and numeric tail as in the FAT spec: upper case, characters
+// 8.3 cannot hold become '_', spaces and extra periods are dropped, and a
+// lossy or colliding basis gets "~N". Past ~4 the tail carries a hash of
+// the long name, so a directory full of similar names still finds a free
+// alias in a few tries
+{
+  char base[9], ext[4];
+  int base_length = 0, ext_length = 0;
+  int lossy = 0;
+
+  const char* start = name;
+  while (*start == '.') // Leading periods are not kept
+    start++, lossy = 1;
+  const char* dot = strrchr(start, '.');
+
+  for (const char* c = start; *c != '\0'; c++)
+  {
+    int in_ext = (dot != NULL && c > dot);
+    char value = *c;
+    if (c == dot)
+      continue;
+    if (value == ' ' || value == '.')
+    {
+      lossy = 1;
+      continue;
+    }
+    if ((unsigned char) value >= 0x80) // One '_' per UTF-8 sequence
+    {
+      while ((c[1] & 0xC0) == 0x80)
+        c++;
+      value = '_';
+      lossy = 1;
+    }
+    else if (strchr("+,;=[]", value) != NULL)
+      value = '_', lossy = 1;
+    else if (value >= 'a' && value <= 'z')
+      value -= 'a' - 'A';
+
+    if (!in_ext && base_length < 8)
+      base[base_length++] = value;
+    else if (in_ext && ext_length < 3)
+      ext[ext_length++] = value;
+    else
+      lossy = 1; // Truncated
+  }
+  if (base_length == 0)
+    base[base_length++] = '_', lossy = 1;
+
+  char display[13];
+  for (int attempt = 0; attempt < 10000; attempt++)
+  {
+    char tail[10] = "";
+    int keep = base_length;
+    if (attempt > 0 && attempt <= 4)
+      sprintf(tail, "~%d", attempt);
+    else if (attempt > 4)
+    {
+      uint32_t hash = HashName(name) + (attempt - 5) / 9;
+      sprintf(tail, "%04X~%d", (hash ^ (hash >> 16)) & 0xFFFF,
+              (attempt - 5) % 9 + 1);
+      keep = (base_length < 2) ? base_length : 2;
+    }
+    if (attempt == 0 && lossy)
+      continue; // A lossy basis always gets a tail
+    if (keep > 8 - (int) strlen(tail))
+      keep = 8 - strlen(tail);
+
+    memset(short_name, ' ', 11);
+    memcpy(short_name, base, keep);
+    memcpy(&short_name[keep], tail, strlen(tail));
+    memcpy(&short_name[8], ext, ext_length);
+
+    ShortNameString(short_name, display);
+    if (taken == NULL || !taken(display, arg))
+      return strcmp(display, name) != 0; // Long name unless typed as 8.3
+  }
+  return -1;
+}
+
+int MakeLongEntries(const char* name, const uint8_t* short_name,
+                    LDIR_ENTRY* slots)
+{
+  uint16_t units[LFN_MAX];
+  int count = NameToUnits(name, units);
+  if (count <= 0)
+    return 0;
+
+  // 13 units per LDIR_ENTRY. After the name: one 0x0000, then 0xFFFF
+  int parts = (count + 12) / 13;
+  uint8_t checksum = ShortNameChecksum(short_name);
+  for (int order = 1; order <= parts; order++)
+  {
+    uint16_t part[13];
+    for (int i = 0; i < 13; i++)
+    {
+      int position = (order - 1) * 13 + i;
+      part[i] = (position < count) ? units[position]
+              : (position == count) ? 0x0000 : 0xFFFF;
+    }
+
+    LDIR_ENTRY* long_entry = &slots[parts - order]; // Last part first
+    memset(long_entry, 0, sizeof(LDIR_ENTRY));
+    long_entry->LDIR_Ord = order | ((order == parts) ? 0x40 : 0);
+    long_entry->LDIR_Attr = 0xf;
+    long_entry->LDIR_Chksum = checksum;
+    memcpy(long_entry->LDIR_Name1, &part[0], 5 * sizeof(uint16_t));
+    memcpy(long_entry->LDIR_Name2, &part[5], 6 * sizeof(uint16_t));
+    memcpy(long_entry->LDIR_Name3, &part[11], 2 * sizeof(uint16_t));
+  }
+  return parts;
+}
+
+int NameTakenIn(const char* name, void* cluster_no)
+{
+  NAMED_ENTRY found;
+  return FindEntry(name, *(uint32_t*) cluster_no, &found, NULL);
+}
+
+uint32_t HashName(const char* name)
+{
+  // FNV-1a over the name with ASCII letters folded to lower case, matching
+  // the strcasecmp() comparisons made by IndexFind()
+  uint32_t hash = 2166136261u;
+  for (const unsigned char* c = (const unsigned char*) name; *c != '\0'; c++)
+  {
+    unsigned char folded = (*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c;
+    hash = (hash ^ folded) * 16777619u;
+  }
+  return hash;
+}
+
+//------------------------------DIRECTORY INDEX---------------------------------
+
+void IndexAdd(DIR_INDEX* index, NAMED_ENTRY* entry)
+{
+  if (index->count == index->capacity)
+  {
+    index->capacity = (index->capacity == 0) ? 16 : index->capacity * 2;
+    index->entries = realloc(index->entries,
+                             index->capacity * sizeof(NAMED_ENTRY));
+  }
+  index->entries[index->count++] = *entry;
+
+  // Keep the table under half full, rehashing every entry when it grows
+  int rehash = 0;
+  while ((index->keys + 2) * 2 > index->table_size)
+  {
+    index->table_size = (index->table_size == 0) ? 64
+                      : index->table_size * 2;
+    rehash = 1;
+  }
+  int first = index->count - 1;
+  if (rehash)
+  {
+    free(index->table);
+    index->table = calloc(index->table_size, sizeof(int));
+    index->keys = 0;
+    first = 0;
+  }
+
+  uint32_t mask = index->table_size - 1;
+  for (int i = first; i < index->count; i++)
+  {
+    // Hash the long name, and the 8.3 name when it reads differently
+    char short_name[13];
+    ShortNameString(index->entries[i].entry.DIR_Name, short_name);
+    const char* keys[2] = { index->entries[i].name, short_name };
+    int key_count = (strcasecmp(keys[0], keys[1]) == 0) ? 1 : 2;
+
+    for (int k = 0; k < key_count; k++)
+    {
+      uint32_t position = HashName(keys[k]) & mask;
+      while (index->table[position] != 0)
+        position = (position + 1) & mask;
+      index->table[position] = i + 1;
+      index->keys++;
+    }
+  }
+}
+
+NAMED_ENTRY* IndexFind(DIR_INDEX* index, const char* name)
+{
+  if (index->table_size == 0)
+    return NULL;
+
+  uint32_t mask = index->table_size - 1;
+  uint32_t position = HashName(name) & mask;
+  while (index->table[position] != 0)
+  {
+    NAMED_ENTRY* entry = &index->entries[index->table[position] - 1];
+    char short_name[13];
+    ShortNameString(entry->entry.DIR_Name, short_name);
+    if (strcasecmp(entry->name, name) == 0 ||
+        strcasecmp(short_name, name) == 0)
+      return entry;
+    position = (position + 1) & mask;
+  }
+  return NULL;
+}
+
+DIR_INDEX* BuildDirIndex(uint32_t cluster_no)
+{
+  DIR_INDEX* index = calloc(1, sizeof(DIR_INDEX));
+  index->cluster_no = cluster_no;
+
+  NAMED_ENTRY* entries;
+  int count = ReadDirectory(cluster_no, &entries);
+  for (int i = 0; i < count; i++)
+    IndexAdd(index, &entries[i]); // Takes over the name
+  free(entries);
+  return index;
+}
+
+void FreeDirIndex(DIR_INDEX* index)
+{
+  for (int i = 0; i < index->count; i++)
+    free(index->entries[i].name);
+  free(index->entries);
+  free(index->table);
+  free(index);
+}
+
+int FindEntry(const char* name, uint32_t cluster_no, NAMED_ENTRY* found,
+              char* long_name)
+// Callers hold the directory's lock (DirLock()), so the index cannot be
+// invalidated by a writer under them; DIR_INDEX_LOCK only guards the table
+// against lookups of other directories. The DIR_ENTRY is re-read from
+// IMAGEFILE, since sizes and clusters change without invalidating
+{
+  // . and .. lead every directory but the root and have no long name
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+  {
+    if (cluster_no == FIRST_CLUSTER)
+      return 0;
+    found->slot = (name[1] == '.') ? 1 : 0;
+    found->long_slots = 0;
+    found->offset = ClusterNo_To_DataOffset(cluster_no) +
+                    found->slot * sizeof(DIR_ENTRY);
+    found->name = long_name;
+    if (long_name != NULL)
+      strcpy(long_name, name);
+    return ReadImage(&found->entry, sizeof(DIR_ENTRY), found->offset) == 0;
+  }
+
+  int bucket = cluster_no % DIR_INDEX_BUCKETS;
+  pthread_mutex_lock(&DIR_INDEX_LOCK);
+  DIR_INDEX* index = DIR_INDEX_TABLE[bucket];
+  while (index != NULL && index->cluster_no != cluster_no)
+    index = index->next;
+
+  if (index == NULL) // First lookup since the directory changed: build it
+  {                  // without holding DIR_INDEX_LOCK across the reads
+    pthread_mutex_unlock(&DIR_INDEX_LOCK);
+    DIR_INDEX* built = BuildDirIndex(cluster_no);
+    pthread_mutex_lock(&DIR_INDEX_LOCK);
+
+    index = DIR_INDEX_TABLE[bucket];
+    while (index != NULL && index->cluster_no != cluster_no)
+      index = index->next;
+    if (index != NULL) // Another reader got there first
+      FreeDirIndex(built);
+    else
+    {
+      if (DIR_INDEX_COUNT >= DIR_INDEX_MAX) // Crude bound: start over
+      {
+        for (int i = 0; i < DIR_INDEX_BUCKETS; i++)
+          while (DIR_INDEX_TABLE[i] != NULL)
+          {
+            DIR_INDEX* next = DIR_INDEX_TABLE[i]->next;
+            FreeDirIndex(DIR_INDEX_TABLE[i]);
+            DIR_INDEX_TABLE[i] = next;
+          }
+        DIR_INDEX_COUNT = 0;
+      }
+      built->next = DIR_INDEX_TABLE[bucket];
+      DIR_INDEX_TABLE[bucket] = built;
+      DIR_INDEX_COUNT++;
+      index = built;
+    }
+  }
+
+  NAMED_ENTRY* match = IndexFind(index, name);
+  if (match != NULL)
+  {
+    *found = *match;
+    found->name = long_name;
+    if (long_name != NULL)
+      strcpy(long_name, match->name);
+  }
+  pthread_mutex_unlock(&DIR_INDEX_LOCK);
+
+  if (match == NULL)
+    return 0;
+  return ReadImage(&found->entry, sizeof(DIR_ENTRY), found->offset) == 0;
+}
+
+void InvalidateDirIndex(uint32_t cluster_no)
+{
+  pthread_mutex_lock(&DIR_INDEX_LOCK);
+  DIR_INDEX** link = &DIR_INDEX_TABLE[cluster_no % DIR_INDEX_BUCKETS];
+  while (*link != NULL && (*link)->cluster_no != cluster_no)
+    link = &(*link)->next;
+  if (*link != NULL)
+  {
+    DIR_INDEX* index = *link;
+    *link = index->next;
+    FreeDirIndex(index);
+    DIR_INDEX_COUNT--;
+  }
+  pthread_mutex_unlock(&DIR_INDEX_LOCK);
+}
+
+//---------------------------IMAGEFILE MANIPULATION-----------------------------
+
+void rm_DIR_ENTRY(char* file, uint32_t cluster_no)
+{
+  NAMED_ENTRY found;
+  if (!FindEntry(file, cluster_no, &found, NULL))
+  {
+    Error(STATUS_IO, "Error in rm_DIR_ENTRY function.\n");
+    return;
+  }
+
+  SizeIndexEntry(cluster_no, &found.entry, -1);
+
+  // Mark the DIR_ENTRY and the LDIR_ENTRYs of its long name as deallocated.
+  // (0x00 would also hide any entries after them)
+  uint8_t deallocated = 0xE5;
+  for (int i = 0; i <= found.long_slots; i++)
+    WriteImage(&deallocated, sizeof(deallocated),
+               SlotOffset(cluster_no, found.slot - i));
+  InvalidateDirIndex(cluster_no);
+  if (found.entry.DIR_Attr & 0x10) // Paths through it lead elsewhere now
+    ExpirePaths();
+}
+
+void DeallocateEntries(uint32_t cluster_no, NAMED_ENTRY* entries, int count)
+{
+  int per_cluster = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus /
+                    sizeof(DIR_ENTRY);
+  uint32_t* chain;
+  uint32_t clusters;
+  DIR_ENTRY* table = ReadDirectoryTable(cluster_no, &chain, &clusters);
+  if (table == NULL)
+  {
+    Error(STATUS_IO, "Error. Cannot read directory.\n");
+    return;
+  }
+
+  uint8_t* dirty = calloc(clusters, 1);
+  int directories = 0;
+  for (int i = 0; i < count; i++)
+  {
+    SizeIndexEntry(cluster_no, &entries[i].entry, -1);
+    directories |= entries[i].entry.DIR_Attr & 0x10;
+    for (int j = 0; j <= entries[i].long_slots; j++)
+    {
+      uint32_t slot = entries[i].slot - j;
+      table[slot].DIR_Name[0] = 0xE5;
+      dirty[slot / per_cluster] = 1;
+    }
+  }
+  for (uint32_t i = 0; i < clusters; i++)
+    if (dirty[i])
+      WriteImage(&table[i * per_cluster], per_cluster * sizeof(DIR_ENTRY),
+                 ClusterNo_To_DataOffset(chain[i]));
+
+  InvalidateDirIndex(cluster_no);
+  if (directories)
+    ExpirePaths();
+  free(dirty);
+  free(chain);
+  free(table);
+}
+
+DIR_ENTRY create_newfile(char* file)
+{
+  // Set all necessary fields for program operation
+  // As well as all fields that must be set to a specific value
+  // According to FAT32 specs
+	DIR_ENTRY NewFile;
+	memset(&NewFile, 0, sizeof(NewFile)); // No stray bytes in unused fields
+	NewFile.DIR_FileSize=0;
+	NewFile.DIR_FstClusHI=0;
+	NewFile.DIR_FstClusLO=0;
+  NewFile.DIR_Attr=0x20;
+  NewFile.DIR_NTRes=0;
+  uint16_t date, clock; // Entry fields are packed, fill them by value
+  FatTime(&date, &clock);
+  NewFile.DIR_CrtDate = NewFile.DIR_WrtDate = NewFile.DIR_LstAccDate = date;
+  NewFile.DIR_CrtTime = NewFile.DIR_WrtTime = clock;
+  // Space padded, as . and .. are stored; fat_creat() sets the 8.3 alias
+  // of any other name
+  memset(NewFile.DIR_Name, ' ', sizeof(NewFile.DIR_Name));
+  memcpy(NewFile.DIR_Name, file, strnlen(file, sizeof(NewFile.DIR_Name)));
+  //printf("%c\n",NewFile.DIR_Name[0]);
+
+  return NewFile;
+}
+
+void FatTime(uint16_t* date, uint16_t* clock)
+{
+  time_t now = (TRACE_NOW != 0) ? TRACE_NOW : time(NULL); // Replays stamp
+                                     // entries as the recording did
+  struct tm local;
+  localtime_r(&now, &local);
+  *date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) |
+          local.tm_mday;
+  *clock = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+}
+
+void UpdateFileSize(char* file, uint32_t cluster_no, int new_size)
+{
+  // Get current DIR_ENTRY and its offset
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  int update_offset = Get_DIR_ENTRY_Offset(file, cluster_no);
+
+  // Change current file size and write back to data region of IMAGEFILE
+  SizeIndexFile(cluster_no, current.DIR_FileSize, new_size);
+  current.DIR_FileSize = new_size;
+  uint16_t date, clock;
+  FatTime(&date, &clock);
+  current.DIR_WrtDate = current.DIR_LstAccDate = date;
+  current.DIR_WrtTime = clock;
+  WriteImage(&current, sizeof(current), update_offset);
+}
+
+void UpdateClusterInFAT(uint32_t cluster_no, uint32_t next_cluster)
+{
+  // Write next cluster in current cluster's FAT sector, in every FAT
+  pthread_mutex_lock(&ALLOC_LOCK);
+  WriteFAT(&next_cluster, sizeof(next_cluster), cluster_no);
+  if (FAT_CACHE != NULL && cluster_no < FAT_CACHE_ENTRIES)
+    FAT_CACHE[cluster_no] = next_cluster; // Keep cached FAT in step
+  if (next_cluster == 0x0 && cluster_no < FREE_CLUSTER_HINT)
+    FREE_CLUSTER_HINT = cluster_no; // Freed below the hint, move hint back
+  pthread_mutex_unlock(&ALLOC_LOCK);
+}
+
+void FreeChain(uint32_t first_cluster)
+{
+  uint32_t entry = 0x0; // Empty entry used to deallocate cluster
+  uint32_t current_cluster = first_cluster;
+
+  while (current_cluster >= 2 && current_cluster < 0x0FFFFFF6)
+  {
+    uint32_t next_cluster = NextClusterNo(current_cluster);
+    UpdateClusterInFAT(current_cluster, entry); // Write to IMAGEFILE FAT
+    PERF_ADD(freed, 1);
+    current_cluster = next_cluster; // store next cluster
+  }
+  InvalidateDirIndex(first_cluster); // In case the chain was a directory
+}
+
+void FreeChains(uint32_t* first_clusters, int count)
+// The chains are cleared in FAT_CACHE and only the FAT sectors they touch
+// go back to the image, each once, however many files share a sector
+{
+  if (FAT_CACHE == NULL)
+  {
+    for (int i = 0; i < count; i++)
+      FreeChain(first_clusters[i]);
+    return;
+  }
+
+  uint32_t per_sector = BOOT.BPB_BytsPerSec / 4;
+  uint32_t sectors = (FAT_CACHE_ENTRIES + per_sector - 1) / per_sector;
+  uint8_t* dirty = calloc(sectors, 1);
+  uint32_t limit = ClusterLimit();
+
+  pthread_mutex_lock(&ALLOC_LOCK);
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t cluster = first_clusters[i];
+    for (uint32_t steps = 0; cluster >= 2 && cluster < 0x0FFFFFF6 &&
+         cluster < FAT_CACHE_ENTRIES && steps < limit; steps++)
+    {
+      uint32_t next = FAT_CACHE[cluster];
+      FAT_CACHE[cluster] = 0x0;
+      PERF_ADD(freed, 1);
+      dirty[cluster / per_sector] = 1;
+      if (cluster < FREE_CLUSTER_HINT)
+        FREE_CLUSTER_HINT = cluster;
+      cluster = next;
+    }
+  }
+  WriteFATSectors(dirty, sectors);
+  pthread_mutex_unlock(&ALLOC_LOCK);
+  free(dirty);
+}
+
+void WriteFATSectors(const uint8_t* dirty, uint32_t sectors)
+{
+  uint32_t per_sector = BOOT.BPB_BytsPerSec / 4;
+  for (uint32_t i = 0; i < sectors; i++) // Runs of dirty sectors
+  {
+    if (!dirty[i])
+      continue;
+    uint32_t run = 1;
+    while (i + run < sectors && dirty[i + run])
+      run++;
+    WriteFAT(&FAT_CACHE[i * per_sector], run * BOOT.BPB_BytsPerSec,
+             i * per_sector);
+    i += run;
+  }
+}
+
+void AllocateClusterToEmptyFile(DIR_ENTRY current, int offset,
+                                  uint32_t cluster_no)
+// Given a free cluster, change a DIR_ENTRY in IMAGEFILE's data
+// region to point to said cluster, change cluster_no in IMAGEFILE
+// FAT Region to point to last cluster in a list (0xFFFFFFFF)
+{
+  // Allocate char arrays for 8 bit byte, high 4 bits and low 4 bits
+  char byte[9];
+  char low[5];
+  char high[5];
+
+  // write cluster number in 8 bit hex format into string byte, null terminate
+  sprintf(byte, "%08x", cluster_no);
+  byte[8] = '\0';
+  //printf("%s\n", byte);
+
+  // Now that bytes string is set, write 4 high bits to high string
+  for (int i = 0; i < 4; i++)
+    high[i] = byte[i];
+  high[4] = '\0';
+  // And write four low bits to low string
+  for (int j = 4; j < 8; j++)
+    low[j - 4] = byte[j];
+  low[4] = '\0';
+  //printf("%s %s\n", high, low);
+
+  // Declare 16 bit integers for high and low
+  uint16_t high_clus;
+  uint16_t low_clus;
+
+  // Convert high and low bit strings to ints, write into current DIR_ENTRY
+  sscanf(high, "%x", &high_clus);
+  sscanf(low, "%x", &low_clus);
+  //printf("High Clus: %i\n", high_clus);
+  //printf("Low Clus: %i\n", low_clus);
+  current.DIR_FstClusHI = high_clus;
+  current.DIR_FstClusLO = low_clus;
+
+  // Re-write DIR_ENTRY over old version of DIR_ENTRY in IMAGEFILE data region
+  WriteImage(&current, sizeof(current), offset);
+  UpdateClusterInFAT(cluster_no, 0xFFFFFFFF); // Set new cluster to last in list
+  //printf("Cluster No. %i set to 0xFFFFFFFF in FAT Region\n", cluster_no);
+}
+
+DIR_ENTRY UpdateTwoDotDirectory(DIR_ENTRY entry, uint32_t parent_cluster_no)
+// Update .. DIR_ENTRY to point to parent cluster no.
+{
+  // Allocate char arrays for 8 bit byte, high 4 bits and low 4 bits
+  char byte[9], low[5], high[5];
+  uint16_t high_clus, low_clus;
+
+  // write cluster number in 8 bit hex format into string byte, null terminate
+  sprintf(byte, "%08x", parent_cluster_no);
+  byte[8] = '\0';
+
+  // Now that bytes string is set, write 4 high bits to high string
+  for (int i = 0; i < 4; i++)
+    high[i] = byte[i];
+  high[4] = '\0';
+  // And write four low bits to low string
+  for (int j = 4; j < 8; j++)
+    low[j - 4] = byte[j];
+  low[4] = '\0';
+
+  // Convert high and low bit strings to ints, write into current DIR_ENTRY
+  sscanf(high, "%x", &high_clus);
+  sscanf(low, "%x", &low_clus);
+  entry.DIR_FstClusHI = high_clus;
+  entry.DIR_FstClusLO = low_clus;
+  return entry;
+}
+
+//-----------------------------OPENFILE_LIST FUNCS------------------------------
+
+int Get_OPENFILE_Entry(off_t entry) // Return array index of openfile
+{
+  if (entry == 0) // No such DIR_ENTRY
+    return -1;
+
+  // Iterate through list
+  pthread_mutex_lock(&OPENFILE_LIST_LOCK);
+  for (int i = 0; i < 100; i++)
+  {
+    if(OPENFILE_LIST[i].entry == entry)
+    {
+      pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+      return i; // return entry index
+    }
+  }
+  pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+
+  return -1; // if no index, return -1
+}
+
+void AddToList(uint32_t first_cluster, off_t entry, char* filename,
+               char* mode, int offset)
+// Add new entry to OEPNFILE_LIST
+{
+  // UPDATE OPENFILE_LIST
+  pthread_mutex_lock(&OPENFILE_LIST_LOCK);
+  if (OPENFILE_LIST_SIZE == 100)
+  {
+    pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+    Error(STATUS_NO_SPACE, "Program set to allow 100 maximum open files. ");
+    fprintf(OUT, "Readjust program code to continue.\n");
+    return;
+  }
+
+  // Iterate through list
+  for (int i = 0; i < 100; i++)
+  {
+    if(OPENFILE_LIST[i].first_cluster == 0 &&
+        ModeCheck(OPENFILE_LIST[i].m) == 1) // If not allocated
+    {
+      // Allocate and set struct fields w/ given function parameters
+      OPENFILE_LIST[i].first_cluster = first_cluster;
+      OPENFILE_LIST[i].entry = entry;
+      strcpy(OPENFILE_LIST[i].m, mode);
+      OPENFILE_LIST[i].offset = offset;
+      strcpy(OPENFILE_LIST[i].file, filename);
+      OPENFILE_LIST_SIZE++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+}
+
+int RemoveFromList(off_t entry)
+// If valid entry, remove from list
+{
+  if (entry == 0) // No such DIR_ENTRY
+    return 1;
+
+  // Iterate through list
+  pthread_mutex_lock(&OPENFILE_LIST_LOCK);
+  for (int i = 0; i < 100; i++)
+  {
+    if(OPENFILE_LIST[i].entry == entry)
+    {
+      // Wait out any read/write still using the handle
+      pthread_mutex_lock(&OPENFILE_LIST[i].lock);
+
+      // Deallocate list entry, return to default settings
+      OPENFILE_LIST[i].first_cluster = 0;
+      OPENFILE_LIST[i].entry = 0;
+      strcpy(OPENFILE_LIST[i].m, "");
+      OPENFILE_LIST[i].offset = 0;
+      strcpy(OPENFILE_LIST[i].file, "");
+      OPENFILE_LIST_SIZE--;
+      pthread_mutex_unlock(&OPENFILE_LIST[i].lock);
+      pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+
+  // If not found anywhere in list
+  return 1;
+}
+
+void MoveOpenFile(off_t from, off_t to)
+// A DIR_ENTRY was rewritten at another slot (CompactDirectory()): a handle
+// on it follows it there
+{
+  pthread_mutex_lock(&OPENFILE_LIST_LOCK);
+  for (int i = 0; i < 100; i++)
+    if (OPENFILE_LIST[i].entry == from)
+      OPENFILE_LIST[i].entry = to;
+  pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+}
+
+void PrintList(void) // For debugging
+{
+  // Iterate through list
+  for (int i = 0; i < 100; i++)
+  {
+    if(ModeCheck(OPENFILE_LIST[i].m) == 0) // If valid mode, a valid entry must
+    {                                      // exist
+      fprintf(OUT, "Entry at index[%i]:\n", i);
+      fprintf(OUT, "Filename: %s\n", OPENFILE_LIST[i].file);
+      fprintf(OUT, "First cluster: %i\n", OPENFILE_LIST[i].first_cluster);
+      fprintf(OUT, "Mode: %s\n", OPENFILE_LIST[i].m);
+      fprintf(OUT, "Offset: %i\n\n", OPENFILE_LIST[i].offset);
+    }
+  }
+}
+
+//------------------------------PATH RESOLUTION---------------------------------
+
+int ResolvePath(char* path, uint32_t cwd, uint32_t* dir, char** name)
+// "a/b/c.txt" gives the cluster of a/b and "c.txt". A leading '/' starts
+// at the root; trailing '/'s are dropped, so "a/b/" names b in a, and "/"
+// alone is "." in the root
+{
+  size_t length = strlen(path);
+  while (length > 1 && path[length - 1] == '/')
+    path[--length] = '\0';
+
+  char* slash = strrchr(path, '/');
+  if (slash == NULL) // Plain name, relative to the CWD
+  {
+    *dir = cwd;
+    *name = path;
+    return 0;
+  }
+
+  *name = (slash[1] == '\0') ? "." : slash + 1;
+  if (slash == path) // "/name"
+  {
+    *dir = FIRST_CLUSTER;
+    return 0;
+  }
+  *slash = '\0'; // path now holds the directory part only
+  return WalkPath(path, (path[0] == '/') ? FIRST_CLUSTER : cwd, dir);
+}
+
+int WalkPath(char* path, uint32_t start, uint32_t* cluster_no)
+// Each step looks one component up under that directory's read lock (one
+// lock at a time). Every prefix walked is cached, so the next path through
+// the same directories starts from the deepest one already known
+{
+  pthread_mutex_lock(&PATH_CACHE_LOCK);
+  unsigned long generation = PATH_GENERATION; // Before any lookup: a move
+  pthread_mutex_unlock(&PATH_CACHE_LOCK);     // meanwhile expires results
+
+  if (PathCacheFind(start, path, cluster_no))
+    return 0;
+
+  // Otherwise start below the longest prefix that is cached
+  uint32_t current = start;
+  char* rest = path;
+  for (char* slash = path + strlen(path) - 1; slash > path; slash--)
+  {
+    if (*slash != '/')
+      continue;
+    *slash = '\0';
+    int found = PathCacheFind(start, path, &current);
+    *slash = '/';
+    if (found)
+    {
+      rest = slash + 1;
+      break;
+    }
+  }
+
+  while (*rest != '\0')
+  {
+    char* end = strchr(rest, '/');
+    if (end != NULL)
+      *end = '\0';
+
+    if (rest[0] != '\0') // Empty components ("a//b", leading '/') are skipped
+    {
+      DirLock(current, DIR_LOCK_READ);
+      uint32_t next = cd(rest, current);
+      DirUnlock(current);
+      if (next == 0) // Error already printed
+      {
+        if (end != NULL)
+          *end = '/';
+        return -1;
+      }
+      current = next;
+      PathCacheStore(start, path, current, generation);
+    }
+
+    if (end == NULL)
+      break;
+    *end = '/';
+    rest = end + 1;
+  }
+
+  *cluster_no = current;
+  return 0;
+}
+
+uint32_t PathCacheSlot(uint32_t start, const char* path)
+{
+  return (HashName(path) ^ (start * 2654435761u)) & (PATH_CACHE_SLOTS - 1);
+}
+
+int PathCacheFind(uint32_t start, const char* path, uint32_t* cluster_no)
+{
+  PATH_CACHE_ENTRY* entry = &PATH_CACHE[PathCacheSlot(start, path)];
+  int found = 0;
+
+  pthread_mutex_lock(&PATH_CACHE_LOCK);
+  if (entry->path != NULL && entry->start == start &&
+      entry->generation == PATH_GENERATION &&
+      strcasecmp(entry->path, path) == 0) // Names ignore case
+  {
+    *cluster_no = entry->cluster_no;
+    found = 1;
+  }
+  pthread_mutex_unlock(&PATH_CACHE_LOCK);
+  return found;
+}
+
+void PathCacheStore(uint32_t start, const char* path, uint32_t cluster_no,
+                    unsigned long generation)
+{
+  PATH_CACHE_ENTRY* entry = &PATH_CACHE[PathCacheSlot(start, path)];
+
+  pthread_mutex_lock(&PATH_CACHE_LOCK);
+  free(entry->path); // Direct-mapped: the newest path wins the slot
+  entry->path = strdup(path);
+  entry->start = start;
+  entry->cluster_no = cluster_no;
+  entry->generation = generation;
+  pthread_mutex_unlock(&PATH_CACHE_LOCK);
+}
+
+void ExpirePaths(void)
+{
+  // Creating entries never changes where a path leads, removing or moving
+  // a directory can. Both are rare next to lookups, so expire everything
+  pthread_mutex_lock(&PATH_CACHE_LOCK);
+  PATH_GENERATION++;
+  pthread_mutex_unlock(&PATH_CACHE_LOCK);
+}
+
+int IsPattern(const char* name)
+{
+  return strpbrk(name, "*?[") != NULL;
+}
+
+int MultiTarget(tokenlist* tokens, int end)
+{
+  return end > 2 || IsPattern(tokens->items[1]);
+}
+
+int ExpandTargets(tokenlist* tokens, int end, uint32_t dir, uint32_t cwd,
+                  NAMED_ENTRY** matched)
+// Token 1 was resolved by ExecuteCommand(); the others are resolved here
+// and must lead to the same directory, which is then read once. A plain
+// name matches an entry's long or 8.3 name, a pattern (as in find) its
+// name, case ignored either way. Each entry is kept once, in directory
+// order; a token matching nothing is reported and skipped
+{
+  int names = end - 1;
+  char** name = malloc(names * sizeof(char*));
+  int* found = calloc(names, sizeof(int));
+  name[0] = tokens->items[1];
+  for (int i = 1; i < names; i++)
+  {
+    uint32_t other;
+    char* path = strdup(tokens->items[i + 1]); // Resolving cuts the token
+    name[i] = NULL;
+    if (ResolvePath(tokens->items[i + 1], cwd, &other, &name[i]) != 0)
+      found[i] = 1; // Not a name to look for, error already printed
+    else if (other != dir)
+    {
+      Error(STATUS_INVALID, "Error. %s is not in the same directory as %s.\n",
+            path, tokens->items[1]);
+      found[i] = 1;
+      name[i] = NULL;
+    }
+    free(path);
+  }
+
+  NAMED_ENTRY* entries;
+  int count = ReadDirectory(dir, &entries), kept = 0;
+  char short_name[13];
+  for (int e = 0; e < count; e++)
+  {
+    int match = 0;
+    ShortNameString(entries[e].entry.DIR_Name, short_name);
+    for (int i = 0; i < names; i++)
+    {
+      if (name[i] == NULL)
+        continue;
+      int hit = IsPattern(name[i])
+                ? fnmatch(name[i], entries[e].name, FNM_CASEFOLD) == 0
+                : strcasecmp(name[i], entries[e].name) == 0 ||
+                  strcasecmp(name[i], short_name) == 0;
+      if (hit)
+        match = found[i] = 1;
+    }
+    if (match)
+      entries[kept++] = entries[e]; // Keeps its name
+    else
+      free(entries[e].name);
+  }
+
+  for (int i = 0; i < names; i++)
+    if (!found[i])
+      Error(STATUS_NOT_FOUND, "%s not found.\n", name[i]);
+  free(name);
+  free(found);
+  *matched = entries;
+  return kept;
+}
+
+//--------------------------------COMMAND STATUS--------------------------------
+
+void Error(int status, const char* format, ...)
+{
+  if (COMMAND_STATUS == STATUS_OK) // Keep the first failure of a command
+    COMMAND_STATUS = status;
+
+  va_list args;
+  va_start(args, format);
+  vfprintf(OUT, format, args);
+  va_end(args);
+}
+
+//-------------------------------STRING UTILITES--------------------------------
+
+int ModeCheck(char* mode) // Check for valid mode when opening file
+{
   if (strcmp(mode, "r") == 0 || strcmp(mode, "w") == 0 ||
       strcmp(mode, "rw") == 0 || strcmp(mode, "wr") == 0 )
     return 0; // valid modes
   else
-    return 1; // invalid
+    return 1; // invalid
+}
+
+//----------------------------------DEBUGGING-----------------------------------
+
+void Print_DIR (DIR_ENTRY current) // Print func for debugging
+{
+  fprintf(OUT, "\n");
+  fprintf(OUT, "%x\n", current.DIR_Attr); // Print all fields in DIR_ENTRY struct
+  fprintf(OUT, "%i\n", current.DIR_NTRes);
+  fprintf(OUT, "%i\n", current.DIR_CrtTimeTenth);
+  fprintf(OUT, "%i\n", current.DIR_CrtTime);
+  fprintf(OUT, "%i\n", current.DIR_LstAccDate);
+  fprintf(OUT, "%x\n", current.DIR_FstClusHI);
+  fprintf(OUT, "%i\n", current.DIR_WrtTime);
+  fprintf(OUT, "%i\n", current.DIR_WrtDate);
+  fprintf(OUT, "%x\n", current.DIR_FstClusLO);
+  fprintf(OUT, "%i\n", current.DIR_FileSize);
+}
+
+void Print_LDIR (LDIR_ENTRY long_entry) // Print func for debugging
+{
+  fprintf(OUT, "\n");
+  fprintf(OUT, "%i\n", long_entry.LDIR_Ord); // Print all fields in LDIR_ENTRY struct
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name1[0]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name1[1]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name1[2]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name1[3]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name1[4]);
+  fprintf(OUT, "%x\n", long_entry.LDIR_Attr);
+  fprintf(OUT, "%i\n", long_entry.LDIR_Type);
+  fprintf(OUT, "%i\n", long_entry.LDIR_Chksum);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name2[0]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name2[1]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name2[2]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name2[3]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name2[4]);
+  fprintf(OUT, "%c\n", long_entry.LDIR_Name2[5]);
+  fprintf(OUT, "%x\n", long_entry.LDIR_FstClusLO);
+  fprintf(OUT, "%s\n", long_entry.LDIR_Name3);
+}
+
+//------------------------------------------------------------------------------
+//-------------------------------MAIN FUNCTIONS---------------------------------
+
+void info(void) // Parse boot sector & print relevant info
+{
+  fprintf(OUT, "Bytes Per Sector: %d\n", BOOT.BPB_BytsPerSec);
+  fprintf(OUT, "Sectors Per Cluster: %d\n", BOOT.BPB_SecPerClus);
+  fprintf(OUT, "Reserved Sector Count: %d\n", BOOT.BPB_RsvdSecCnt);
+  fprintf(OUT, "Number of FATs: %d\n", BOOT.BPB_NumFATs);
+  fprintf(OUT, "Total Sectors: %d\n", BOOT.BPB_TotSec32);
+  fprintf(OUT, "FATsize: %d sectors\n", BOOT.BPB_FATSz32);
+  fprintf(OUT, "Root Cluster: %d\n", BOOT.BPB_RootClus);
+}
+
+void size(char* file, uint32_t cluster_no)
+// Print size in bytes of FILE file in CWD
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+
+  if (current.DIR_Name[0] == 0x00) // Check if found
+    Error(STATUS_NOT_FOUND,
+          "%s not found in current working directory.\n", file);
+  else if (current.DIR_Attr == 0x10) // Check if a directory
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else  // VALID -- print
+    fprintf(OUT, "%i bytes\n", current.DIR_FileSize);
+}
+
+void ls_CWD(uint32_t cluster_no, int options) // List contents of CWD
+// One pass over the directory; the listing is formatted into memory and
+// handed to OUT in one piece, so a large directory costs a few writes
+{
+  NAMED_ENTRY* entries;
+  int count = ReadDirectory(cluster_no, &entries);
+  if (options & LS_SORT_NAME)
+    qsort(entries, count, sizeof(NAMED_ENTRY), CompareName);
+  else if (options & LS_SORT_SIZE)
+    qsort(entries, count, sizeof(NAMED_ENTRY), CompareSize);
+  else if (options & LS_SORT_CLUSTER)
+    qsort(entries, count, sizeof(NAMED_ENTRY), CompareFirstCluster);
+
+  char* text = NULL;
+  size_t length = 0;
+  FILE* listing = open_memstream(&text, &length);
+
+  if (!(options & LS_LONG))
+  {
+    // . and .. (every directory but the root), then entries by name
+    if (cluster_no != FIRST_CLUSTER)
+      fputs(".\n..\n", listing);
+    for (int i = 0; i < count; i++)
+    {
+      fputs(entries[i].name, listing);
+      fputc('\n', listing);
+    }
+  }
+  else
+  {
+    fprintf(listing, "%-5s %10s %10s %8s %-16s %s\n", "ATTR", "SIZE",
+            "CLUSTER", "CLUSTERS", "MODIFIED", "NAME");
+    for (int i = 0; i < count; i++)
+    {
+      DIR_ENTRY* entry = &entries[i].entry;
+      uint32_t first = ((uint32_t) entry->DIR_FstClusHI << 16) |
+                       entry->DIR_FstClusLO;
+      uint32_t clusters = 0; // From the cached FAT, no I/O
+      for (uint32_t n = first; n >= 2 && n < 0x0FFFFFF6 &&
+           clusters < ClusterLimit(); n = NextClusterNo(n))
+        clusters++;
+
+      char attr[6], modified[17];
+      AttrString(entry->DIR_Attr, attr);
+      FormatFatTime(entry->DIR_WrtDate, entry->DIR_WrtTime, modified);
+      fprintf(listing, "%-5s %10u %10u %8u %-16s %s\n", attr,
+              entry->DIR_FileSize, first, clusters, modified,
+              entries[i].name);
+    }
+  }
+
+  fclose(listing);
+  fwrite(text, 1, length, OUT);
+  free(text);
+  FreeDirectory(entries, count);
+}
+
+void ls_dirname(char* dirname, uint32_t cluster_no, int options)
+// List contents of DIRNAME
+{
+  uint32_t new_cluster_no = cd(dirname, cluster_no);
+  if (new_cluster_no == 0) // CD was unsuccessful (err printed)
+    return;
+  ls_CWD(new_cluster_no, options); // Traverse through new CWD and list
+}
+
+int CompareName(const void* a, const void* b)
+{
+  return strcasecmp(((const NAMED_ENTRY*) a)->name,
+                    ((const NAMED_ENTRY*) b)->name); // Names ignore case
+}
+
+int CompareSize(const void* a, const void* b)
+{
+  uint32_t x = ((const NAMED_ENTRY*) a)->entry.DIR_FileSize;
+  uint32_t y = ((const NAMED_ENTRY*) b)->entry.DIR_FileSize;
+  return (x < y) - (x > y);
+}
+
+void AttrString(uint8_t attr, char* text)
+{
+  text[0] = (attr & 0x10) ? 'd' : '-'; // ATTR_DIRECTORY
+  text[1] = (attr & 0x01) ? 'r' : '-'; // ATTR_READ_ONLY
+  text[2] = (attr & 0x02) ? 'h' : '-'; // ATTR_HIDDEN
+  text[3] = (attr & 0x04) ? 's' : '-'; // ATTR_SYSTEM
+  text[4] = (attr & 0x20) ? 'a' : '-'; // ATTR_ARCHIVE
+  text[5] = '\0';
+}
+
+void FormatFatTime(uint16_t date, uint16_t time, char* text)
+// Refer to page 25 of Microsoft FAT Specification document: date is
+// years since 1980 (7 bits), month, day; time is hours, minutes, 2-second
+// count. A zero date was never set
+{
+  if (date == 0)
+  {
+    strcpy(text, "-");
+    return;
+  }
+  sprintf(text, "%04u-%02u-%02u %02u:%02u", 1980 + (date >> 9),
+          (date >> 5) & 0xF, date & 0x1F, time >> 11, (time >> 5) & 0x3F);
+}
+
+int cd(char* dir, uint32_t cluster_no) // Change CWD to DIRNAME,
+                                       // return 0 for failure
+{
+  if (strcmp(dir, ".") == 0)  // Do not need to change into current directory
+    return cluster_no;
+  if (strcmp(dir, "..") == 0) // Parent is the .. entry, the second slot of
+  {                           // the directory's first cluster
+    if (cluster_no == FIRST_CLUSTER) // Root is its own parent
+      return FIRST_CLUSTER;
+    DIR_ENTRY parent;
+    ReadImage(&parent, sizeof(parent),
+              ClusterNo_To_DataOffset(cluster_no) + sizeof(DIR_ENTRY));
+    if (parent.DIR_Name[0] != '.' || parent.DIR_Name[1] != '.')
+    {
+      Error(STATUS_IO, "Directory has no .. entry.\n");
+      return 0;
+    }
+    uint32_t parent_cluster_no = Get_Child_Cluster_No(parent);
+    return (parent_cluster_no == 0) ? FIRST_CLUSTER : parent_cluster_no;
+  }
+
+  DIR_ENTRY current = Get_DIR_ENTRY(dir, cluster_no);
+
+  if (current.DIR_Name[0] == 0x00) // dir NOT FOUND
+  {
+    Error(STATUS_NOT_FOUND, "%s not found in current working directory.\n",
+          dir);
+    return 0; // Cannot change dir
+  }
+  if (!(current.DIR_Attr & 0x10)) // dir fnd, check if actually a directory
+  {
+    Error(STATUS_INVALID, "%s is not a directory.\n", dir);
+    return 0; // Cannot change dir
+  }
+
+  uint32_t new_cluster_no = Get_Child_Cluster_No(current);
+  return (new_cluster_no == 0) ? FIRST_CLUSTER : new_cluster_no;
+}
+
+void fat_creat(char* file, uint32_t cluster_no, DIR_ENTRY NewFile)
+// Create file FILENAME in CWD, size 0 bytes
+{
+  // Check for valid entry
+  if (DirAlreadyExists(file, cluster_no) != 0) {
+    Error(STATUS_EXISTS, "Filename already exists.\n");
+    return;
+  }
+
+  if (!ValidName(file)) {
+    Error(STATUS_INVALID, INVALID_NAME);
+    return;
+  }
+
+  // Give the entry an 8.3 alias unique in CWD, and LDIR_ENTRYs for the
+  // name as typed unless the alias already spells it
+  int needs_long = MakeShortName(file, NewFile.DIR_Name, NameTakenIn,
+                                 &cluster_no);
+  if (needs_long < 0) {
+    Error(STATUS_NO_SPACE, "No free short name left for %s.\n", file);
+    return;
+  }
+  LDIR_ENTRY long_entries[LFN_SLOTS_MAX];
+  int long_slots = needs_long ? MakeLongEntries(file, NewFile.DIR_Name,
+                                                long_entries) : 0;
+
+  // Find room for all of them in a row (the directory grows if needed)
+  off_t offsets[LFN_SLOTS_MAX + 1];
+  if (FindFreeSlots(cluster_no, long_slots + 1, offsets) != 0)
+    return;
+
+  // Write LDIR and DIR Entries, DIR_ENTRY last
+  for (int i = 0; i < long_slots; i++)
+    WriteImage(&long_entries[i], sizeof(LDIR_ENTRY), offsets[i]);
+  WriteImage(&NewFile, sizeof(NewFile), offsets[long_slots]);
+  InvalidateDirIndex(cluster_no);
+  SizeIndexEntry(cluster_no, &NewFile, 1);
+}
+
+void fat_mkdir(char* dir, uint32_t cluster_no) // Make directory DIRNAME in CWD
+{
+  // All checks for valid entry covered within fat_creat() function call
+
+  // Create new_directory DIR_ENTRY and set its attributes to DIR
+  DIR_ENTRY new_directory = create_newfile(dir);
+  new_directory.DIR_Attr = 0x10;
+
+  // Find_Free_Cluster() claims the cluster it returns, so reject invalid
+  // names first (fat_creat() prints the reason) instead of leaking it
+  if (DirAlreadyExists(dir, cluster_no) != 0 || !ValidName(dir))
+  {
+    fat_creat(dir, cluster_no, new_directory);
+    return;
+  }
+
+  // Find first free cluster for new_directory in FAT
+  uint32_t new_cluster = Find_Free_Cluster(DirectoryGoal(cluster_no));
+  if (new_cluster == -1) // NO MORE MEMORY
+    return;
+
+  // Add new_directory DIR_ENTRY to CWD
+  fat_creat(dir, cluster_no, new_directory);
+  if (COMMAND_STATUS != STATUS_OK) // No room for the DIR_ENTRY
+  {
+    FreeChain(new_cluster);
+    return;
+  }
+
+  // Allocate cluster to new_directory (update FrstClusHI & FrstClusLO)
+  // (And set new cluster's FAT offset to 0xFFFFFFFF)
+  new_directory = Get_DIR_ENTRY(dir, cluster_no); // With its 8.3 alias
+  int data_offset = Get_DIR_ENTRY_Offset(dir, cluster_no);
+  //printf("Offset of current dir: %i\n", data_offset);
+  AllocateClusterToEmptyFile(new_directory, data_offset, new_cluster);
+  SizeIndexDirectory(new_cluster, cluster_no, 1);
+
+  // Write . and .. entries at new_cluster's data_offset
+  data_offset = ClusterNo_To_DataOffset(new_cluster);
+  //printf("Offset of newly allocated dir: %i\n", data_offset);
+  DIR_ENTRY OneDot = UpdateTwoDotDirectory(create_newfile("."), new_cluster);
+  DIR_ENTRY TwoDots = create_newfile("..");
+  OneDot.DIR_Attr = TwoDots.DIR_Attr = 0x10;
+
+  if (cluster_no != BOOT.BPB_RootClus) // If not starting in root
+  // SET DIR_FstClusHI and DIR_FstClusLO for .. to current dir's first cluster
+  // (which is actually cluster_no)
+    TwoDots = UpdateTwoDotDirectory(TwoDots, cluster_no);
+
+  WriteImage(&OneDot, sizeof(OneDot), data_offset);
+  WriteImage(&TwoDots, sizeof(TwoDots), data_offset + sizeof(OneDot));
+  InvalidateDirIndex(new_cluster); // Cluster may have held a directory
+}
+
+void mv(char* dir1, uint32_t cluster_no, char* dir2, uint32_t to_cluster_no)
+// Move file or dir -- mv FROM TO
+{
+  // Check if dir1 is . or ..
+  if (strcmp(dir1, ".") == 0 || strcmp(dir1, "..") == 0)
+  {
+    Error(STATUS_INVALID, "%s cannot be moved into another directory.\n", dir1);
+    return;
+  }
+
+  // Check if dir1 exists in CWD, and get the name it is stored under
+  NAMED_ENTRY found;
+  char name[NAME_BUFFER];
+  if (!FindEntry(dir1, cluster_no, &found, name)) // If it does not, there is
+  {                                               // no entry to move
+    Error(STATUS_NOT_FOUND, "%s not found in CWD.\n", dir1);
+    return;
+  }
+  DIR_ENTRY to_move = found.entry;
+
+  // TO is a directory to move into, or the new path of the entry
+  uint32_t new_cluster_no = to_cluster_no;
+  char* new_name = dir2;
+  if (strcmp(dir2, ".") == 0 || strcmp(dir2, "..") == 0)
+  {
+    if ((new_cluster_no = cd(dir2, to_cluster_no)) == 0)
+      return;
+    new_name = name;
+  }
+  else
+  {
+    DIR_ENTRY destination = Get_DIR_ENTRY(dir2, to_cluster_no);
+    if (to_cluster_no == cluster_no &&
+        Get_DIR_ENTRY_Offset(dir2, to_cluster_no) == found.offset)
+      destination.DIR_Name[0] = 0x00; // Same entry, only the case differs
+
+    if (destination.DIR_Name[0] != 0x00 && (destination.DIR_Attr & 0x10))
+    // If dir2 found and it is a directory
+    // Then move dir1 (a file OR another dir) into dir2
+    {
+      new_cluster_no = Get_Child_Cluster_No(destination);
+      new_name = name;
+    }
+    else if (destination.DIR_Name[0] != 0x00)
+    // If dir2 found and it is a file that already exists
+    {
+      Error(STATUS_EXISTS,
+            "The name is already being used by another file.\n", dir2);
+      return;
+    }
+    else if (!ValidName(dir2)) // dir2 NOT FOUND, it is the new name
+    {
+      Error(STATUS_INVALID, INVALID_NAME);
+      return;
+    }
+  }
+
+  // A directory cannot go into its own subtree: walk up from the target
+  uint32_t moved_cluster = Get_Child_Cluster_No(to_move);
+  if (to_move.DIR_Attr & 0x10)
+    for (uint32_t up = new_cluster_no; ; up = cd("..", up))
+    {
+      if (up == moved_cluster)
+      {
+        Error(STATUS_INVALID, "%s cannot be moved into itself.\n", dir1);
+        return;
+      }
+      if (up == FIRST_CLUSTER || up == 0)
+        break;
+    }
+
+  if (new_cluster_no != cluster_no) // CWD is locked, lock the target too
+    DirLock(new_cluster_no, DIR_LOCK_WRITE);
+
+  // Check if the name is taken in the target directory
+  NAMED_ENTRY taken;
+  if (FindEntry(new_name, new_cluster_no, &taken, NULL) &&
+      !(new_cluster_no == cluster_no && taken.offset == found.offset))
+    Error(STATUS_EXISTS,
+          "The name is already being used by another file.\n", dir2);
+  else
+  {
+    // If file is open, close before moving
+    RemoveFromList(found.offset);
+
+    // The new name may need a different number of LDIR_ENTRYs, so the
+    // entry is written out afresh
+    rm_DIR_ENTRY(dir1, cluster_no);
+    fat_creat(new_name, new_cluster_no, to_move);
+
+    if ((to_move.DIR_Attr & 0x10) && new_cluster_no != cluster_no)
+    // If moving a directory, need to update its .. entry to refelct new parent
+    {
+      int data_offset = ClusterNo_To_DataOffset(moved_cluster) +
+                        sizeof(DIR_ENTRY);
+      DIR_ENTRY TwoDots;
+      ReadImage(&TwoDots, sizeof(TwoDots), data_offset);
+      TwoDots = UpdateTwoDotDirectory(TwoDots, (new_cluster_no ==
+                                      FIRST_CLUSTER) ? 0 : new_cluster_no);
+      WriteImage(&TwoDots, sizeof(TwoDots), data_offset);
+    }
+  }
+
+  if (new_cluster_no != cluster_no)
+    DirUnlock(new_cluster_no);
+}
+
+void fat_open(char* file, char* mode, uint32_t cluster_no) // Opens FILE file in CWD,
+                    // and adds it to the OPENFILE_LIST,
+                    // open in modes r (read-only), w (write-only), rw, or wr
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  int entry_index = Get_OPENFILE_Entry(Get_DIR_ENTRY_Offset(file, cluster_no));
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s not found in current working directory.\n", file);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else if (ModeCheck(mode) == 1) // check for valid mode
+    Error(STATUS_INVALID,
+          "Invalid mode entered. Acceptable modes: r, w, rw, or wr.\n");
+  else if ((current.DIR_Attr == 0x01) && (mode != "r")) // check if read-only
+  // If file permission set to read only
+    Error(STATUS_INVALID,
+          "File permissions set to read-only. Retry opening w/ mode r.\n");
+  else if (entry_index != -1) // files not in list will return an index of -1
+    Error(STATUS_EXISTS, "File is already open.\n");
+  else
+  {
+    // Get file cluster number specifed in dir entry
+    int file_cluster_no = Get_Child_Cluster_No(current);
+    AddToList(file_cluster_no, Get_DIR_ENTRY_Offset(file, cluster_no), file,
+              mode, 0);
+  }
+
+}
+
+void fat_close(char* file, uint32_t cluster_no) // Close FILE file
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s not found in current working directory.\n", file);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else // VALID -- remove from OPENFILE_LIST
+  {
+    // Get file cluster number specifed in dir entry
+    int file_cluster_no = Get_Child_Cluster_No(current);
+
+    if (RemoveFromList(Get_DIR_ENTRY_Offset(file, cluster_no)) != 0)
+      Error(STATUS_INVALID, "%s is not open.\n", file);
+  }
+}
+
+void fat_lseek(char* file, int offset, uint32_t cluster_no) // Set offset (in bytes)
+                                       // of FILENAME given CWD cluster_no
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  int entry_index = Get_OPENFILE_Entry(Get_DIR_ENTRY_Offset(file, cluster_no));
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s not found in current working directory.\n", file);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else if (offset > current.DIR_FileSize) // check if offset is too large
+    Error(STATUS_INVALID, "Error. Offset entered is greater than file size.\n");
+  else if (entry_index == -1) // check if file is open
+    Error(STATUS_INVALID, "Error. File is not open.\n");
+  else if ( strcmp(OPENFILE_LIST[entry_index].m, "w") == 0) // check mode
+    Error(STATUS_INVALID, "Error. File not open for reading.\n");
+  else // VALID -- update offset
+    OPENFILE_LIST[entry_index].offset = offset;
+}
+
+void fat_read(char* file, int size, uint32_t cluster_no)
+    // Read data from FILE file starting at stored offset in open file list
+    // for size bytes, print to screen
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  int entry_index = Get_OPENFILE_Entry(Get_DIR_ENTRY_Offset(file, cluster_no));
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", file);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else if (entry_index == -1) // check if file is open
+    Error(STATUS_INVALID, "Error. File is not open.\n");
+  else if ( strcmp(OPENFILE_LIST[entry_index].m, "w") == 0) // check mode
+    Error(STATUS_INVALID, "Error. File not open for reading.\n");
+  else if (OPENFILE_LIST[entry_index].offset == current.DIR_FileSize)
+    fprintf(OUT, "Offset set to end of file. Nothing left to read.\n");
+  else // VALID -- read file for size bytes starting at offset
+  {
+    // Hold the handle lock so concurrent reads of this open file each
+    // consume their own range of the offset
+    pthread_mutex_lock(&OPENFILE_LIST[entry_index].lock);
+
+    // Get 1st cluster_no of file
+    uint32_t first_cluster = OPENFILE_LIST[entry_index].first_cluster;
+
+    int offset = OPENFILE_LIST[entry_index].offset; // get file offset
+
+    // Check if size entered is larger than what can be read, adjust if needed
+    int maximum_read = current.DIR_FileSize - offset;
+    if (size > maximum_read)
+      size = maximum_read;
+
+    // Allocate buffer, read IMAGEFILE into buffer and print
+    char* buffer = malloc(size + 1);
+    int size_read = ReadFileData(first_cluster, offset, buffer, size);
+    fwrite(buffer, 1, size_read, OUT);
+    fprintf(OUT, "\n");
+    free(buffer);
+
+    // FINALLY, UPDATE OFFSET IN OPENFILE_LIST ENTRY
+    OPENFILE_LIST[entry_index].offset += size;
+    pthread_mutex_unlock(&OPENFILE_LIST[entry_index].lock);
+  }
+}
+
+void fat_write(char* file, int size, char* string, uint32_t cluster_no)
+// Write to file FILENAME in CWD
+// ASSUMES STRING ALWAYS ENTERED IN QUOTES
+{
+  //printf("String: %s\n", string);
+
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  int entry_index = Get_OPENFILE_Entry(Get_DIR_ENTRY_Offset(file, cluster_no));
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", file);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else if (entry_index == -1) // check if file is open
+    Error(STATUS_INVALID, "Error. File is not open.\n");
+  else if ( strcmp(OPENFILE_LIST[entry_index].m, "r") == 0) // check mode
+    Error(STATUS_INVALID, "Error. File not open for writing.\n");
+  else // VALID -- write size bytes starting at offset
+  {
+    pthread_mutex_lock(&OPENFILE_LIST[entry_index].lock);
+
+    // Adjust string to given size-----------------------------------
+    // (If string is shorter than size, fill rest w/ null chars)
+    char* to_write = calloc(size + 1, 1);
+    int length = strlen(string);
+    memcpy(to_write, string, (length < size) ? length : size);
+    //printf("to_write string: %s\n", to_write);
+
+    // Get 1st cluster_no of file------------------------------------
+    uint32_t first_cluster = OPENFILE_LIST[entry_index].first_cluster;
+    int offset = OPENFILE_LIST[entry_index].offset;
+
+    if (first_cluster == 0) // If cluster not yet allcated, must allocate now
+    {
+      // Find first available cluster
+      first_cluster = Find_Free_Cluster(cluster_no);
+      if (first_cluster == -1) // NO MORE MEMORY
+      {
+        free(to_write);
+        pthread_mutex_unlock(&OPENFILE_LIST[entry_index].lock);
+        return;
+      }
+      OPENFILE_LIST[entry_index].first_cluster = first_cluster;
+      int data_offset = Get_DIR_ENTRY_Offset(file, cluster_no);
+      AllocateClusterToEmptyFile(current, data_offset, first_cluster);
+    }
+
+    // Write, allocating new clusters as the chain runs out
+    int size_written = WriteFileData(first_cluster, offset, to_write, size);
+    free(to_write);
+
+    // Update file size if it grew, then update offset
+    if (offset + size_written > current.DIR_FileSize)
+      UpdateFileSize(file, cluster_no, offset + size_written);
+    OPENFILE_LIST[entry_index].offset = offset + size_written;
+
+    pthread_mutex_unlock(&OPENFILE_LIST[entry_index].lock);
+  }
+}
+
+void rm(char* file, uint32_t cluster_no)
+// Remove FILE file given CWD cluster_no
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  int entry_index = Get_OPENFILE_Entry(Get_DIR_ENTRY_Offset(file, cluster_no));
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+  {
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", file);
+    return;
+  }
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+  {
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+    return;
+  }
+  else if (entry_index != -1) // check if file is open, if it is, CLOSE IT
+    fat_close(file, cluster_no);
+
+
+  // Traverse FAT and deallocate all CLUSTERS
+  FreeChain(Get_Child_Cluster_No(current));
+
+  // Remove the DIR_ENTRY from the CWD
+  rm_DIR_ENTRY(file, cluster_no);
+}
+
+void rm_many(NAMED_ENTRY* targets, int count, uint32_t cluster_no)
+// rm for every file among targets: one FAT pass frees all their chains and
+// every directory cluster holding one of their entries is written once
+{
+  uint32_t* chains = malloc(count * sizeof(uint32_t));
+  int files = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (targets[i].entry.DIR_Attr & 0x10) // check if file is a dir
+    {
+      Error(STATUS_INVALID, "Error. %s is a Directory.\n", targets[i].name);
+      continue;
+    }
+    RemoveFromList(targets[i].offset); // if open, CLOSE IT
+    chains[files] = Get_Child_Cluster_No(targets[i].entry);
+    NAMED_ENTRY file = targets[i]; // Files to the front, names kept
+    targets[i] = targets[files];
+    targets[files++] = file;
+  }
+
+  FreeChains(chains, files);
+  DeallocateEntries(cluster_no, targets, files);
+  free(chains);
+}
+
+uint32_t CopyFileData(uint32_t first_cluster, uint32_t size, uint32_t goal)
+// The copy's chain is claimed in one go, then data moves image to image one
+// extent at a time (runs contiguous in both chains), bytes as they are
+{
+  PERF_FILE_DATA;
+  off_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t copy = AllocateChain((size + cluster_size - 1) / cluster_size,
+                                goal);
+  if (copy == 0 || copy == -1) // Empty file, or out of space
+    return copy;
+
+  uint32_t from = first_cluster, to = copy;
+  off_t done = 0;
+  while (done < size && from >= 2 && from < 0x0FFFFFF6)
+  {
+    uint32_t from_start = from, to_start = to;
+    off_t length = cluster_size;
+    uint32_t from_next = NextClusterNo(from), to_next = NextClusterNo(to);
+    while (from_next == from + 1 && to_next == to + 1 && done + length < size)
+    {
+      from = from_next;
+      to = to_next;
+      length += cluster_size;
+      from_next = NextClusterNo(from);
+      to_next = NextClusterNo(to);
+    }
+    if (length > size - done)
+      length = size - done;
+
+    off_t target = ClusterNo_To_DataOffset(to_start);
+    off_t n = CopyRange(IMAGE_FD, ClusterNo_To_DataOffset(from_start),
+                        IMAGE_FD, target, length);
+    InvalidateBlockCache(target, length); // Written behind its back
+    done += n;
+    if (n < length)
+      break;
+    from = from_next;
+    to = to_next;
+  }
+
+  if (done != size)
+  {
+    FreeChain(copy);
+    Error(STATUS_IO, "Error. Only %lld of %u bytes could be copied.\n",
+          (long long) done, size);
+    return -1;
+  }
+  return copy;
+}
+
+void cp(char* file, uint32_t cluster_no, char* dir, uint32_t to_cluster_no)
+// Copy file FILENAME to specified directory
+{
+  // Special case
+  if (strcmp(file, ".") == 0 || strcmp(file, "..") == 0)
+  {
+    Error(STATUS_INVALID, ". and .. cannot be copied\n", file);
+    return;
+  }
+
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  DIR_ENTRY destination = Get_DIR_ENTRY(dir, to_cluster_no);
+  uint32_t into = 0; // Directory to copy into, under the file's own name
+  if (strcmp(dir, ".") == 0 || strcmp(dir, "..") == 0)
+  {
+    if ((into = cd(dir, to_cluster_no)) == 0)
+      return;
+  }
+  else if (destination.DIR_Name[0] != 0x00 && (destination.DIR_Attr & 0x10))
+    into = cd(dir, to_cluster_no);
+  int entry_index = Get_OPENFILE_Entry(Get_DIR_ENTRY_Offset(file, cluster_no));
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", file);
+  else if (current.DIR_Attr & 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+  else if (destination.DIR_Name[0] != 0x00 && into == 0)
+  // If destination exists and is a file, NOT a dir
+    Error(STATUS_EXISTS,
+          "Error. Cannot copy to a file that already exists.\n", dir);
+  else // VALID CASE
+  // If destination exists and IS a directory, copy file into it under its
+  // own name. If it does not exist, creat newfile and copy contents to it
+  {
+    if (entry_index != -1) // check if file is open, if it is, CLOSE IT
+    {
+      fat_close(file, cluster_no);
+      fprintf(OUT, "Notice: file [%s] was closed before copying.\n", file);
+    }
+    uint32_t new_cluster_no = (into != 0) ? into : to_cluster_no;
+    char* new_name = (into != 0) ? file : dir;
+
+    if (new_cluster_no != cluster_no) // CWD is locked, lock the target too
+      DirLock(new_cluster_no, DIR_LOCK_WRITE);
+    if (Get_DIR_ENTRY(new_name, new_cluster_no).DIR_Name[0] != 0x00)
+      Error(STATUS_EXISTS, "File %s already exists in dir %s\n", new_name,
+            dir);
+    else if (!ValidName(new_name))
+      Error(STATUS_INVALID, INVALID_NAME);
+    else
+    {
+      // Copy the chain first, then point a new DIR_ENTRY at it (as put()
+      // does), so a failed copy leaves no file behind
+      uint32_t copy = CopyFileData(Get_Child_Cluster_No(current),
+                                   current.DIR_FileSize, new_cluster_no);
+      if (copy != -1)
+      {
+        DIR_ENTRY NewFile = create_newfile(new_name);
+        NewFile.DIR_FileSize = current.DIR_FileSize;
+        NewFile.DIR_FstClusHI = copy >> 16;
+        NewFile.DIR_FstClusLO = copy & 0xFFFF;
+        fat_creat(new_name, new_cluster_no, NewFile);
+        if (COMMAND_STATUS != STATUS_OK && copy != 0) // No room for entry
+          FreeChain(copy);
+      }
+    }
+    if (new_cluster_no != cluster_no)
+      DirUnlock(new_cluster_no);
+  }
+}
+
+//----------------------------EXTRA CREDIT FUNCTION-----------------------------
+
+void fat_rmdir(char* dir, uint32_t cluster_no) // Remove dir DIRNAME from CWD
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(dir, cluster_no);
+  uint32_t first_cluster = Get_Child_Cluster_No(current);
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", dir);
+  else if (current.DIR_Attr != 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is not a Directory.\n", dir);
+  else if (IsDirEmpty(dir, first_cluster) == 1)
+    Error(STATUS_INVALID, "Directory is not empty.\n");
+  else // VALID CASE
+  {
+    // Traverse FAT and deallocate all clusters for child dir
+    uint32_t current_cluster = first_cluster;
+
+    int data_offset = ClusterNo_to_FATOffset(cluster_no);
+
+    while (NextClusterNo(current_cluster) < 0x0FFFFFF6)
+    {
+      int previous_cluster = current_cluster;
+      current_cluster = NextClusterNo(current_cluster);
+      UpdateClusterInFAT(previous_cluster, 0x00000000);
+    }
+    UpdateClusterInFAT(current_cluster, 0x00000000);
+
+    // Then delete the DIRENTRY from the current directory
+    rm_DIR_ENTRY(dir, cluster_no);
+    InvalidateDirIndex(first_cluster);
+  }
+}
+
+//-------------------------------HOST TRANSFER----------------------------------
+
+#define COPY_CHUNK (1 << 20) // Buffer size when the kernel cannot copy
+
+off_t CopyRange(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+                off_t size)
+// Copy size bytes between two positioned fds. copy_file_range() keeps the
+// data in the kernel (and may share extents on reflink filesystems); when
+// it is unsupported for this pair of files, fall back to pread/pwrite.
+// Neither path moves a file position, so IMAGE_FD stays shareable. When
+// IMAGEFILE is not the device (--overlay, --ram) the image side goes
+// through DEVICE, never the kernel copy
+{
+  if (in_fd == IMAGE_FD)
+    PERF_IO(0, size, in_offset);
+  if (out_fd == IMAGE_FD)
+    PERF_IO(1, size, out_offset);
+  int device_in = in_fd == IMAGE_FD && DEVICE != &FILE_DEVICE;
+  int device_out = out_fd == IMAGE_FD && DEVICE != &FILE_DEVICE;
+  off_t copied = 0;
+  while (!device_in && !device_out && copied < size)
+  {
+    ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset,
+                                size - copied, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) // EXDEV, ENOSYS, EINVAL... or end of input
+      break;
+    copied += n;
+  }
+  if (copied == size)
+    return copied;
+
+  char* buffer = malloc(COPY_CHUNK);
+  if (buffer == NULL)
+    return copied;
+  while (copied < size)
+  {
+    size_t chunk = (size - copied < COPY_CHUNK) ? size - copied : COPY_CHUNK;
+    ssize_t got = device_in ? DEVICE->read(buffer, chunk, in_offset)
+                            : pread(in_fd, buffer, chunk, in_offset);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break; // Input ended early
+    ssize_t done = 0;
+    if (device_out)
+      done = (DEVICE->write(buffer, got, out_offset) == 0) ? got : 0;
+    while (done < got)
+    {
+      ssize_t n = pwrite(out_fd, buffer + done, got - done, out_offset + done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    in_offset += done;
+    out_offset += done;
+    copied += done;
+    if (done < got)
+      break; // Output full or failing
+  }
+  free(buffer);
+  return copied;
+}
+
+off_t CopyChain(uint32_t first_cluster, int host_fd, off_t size, int to_image)
+// Walk the chain, merging runs of consecutive clusters into one extent, and
+// hand each extent to CopyRange(). A contiguous file is a single call
+{
+  PERF_FILE_DATA;
+  off_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t cluster = first_cluster;
+  off_t done = 0;
+
+  while (done < size && cluster >= 2 && cluster < 0x0FFFFFF6)
+  {
+    // Extend the extent while the next cluster follows on disk
+    uint32_t start = cluster;
+    off_t length = cluster_size;
+    uint32_t next = NextClusterNo(cluster);
+    while (next == cluster + 1 && done + length < size)
+    {
+      cluster = next;
+      length += cluster_size;
+      next = NextClusterNo(cluster);
+    }
+    if (length > size - done)
+      length = size - done;
+
+    off_t image_offset = ClusterNo_To_DataOffset(start);
+    off_t n;
+    if (to_image)
+    {
+      n = CopyRange(host_fd, done, IMAGE_FD, image_offset, length);
+      InvalidateBlockCache(image_offset, length); // Written behind its back
+    }
+    else
+      n = CopyRange(IMAGE_FD, image_offset, host_fd, done, length);
+
+    done += n;
+    if (n < length)
+      break;
+    cluster = next;
+  }
+  return done;
+}
+
+void put(char* hostpath, char* file, uint32_t cluster_no)
+// Copy host file HOSTPATH into new FILE file in CWD. The chain is sized
+// from fstat and claimed in one go, the data is streamed extent by extent,
+// and the DIR_ENTRY is written last so a failed copy leaves no file behind
+{
+  if (DirAlreadyExists(file, cluster_no) != 0) {
+    Error(STATUS_EXISTS, "Filename already exists.\n");
+    return;
+  }
+  if (!ValidName(file)) {
+    Error(STATUS_INVALID, INVALID_NAME);
+    return;
+  }
+
+  int host_fd = open(hostpath, O_RDONLY);
+  if (host_fd < 0)
+  {
+    Error(STATUS_NOT_FOUND, "Cannot open %s: %s\n", hostpath,
+          strerror(errno));
+    return;
+  }
+  struct stat info;
+  if (fstat(host_fd, &info) != 0 || !S_ISREG(info.st_mode))
+  {
+    Error(STATUS_INVALID, "Error. %s is not a regular file.\n", hostpath);
+    close(host_fd);
+    return;
+  }
+  if (info.st_size > 0xFFFFFFFFLL) // DIR_FileSize is 32 bits
+  {
+    Error(STATUS_INVALID, "Error. %s is larger than 4 GB.\n", hostpath);
+    close(host_fd);
+    return;
+  }
+
+  off_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t clusters = (info.st_size + cluster_size - 1) / cluster_size;
+  uint32_t first_cluster = AllocateChain(clusters, cluster_no);
+  if (first_cluster == -1) // NO MORE MEMORY
+  {
+    close(host_fd);
+    return;
+  }
+
+  off_t copied = CopyChain(first_cluster, host_fd, info.st_size, 1);
+  close(host_fd);
+  if (copied != info.st_size)
+  {
+    Error(STATUS_IO, "Error. Only %lld of %lld bytes of %s could be copied.\n",
+          (long long) copied, (long long) info.st_size, hostpath);
+    FreeChain(first_cluster);
+    return;
+  }
+
+  DIR_ENTRY NewFile = create_newfile(file);
+  NewFile.DIR_FileSize = info.st_size;
+  NewFile.DIR_FstClusHI = first_cluster >> 16;
+  NewFile.DIR_FstClusLO = first_cluster & 0xFFFF;
+  fat_creat(file, cluster_no, NewFile);
+  if (COMMAND_STATUS != STATUS_OK) // No room for the DIR_ENTRY
+  {
+    FreeChain(first_cluster);
+    return;
+  }
+  fprintf(OUT, "%lld bytes written\n", (long long) copied);
+}
+
+void get(char* file, char* hostpath, uint32_t cluster_no)
+// Copy FILE file in CWD out to host file HOSTPATH, created or truncated
+{
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+  {
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", file);
+    return;
+  }
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+  {
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+    return;
+  }
+
+  int host_fd = open(hostpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (host_fd < 0)
+  {
+    Error(STATUS_IO, "Cannot create %s: %s\n", hostpath, strerror(errno));
+    return;
+  }
+
+  // Size the host file first so the filesystem can lay it out in one go
+  off_t size = current.DIR_FileSize;
+  if (size > 0)
+    posix_fallocate(host_fd, 0, size);
+
+  off_t copied = CopyChain(Get_Child_Cluster_No(current), host_fd, size, 0);
+  int failed = (copied != size || ftruncate(host_fd, copied) != 0);
+  if (close(host_fd) != 0)
+    failed = 1;
+  if (failed)
+  {
+    Error(STATUS_IO, "Error. Only %lld of %lld bytes of %s could be copied.\n",
+          (long long) copied, (long long) size, file);
+    return;
+  }
+  fprintf(OUT, "%lld bytes read\n", (long long) copied);
+}
+
+//--------------------------------BULK IMPORT-----------------------------------
+
+IMPORT_NODE* ScanHostTree(const char* path, const char* name, int* files,
+                          int* dirs)
+// Pre-pass over the host tree: names, types and sizes only, no data read.
+// Entries that cannot be represented (invalid names, anything but regular
+// files and directories) are reported and left out
+{
+  struct stat info;
+  if (stat(path, &info) != 0)
+  {
+    Error(STATUS_NOT_FOUND, "Cannot open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (!S_ISREG(info.st_mode) && !S_ISDIR(info.st_mode))
+  {
+    Error(STATUS_INVALID, "Skipping %s: not a regular file.\n", path);
+    return NULL;
+  }
+  if (S_ISREG(info.st_mode) && info.st_size > 0xFFFFFFFFLL)
+  {
+    Error(STATUS_INVALID, "Skipping %s: larger than 4 GB.\n", path);
+    return NULL;
+  }
+
+  IMPORT_NODE* node = calloc(1, sizeof(IMPORT_NODE));
+  node->name = strdup(name);
+  node->path = strdup(path);
+  node->is_dir = S_ISDIR(info.st_mode);
+  node->size = node->is_dir ? 0 : info.st_size;
+
+  if (!node->is_dir)
+  {
+    (*files)++;
+    return node;
+  }
+  (*dirs)++;
+
+  DIR* host_dir = opendir(path);
+  if (host_dir == NULL)
+  {
+    Error(STATUS_IO, "Cannot read %s: %s\n", path, strerror(errno));
+    return node; // Imported as an empty directory
+  }
+
+  IMPORT_NODE** tail = &node->child;
+  struct dirent* host_entry;
+  while ((host_entry = readdir(host_dir)) != NULL)
+  {
+    if (strcmp(host_entry->d_name, ".") == 0 ||
+        strcmp(host_entry->d_name, "..") == 0)
+      continue;
+
+    size_t length = strlen(path) + strlen(host_entry->d_name) + 2;
+    char* child_path = malloc(length);
+    snprintf(child_path, length, "%s/%s", path, host_entry->d_name);
+
+    if (!ValidName(host_entry->d_name))
+      Error(STATUS_INVALID, "Skipping %s: invalid name.\n", child_path);
+    else
+    {
+      IMPORT_NODE* child = ScanHostTree(child_path, host_entry->d_name,
+                                        files, dirs);
+      if (child != NULL)
+      {
+        *tail = child;
+        tail = &child->next;
+        node->count++;
+      }
+    }
+    free(child_path);
+  }
+  closedir(host_dir);
+  return node;
+}
+
+void FreeImportTree(IMPORT_NODE* node)
+{
+  while (node != NULL)
+  {
+    IMPORT_NODE* next = node->next;
+    FreeImportTree(node->child);
+    free(node->name);
+    free(node->path);
+    free(node);
+    node = next;
+  }
+}
+
+int AssignShortNames(IMPORT_NODE* dir)
+// Aliases are unique among the children being imported together, which is
+// all a new directory will hold. A name already used in another case is
+// skipped, as the directory could not tell the two apart
+{
+  DIR_INDEX siblings;
+  memset(&siblings, 0, sizeof(siblings));
+  int entries = 0;
+
+  for (IMPORT_NODE* child = dir->child; child != NULL; child = child->next)
+  {
+    if (IndexFind(&siblings, child->name) != NULL)
+    {
+      Error(STATUS_EXISTS, "Skipping %s: %s already exists.\n", child->path,
+            child->name);
+      child->failed = 1;
+      continue;
+    }
+    int needs_long = MakeShortName(child->name, child->short_name,
+                                   ImportNameTaken, &siblings);
+    if (needs_long < 0)
+    {
+      Error(STATUS_NO_SPACE, "Skipping %s: no free short name left.\n",
+            child->path);
+      child->failed = 1;
+      continue;
+    }
+    LDIR_ENTRY long_entries[LFN_SLOTS_MAX];
+    child->long_slots = needs_long ? MakeLongEntries(child->name,
+                                       child->short_name, long_entries) : 0;
+    entries += child->long_slots + 1;
+
+    NAMED_ENTRY named;
+    memset(&named, 0, sizeof(named));
+    memcpy(named.entry.DIR_Name, child->short_name, 11);
+    named.name = strdup(child->name);
+    IndexAdd(&siblings, &named);
+  }
+
+  for (int i = 0; i < siblings.count; i++)
+    free(siblings.entries[i].name);
+  free(siblings.entries);
+  free(siblings.table);
+  return entries;
+}
+
+int ImportNameTaken(const char* name, void* index)
+{
+  return IndexFind(index, name) != NULL;
+}
+
+uint32_t DirClusters(uint32_t entries)
+{
+  // . and .. then the children's LDIR_ENTRYs and DIR_ENTRYs, as
+  // AssignShortNames() counted them
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t bytes = (2 + entries) * sizeof(DIR_ENTRY);
+  return (bytes + cluster_size - 1) / cluster_size;
+}
+
+void QueueImportJob(IMPORT_STATE* state, IMPORT_NODE* file)
+{
+  // Spread jobs round-robin; stealing evens out files of unequal size
+  IMPORT_QUEUE* queue = &state->queues[state->next_queue];
+  state->next_queue = (state->next_queue + 1) % state->workers;
+
+  pthread_mutex_lock(&queue->lock);
+  queue->jobs[queue->tail++] = file;
+  pthread_mutex_unlock(&queue->lock);
+
+  pthread_mutex_lock(&state->lock);
+  state->available++;
+  pthread_cond_signal(&state->ready);
+  pthread_mutex_unlock(&state->lock);
+}
+
+IMPORT_NODE* TakeImportJob(IMPORT_STATE* state, int self)
+{
+  IMPORT_NODE* job = NULL;
+
+  // Own queue first, newest job (its chain was allocated last)
+  IMPORT_QUEUE* queue = &state->queues[self];
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail > queue->head)
+    job = queue->jobs[--queue->tail];
+  pthread_mutex_unlock(&queue->lock);
+
+  // Otherwise steal the oldest job of another worker
+  for (int i = 1; job == NULL && i < state->workers; i++)
+  {
+    queue = &state->queues[(self + i) % state->workers];
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head)
+      job = queue->jobs[queue->head++];
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  if (job != NULL)
+  {
+    pthread_mutex_lock(&state->lock);
+    state->available--;
+    pthread_mutex_unlock(&state->lock);
+  }
+  return job;
+}
+
+typedef struct{
+
+  IMPORT_STATE* state;
+  int self; // index of this worker's queue
+} IMPORT_WORKER_ARG;
+
+void* ImportWorker(void* arg)
+{
+  IMPORT_WORKER_ARG* worker = arg;
+  IMPORT_STATE* state = worker->state;
+
+  while (1)
+  {
+    IMPORT_NODE* file = TakeImportJob(state, worker->self);
+    if (file != NULL)
+    {
+      // The chain was preallocated, so this is pure data movement
+      int host_fd = open(file->path, O_RDONLY);
+      if (host_fd < 0 ||
+          CopyChain(file->first_cluster, host_fd, file->size, 1) != file->size)
+        file->copy_failed = 1; // Removed by import() once workers are done
+      if (host_fd >= 0)
+        close(host_fd);
+      continue;
+    }
+
+    // Nothing to take: wait for the metadata stage, or stop once it is done
+    pthread_mutex_lock(&state->lock);
+    while (state->available == 0 && state->producing)
+      pthread_cond_wait(&state->ready, &state->lock);
+    int finished = (state->available == 0 && !state->producing);
+    pthread_mutex_unlock(&state->lock);
+    if (finished)
+      return NULL;
+  }
+}
+
+void ImportEntries(IMPORT_NODE* dir, uint32_t cluster_no,
+                   uint32_t parent_cluster, IMPORT_STATE* state, int existing)
+// Serialized metadata stage for one directory: preallocate every child's
+// chain (in order, so siblings land next to each other), queue file data
+// for the workers, then write the directory entries. A new directory's
+// table is composed in memory and written whole; an existing one gets
+// its entries through fat_creat()
+{
+  for (IMPORT_NODE* child = dir->child; child != NULL; child = child->next)
+  {
+    if (child->failed) // Name clash found by AssignShortNames()
+      continue;
+    if (existing && DirAlreadyExists(child->name, cluster_no) != 0)
+    {
+      Error(STATUS_EXISTS, "Skipping %s: %s already exists.\n", child->path,
+            child->name);
+      child->failed = 1;
+      continue;
+    }
+
+    uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+    child->clusters = child->is_dir ? DirClusters(AssignShortNames(child))
+                    : (child->size + cluster_size - 1) / cluster_size;
+    child->first_cluster = AllocateChain(child->clusters, child->is_dir ?
+                                         DirectoryGoal(cluster_no) :
+                                         cluster_no);
+    if (child->first_cluster == -1) // NO MORE MEMORY
+    {
+      child->first_cluster = 0;
+      child->failed = 1;
+      continue;
+    }
+    if (!child->is_dir && child->clusters > 0)
+      QueueImportJob(state, child);
+
+    if (existing)
+    {
+      DIR_ENTRY entry = create_newfile(child->name);
+      entry.DIR_Attr = child->is_dir ? 0x10 : 0x20;
+      entry.DIR_FileSize = child->size;
+      entry.DIR_FstClusHI = child->first_cluster >> 16;
+      entry.DIR_FstClusLO = child->first_cluster & 0xFFFF;
+      fat_creat(child->name, cluster_no, entry);
+    }
+  }
+
+  if (!existing) // Compose the whole directory table of this new directory
+  {
+    uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+    int table_size = dir->clusters * cluster_size;
+    char* table = calloc(1, table_size);
+    SizeIndexDirectory(cluster_no, parent_cluster, dir->clusters);
+
+    DIR_ENTRY OneDot = UpdateTwoDotDirectory(create_newfile("."),
+                                             cluster_no);
+    DIR_ENTRY TwoDots = create_newfile("..");
+    OneDot.DIR_Attr = TwoDots.DIR_Attr = 0x10;
+    if (parent_cluster != BOOT.BPB_RootClus) // Same as fat_mkdir()
+      TwoDots = UpdateTwoDotDirectory(TwoDots, parent_cluster);
+    memcpy(&table[0], &OneDot, sizeof(OneDot));
+    memcpy(&table[sizeof(OneDot)], &TwoDots, sizeof(TwoDots));
+
+    int offset = sizeof(OneDot) + sizeof(TwoDots);
+    for (IMPORT_NODE* child = dir->child; child != NULL; child = child->next)
+    {
+      if (child->failed)
+        continue;
+
+      DIR_ENTRY entry = create_newfile(".");
+      memcpy(entry.DIR_Name, child->short_name, 11);
+      entry.DIR_Attr = child->is_dir ? 0x10 : 0x20;
+      entry.DIR_FileSize = child->size;
+      entry.DIR_FstClusHI = child->first_cluster >> 16;
+      entry.DIR_FstClusLO = child->first_cluster & 0xFFFF;
+
+      // Name slots were counted into dir->clusters by AssignShortNames()
+      LDIR_ENTRY long_entries[LFN_SLOTS_MAX];
+      if (child->long_slots > 0)
+        MakeLongEntries(child->name, child->short_name, long_entries);
+      memcpy(&table[offset], long_entries,
+             child->long_slots * sizeof(LDIR_ENTRY));
+      offset += child->long_slots * sizeof(LDIR_ENTRY);
+      memcpy(&table[offset], &entry, sizeof(entry));
+      offset += sizeof(entry);
+      SizeIndexEntry(cluster_no, &entry, 1);
+    }
+
+    WriteFileData(cluster_no, 0, table, table_size);
+    free(table);
+    InvalidateDirIndex(cluster_no); // Cluster may have held a directory
+  }
+
+  // Then descend, each subdirectory's chain already known to its parent
+  for (IMPORT_NODE* child = dir->child; child != NULL; child = child->next)
+    if (child->is_dir && !child->failed)
+      ImportEntries(child, child->first_cluster, cluster_no, state, 0);
+}
+
+void ReportImport(IMPORT_NODE* dir, uint32_t cluster_no, int* files,
+                  int* dirs, off_t* bytes)
+// A file whose copy failed already has its entry, with the full size, over
+// a chain of stale clusters. The entry goes first, then the chain, so a
+// crash in between only leaks clusters
+{
+  for (IMPORT_NODE* child = dir->child; child != NULL; child = child->next)
+  {
+    if (child->copy_failed)
+    {
+      Error(STATUS_IO, "Error. Could not copy %s, not imported.\n",
+            child->path);
+      DirLock(cluster_no, DIR_LOCK_WRITE);
+      rm_DIR_ENTRY(child->name, cluster_no);
+      FreeChain(child->first_cluster);
+      DirUnlock(cluster_no);
+    }
+    if (child->failed || child->copy_failed)
+      continue;
+    if (child->is_dir)
+    {
+      (*dirs)++;
+      ReportImport(child, child->first_cluster, files, dirs, bytes);
+    }
+    else
+    {
+      (*files)++;
+      *bytes += child->size;
+    }
+  }
+}
+
+void import(char* hostdir, char* dir, uint32_t cluster_no)
+// Import the contents of host directory HOSTDIR into DIR (default CWD)
+{
+  // Resolve the target directory
+  uint32_t target = (dir == NULL) ? cluster_no : cd(dir, cluster_no);
+  if (target == 0) // Error already printed
+    return;
+
+  // PRE-PASS -- names and sizes of the whole host tree
+  int files = 0, dirs = 0;
+  IMPORT_NODE* root = ScanHostTree(hostdir, "", &files, &dirs);
+  if (root == NULL)
+    return;
+  if (!root->is_dir)
+  {
+    Error(STATUS_INVALID, "Error. %s is not a Directory.\n", hostdir);
+    FreeImportTree(root);
+    return;
+  }
+
+  // COPY WORKERS -- I/O bound, so more workers than CPUs
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  IMPORT_STATE state;
+  state.workers = (cpus < 1) ? 2 : (cpus * 2 > 16) ? 16 : cpus * 2;
+  state.next_queue = 0;
+  state.available = 0;
+  state.producing = 1;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.ready, NULL);
+  state.queues = calloc(state.workers, sizeof(IMPORT_QUEUE));
+  for (int i = 0; i < state.workers; i++)
+  {
+    state.queues[i].jobs = malloc((files + 1) * sizeof(IMPORT_NODE*));
+    pthread_mutex_init(&state.queues[i].lock, NULL);
+  }
+
+  pthread_t threads[state.workers];
+  IMPORT_WORKER_ARG args[state.workers];
+  for (int i = 0; i < state.workers; i++)
+  {
+    args[i].state = &state;
+    args[i].self = i;
+    pthread_create(&threads[i], NULL, ImportWorker, &args[i]);
+  }
+
+  // METADATA STAGE -- runs here, alone, while the workers copy data
+  DirLock(target, DIR_LOCK_WRITE); // CWD is locked, lock target too
+  ImportEntries(root, target, 0, &state, 1);
+  DirUnlock(target);
+
+  pthread_mutex_lock(&state.lock);
+  state.producing = 0;
+  pthread_cond_broadcast(&state.ready);
+  pthread_mutex_unlock(&state.lock);
+  for (int i = 0; i < state.workers; i++)
+    pthread_join(threads[i], NULL);
+
+  // REPORT -- failed copies removed, then totals
+  int imported_files = 0, imported_dirs = 0;
+  off_t bytes = 0;
+  ReportImport(root, target, &imported_files, &imported_dirs, &bytes);
+  fprintf(OUT, "Imported %i files (%lld bytes) and %i directories with "
+          "%i workers.\n", imported_files, (long long) bytes, imported_dirs,
+          state.workers);
+
+  for (int i = 0; i < state.workers; i++)
+  {
+    free(state.queues[i].jobs);
+    pthread_mutex_destroy(&state.queues[i].lock);
+  }
+  free(state.queues);
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.ready);
+  FreeImportTree(root);
+}
+
+//---------------------------------TAR EXPORT-----------------------------------
+
+char* TarSpace(TAR_STREAM* tar, int* room)
+{
+  pthread_mutex_lock(&tar->lock);
+  while (tar->produced - tar->consumed == TAR_SLOTS && !tar->failed)
+    pthread_cond_wait(&tar->changed, &tar->lock); // Writer is behind
+  pthread_mutex_unlock(&tar->lock);
+
+  *room = TAR_SLOT_SIZE - tar->fill;
+  return &tar->slots[tar->produced % TAR_SLOTS][tar->fill];
+}
+
+void TarCommit(TAR_STREAM* tar, int size)
+{
+  tar->fill += size;
+  if (tar->fill < TAR_SLOT_SIZE)
+    return;
+
+  pthread_mutex_lock(&tar->lock);
+  tar->length[tar->produced % TAR_SLOTS] = tar->fill;
+  tar->produced++;
+  pthread_cond_broadcast(&tar->changed);
+  pthread_mutex_unlock(&tar->lock);
+  tar->fill = 0;
+}
+
+void TarEmit(TAR_STREAM* tar, const void* data, int size)
+{
+  const char* src = data;
+  while (size > 0 && !tar->failed)
+  {
+    int room;
+    char* space = TarSpace(tar, &room);
+    int n = (size < room) ? size : room;
+    memcpy(space, src, n);
+    TarCommit(tar, n);
+    src += n;
+    size -= n;
+  }
+}
+
+const char* UstarSplit(const char* path)
+// ustar splits long paths at a '/' into prefix (155) and name (100)
+{
+  size_t length = strlen(path);
+  if (length <= 100)
+    return path;
+  const char* split = strchr(path + length - 101, '/');
+  if (split == NULL || split - path > 155)
+    return NULL;
+  return split;
+}
+
+void TarBlock(TAR_STREAM* tar, const char* path, char type, int mode,
+              long long size, long long mtime)
+// A path ustar cannot hold is cut to its first 100 bytes; the caller has
+// sent the whole path in a pax header first
+{
+  char header[512];
+  memset(header, 0, sizeof(header));
+
+  const char* split = UstarSplit(path);
+  if (split == path)
+    memcpy(&header[0], path, strlen(path));
+  else if (split != NULL)
+  {
+    memcpy(&header[0], split + 1, strlen(split + 1));
+    memcpy(&header[345], path, split - path);
+  }
+  else
+    memcpy(&header[0], path, 100);
+
+  sprintf(&header[100], "%07o", mode);
+  sprintf(&header[108], "%07o", 0); // uid
+  sprintf(&header[116], "%07o", 0); // gid
+  sprintf(&header[124], "%011llo", size);
+  sprintf(&header[136], "%011llo", mtime);
+  header[156] = type; // typeflag
+  memcpy(&header[257], "ustar", 6); // magic, with its terminator
+  memcpy(&header[263], "00", 2); // version
+
+  // Checksum: byte sum with the checksum field counted as spaces
+  memset(&header[148], ' ', 8);
+  unsigned int checksum = 0;
+  for (int i = 0; i < 512; i++)
+    checksum += (unsigned char) header[i];
+  sprintf(&header[148], "%06o", checksum);
+  header[155] = ' ';
+
+  TarEmit(tar, header, sizeof(header));
+}
+
+void TarHeader(TAR_STREAM* tar, const char* path, DIR_ENTRY* entry)
+{
+  int is_dir = (entry->DIR_Attr & 0x10) != 0;
+  long long mtime = 0;
+  if (entry->DIR_WrtDate != 0) // FAT date and time to seconds since 1970
+  {
+    struct tm when;
+    memset(&when, 0, sizeof(when));
+    when.tm_year = 80 + (entry->DIR_WrtDate >> 9);
+    when.tm_mon = ((entry->DIR_WrtDate >> 5) & 0xF) - 1;
+    when.tm_mday = entry->DIR_WrtDate & 0x1F;
+    when.tm_hour = entry->DIR_WrtTime >> 11;
+    when.tm_min = (entry->DIR_WrtTime >> 5) & 0x3F;
+    when.tm_sec = (entry->DIR_WrtTime & 0x1F) * 2;
+    mtime = timegm(&when);
+  }
+
+  // Too long for ustar: a pax extended header (POSIX.1-2001) holds the
+  // whole path as a "LENGTH path=PATH\n" record, LENGTH counting itself
+  if (UstarSplit(path) == NULL)
+  {
+    int body = strlen(path) + 7; // " path=" and "\n"
+    int length = body + 1;
+    while (length != body + snprintf(NULL, 0, "%d", length))
+      length = body + snprintf(NULL, 0, "%d", length);
+    char* record = malloc(length + 1);
+    sprintf(record, "%d path=%s\n", length, path);
+
+    static const char zeros[512];
+    TarBlock(tar, "././@PaxHeader", 'x', 0644, length, mtime);
+    TarEmit(tar, record, length);
+    if (length % 512 != 0)
+      TarEmit(tar, zeros, 512 - length % 512);
+    free(record);
+  }
+
+  TarBlock(tar, path, is_dir ? '5' : '0', is_dir ? 0755 : 0644,
+           is_dir ? 0 : entry->DIR_FileSize, mtime);
+}
+
+void TarFile(TAR_STREAM* tar, DIR_ENTRY* entry)
+{
+  PERF_FILE_DATA;
+  off_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t cluster = ((uint32_t) entry->DIR_FstClusHI << 16) |
+                     entry->DIR_FstClusLO;
+  off_t remaining = entry->DIR_FileSize;
+
+  while (remaining > 0 && cluster >= 2 && cluster < 0x0FFFFFF6 &&
+         !tar->failed)
+  {
+    // Merge the run of consecutive clusters starting here into one extent
+    uint32_t start = cluster;
+    off_t length = cluster_size;
+    uint32_t next = NextClusterNo(cluster);
+    while (next == cluster + 1 && length < remaining)
+    {
+      cluster = next;
+      length += cluster_size;
+      next = NextClusterNo(cluster);
+    }
+    if (length > remaining)
+      length = remaining;
+
+    // Read the extent straight into the output slots
+    off_t offset = ClusterNo_To_DataOffset(start);
+    while (length > 0 && !tar->failed)
+    {
+      int room;
+      char* space = TarSpace(tar, &room);
+      int n = (length < room) ? length : room;
+      if (DeviceRead(space, n, offset) != 0)
+        memset(space, 0, n); // Keep the archive well formed
+      TarCommit(tar, n);
+      offset += n;
+      length -= n;
+      remaining -= n;
+    }
+    cluster = next;
+  }
+
+  // A chain shorter than DIR_FileSize still gets a full-size member
+  static const char zeros[512];
+  while (remaining > 0 && !tar->failed)
+  {
+    int n = (remaining < 512) ? remaining : 512;
+    TarEmit(tar, zeros, n);
+    remaining -= n;
+  }
+  if (entry->DIR_FileSize % 512 != 0)
+    TarEmit(tar, zeros, 512 - entry->DIR_FileSize % 512);
+}
+
+int CompareFirstCluster(const void* a, const void* b)
+{
+  const DIR_ENTRY* x = &((const NAMED_ENTRY*) a)->entry;
+  const DIR_ENTRY* y = &((const NAMED_ENTRY*) b)->entry;
+  uint32_t cx = ((uint32_t) x->DIR_FstClusHI << 16) | x->DIR_FstClusLO;
+  uint32_t cy = ((uint32_t) y->DIR_FstClusHI << 16) | y->DIR_FstClusLO;
+  return (cx > cy) - (cx < cy);
+}
+
+void TarDirectory(TAR_STREAM* tar, uint32_t cluster_no, char* path)
+{
+  DirLock(cluster_no, DIR_LOCK_READ);
+  NAMED_ENTRY* entries;
+  int count = ReadDirectory(cluster_no, &entries);
+  DirUnlock(cluster_no);
+
+  // Visit entries by first cluster, so reads sweep the image forward
+  qsort(entries, count, sizeof(NAMED_ENTRY), CompareFirstCluster);
+
+  size_t path_length = strlen(path);
+  for (int i = 0; i < count && !tar->failed; i++)
+  {
+    DIR_ENTRY* entry = &entries[i].entry;
+    int is_dir = (entry->DIR_Attr & 0x10) != 0;
+    if (path_length + strlen(entries[i].name) + 2 > TAR_PATH_MAX)
+    {
+      // Reported by export_tar() after the archive, which may be OUT
+      char* skipped = malloc(path_length + strlen(entries[i].name) + 1);
+      sprintf(skipped, "%s%s", path, entries[i].name);
+      tar->skipped = realloc(tar->skipped,
+                             (tar->skipped_count + 1) * sizeof(char*));
+      tar->skipped[tar->skipped_count++] = skipped;
+      continue;
+    }
+    sprintf(&path[path_length], "%s%s", entries[i].name, is_dir ? "/" : "");
+    TarHeader(tar, path, entry);
+
+    uint32_t child = ((uint32_t) entry->DIR_FstClusHI << 16) |
+                     entry->DIR_FstClusLO;
+    if (is_dir)
+    {
+      tar->dirs++;
+      if (child >= 2 && child != cluster_no)
+        TarDirectory(tar, child, path);
+    }
+    else
+    {
+      tar->files++;
+      TarFile(tar, entry);
+    }
+  }
+  path[path_length] = '\0';
+  FreeDirectory(entries, count);
+}
+
+void* TarReader(void* arg)
+{
+  TAR_STREAM* tar = arg;
+  char path[TAR_PATH_MAX + 1];
+  path[0] = '\0';
+  TarDirectory(tar, tar->root, path);
+
+  // End of archive: two zero blocks, then flush the partial slot
+  static const char zeros[1024];
+  TarEmit(tar, zeros, sizeof(zeros));
+
+  pthread_mutex_lock(&tar->lock);
+  if (tar->fill > 0)
+  {
+    tar->length[tar->produced % TAR_SLOTS] = tar->fill;
+    tar->produced++;
+  }
+  tar->done = 1;
+  pthread_cond_broadcast(&tar->changed);
+  pthread_mutex_unlock(&tar->lock);
+  return NULL;
+}
+
+void export_tar(char* dir, char* hostpath, uint32_t cluster_no)
+// Write DIR (default CWD) as a ustar stream to HOSTPATH, or to the
+// command output when no HOSTPATH is given
+{
+  // Resolve the directory to export
+  uint32_t root = (dir == NULL) ? cluster_no : cd(dir, cluster_no);
+  if (root == 0) // Error already printed
+    return;
+
+  FILE* output = OUT;
+  if (hostpath != NULL)
+  {
+    output = fopen(hostpath, "w");
+    if (output == NULL)
+    {
+      Error(STATUS_IO, "Cannot create %s: %s\n", hostpath, strerror(errno));
+      return;
+    }
+  }
+
+  TAR_STREAM tar;
+  memset(&tar, 0, sizeof(tar));
+  tar.root = root;
+  pthread_mutex_init(&tar.lock, NULL);
+  pthread_cond_init(&tar.changed, NULL);
+  for (int i = 0; i < TAR_SLOTS; i++)
+    tar.slots[i] = malloc(TAR_SLOT_SIZE);
+
+  // The reader walks chains and reads extents while this thread writes
+  pthread_t reader;
+  pthread_create(&reader, NULL, TarReader, &tar);
+
+  while (1)
+  {
+    pthread_mutex_lock(&tar.lock);
+    while (tar.consumed == tar.produced && !tar.done)
+      pthread_cond_wait(&tar.changed, &tar.lock);
+    int finished = (tar.consumed == tar.produced && tar.done);
+    pthread_mutex_unlock(&tar.lock);
+    if (finished)
+      break;
+
+    int slot = tar.consumed % TAR_SLOTS;
+    if (!tar.failed &&
+        fwrite(tar.slots[slot], 1, tar.length[slot], output) !=
+        (size_t) tar.length[slot])
+      tar.failed = 1; // Reader stops at its next slot; drain what is left
+
+    pthread_mutex_lock(&tar.lock);
+    tar.consumed++;
+    pthread_cond_broadcast(&tar.changed);
+    pthread_mutex_unlock(&tar.lock);
+  }
+  pthread_join(reader, NULL);
+
+  if (fflush(output) != 0)
+    tar.failed = 1;
+  if (hostpath != NULL)
+  {
+    if (fclose(output) != 0)
+      tar.failed = 1;
+    if (!tar.failed)
+      fprintf(OUT, "Exported %i files and %i directories to %s\n",
+              tar.files, tar.dirs, hostpath);
+  }
+  if (tar.failed)
+    Error(STATUS_IO, "Error. Could not write the archive.\n");
+  for (int i = 0; i < tar.skipped_count; i++)
+  {
+    Error(STATUS_INVALID, "Error. %s is nested too deep to export, "
+          "skipped.\n", tar.skipped[i]);
+    free(tar.skipped[i]);
+  }
+  free(tar.skipped);
+
+  for (int i = 0; i < TAR_SLOTS; i++)
+    free(tar.slots[i]);
+  pthread_mutex_destroy(&tar.lock);
+  pthread_cond_destroy(&tar.changed);
+}
+
+//---------------------------------TREE WALK------------------------------------
+
+int WalkTree(uint32_t cluster_no, WALK_VISIT visit, void* arg)
+// Breadth of real trees grows fast, so one worker per CPU soon has a
+// directory each. Directories come off the stack newest first, which keeps
+// the stack short and the workers close to what they just read
+{
+  WALK_STATE state;
+  state.pending = malloc(sizeof(WALK_DIR));
+  state.pending->cluster_no = cluster_no;
+  state.pending->path = strdup("");
+  state.pending->next = NULL;
+  state.busy = 0;
+  state.visit = visit;
+  state.arg = arg;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.ready, NULL);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = (cpus < 1) ? 1 : (cpus > WALK_WORKERS_MAX) ? WALK_WORKERS_MAX
+                                                           : cpus;
+  pthread_t threads[WALK_WORKERS_MAX];
+  WALK_WORKER_ARG worker_args[WALK_WORKERS_MAX];
+  for (int i = 0; i < workers; i++)
+  {
+    worker_args[i].state = &state;
+    worker_args[i].self = i;
+    pthread_create(&threads[i], NULL, WalkWorker, &worker_args[i]);
+  }
+  for (int i = 0; i < workers; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.ready);
+  return workers;
+}
+
+void* WalkWorker(void* arg)
+{
+  WALK_WORKER_ARG* worker = arg;
+  WALK_STATE* state = worker->state;
+  char path[WALK_PATH_MAX + 1];
+
+  pthread_mutex_lock(&state->lock);
+  while (1)
+  {
+    // Wait for a directory, or stop once none is left and no worker can
+    // push another
+    while (state->pending == NULL && state->busy > 0)
+      pthread_cond_wait(&state->ready, &state->lock);
+    if (state->pending == NULL)
+    {
+      pthread_cond_broadcast(&state->ready);
+      pthread_mutex_unlock(&state->lock);
+      return NULL;
+    }
+    WALK_DIR* dir = state->pending;
+    state->pending = dir->next;
+    state->busy++;
+    pthread_mutex_unlock(&state->lock);
+
+    DirLock(dir->cluster_no, DIR_LOCK_READ);
+    NAMED_ENTRY* entries;
+    int count = ReadDirectory(dir->cluster_no, &entries);
+    DirUnlock(dir->cluster_no);
+
+    // Visit the entries, collecting subdirectories to push in one go
+    WALK_DIR* found = NULL;
+    WALK_DIR** last = &found;
+    size_t path_length = strlen(dir->path);
+    for (int i = 0; i < count; i++)
+    {
+      if (path_length + strlen(entries[i].name) + 2 > WALK_PATH_MAX)
+        continue; // Too deep, or a loop in a damaged image
+      sprintf(path, "%s%s%s", dir->path, (path_length > 0) ? "/" : "",
+              entries[i].name);
+      state->visit(path, &entries[i], dir->cluster_no, worker->self,
+                   state->arg);
+
+      DIR_ENTRY* entry = &entries[i].entry;
+      uint32_t child = ((uint32_t) entry->DIR_FstClusHI << 16) |
+                       entry->DIR_FstClusLO;
+      if ((entry->DIR_Attr & 0x10) && child >= 2 && child != dir->cluster_no &&
+          child != FIRST_CLUSTER)
+      {
+        WALK_DIR* next = malloc(sizeof(WALK_DIR));
+        next->cluster_no = child;
+        next->path = strdup(path);
+        next->next = NULL;
+        *last = next;
+        last = &next->next;
+      }
+    }
+    FreeDirectory(entries, count);
+    free(dir->path);
+    free(dir);
+
+    pthread_mutex_lock(&state->lock);
+    if (found != NULL)
+    {
+      *last = state->pending;
+      state->pending = found;
+      pthread_cond_broadcast(&state->ready);
+    }
+    state->busy--;
+  }
+}
+
+// FIND -- matches are kept per worker, then sorted so output is stable
+typedef struct{
+
+  char* pattern;
+  char** paths[WALK_WORKERS_MAX];
+  int count[WALK_WORKERS_MAX], capacity[WALK_WORKERS_MAX];
+} FIND_STATE;
+
+void FindVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+               int worker, void* arg)
+{
+  FIND_STATE* state = arg;
+  if (fnmatch(state->pattern, entry->name, FNM_CASEFOLD) != 0)
+    return; // Names ignore case, so patterns do too
+
+  if (state->count[worker] == state->capacity[worker])
+  {
+    state->capacity[worker] = (state->capacity[worker] == 0) ? 64 :
+                              state->capacity[worker] * 2;
+    state->paths[worker] = realloc(state->paths[worker],
+                                   state->capacity[worker] * sizeof(char*));
+  }
+  state->paths[worker][state->count[worker]++] = strdup(path);
+}
+
+int ComparePaths(const void* a, const void* b)
+{
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+void find(char* dir, char* pattern, uint32_t cluster_no)
+// Print the path, relative to DIR, of every entry below it whose name
+// matches the shell pattern
+{
+  uint32_t root = (dir == NULL) ? cluster_no : cd(dir, cluster_no);
+  if (root == 0) // Error already printed
+    return;
+
+  FIND_STATE state;
+  memset(&state, 0, sizeof(state));
+  state.pattern = pattern;
+  int workers = WalkTree(root, FindVisit, &state);
+
+  int total = 0;
+  for (int i = 0; i < workers; i++)
+    total += state.count[i];
+  char** paths = malloc((total + 1) * sizeof(char*));
+  for (int i = 0, n = 0; i < workers; n += state.count[i], i++)
+  {
+    if (state.count[i] > 0)
+      memcpy(&paths[n], state.paths[i], state.count[i] * sizeof(char*));
+    free(state.paths[i]);
+  }
+  qsort(paths, total, sizeof(char*), ComparePaths);
+
+  for (int i = 0; i < total; i++)
+  {
+    fputs(paths[i], OUT); // OUT is buffered, so this is a few writes
+    fputc('\n', OUT);
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+// DU -- totals per worker, padded so workers do not share a cache line
+typedef struct{
+
+  _Alignas(64) unsigned long long bytes; // sum of file sizes
+  unsigned long long clusters; // allocated to files and directories
+  long files, dirs;
+} DU_TOTALS;
+
+void DuVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir, int worker,
+             void* arg)
+{
+  DU_TOTALS* totals = &((DU_TOTALS*) arg)[worker];
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+
+  if (entry->entry.DIR_Attr & 0x10) // A directory's chain, from the FAT
+  {
+    totals->dirs++;
+    uint32_t cluster = ((uint32_t) entry->entry.DIR_FstClusHI << 16) |
+                       entry->entry.DIR_FstClusLO;
+    for (uint32_t n = 0; cluster >= 2 && cluster < 0x0FFFFFF6 &&
+         n < ClusterLimit(); n++, cluster = NextClusterNo(cluster))
+      totals->clusters++;
+  }
+  else // A file's chain holds its size, rounded up to whole clusters
+  {
+    totals->files++;
+    totals->bytes += entry->entry.DIR_FileSize;
+    totals->clusters += (entry->entry.DIR_FileSize + cluster_size - 1) /
+                        cluster_size;
+  }
+}
+
+void du(char* dir, uint32_t cluster_no)
+// Bytes in files and clusters in use below DIR, not counting DIR's own
+// directory table
+{
+  uint32_t root = (dir == NULL) ? cluster_no : cd(dir, cluster_no);
+  if (root == 0) // Error already printed
+    return;
+
+  DU_TOTALS totals[WALK_WORKERS_MAX];
+  memset(totals, 0, sizeof(totals));
+  int workers = 1;
+  SUBTREE_SIZE* known = NULL;
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  if (SIZE_INDEX != NULL && (known = SizeIndexSlot(root, 0)) != NULL)
+  {
+    totals[0].bytes = known->bytes; // Kept up to date, no walk needed
+    totals[0].clusters = known->clusters;
+    totals[0].files = known->files;
+    totals[0].dirs = known->dirs;
+  }
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
+  if (known == NULL)
+    workers = WalkTree(root, DuVisit, totals);
+
+  for (int i = 1; i < workers; i++)
+  {
+    totals[0].bytes += totals[i].bytes;
+    totals[0].clusters += totals[i].clusters;
+    totals[0].files += totals[i].files;
+    totals[0].dirs += totals[i].dirs;
+  }
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  fprintf(OUT, "%llu bytes in %li files and %li directories\n",
+          totals[0].bytes, totals[0].files, totals[0].dirs);
+  fprintf(OUT, "%llu clusters used (%llu bytes on disk)\n",
+          totals[0].clusters, totals[0].clusters * cluster_size);
+}
+
+//------------------------------SUBTREE SIZE INDEX------------------------------
+
+SUBTREE_SIZE* SizeIndexSlot(uint32_t cluster_no, int insert)
+{
+  if (insert && (SIZE_INDEX_COUNT + 1) * 2 > SIZE_INDEX_CAPACITY)
+  {
+    // Keep the table at most half full: rehash into twice the slots
+    SUBTREE_SIZE* old = SIZE_INDEX;
+    uint32_t old_capacity = SIZE_INDEX_CAPACITY;
+    SIZE_INDEX_CAPACITY *= 2;
+    SIZE_INDEX = calloc(SIZE_INDEX_CAPACITY, sizeof(SUBTREE_SIZE));
+    SIZE_INDEX_COUNT = 0;
+    for (uint32_t i = 0; i < old_capacity; i++)
+      if (old[i].cluster_no != 0)
+        *SizeIndexSlot(old[i].cluster_no, 1) = old[i];
+    free(old);
+  }
+
+  uint32_t mask = SIZE_INDEX_CAPACITY - 1;
+  for (uint32_t i = (cluster_no * 2654435761u) & mask; ; i = (i + 1) & mask)
+  {
+    if (SIZE_INDEX[i].cluster_no == cluster_no)
+      return &SIZE_INDEX[i];
+    if (SIZE_INDEX[i].cluster_no == 0) // Not present
+    {
+      if (!insert)
+        return NULL;
+      memset(&SIZE_INDEX[i], 0, sizeof(SUBTREE_SIZE));
+      SIZE_INDEX[i].cluster_no = cluster_no;
+      SIZE_INDEX[i].parent = FIRST_CLUSTER;
+      SIZE_INDEX_COUNT++;
+      return &SIZE_INDEX[i];
+    }
+  }
+}
+
+void SizeIndexAdd(uint32_t cluster_no, SUBTREE_SIZE* delta, int sign)
+// Up the parent chain to the root. The chain is as deep as the tree, and
+// bounded in case a damaged image links directories in a loop
+{
+  SUBTREE_SIZE* node = SizeIndexSlot(cluster_no, 0);
+  for (int depth = 0; node != NULL && depth < WALK_PATH_MAX / 2; depth++)
+  {
+    node->bytes += sign * (int64_t) delta->bytes;
+    node->clusters += sign * (int64_t) delta->clusters;
+    node->files += sign * (int32_t) delta->files;
+    node->dirs += sign * (int32_t) delta->dirs;
+    if (node->cluster_no == FIRST_CLUSTER)
+      break;
+    node = SizeIndexSlot(node->parent, 0);
+  }
+}
+
+void SizeIndexEntry(uint32_t cluster_no, DIR_ENTRY* entry, int sign)
+// A file brings its size, and its chain as the size rounds up to clusters.
+// A directory brings everything below it plus its own table, and follows
+// the entry to its new parent when moved
+{
+  if (SIZE_INDEX == NULL)
+    return;
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  SUBTREE_SIZE delta;
+  memset(&delta, 0, sizeof(delta));
+
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  if (entry->DIR_Attr & 0x10)
+  {
+    uint32_t child = ((uint32_t) entry->DIR_FstClusHI << 16) |
+                     entry->DIR_FstClusLO;
+    SUBTREE_SIZE* node = (child >= 2) ? SizeIndexSlot(child, 0) : NULL;
+    if (node != NULL) // Not there yet for a directory being made
+    {
+      delta = *node;
+      delta.clusters += node->table;
+      if (sign > 0)
+        node->parent = cluster_no;
+    }
+    delta.dirs++;
+  }
+  else
+  {
+    delta.files = 1;
+    delta.bytes = entry->DIR_FileSize;
+    delta.clusters = (entry->DIR_FileSize + cluster_size - 1) / cluster_size;
+  }
+  SizeIndexAdd(cluster_no, &delta, sign);
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
 }
 
-//----------------------------------DEBUGGING-----------------------------------
+void SizeIndexFile(uint32_t cluster_no, uint32_t old_size, uint32_t new_size)
+{
+  if (SIZE_INDEX == NULL || old_size == new_size)
+    return;
+  uint64_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint64_t old_clusters = (old_size + cluster_size - 1) / cluster_size;
+  uint64_t new_clusters = (new_size + cluster_size - 1) / cluster_size;
+
+  SUBTREE_SIZE delta;
+  memset(&delta, 0, sizeof(delta));
+  int sign = (new_size > old_size) ? 1 : -1;
+  delta.bytes = (sign > 0) ? new_size - old_size : old_size - new_size;
+  delta.clusters = (sign > 0) ? new_clusters - old_clusters
+                              : old_clusters - new_clusters;
+
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  SizeIndexAdd(cluster_no, &delta, sign);
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
+}
 
-void Print_DIR (DIR_ENTRY current) // Print func for debugging
+void SizeIndexDirectory(uint32_t cluster_no, uint32_t parent, int clusters)
+// The table of a directory counts toward its parent, not itself (as in du)
 {
-  printf("\n");
-  printf("%x\n", current.DIR_Attr); // Print all fields in DIR_ENTRY struct
-  printf("%i\n", current.DIR_NTRes);
-  printf("%i\n", current.DIR_CrtTimeTenth);
-  printf("%i\n", current.DIR_CrtTime);
-  printf("%i\n", current.DIR_LstAccDate);
-  printf("%x\n", current.DIR_FstClusHI);
-  printf("%i\n", current.DIR_WrtTime);
-  printf("%i\n", current.DIR_WrtDate);
-  printf("%x\n", current.DIR_FstClusLO);
-  printf("%i\n", current.DIR_FileSize);
+  if (SIZE_INDEX == NULL)
+    return;
+  SUBTREE_SIZE delta;
+  memset(&delta, 0, sizeof(delta));
+  delta.clusters = clusters;
+
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  SUBTREE_SIZE* node = SizeIndexSlot(cluster_no, 1);
+  if (parent != 0) // New directory, the cluster may have held another
+  {
+    memset(node, 0, sizeof(SUBTREE_SIZE));
+    node->cluster_no = cluster_no;
+    node->parent = parent;
+  }
+  node->table += clusters;
+  if (cluster_no != FIRST_CLUSTER)
+    SizeIndexAdd(node->parent, &delta, 1);
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
 }
 
-void Print_LDIR (LDIR_ENTRY long_entry) // Print func for debugging
+void SizeVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+               int worker, void* arg)
+// Adds each entry to its own directory only; BuildSizeIndex() then carries
+// the totals up. A subdirectory is registered before the walker pushes it,
+// so its node exists by the time its own entries are visited
 {
-  printf("\n");
-  printf("%i\n", long_entry.LDIR_Ord); // Print all fields in LDIR_ENTRY struct
-  printf("%c\n", long_entry.LDIR_Name1[0]);
-  printf("%c\n", long_entry.LDIR_Name1[1]);
-  printf("%c\n", long_entry.LDIR_Name1[2]);
-  printf("%c\n", long_entry.LDIR_Name1[3]);
-  printf("%c\n", long_entry.LDIR_Name1[4]);
-  printf("%x\n", long_entry.LDIR_Attr);
-  printf("%i\n", long_entry.LDIR_Type);
-  printf("%i\n", long_entry.LDIR_Chksum);
-  printf("%c\n", long_entry.LDIR_Name2[0]);
-  printf("%c\n", long_entry.LDIR_Name2[1]);
-  printf("%c\n", long_entry.LDIR_Name2[2]);
-  printf("%c\n", long_entry.LDIR_Name2[3]);
-  printf("%c\n", long_entry.LDIR_Name2[4]);
-  printf("%c\n", long_entry.LDIR_Name2[5]);
-  printf("%x\n", long_entry.LDIR_FstClusLO);
-  printf("%s\n", long_entry.LDIR_Name3);
+  DIR_ENTRY* current = &entry->entry;
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t table = 0;
+  if (current->DIR_Attr & 0x10)
+  {
+    uint32_t child = ((uint32_t) current->DIR_FstClusHI << 16) |
+                     current->DIR_FstClusLO;
+    for (uint32_t n = child; n >= 2 && n < 0x0FFFFFF6 &&
+         table < ClusterLimit(); n = NextClusterNo(n))
+      table++;
+    if (child >= 2)
+    {
+      pthread_mutex_lock(&SIZE_INDEX_LOCK);
+      SUBTREE_SIZE* node = SizeIndexSlot(child, 1);
+      node->parent = dir;
+      node->table = table;
+      pthread_mutex_unlock(&SIZE_INDEX_LOCK);
+    }
+  }
+
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  SUBTREE_SIZE* node = SizeIndexSlot(dir, 1);
+  if (current->DIR_Attr & 0x10)
+  {
+    node->dirs++;
+    node->clusters += table;
+  }
+  else
+  {
+    node->files++;
+    node->bytes += current->DIR_FileSize;
+    node->clusters += (current->DIR_FileSize + cluster_size - 1) /
+                      cluster_size;
+  }
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
 }
 
-//------------------------------------------------------------------------------
-//-------------------------------MAIN FUNCTIONS---------------------------------
+void BuildSizeIndex(void)
+{
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  free(SIZE_INDEX);
+  SIZE_INDEX_CAPACITY = 1024;
+  SIZE_INDEX_COUNT = 0;
+  SIZE_INDEX = calloc(SIZE_INDEX_CAPACITY, sizeof(SUBTREE_SIZE));
+  SizeIndexSlot(FIRST_CLUSTER, 1); // Its own parent
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
+
+  WalkTree(FIRST_CLUSTER, SizeVisit, NULL);
+
+  // Each node holds what sits directly in it: carry that up to every
+  // ancestor, from a copy so no total is counted twice
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  uint32_t capacity = SIZE_INDEX_CAPACITY;
+  SUBTREE_SIZE* direct = malloc(capacity * sizeof(SUBTREE_SIZE));
+  memcpy(direct, SIZE_INDEX, capacity * sizeof(SUBTREE_SIZE));
+  for (uint32_t i = 0; i < capacity; i++)
+    if (direct[i].cluster_no != 0 && direct[i].cluster_no != FIRST_CLUSTER)
+    {
+      SUBTREE_SIZE* node = SizeIndexSlot(direct[i].parent, 0);
+      if (node != NULL)
+        SizeIndexAdd(node->cluster_no, &direct[i], 1);
+    }
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
+  free(direct);
+}
 
-void info(void) // Parse boot sector & print relevant info
+int LoadSizeIndex(const char* image_path, int create)
+// IMAGEFILE.du is only trusted if IMAGEFILE was not written since it was
+// saved: its mtime and size serve as the image's generation counter
 {
-  printf("Bytes Per Sector: %d\n", BOOT.BPB_BytsPerSec);
-  printf("Sectors Per Cluster: %d\n", BOOT.BPB_SecPerClus);
-  printf("Reserved Sector Count: %d\n", BOOT.BPB_RsvdSecCnt);
-  printf("Number of FATs: %d\n", BOOT.BPB_NumFATs);
-  printf("Total Sectors: %d\n", BOOT.BPB_TotSec32);
-  printf("FATsize: %d sectors\n", BOOT.BPB_FATSz32);
-  printf("Root Cluster: %d\n", BOOT.BPB_RootClus);
+  SIZE_INDEX_PATH = malloc(strlen(image_path) + 4);
+  sprintf(SIZE_INDEX_PATH, "%s.du", image_path);
+
+  int fd = open(SIZE_INDEX_PATH, O_RDONLY);
+  if (fd < 0 && !create)
+    return -1; // No index, du walks the tree
+
+  struct stat image;
+  fstat(IMAGE_FD, &image);
+  SIZE_INDEX_HEADER header;
+  int valid = fd >= 0 &&
+              read(fd, &header, sizeof(header)) == sizeof(header) &&
+              memcmp(header.magic, SIZE_INDEX_MAGIC, 8) == 0 &&
+              header.image_mtime_sec == image.st_mtim.tv_sec &&
+              header.image_mtime_nsec == image.st_mtim.tv_nsec &&
+              header.image_size == image.st_size;
+
+  if (valid)
+  {
+    SIZE_INDEX_CAPACITY = 1024;
+    while (SIZE_INDEX_CAPACITY < header.count * 2 + 2)
+      SIZE_INDEX_CAPACITY *= 2;
+    SIZE_INDEX_COUNT = 0;
+    SIZE_INDEX = calloc(SIZE_INDEX_CAPACITY, sizeof(SUBTREE_SIZE));
+    SUBTREE_SIZE* saved = malloc((header.count + 1) * sizeof(SUBTREE_SIZE));
+    ssize_t length = header.count * sizeof(SUBTREE_SIZE);
+    if (read(fd, saved, length) == length)
+      for (uint32_t i = 0; i < header.count; i++)
+        *SizeIndexSlot(saved[i].cluster_no, 1) = saved[i];
+    else
+      valid = 0;
+    free(saved);
+  }
+  if (fd >= 0)
+    close(fd);
+
+  if (!valid) // Missing or stale: one walk of the tree sets it right
+    BuildSizeIndex();
+  return 0;
 }
 
-void size(char* file, uint32_t cluster_no)
-// Print size in bytes of FILE file in CWD
+void SaveSizeIndex(void)
+// Written to a temporary file and renamed over the old one, so a crash
+// leaves the old index (stale, so rebuilt) rather than half a new one.
+// Under --ram the file only holds the image in memory while nothing has
+// been written since RamFlush(); otherwise the index would be stamped with
+// the mtime of an image it does not describe, and is not saved. Callers
+// hold SNAPSHOT_LOCK for writing (or run no commands any more), so the
+// stamp and the copy see every command's writes and index updates whole
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  if (SIZE_INDEX == NULL || RO_MODE ||
+      (RAM_MODE && __atomic_load_n(&RAM_DIRTY, __ATOMIC_RELAXED)))
+    return;
+  char* temporary = malloc(strlen(SIZE_INDEX_PATH) + 5);
+  sprintf(temporary, "%s.tmp", SIZE_INDEX_PATH);
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    free(temporary);
+    return;
+  }
 
-  if (current.DIR_Name[0] == 0x00) // Check if found
-    printf("%s not found in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // Check if a directory
-    printf("Error. %s is a Directory.\n", file);
-  else  // VALID -- print
-    printf("%i bytes\n", current.DIR_FileSize);
+  pthread_mutex_lock(&SIZE_INDEX_LOCK);
+  struct stat image;
+  fstat(IMAGE_FD, &image); // Every write so far is in the mtime
+  SIZE_INDEX_HEADER header;
+  memcpy(header.magic, SIZE_INDEX_MAGIC, 8);
+  header.image_mtime_sec = image.st_mtim.tv_sec;
+  header.image_mtime_nsec = image.st_mtim.tv_nsec;
+  header.image_size = image.st_size;
+  header.count = 0;
+  SUBTREE_SIZE* saved = malloc((SIZE_INDEX_COUNT + 1) * sizeof(SUBTREE_SIZE));
+  for (uint32_t i = 0; i < SIZE_INDEX_CAPACITY; i++)
+    if (SIZE_INDEX[i].cluster_no != 0)
+      saved[header.count++] = SIZE_INDEX[i];
+  pthread_mutex_unlock(&SIZE_INDEX_LOCK);
+
+  ssize_t length = header.count * sizeof(SUBTREE_SIZE);
+  int ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+           write(fd, saved, length) == length;
+  if (close(fd) != 0 || !ok || rename(temporary, SIZE_INDEX_PATH) != 0)
+    unlink(temporary);
+  free(saved);
+  free(temporary);
 }
 
-void ls_CWD(uint32_t cluster_no) // List contents of CWD
+//----------------------------DIRECTORY COMPACTION------------------------------
+
+int CompactDirectory(uint32_t cluster_no, int* slots, uint32_t* clusters)
+// Kept, in their order: . and .. (. pointed at the directory itself), a
+// volume label, and each live entry with the LDIR_ENTRYs of its long name.
+// Deallocated and orphaned LDIR slots go, the rest of the last cluster kept
+// is zeroed (so a 0x00 ends the directory) and the clusters after it are
+// freed. First clusters do not move, so cached paths still hold; handles on
+// open files are moved with their entries (MoveOpenFile()) and the
+// directory's name index is rebuilt on its next lookup
 {
-  DIR_ENTRY current;
-  LDIR_ENTRY long_entry;
-  int iteration = 0; // How many CLUSTERS traversed, for debugging
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  int per_cluster = cluster_size / sizeof(DIR_ENTRY);
+  uint32_t* chain;
+  uint32_t count;
+  DIR_ENTRY* old = ReadDirectoryTable(cluster_no, &chain, &count);
+  if (old == NULL)
+    return -1;
+  DIR_ENTRY* new = calloc(count, cluster_size);
+
+  // Slots to keep: ReadDirectory() has already matched long names to
+  // their entries, the special entries it skips are picked up here
+  uint32_t total = count * per_cluster, end = 0;
+  while (end < total && old[end].DIR_Name[0] != 0x00)
+    end++;
+  uint8_t* keep = calloc(total, 1);
+  NAMED_ENTRY* entries;
+  int live = ReadDirectory(cluster_no, &entries);
+  for (int i = 0; i < live; i++)
+    for (int j = 0; j <= entries[i].long_slots; j++)
+      keep[entries[i].slot - j] = 1;
+  FreeDirectory(entries, live);
+  for (uint32_t i = 0; i < end; i++)
+    if (old[i].DIR_Name[0] != 0xE5 && (old[i].DIR_Attr & 0x3f) != 0xf &&
+        ((old[i].DIR_Attr & 0x08) || old[i].DIR_Name[0] == '.'))
+      keep[i] = 1;
+
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < end; i++)
+    if (keep[i])
+    {
+      if (used != i && (old[i].DIR_Attr & 0x3f) != 0xf) // Open files follow
+        MoveOpenFile(ClusterNo_To_DataOffset(chain[i / per_cluster]) +
+                     (i % per_cluster) * sizeof(DIR_ENTRY),
+                     ClusterNo_To_DataOffset(chain[used / per_cluster]) +
+                     (used % per_cluster) * sizeof(DIR_ENTRY));
+      new[used] = old[i];
+      if (memcmp(new[used].DIR_Name, ".          ", 11) == 0)
+      {
+        new[used].DIR_FstClusHI = cluster_no >> 16;
+        new[used].DIR_FstClusLO = cluster_no & 0xFFFF;
+      }
+      used++;
+    }
+  free(keep);
+
+  // Write back the clusters that changed, then cut the chain
+  uint32_t kept = (used + per_cluster - 1) / per_cluster;
+  if (kept == 0)
+    kept = 1; // A directory keeps its first cluster
+  for (uint32_t i = 0; i < kept; i++)
+    if (memcmp(&old[i * per_cluster], &new[i * per_cluster],
+               cluster_size) != 0)
+      WriteImage(&new[i * per_cluster], cluster_size,
+                 ClusterNo_To_DataOffset(chain[i]));
+  if (kept < count)
+  {
+    UpdateClusterInFAT(chain[kept - 1], 0xFFFFFFFF);
+    FreeChain(chain[kept]);
+    SizeIndexDirectory(cluster_no, 0, -(int) (count - kept));
+  }
+  InvalidateDirIndex(cluster_no);
+
+  *slots = end - used;
+  *clusters = count - kept;
+  free(chain);
+  free(old);
+  free(new);
+  return 0;
+}
+
+void compact(char* dir, uint32_t cluster_no)
+{
+  uint32_t target = (dir == NULL) ? cluster_no : cd(dir, cluster_no);
+  if (target == 0) // Error already printed
+    return;
+  if (target != cluster_no)
+    DirLock(target, DIR_LOCK_WRITE); // CWD is locked, lock target too
+
+  int slots;
+  uint32_t clusters;
+  if (CompactDirectory(target, &slots, &clusters) != 0)
+    Error(STATUS_IO, "Error. Cannot read directory.\n");
+  else
+    fprintf(OUT, "Reclaimed %i slots, freed %u clusters.\n", slots,
+            clusters);
+
+  if (target != cluster_no)
+    DirUnlock(target);
+}
+
+//-----------------------------CONSISTENCY CHECK--------------------------------
+
+void CheckReport(CHECK_LIST* list, int kind, uint32_t cluster, uint32_t count,
+                 uint32_t size, uint32_t dir, off_t offset, const char* path)
+{
+  if (list->count == list->capacity)
+  {
+    list->capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+    list->problems = realloc(list->problems,
+                             list->capacity * sizeof(CHECK_PROBLEM));
+  }
+  CHECK_PROBLEM* problem = &list->problems[list->count++];
+  problem->kind = kind;
+  problem->cluster = cluster;
+  problem->count = count;
+  problem->size = size;
+  problem->dir = dir;
+  problem->offset = offset;
+  problem->path = (path == NULL) ? NULL : strdup(path);
+}
+
+void* CheckWorker(void* arg)
+// Worker self takes one slice of the FAT. Phase 0 counts the links into
+// each cluster, flags entries that lead nowhere and compares its slice of
+// every FAT copy with FAT 1 (memcmp runs vectorized, one entry at a time
+// only once a block differs). Phase 2 runs after the walk has marked every
+// cluster reachable from an entry
+{
+  CHECK_WORKER_ARG* worker = arg;
+  CHECK_STATE* state = worker->state;
+  CHECK_LIST* list = &state->lists[worker->self];
+  uint32_t slice = (state->entries + state->workers - 1) / state->workers;
+  uint32_t low = worker->self * slice;
+  uint32_t high = (low + slice < state->entries) ? low + slice
+                                                 : state->entries;
+  uint32_t* fat = state->fat;
+
+  if (state->phase == 0)
+  {
+    for (uint32_t c = (low < 2) ? 2 : low; c < high && c < state->clusters;
+         c++)
+    {
+      uint32_t next = fat[c] & 0x0FFFFFFF; // Top 4 bits are reserved
+      if (next == 0)
+        continue;
+      list->allocated++;
+      if (next >= 0x0FFFFFF7) // Bad cluster or end of chain
+        continue;
+      if (next < 2 || next >= state->clusters || fat[next] == 0)
+        CheckReport(list, CHECK_BAD_NEXT, c, next, 0, 0, 0, NULL);
+      else if (state->links[next] < 255)
+        __atomic_fetch_add(&state->links[next], 1, __ATOMIC_RELAXED);
+    }
+
+    off_t fat_size = (off_t) BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec;
+    uint32_t block = 16384; // entries compared per read, 64 KB
+    uint32_t* copy = malloc(block * 4);
+    for (int k = 1; k < BOOT.BPB_NumFATs; k++)
+    {
+      uint32_t differ = 0, first = 0;
+      for (uint32_t c = low; c < high; c += block)
+      {
+        uint32_t n = (high - c < block) ? high - c : block;
+        if (DeviceRead(copy, n * 4, ClusterNo_to_FATOffset(c) +
+                       k * fat_size) != 0)
+        {
+          differ += high - c; // Unreadable counts as different
+          first = (differ == high - c) ? c : first;
+          break;
+        }
+        if (memcmp(copy, &fat[c], n * 4) == 0)
+          continue;
+        for (uint32_t i = 0; i < n; i++)
+          if (copy[i] != fat[c + i] && differ++ == 0)
+            first = c + i;
+      }
+      if (differ > 0)
+        CheckReport(list, CHECK_FAT_COPY, first, differ, k + 1, 0, 0, NULL);
+    }
+    free(copy);
+  }
+  else
+  {
+    uint32_t lost = 0, first = 0;
+    for (uint32_t c = (low < 2) ? 2 : low; c < high && c < state->clusters;
+         c++)
+    {
+      if ((fat[c] & 0x0FFFFFFF) == 0)
+        continue;
+      if (!state->reached[c] && (fat[c] & 0x0FFFFFFF) != 0x0FFFFFF7 &&
+          lost++ == 0)
+        first = c;
+      if (state->links[c] > 1)
+        CheckReport(list, CHECK_CROSS_LINK, c, state->links[c], 0, 0, 0,
+                    NULL);
+    }
+    if (lost > 0)
+      CheckReport(list, CHECK_LOST, first, lost, 0, 0, 0, NULL);
+  }
+  return NULL;
+}
+
+void CheckRanges(CHECK_STATE* state, int phase)
+{
+  state->phase = phase;
+  pthread_t threads[WALK_WORKERS_MAX];
+  CHECK_WORKER_ARG args[WALK_WORKERS_MAX];
+  for (int i = 0; i < state->workers; i++)
+  {
+    args[i].state = state;
+    args[i].self = i;
+    pthread_create(&threads[i], NULL, CheckWorker, &args[i]);
+  }
+  for (int i = 0; i < state->workers; i++)
+    pthread_join(threads[i], NULL);
+}
+
+void CheckVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+                int worker, void* arg)
+// A file's chain is followed only as far as its size needs, so a longer
+// chain (or one looping back on itself) leaves its tail unreached and
+// lost. A directory's chain is followed to its end
+{
+  CHECK_STATE* state = arg;
+  CHECK_LIST* list = &state->lists[worker];
+  DIR_ENTRY* current = &entry->entry;
+  uint32_t* fat = state->fat;
+  uint32_t first = ((uint32_t) current->DIR_FstClusHI << 16) |
+                   current->DIR_FstClusLO;
+  int directory = (current->DIR_Attr & 0x10) != 0;
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  uint32_t needed = directory ? state->clusters
+                  : (uint32_t) (((uint64_t) current->DIR_FileSize +
+                                 cluster_size - 1) / cluster_size);
+
+  if (first == 0)
+  {
+    if (directory || needed > 0)
+      CheckReport(list, directory ? CHECK_BAD_ENTRY : CHECK_SHORT, 0, 0,
+                  current->DIR_FileSize, dir, entry->offset, path);
+    return;
+  }
+  if (first < 2 || first >= state->clusters || fat[first] == 0)
+  {
+    CheckReport(list, CHECK_BAD_ENTRY, first, 0, 0, dir, entry->offset, path);
+    return;
+  }
+  if (state->links[first] < 255)
+    __atomic_fetch_add(&state->links[first], 1, __ATOMIC_RELAXED);
+  if (needed == 0)
+    needed = 1; // An empty file may keep one cluster
+
+  uint32_t cluster = first, length = 0, last = first;
+  while (cluster >= 2 && cluster < state->clusters && length < needed &&
+         fat[cluster] != 0)
+  {
+    state->reached[cluster] = 1; // Any worker may set it, all store 1
+    length++;
+    last = cluster;
+    cluster = fat[cluster] & 0x0FFFFFFF;
+  }
 
-  // ITERATE THROUGH DIRECTORY
-  do {
-    iteration++;
+  int ended = (cluster >= 0x0FFFFFF8); // Bad links were found in phase 0
+  if (directory && length == needed && !ended)
+    CheckReport(list, CHECK_LOOP, first, length, 0, dir, entry->offset, path);
+  else if (!directory && length < needed && current->DIR_FileSize > 0)
+    CheckReport(list, CHECK_SHORT, first, length, current->DIR_FileSize, dir,
+                entry->offset, path);
+  else if (!directory && length == needed && cluster >= 2 &&
+           cluster < state->clusters && fat[cluster] != 0)
+    CheckReport(list, CHECK_LONG, last, length, current->DIR_FileSize, dir,
+                entry->offset, path);
+}
 
-    // FIND OFFSET OF CLUSTER IN THE DATA REGION
-    int data_offset = ClusterNo_To_DataOffset(cluster_no);
-    int starting_offset = data_offset;
+int CompareProblems(const void* a, const void* b)
+{
+  const CHECK_PROBLEM* x = a;
+  const CHECK_PROBLEM* y = b;
+  if (x->kind != y->kind)
+    return x->kind - y->kind;
+  if (x->size != y->size) // FAT copy no. before cluster
+    return (x->size > y->size) - (x->size < y->size);
+  return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
 
-    // CHECK FOR . and .. ENTRIES
-    if ((cluster_no != FIRST_CLUSTER) && (iteration == 1))
+int CheckRepair(CHECK_STATE* state, CHECK_PROBLEM* problem)
+// Lost clusters are freed separately, all in one pass (see check())
+{
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  if (problem->kind == CHECK_FAT_COPY) // Copy FAT 1 over it, 1 MB at a time
+  {
+    off_t fat_size = (off_t) BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec;
+    off_t target = ClusterNo_to_FATOffset(0) + (problem->size - 1) * fat_size;
+    for (off_t done = 0; done < fat_size; done += 1 << 20)
     {
-      DIR_ENTRY OneDot, TwoDots; // dir entries for . and .. have NOT longentry
-                                // preceding them
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-      printf("%s\n", OneDot.DIR_Name); // Should print .
-      data_offset += sizeof(OneDot);
+      size_t n = (fat_size - done < (1 << 20)) ? fat_size - done : 1 << 20;
+      if (WriteImage((char*) state->fat + done, n, target + done) != 0)
+        return 0;
+    }
+    return 1;
+  }
+  if (problem->kind == CHECK_BAD_NEXT || problem->kind == CHECK_LONG)
+  {
+    UpdateClusterInFAT(problem->cluster, 0x0FFFFFFF); // End the chain here
+    return 1;
+  }
+  if (problem->kind == CHECK_SHORT) // Keep what the chain holds
+  {
+    DIR_ENTRY current;
+    if (ReadImage(&current, sizeof(current), problem->offset) != 0)
+      return 0;
+    current.DIR_FileSize = problem->count * cluster_size;
+    WriteImage(&current, sizeof(current), problem->offset);
+    InvalidateDirIndex(problem->dir);
+    return 1;
+  }
+  return 0; // Cross-links, loops and bad entries need a person
+}
 
-      fread(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-      printf("%s\n", TwoDots.DIR_Name); // Should print ..
-      data_offset += sizeof(TwoDots);
+int check(int repair)
+// Three phases, each spread over every CPU: a scan of the FAT in slices,
+// a walk of the directory tree following each entry's chain, and a scan
+// for clusters in use that no chain reached
+{
+  CHECK_STATE state;
+  memset(&state, 0, sizeof(state));
+  state.entries = BOOT.BPB_FATSz32 * BOOT.BPB_BytsPerSec / 4;
+  state.clusters = ClusterLimit();
+  state.fat = FAT_CACHE;
+  if (state.fat == NULL) // Not cached (very large FAT): read it once here
+  {
+    state.fat = malloc((size_t) state.entries * 4);
+    if (state.fat == NULL ||
+        DeviceRead(state.fat, (size_t) state.entries * 4,
+                   ClusterNo_to_FATOffset(0)) != 0)
+    {
+      free(state.fat);
+      Error(STATUS_IO, "Error. Cannot read the FAT.\n");
+      return 1;
     }
+  }
+  state.links = calloc(state.clusters, 1);
+  state.reached = calloc(state.clusters, 1);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  state.workers = (cpus < 1) ? 1 : (cpus > WALK_WORKERS_MAX)
+                                   ? WALK_WORKERS_MAX : cpus;
+
+  CheckRanges(&state, 0);
+
+  // The root has no DIR_ENTRY: take its chain here, then walk below it
+  uint32_t cluster = FIRST_CLUSTER;
+  state.links[cluster]++;
+  for (uint32_t n = 0; cluster >= 2 && cluster < state.clusters &&
+       state.fat[cluster] != 0 && n < state.clusters; n++)
+  {
+    state.reached[cluster] = 1;
+    cluster = state.fat[cluster] & 0x0FFFFFFF;
+  }
+  WalkTree(FIRST_CLUSTER, CheckVisit, &state);
 
-    // READ IN DIR_ENTRY VALUES UNTIL ALL CLUSTER SPACE HAS BEEN READ IN
-    // (Very likely empty space will exist for additional DIR_ENTRYs)
-    while (data_offset < ((starting_offset + BOOT.BPB_BytsPerSec)
-                                           * BOOT.BPB_SecPerClus)) {
+  CheckRanges(&state, 2);
 
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
+  // Merge, sort and report. Per kind, the first CHECK_REPORT_MAX are listed
+  int total = 0;
+  uint32_t allocated = 0;
+  for (int i = 0; i < state.workers; i++)
+  {
+    total += state.lists[i].count;
+    allocated += state.lists[i].allocated;
+  }
+  CHECK_PROBLEM* problems = malloc((total + 1) * sizeof(CHECK_PROBLEM));
+  total = 0;
+  for (int i = 0; i < state.workers; i++)
+  {
+    memcpy(&problems[total], state.lists[i].problems,
+           state.lists[i].count * sizeof(CHECK_PROBLEM));
+    total += state.lists[i].count;
+    free(state.lists[i].problems);
+  }
+  qsort(problems, total, sizeof(CHECK_PROBLEM), CompareProblems);
 
-      int additional_offset = sizeof(long_entry);
+  // FAT copy and lost cluster reports come per slice, fold them into one
+  int merged = 0;
+  for (int i = 0; i < total; i++)
+  {
+    CHECK_PROBLEM* last = (merged > 0) ? &problems[merged - 1] : NULL;
+    if (last != NULL && last->kind == problems[i].kind &&
+        ((last->kind == CHECK_FAT_COPY && last->size == problems[i].size) ||
+         last->kind == CHECK_LOST))
+      last->count += problems[i].count;
+    else
+      problems[merged++] = problems[i];
+  }
+  total = merged;
 
-      if (long_entry.LDIR_Ord == 0x00) // The remainder of the cluster is empty
-        break;
+  int listed[CHECK_KINDS] = { 0 }, skipped[CHECK_KINDS] = { 0 };
+  int repaired = 0;
+  for (int i = 0; i < total; i++)
+  {
+    CHECK_PROBLEM* p = &problems[i];
+    if (listed[p->kind] == CHECK_REPORT_MAX)
+      skipped[p->kind]++;
+    else
+    {
+      listed[p->kind]++;
+      switch (p->kind)
+      {
+        case CHECK_FAT_COPY:
+          fprintf(OUT, "FAT %u differs from FAT 1 in %u entries (first at "
+                  "cluster %u)\n", p->size, p->count, p->cluster);
+          break;
+        case CHECK_BAD_NEXT:
+          fprintf(OUT, "Cluster %u points to %s cluster %u\n", p->cluster,
+                  (p->count >= 2 && p->count < state.clusters) ? "free"
+                                                               : "invalid",
+                  p->count);
+          break;
+        case CHECK_BAD_ENTRY:
+          fprintf(OUT, "%s: first cluster %u is free or invalid\n", p->path,
+                  p->cluster);
+          break;
+        case CHECK_CROSS_LINK:
+          fprintf(OUT, "Cluster %u is on %u chains (cross-linked)\n",
+                  p->cluster, p->count);
+          break;
+        case CHECK_LOOP:
+          fprintf(OUT, "%s: directory chain does not end\n", p->path);
+          break;
+        case CHECK_SHORT:
+          fprintf(OUT, "%s: size %u but chain has only %u clusters\n",
+                  p->path, p->size, p->count);
+          break;
+        case CHECK_LONG:
+          fprintf(OUT, "%s: chain goes on past cluster %u, size %u needs "
+                  "%u\n", p->path, p->cluster, p->size, p->count);
+          break;
+        case CHECK_LOST:
+          fprintf(OUT, "%u lost clusters (first at %u)\n", p->count,
+                  p->cluster);
+          break;
+      }
+    }
+    if (repair && p->kind != CHECK_LOST && CheckRepair(&state, p))
+      repaired++;
+  }
+  for (int k = 0; k < CHECK_KINDS; k++)
+    if (skipped[k] > 0)
+      fprintf(OUT, "... and %i more of the kind above the last listed\n",
+              skipped[k]);
+
+  // Lost clusters last: chains cut above have just added to them
+  if (repair && total > 0)
+  {
+    uint32_t freed = 0;
+    pthread_mutex_lock(&ALLOC_LOCK);
+    uint32_t per_sector = BOOT.BPB_BytsPerSec / 4;
+    uint32_t sectors = (state.entries + per_sector - 1) / per_sector;
+    uint8_t* dirty = calloc(sectors, 1);
+    for (uint32_t c = 2; c < state.clusters; c++)
+    {
+      uint32_t next = NextClusterNo(c) & 0x0FFFFFFF;
+      if (state.reached[c] || next == 0 || next == 0x0FFFFFF7)
+        continue;
+      if (FAT_CACHE != NULL)
+      {
+        FAT_CACHE[c] = 0x0;
+        dirty[c / per_sector] = 1;
+      }
+      else
+        UpdateClusterInFAT(c, 0x0);
+      if (c < FREE_CLUSTER_HINT)
+        FREE_CLUSTER_HINT = c;
+      freed++;
+    }
+    if (FAT_CACHE != NULL)
+      WriteFATSectors(dirty, sectors);
+    pthread_mutex_unlock(&ALLOC_LOCK);
+    free(dirty);
+    for (int i = 0; i < total; i++)
+      if (problems[i].kind == CHECK_LOST)
+        repaired++;
+    if (freed > 0)
+      fprintf(OUT, "Freed %u lost clusters.\n", freed);
+    if (repaired > 0 && SIZE_INDEX != NULL)
+      BuildSizeIndex(); // Sizes may have been cut
+  }
+
+  int left = total - repaired;
+  fprintf(OUT, "Checked %u clusters (%u in use) with %i workers: ",
+          state.clusters - 2, allocated, state.workers);
+  if (total == 0)
+    fprintf(OUT, "no problems found.\n");
+  else if (left == 0)
+    fprintf(OUT, "%i problems, all repaired.\n", total);
+  else if (repair)
+    Error(STATUS_INVALID, "%i problems, %i repaired.\n", total, repaired);
+  else
+    Error(STATUS_INVALID, "%i problems (check -r repairs what it can).\n",
+          total);
+
+  for (int i = 0; i < total; i++)
+    free(problems[i].path);
+  free(problems);
+  if (state.fat != FAT_CACHE)
+    free(state.fat);
+  free(state.links);
+  free(state.reached);
+  return left;
+}
+
+//------------------------------DEFRAGMENTATION---------------------------------
+
+uint32_t ChainExtents(uint32_t first_cluster, uint32_t* clusters)
+{
+  uint32_t extents = 0, length = 0, limit = ClusterLimit();
+  uint32_t previous = 0;
+  for (uint32_t c = first_cluster; c >= 2 && c < 0x0FFFFFF6 && length < limit;
+       c = NextClusterNo(c))
+  {
+    if (c != previous + 1)
+      extents++;
+    previous = c;
+    length++;
+  }
+  *clusters = length;
+  return extents;
+}
+
+void DefragVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+                 int worker, void* arg)
+{
+  DEFRAG_STATE* state = arg;
+  DIR_ENTRY* current = &entry->entry;
+  if (current->DIR_Attr & 0x10) // Files only, directories stay put
+    return;
+  uint32_t first = ((uint32_t) current->DIR_FstClusHI << 16) |
+                   current->DIR_FstClusLO;
+  uint32_t clusters;
+  uint32_t extents = ChainExtents(first, &clusters);
+  if (extents <= 1)
+    return;
+
+  if (state->count[worker] == state->capacity[worker])
+  {
+    state->capacity[worker] = (state->capacity[worker] == 0) ? 64 :
+                              state->capacity[worker] * 2;
+    state->files[worker] = realloc(state->files[worker],
+                                   state->capacity[worker] *
+                                   sizeof(DEFRAG_FILE));
+  }
+  DEFRAG_FILE* file = &state->files[worker][state->count[worker]++];
+  file->path = strdup(path);
+  file->dir = dir;
+  file->offset = entry->offset;
+  file->first_cluster = first;
+  file->clusters = clusters;
+  file->extents = extents;
+}
+
+int FindFreeRuns(FREE_RUN** runs)
+{
+  int count = 0, capacity = 64;
+  *runs = malloc(capacity * sizeof(FREE_RUN));
+  uint32_t limit = ClusterLimit();
+
+  pthread_mutex_lock(&ALLOC_LOCK);
+  for (uint32_t c = BOOT.BPB_RootClus; c < limit; c++)
+  {
+    if (NextClusterNo(c) != 0x0)
+      continue;
+    uint32_t start = c;
+    while (c < limit && NextClusterNo(c) == 0x0)
+      c++;
+    if (count == capacity)
+    {
+      capacity *= 2;
+      *runs = realloc(*runs, capacity * sizeof(FREE_RUN));
+    }
+    (*runs)[count].start = start;
+    (*runs)[count++].length = c - start;
+  }
+  pthread_mutex_unlock(&ALLOC_LOCK);
+  return count;
+}
+
+int CompareDefragFiles(const void* a, const void* b)
+{
+  uint32_t x = ((const DEFRAG_FILE*) a)->first_cluster;
+  uint32_t y = ((const DEFRAG_FILE*) b)->first_cluster;
+  return (x > y) - (x < y);
+}
+
+int RelocateFile(DEFRAG_FILE* file, FREE_RUN* runs, int run_count)
+// Copy into the first free run that holds the whole file, extent by
+// extent, then claim the run, point the DIR_ENTRY and any open handle at
+// it and free the old chain. The directory is write-locked throughout so
+// the file cannot change underneath; the run is taken out of runs[]
+{
+  int chosen = -1;
+  for (int i = 0; i < run_count && chosen < 0; i++)
+    if (runs[i].length >= file->clusters)
+      chosen = i;
+  if (chosen < 0)
+    return 0;
+  uint32_t target = runs[chosen].start;
+
+  DirLock(file->dir, DIR_LOCK_WRITE);
+  DIR_ENTRY current;
+  uint32_t clusters;
+  if (ReadImage(&current, sizeof(current), file->offset) != 0 ||
+      (((uint32_t) current.DIR_FstClusHI << 16) | current.DIR_FstClusLO) !=
+      file->first_cluster ||
+      ChainExtents(file->first_cluster, &clusters) <= 1 ||
+      clusters != file->clusters)
+  {
+    DirUnlock(file->dir); // Changed since the walk, leave it alone
+    return 0;
+  }
+
+  // Claim the run first so no allocation lands in it mid-copy
+  pthread_mutex_lock(&ALLOC_LOCK);
+  int taken = 1;
+  for (uint32_t i = 0; i < clusters && taken; i++)
+    taken = (NextClusterNo(target + i) == 0x0);
+  if (taken && FAT_CACHE != NULL) // Link in memory, one FAT write
+  {
+    for (uint32_t i = 0; i < clusters; i++)
+      FAT_CACHE[target + i] = (i + 1 < clusters) ? target + i + 1
+                                                 : 0xFFFFFFFF;
+    WriteFAT(&FAT_CACHE[target], (size_t) clusters * 4, target);
+  }
+  else if (taken)
+    for (uint32_t i = 0; i < clusters; i++)
+      UpdateClusterInFAT(target + i, (i + 1 < clusters) ? target + i + 1
+                                                         : 0xFFFFFFFF);
+  pthread_mutex_unlock(&ALLOC_LOCK);
+  runs[chosen].start += clusters;
+  runs[chosen].length -= clusters;
+  if (!taken) // Allocated since the free map was read
+  {
+    DirUnlock(file->dir);
+    return 0;
+  }
+
+  PERF_ADD(allocated, clusters);
+  PERF_FILE_DATA;
+  off_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  off_t destination = ClusterNo_To_DataOffset(target);
+  off_t done = 0, total = (off_t) clusters * cluster_size;
+  uint32_t c = file->first_cluster;
+  while (done < total && c >= 2 && c < 0x0FFFFFF6)
+  {
+    uint32_t start = c;
+    off_t length = cluster_size;
+    uint32_t next = NextClusterNo(c);
+    while (next == c + 1)
+    {
+      c = next;
+      length += cluster_size;
+      next = NextClusterNo(c);
+    }
+    if (CopyRange(IMAGE_FD, ClusterNo_To_DataOffset(start), IMAGE_FD,
+                  destination + done, length) != length)
+      break;
+    done += length;
+    c = next;
+  }
+  InvalidateBlockCache(destination, total); // Written behind its back
+  if (done != total)
+  {
+    FreeChain(target);
+    DirUnlock(file->dir);
+    Error(STATUS_IO, "Error. Cannot move %s.\n", file->path);
+    return 0;
+  }
+
+  current.DIR_FstClusHI = target >> 16;
+  current.DIR_FstClusLO = target & 0xFFFF;
+  WriteImage(&current, sizeof(current), file->offset);
+  pthread_mutex_lock(&OPENFILE_LIST_LOCK);
+  for (int i = 0; i < 100; i++)
+    if (OPENFILE_LIST[i].entry == file->offset)
+      OPENFILE_LIST[i].first_cluster = target;
+  pthread_mutex_unlock(&OPENFILE_LIST_LOCK);
+  FreeChains(&file->first_cluster, 1);
+  InvalidateDirIndex(file->dir);
+  DirUnlock(file->dir);
+  file->first_cluster = target;
+  return 1;
+}
+
+void defrag(char* target, long budget_mb, uint32_t cluster_no)
+// Fragmented files are found by a walk, then moved one at a time in disk
+// order into runs of the free map read at the start (first fit). Clusters
+// freed by a move are left for the next run of defrag, which also picks up
+// whatever the budget left behind
+{
+  DEFRAG_STATE state;
+  memset(&state, 0, sizeof(state));
+  int workers = 1;
+  if (strcmp(target, "-a") == 0)
+    workers = WalkTree(FIRST_CLUSTER, DefragVisit, &state);
+  else
+  {
+    NAMED_ENTRY found;
+    if (!FindEntry(target, cluster_no, &found, NULL))
+    {
+      Error(STATUS_NOT_FOUND, "%s not found.\n", target);
+      return;
+    }
+    if (found.entry.DIR_Attr & 0x10)
+      workers = WalkTree(cd(target, cluster_no), DefragVisit, &state);
+    else
+      DefragVisit(target, &found, cluster_no, 0, &state);
+  }
+
+  int total = 0;
+  for (int i = 0; i < workers; i++)
+    total += state.count[i];
+  DEFRAG_FILE* files = malloc((total + 1) * sizeof(DEFRAG_FILE));
+  for (int i = 0, n = 0; i < workers; n += state.count[i], i++)
+  {
+    if (state.count[i] > 0)
+      memcpy(&files[n], state.files[i], state.count[i] * sizeof(DEFRAG_FILE));
+    free(state.files[i]);
+  }
+  qsort(files, total, sizeof(DEFRAG_FILE), CompareDefragFiles);
+
+  FREE_RUN* runs;
+  int run_count = FindFreeRuns(&runs);
+  off_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  off_t budget = (off_t) budget_mb << 20, moved_bytes = 0;
+  int moved = 0, no_room = 0, left = 0;
+  unsigned long extents = 0;
+  for (int i = 0; i < total; i++)
+  {
+    off_t bytes = (off_t) files[i].clusters * cluster_size;
+    if (budget > 0 && moved_bytes + bytes > budget)
+      left++; // Next time
+    else if (RelocateFile(&files[i], runs, run_count))
+    {
+      moved++;
+      moved_bytes += bytes;
+      extents += files[i].extents;
+    }
+    else
+      no_room++;
+    free(files[i].path);
+  }
+  free(files);
+  free(runs);
+
+  fprintf(OUT, "%i fragmented files: %i moved (%lu extents into %i, %lld "
+          "bytes)", total, moved, extents, moved, (long long) moved_bytes);
+  if (no_room > 0)
+    fprintf(OUT, ", %i without a free run large enough", no_room);
+  if (left > 0)
+    fprintf(OUT, ", %i left for the next run (budget)", left);
+  fprintf(OUT, ".\n");
+}
 
-      // IGNORE LONG DIRECTORY NAME ENTRIES
-      while (long_entry.LDIR_Ord != 65)
-                             // THIS LOOP IS EXPLAINED IN Get_DIR_ENTRY() func
-      {
-        fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-        additional_offset += sizeof(long_entry);
+//------------------------------SPACE STATISTICS--------------------------------
 
-        if ((long_entry.LDIR_Ord == 65) && (long_entry.LDIR_Attr != 0xf))
-          continue;
-      }
+int StatsBucket(uint32_t value)
+{
+  return 31 - __builtin_clz(value);
+}
 
-      fread(&current, sizeof(current), 1, IMAGEFILE); // Read in new DIR_ENTRY
+void StatsEndRun(STATS_FREE* space)
+{
+  if (space->run == 0)
+    return;
+  space->histogram[StatsBucket(space->run)]++;
+  space->extents++;
+  if (space->run > space->largest)
+    space->largest = space->run;
+  space->run = 0;
+}
 
-      if (current.DIR_Name[0] == 0xE5) // If dir_entry is deallocated, skip
+void StatsScan(const uint32_t* fat, uint32_t n, STATS_FREE* space)
+// Free and bad entries are counted per lane, with no branch. Free space
+// and used space both come in long runs, so a vector that is all free only
+// extends the open run and one that is all used only ends it; the mixed
+// ones, at the edges of extents, go entry by entry
+{
+  const FAT_VECTOR mask = (FAT_VECTOR) {} + 0x0FFFFFFF; // Top 4 reserved
+  const FAT_VECTOR bad = (FAT_VECTOR) {} + 0x0FFFFFF7;
+  uint32_t i = 0;
+  for (; i + FAT_VECTOR_LANES <= n; i += FAT_VECTOR_LANES)
+  {
+    FAT_VECTOR next = *(const FAT_VECTOR*) &fat[i] & mask;
+    FAT_VECTOR_MASK is_free = (next == 0);
+    space->free_lanes -= (FAT_VECTOR) is_free;
+    space->bad_lanes -= (FAT_VECTOR) (next == bad);
+
+    FAT_VECTOR_PAIRS pairs = (FAT_VECTOR_PAIRS) is_free;
+    uint64_t all = pairs[0] & pairs[1], any = pairs[0] | pairs[1];
+    if (all == ~0ULL)
+      space->run += FAT_VECTOR_LANES;
+    else if (any == 0)
+      StatsEndRun(space);
+    else
+      for (int lane = 0; lane < FAT_VECTOR_LANES; lane++)
       {
-        data_offset += (sizeof(current) + additional_offset); // update data_off
-        continue;
+        if (is_free[lane])
+          space->run++;
+        else
+          StatsEndRun(space);
       }
+  }
 
+  for (; i < n; i++) // The last few, one at a time
+  {
+    uint32_t next = fat[i] & 0x0FFFFFFF;
+    space->free_count += (next == 0);
+    space->bad += (next == 0x0FFFFFF7);
+    if (next == 0)
+      space->run++;
+    else
+      StatsEndRun(space);
+  }
+}
 
-      if (strcmp((char *)current.DIR_Name, "") != 0) // If DIR_Name not empty,
-        printf("%s\n", current.DIR_Name);            // print
-
-      //if (current.DIR_Attr == 0x10)
-        //printf("\tIs a directory.\n", current.DIR_Name);
-
-      //Print_LDIR(long_entry);
-      //Print_DIR(current);
-
-      //printf("%x\t", current.DIR_FstClusHI);
-      //printf("%x\n", current.DIR_FstClusLO);
-
-      data_offset += (sizeof(current) + additional_offset); // update data_off
-    } // END OF INSIDE WHILE LOOP -- cluster fully read
+void StatsVisit(const char* path, NAMED_ENTRY* entry, uint32_t dir,
+                int worker, void* arg)
+{
+  STATS_TOTALS* totals = &((STATS_TOTALS*) arg)[worker];
+  DIR_ENTRY* current = &entry->entry;
+  if (current->DIR_Attr & 0x10)
+  {
+    totals->dirs++;
+    return;
+  }
+  totals->files++;
+  uint32_t first = ((uint32_t) current->DIR_FstClusHI << 16) |
+                   current->DIR_FstClusLO;
+  uint32_t clusters;
+  uint32_t extents = ChainExtents(first, &clusters);
+  if (extents == 0) // Empty file, no chain
+    return;
+  totals->extents += extents;
+  totals->extent_histogram[StatsBucket(extents)]++;
 
-    cluster_no = NextClusterNo(cluster_no);
-  } while(cluster_no < 0x0FFFFFF6); // End loop if final cluster
+  // Insertion into the short list of most fragmented files
+  if (extents < 2 || (totals->top_count == STATS_TOP &&
+                      extents <= totals->top[STATS_TOP - 1].extents))
+    return;
+  int i = STATS_TOP - 1;
+  if (totals->top_count < STATS_TOP)
+    i = totals->top_count++;
+  else
+    free(totals->top[i].path); // Evict the least fragmented
+  for (; i > 0 && totals->top[i - 1].extents < extents; i--)
+    totals->top[i] = totals->top[i - 1];
+  totals->top[i].path = strdup(path);
+  totals->top[i].extents = extents;
+  totals->top[i].clusters = clusters;
 }
 
-void ls_dirname(char* dirname, uint32_t cluster_no) // List contents of DIRNAME
+void JsonString(const char* text)
 {
-  if (strlen(dirname) > 11) // long dir names unsupported
+  fputc('"', OUT);
+  for (; *text != '\0'; text++)
   {
-    printf("Long directory names unsupported. 11 Character Maximum per ");
-    printf("FAT Spec Doc.\n");
-    return;
+    if (*text == '"' || *text == '\\')
+      fprintf(OUT, "\\%c", *text);
+    else if ((unsigned char) *text < 0x20)
+      fprintf(OUT, "\\u%04x", *text);
+    else
+      fputc(*text, OUT);
   }
+  fputc('"', OUT);
+}
 
-  if (strcmp(dirname, ".") == 0) // if listing current dir
-    ls_CWD(cluster_no);
-  else if (strcmp(dirname, "..") == 0) // if listing parent dir
-    ls_CWD( DIR_peek() );
+void PrintHistogram(const char* name, unsigned long* histogram, int json)
+{
+  int first = 1;
+  if (json)
+    fprintf(OUT, "\"%s\": [", name);
   else
+    fprintf(OUT, "%s:\n", name);
+  for (int k = 0; k < STATS_BUCKETS; k++)
   {
-    // Change directory in entered dirname
-    uint32_t new_cluster_no = cd(dirname, cluster_no);
-    if (new_cluster_no == cluster_no) // CD was unsuccessful (err printed)
-      return;
-    else                     // Traverse through new CWD and list contents
-      ls_CWD(new_cluster_no);
+    if (histogram[k] == 0)
+      continue;
+    unsigned long long low = 1ULL << k, high = (2ULL << k) - 1;
+    if (json)
+      fprintf(OUT, "%s{\"min\": %llu, \"max\": %llu, \"count\": %lu}",
+              first ? "" : ", ", low, high, histogram[k]);
+    else if (low == high)
+      fprintf(OUT, "  %10llu            %10lu\n", low, histogram[k]);
+    else
+      fprintf(OUT, "  %10llu-%-10llu %10lu\n", low, high, histogram[k]);
+    first = 0;
   }
+  if (json)
+    fprintf(OUT, "]");
 }
 
-int cd(char* dir, uint32_t cluster_no) // Change CWD to DIRNAME,
-                                       // return 0 for failure
+void stats(int json)
+// The FAT is read once, in order, in blocks: the free and used counts and
+// the free extents fall out of the same vector pass. Files come from a
+// walk, their chains followed through the cached FAT
 {
-  if (strcmp(dir, ".") == 0)  // Do not need to change into current directory
+  uint32_t clusters = ClusterLimit();
+  uint32_t cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  STATS_FREE space;
+  memset(&space, 0, sizeof(space));
+
+  uint32_t block = 16384; // FAT entries per read when it is not cached
+  uint32_t* buffer = (FAT_CACHE == NULL) ? malloc(block * 4) : NULL;
+  for (uint32_t base = 2; base < clusters; base += block)
   {
-    CURRENT_STACK_SIZE = 0;
-    return cluster_no;
+    uint32_t n = (clusters - base < block) ? clusters - base : block;
+    const uint32_t* fat = &FAT_CACHE[base];
+    if (FAT_CACHE == NULL)
+    {
+      if (ReadImage(buffer, n * 4, ClusterNo_to_FATOffset(base)) != 0)
+        break;
+      fat = buffer;
+    }
+    StatsScan(fat, n, &space);
   }
-  if (strcmp(dir, "..") == 0) // Change into parent directory using DIR_STACK
+  free(buffer);
+  StatsEndRun(&space);
+  for (int lane = 0; lane < FAT_VECTOR_LANES; lane++)
   {
-    return DIR_pop();
+    space.free_count += space.free_lanes[lane];
+    space.bad += space.bad_lanes[lane];
   }
-
-  DIR_ENTRY current;
-  LDIR_ENTRY long_entry;
-  int given_cluster = cluster_no; // Keep record of given cluster_no
-  int iteration = 0; // How many CLUSTERS traversed, for debugging
-
-  // ITERATE THROUGH DIRECTORY
-  do {
-    iteration++;
-
-    // FIND OFFSET OF CLUSTER IN THE DATA REGION
-    int data_offset = ClusterNo_To_DataOffset(cluster_no);
-    int starting_offset = data_offset;
-
-    // CHECK FOR . and .. ENTRIES
-    if ((cluster_no != FIRST_CLUSTER) && (iteration == 1))
+  uint32_t free_count = space.free_count, bad = space.bad;
+  uint32_t largest = space.largest;
+  unsigned long free_extents = space.extents;
+  unsigned long* free_histogram = space.histogram;
+  uint32_t total = clusters - 2, used = total - free_count - bad;
+
+  // FILE LAYOUT -- per worker, merged here
+  STATS_TOTALS totals[WALK_WORKERS_MAX];
+  memset(totals, 0, sizeof(totals));
+  int workers = WalkTree(FIRST_CLUSTER, StatsVisit, totals);
+  for (int w = 1; w < workers; w++)
+  {
+    totals[0].files += totals[w].files;
+    totals[0].dirs += totals[w].dirs;
+    totals[0].extents += totals[w].extents;
+    for (int k = 0; k < STATS_BUCKETS; k++)
+      totals[0].extent_histogram[k] += totals[w].extent_histogram[k];
+  }
+  STATS_FILE top[STATS_TOP * WALK_WORKERS_MAX];
+  int top_count = 0;
+  for (int w = 0; w < workers; w++)
+    for (int i = 0; i < totals[w].top_count; i++)
+      top[top_count++] = totals[w].top[i];
+  for (int i = 1; i < top_count; i++) // Few entries: insertion sort
+    for (int j = i; j > 0 && top[j - 1].extents < top[j].extents; j--)
     {
-      DIR_ENTRY OneDot, TwoDots; // dir entries for . and .. do not have
-                                 // long_entry preceding them
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-      data_offset += sizeof(OneDot);
-
-      fread(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-      data_offset += sizeof(TwoDots);
+      STATS_FILE swap = top[j];
+      top[j] = top[j - 1];
+      top[j - 1] = swap;
     }
+  unsigned long chained = 0; // files with at least one cluster
+  for (int k = 0; k < STATS_BUCKETS; k++)
+    chained += totals[0].extent_histogram[k];
+  double average = (chained > 0) ? (double) totals[0].extents / chained : 0;
+  int listed = (top_count < STATS_TOP) ? top_count : STATS_TOP;
 
-    // READ IN DIR_ENTRY VALUES UNTIL ALL CLUSTER SPACE HAS BEEN READ IN
-    // (Very likely empty space will exist for additional DIR_ENTRYs)
-    while (data_offset < ((starting_offset + BOOT.BPB_BytsPerSec)
-                                           * BOOT.BPB_SecPerClus)) {
-
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-
-      int additional_offset = sizeof(long_entry);
-
-      if (long_entry.LDIR_Ord == 0x00) // The remainder of the cluster is empty
-        break;
+  if (json)
+  {
+    fprintf(OUT, "{\"cluster_size\": %u, \"clusters\": {\"total\": %u, "
+            "\"used\": %u, \"free\": %u, \"bad\": %u}, ", cluster_size,
+            total, used, free_count, bad);
+    fprintf(OUT, "\"free_extents\": {\"count\": %lu, \"largest\": %u, ",
+            free_extents, largest);
+    PrintHistogram("histogram", free_histogram, 1);
+    fprintf(OUT, "}, \"files\": {\"count\": %lu, \"directories\": %lu, "
+            "\"with_data\": %lu, \"extents\": %llu, "
+            "\"average_extents\": %.3f, ", totals[0].files, totals[0].dirs,
+            chained, totals[0].extents, average);
+    PrintHistogram("histogram", totals[0].extent_histogram, 1);
+    fprintf(OUT, ", \"most_fragmented\": [");
+    for (int i = 0; i < listed; i++)
+    {
+      fprintf(OUT, "%s{\"path\": ", (i > 0) ? ", " : "");
+      JsonString(top[i].path);
+      fprintf(OUT, ", \"extents\": %u, \"clusters\": %u}", top[i].extents,
+              top[i].clusters);
+    }
+    fprintf(OUT, "]}}\n");
+  }
+  else
+  {
+    fprintf(OUT, "Clusters: %u of %u bytes, %u used (%.1f%%), %u free, "
+            "%u bad\n", total, cluster_size, used,
+            (total > 0) ? 100.0 * used / total : 0.0, free_count, bad);
+    fprintf(OUT, "Free extents: %lu, largest %u clusters\n", free_extents,
+            largest);
+    PrintHistogram("Free extent sizes (clusters, extents)", free_histogram,
+                   0);
+    fprintf(OUT, "Files: %lu (%lu with data) in %lu directories, %.2f "
+            "extents per file on average\n", totals[0].files, chained,
+            totals[0].dirs, average);
+    PrintHistogram("Extents per file (extents, files)",
+                   totals[0].extent_histogram, 0);
+    if (listed > 0)
+      fprintf(OUT, "Most fragmented:\n");
+    for (int i = 0; i < listed; i++)
+      fprintf(OUT, "  %8u extents %8u clusters  %s\n", top[i].extents,
+              top[i].clusters, top[i].path);
+  }
+  for (int i = 0; i < top_count; i++)
+    free(top[i].path);
+}
 
-      // IGNORE LONG DIRECTORY NAME ENTRIES
-      while (long_entry.LDIR_Ord != 65)
-                              // THIS LOOP IS EXPLAINED IN Get_DIR_ENTRY() func
-     {
-        fread(&long_entry, sizeof(long_entry), 1, IMAGEFILE);
-        additional_offset += sizeof(long_entry);
+//----------------------------ALLOCATION BENCHMARK------------------------------
 
-        if ((long_entry.LDIR_Ord == 65) && (long_entry.LDIR_Attr != 0xf))
-        // If statement explained in Get_DIR_ENTRY() func
-          continue;
-     }
+int BenchCommand(uint32_t* cwd, const char* format, ...)
+{
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  tokenlist tokens;
+  if (get_tokens(line, &tokens) == 0)
+    ExecuteCommand(&tokens, cwd);
+  return COMMAND_STATUS;
+}
 
-      fread(&current, sizeof(current), 1, IMAGEFILE); // Read in new DIR_ENTRY
+void BenchSeeks(uint32_t cluster_no, uint32_t* last, unsigned long* seeks,
+                unsigned long long* distance)
+{
+  for (; cluster_no >= 2 && cluster_no < 0x0FFFFFF8;
+       cluster_no = NextClusterNo(cluster_no))
+  {
+    if (cluster_no != *last + 1)
+    {
+      (*seeks)++;
+      *distance += (cluster_no > *last) ? cluster_no - *last
+                                        : *last - cluster_no;
+    }
+    *last = cluster_no;
+  }
+}
 
-      if (current.DIR_Name[0] == 0xE5) // If dir_entry is deallocated, skip
+int AllocBench(int dirs, int files, int clusters, uint32_t cluster_no,
+               ALLOC_BENCH_RESULT* result)
+// The tree is ALLOCBCH/Dd/Fd_f. Files grow one cluster per round, round
+// robin over every file, the way concurrent appenders interleave. Reads
+// go through the shell commands, output discarded
+{
+  uint32_t cwd = cluster_no;
+  int cluster_size = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
+  int status = STATUS_OK;
+  struct timespec start, end;
+  memset(result, 0, sizeof(*result));
+
+  // BUILD
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  status |= BenchCommand(&cwd, "mkdir ALLOCBCH");
+  for (int d = 0; d < dirs && status == STATUS_OK; d++)
+  {
+    status |= BenchCommand(&cwd, "mkdir ALLOCBCH/D%d", d);
+    for (int f = 0; f < files; f++)
+      status |= BenchCommand(&cwd, "creat ALLOCBCH/D%d/F%d_%d", d, d, f);
+  }
+  for (int round = 0; round < clusters && status == STATUS_OK; round++)
+    for (int d = 0; d < dirs; d++)
+      for (int f = 0; f < files; f++)
       {
-        data_offset += (sizeof(current) + additional_offset); // update data_off
-        continue;
+        status |= BenchCommand(&cwd, "open ALLOCBCH/D%d/F%d_%d rw", d, d, f);
+        status |= BenchCommand(&cwd, "lseek ALLOCBCH/D%d/F%d_%d %d", d, d, f,
+                               round * cluster_size);
+        status |= BenchCommand(&cwd, "write ALLOCBCH/D%d/F%d_%d %d \"x\"", d,
+                               d, f, cluster_size);
+        status |= BenchCommand(&cwd, "close ALLOCBCH/D%d/F%d_%d", d, d, f);
       }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->build = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  // SEQUENTIAL READ -- every file in turn
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int d = 0; d < dirs && status == STATUS_OK; d++)
+    for (int f = 0; f < files; f++)
+    {
+      status |= BenchCommand(&cwd, "open ALLOCBCH/D%d/F%d_%d r", d, d, f);
+      status |= BenchCommand(&cwd, "read ALLOCBCH/D%d/F%d_%d %d", d, d, f,
+                             clusters * cluster_size);
+      status |= BenchCommand(&cwd, "close ALLOCBCH/D%d/F%d_%d", d, d, f);
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->sequential = (end.tv_sec - start.tv_sec) +
+                       (end.tv_nsec - start.tv_nsec) / 1e9;
 
-      char* temp = RemoveWhiteSpaces(current.DIR_Name);
-
-      //printf("%s\n", dir);
-      //printf("%s\n", temp);
-      //printf("%s\n", current.DIR_Name);
+  // LS + READ -- list a directory, then read its files
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int d = 0; d < dirs && status == STATUS_OK; d++)
+  {
+    status |= BenchCommand(&cwd, "ls ALLOCBCH/D%d", d);
+    for (int f = 0; f < files; f++)
+    {
+      status |= BenchCommand(&cwd, "open ALLOCBCH/D%d/F%d_%d r", d, d, f);
+      status |= BenchCommand(&cwd, "read ALLOCBCH/D%d/F%d_%d %d", d, d, f,
+                             clusters * cluster_size);
+      status |= BenchCommand(&cwd, "close ALLOCBCH/D%d/F%d_%d", d, d, f);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->listing = (end.tv_sec - start.tv_sec) +
+                    (end.tv_nsec - start.tv_nsec) / 1e9;
 
-      // IF dir IS FOUND IN THE DIRECTORY-----------------------
-      if (strcmp(dir, temp) == 0)
+  // SEEK MODEL -- the same two access orders, replayed on the layout
+  if (status == STATUS_OK)
+  {
+    uint32_t bench = Get_Child_Cluster_No(Get_DIR_ENTRY("ALLOCBCH",
+                                                        cluster_no));
+    uint32_t sequential_last = 0, listing_last = 0;
+    NAMED_ENTRY* subdirs;
+    int subdir_count = ReadDirectory(bench, &subdirs);
+    for (int d = 0; d < subdir_count; d++)
+    {
+      uint32_t sub = Get_Child_Cluster_No(subdirs[d].entry);
+      BenchSeeks(sub, &listing_last, &result->listing_seeks,
+                 &result->listing_distance);
+      NAMED_ENTRY* entries;
+      int count = ReadDirectory(sub, &entries);
+      for (int f = 0; f < count; f++)
       {
-        if (current.DIR_Attr != 0x10) // dir fnd, check if actually a directory
-        {
-          printf("%s is not a directory.\n", dir);
-          return given_cluster; // Cannot change dir, so return initial cluster
-        }
-
-        //printf("High byte: %x\t", current.DIR_FstClusHI);
-        //printf("Low byte: %x\n", current.DIR_FstClusLO);
-
-        int new_cluster_no = Get_Child_Cluster_No(current);
-        DIR_push(new_cluster_no);
-
-        // Return the hex string value as an int
-        return new_cluster_no;
+        uint32_t first = Get_Child_Cluster_No(entries[f].entry);
+        BenchSeeks(first, &sequential_last, &result->sequential_seeks,
+                   &result->sequential_distance);
+        BenchSeeks(first, &listing_last, &result->listing_seeks,
+                   &result->listing_distance);
+        uint32_t chain;
+        result->extents += ChainExtents(first, &chain);
+        result->files++;
       }
+      FreeDirectory(entries, count);
+    }
+    FreeDirectory(subdirs, subdir_count);
+  }
 
-      data_offset += (sizeof(current) + additional_offset); // update data_off
-    } // END OF INSIDE WHILE LOOP
-
-    cluster_no = NextClusterNo(cluster_no);
-  } while(cluster_no < 0x0FFFFFF6);
-
-  // IF WE FINISH LOOP ITERATION -- dir NOT FOUND
-  printf("%s not found in current working directory.\n", dir);
-  return given_cluster; // Cannot change dir, so return initial cluster
+  // REMOVE -- the free map is back where it was for the next policy
+  for (int d = 0; d < dirs; d++)
+  {
+    BenchCommand(&cwd, "rm ALLOCBCH/D%d/*", d);
+    BenchCommand(&cwd, "rmdir ALLOCBCH/D%d", d);
+  }
+  BenchCommand(&cwd, "rmdir ALLOCBCH");
+  return status;
 }
 
-void creat(char* file, uint32_t cluster_no, DIR_ENTRY NewFile)
-// Create file FILENAME in CWD, size 0 bytes
+void allocbench(int dirs, int files, int clusters, uint32_t cluster_no)
+// Build the same tree under each policy in turn, time reading it back in
+// file order and directory by directory, and count the seeks each order
+// would cost on a disk
 {
-  // Check for valid entry
-  if (DirAlreadyExists(file, cluster_no) != 0) {
-    printf("Filename already exists.\n");
+  if (dirs < 1 || files < 1 || clusters < 1 || dirs * files > 4096)
+  {
+    Error(STATUS_INVALID, "Error. Counts must be positive, at most 4096 "
+          "files.\n");
+    return;
+  }
+  if (Get_DIR_ENTRY("ALLOCBCH", cluster_no).DIR_Name[0] != 0x00)
+  {
+    Error(STATUS_EXISTS, "Error. ALLOCBCH already exists.\n");
     return;
   }
 
-  if (strlen(file) > 8) {
-		printf("Filename too long. Maximum 8 chararcters supported.\n");
-		return;
-	}
-
-  LDIR_ENTRY NewFileLongEntry;
-  NewFileLongEntry.LDIR_Ord = 65;
-  NewFileLongEntry.LDIR_Attr = 0xf;
-  NewFileLongEntry.LDIR_FstClusLO = 0;
+  FILE* output = OUT;
+  FILE* discard = fopen("/dev/null", "w");
+  ALLOC_POLICY_KIND policy = ALLOC_POLICY;
+  ALLOC_BENCH_RESULT results[3];
+  int status = STATUS_OK, kind;
+  for (kind = 0; kind < 3 && status == STATUS_OK; kind++)
+  {
+    ALLOC_POLICY = kind;
+    OUT = discard;
+    status = AllocBench(dirs, files, clusters, cluster_no, &results[kind]);
+    OUT = output;
+  }
+  ALLOC_POLICY = policy;
+  fclose(discard);
+  COMMAND_STATUS = STATUS_OK; // Reset by the commands run above
+  if (status != STATUS_OK)
+  {
+    Error(status, "Error. allocbench failed under policy %s.\n",
+          ALLOC_POLICY_NAMES[kind - 1]);
+    return;
+  }
 
-  // Get data_offset of first free space in CWD cluster
+  fprintf(OUT, "%d dirs x %d files x %d clusters\n", dirs, files, clusters);
+  fprintf(OUT, "%-6s %9s %9s %8s %11s %9s %8s %11s %8s\n", "policy",
+          "build ms", "seq ms", "seeks", "seek dist", "ls+rd ms", "seeks",
+          "seek dist", "extents");
+  for (kind = 0; kind < 3; kind++)
+  {
+    ALLOC_BENCH_RESULT* r = &results[kind];
+    fprintf(OUT, "%-6s %9.1f %9.1f %8lu %11llu %9.1f %8lu %11llu %8.2f\n",
+            ALLOC_POLICY_NAMES[kind], r->build * 1000, r->sequential * 1000,
+            r->sequential_seeks, r->sequential_distance, r->listing * 1000,
+            r->listing_seeks, r->listing_distance,
+            (r->files > 0) ? (double) r->extents / r->files : 0.0);
+  }
+}
 
-  int data_offset = GetFreeEntryOffset(cluster_no);
+//-------------------------------LOAD GENERATOR---------------------------------
 
-  while (NextClusterNo(cluster_no) < 0x0FFFFFF6)
-    cluster_no = NextClusterNo(cluster_no);
+const char* LOAD_OP_NAMES[] = { "create", "append", "read", "delete" };
 
-  //printf("cluster_no: %i\n", cluster_no);
+int ParseLoadSpec(tokenlist* tokens, LOAD_SPEC* spec)
+{
+  LOAD_SPEC defaults = { 4, 1000, 10, 32, { 20, 40, 30, 10 }, 4096, 65536,
+                         1, 4096, 1, 0 };
+  *spec = defaults;
 
-  // If cluster is full allocate new cluster, update data_offset
-  if (data_offset == -999)
+  for (int i = 1; i < tokens->size; i++)
   {
-    // Update FAT
-    uint32_t new_cluster = Find_Free_Cluster();
-    if (new_cluster == -1) // NO MORE MEMORY
-      return;
-    UpdateClusterInFAT(cluster_no, new_cluster);
-    UpdateClusterInFAT(new_cluster, 0xFFFFFFFF);
-
-    data_offset = ClusterNo_To_DataOffset(new_cluster);
+    const char* option = tokens->items[i];
+    if (strcmp(option, "-u") == 0)
+      spec->log_sizes = 0;
+    else if (strcmp(option, "-k") == 0)
+      spec->keep = 1;
+    else if (i + 1 == tokens->size || option[0] != '-' || option[2] != '\0')
+      return -1;
+    else
+    {
+      const char* value = tokens->items[++i];
+      int parsed;
+      switch (option[1])
+      {
+        case 'c': parsed = sscanf(value, "%d", &spec->clients); break;
+        case 'n': parsed = sscanf(value, "%d", &spec->ops); break;
+        case 'r': parsed = sscanf(value, "%d", &spec->rounds); break;
+        case 'w': parsed = sscanf(value, "%d", &spec->files); break;
+        case 'A': parsed = sscanf(value, "%d", &spec->append); break;
+        case 's': parsed = sscanf(value, "%u", &spec->seed); break;
+        case 'm':
+          parsed = sscanf(value, "%d:%d:%d:%d", &spec->mix[LOAD_CREATE],
+                          &spec->mix[LOAD_APPEND], &spec->mix[LOAD_READ],
+                          &spec->mix[LOAD_DELETE]) == 4;
+          break;
+        case 'z':
+          parsed = sscanf(value, "%d-%d", &spec->min_size, &spec->max_size);
+          if (parsed == 1)
+            spec->max_size = spec->min_size;
+          break;
+        default: parsed = 0;
+      }
+      if (parsed < 1)
+        return -1;
+    }
   }
 
-  // Write LDIR and DIR Entries to data_offset
-  fseek(IMAGEFILE, data_offset, SEEK_SET);
-  fwrite(&NewFileLongEntry, sizeof(NewFileLongEntry), 1, IMAGEFILE);
-  fwrite(&NewFile, sizeof(NewFile), 1, IMAGEFILE);
+  int weight = 0;
+  for (int op = 0; op < LOAD_OPS; op++)
+  {
+    if (spec->mix[op] < 0)
+      return -1;
+    weight += spec->mix[op];
+  }
+  if (weight == 0 || spec->clients < 1 || spec->clients > LOAD_CLIENTS_MAX ||
+      spec->files < 1 || spec->files > LOAD_FILES_MAX || spec->ops < 1 ||
+      spec->rounds < 1 || spec->min_size < 1 ||
+      spec->max_size < spec->min_size || spec->append < 1)
+    return -1;
+  return 0;
 }
 
-void mkdir(char* dir, uint32_t cluster_no) // Make directory DIRNAME in CWD
+int LoadSize(LOAD_CLIENT* client)
+// Log-uniform as a power-of-two band picked uniformly, then a size uniform
+// within it: as many files of 1-2 KB as of 32-64 KB
 {
-  // All checks for valid entry covered within creat() function call
-
-  // Create new_directory DIR_ENTRY and set its attributes to DIR
-  DIR_ENTRY new_directory = create_newfile(dir);
-  new_directory.DIR_Attr = 0x10;
-
-  // Find first free cluster for new_directory in FAT
-  uint32_t new_cluster = Find_Free_Cluster();
-  if (new_cluster == -1) // NO MORE MEMORY
-    return;
+  long low = client->spec->min_size, high = client->spec->max_size;
+  if (client->spec->log_sizes)
+  {
+    int bands = 1;
+    for (long band = low; band * 2 <= high; band *= 2)
+      bands++;
+    for (int k = rand_r(&client->seed) % bands; k > 0; k--)
+      low *= 2;
+    if (low * 2 - 1 < high)
+      high = low * 2 - 1;
+  }
+  return low + rand_r(&client->seed) % (high - low + 1);
+}
 
-  // Add new_directory DIR_ENTRY to CWD
-  creat(dir, cluster_no, new_directory);
+int LoadOp(LOAD_CLIENT* client, int op, int slot)
+// Slot state only changes once the commands doing it succeed
+{
+  char name[16];
+  snprintf(name, sizeof(name), "C%02dF%04d", client->id, slot);
+  int* size = &client->sizes[slot];
+  int status = STATUS_OK;
 
-  // Allocate cluster to new_directory (update FrstClusHI & FrstClusLO)
-  // (And set new cluster's FAT offset to 0xFFFFFFFF)
-  int data_offset = Get_DIR_ENTRY_Offset(dir, cluster_no);
-  //printf("Offset of current dir: %i\n", data_offset);
-  AllocateClusterToEmptyFile(new_directory, data_offset, new_cluster);
+  switch (op)
+  {
+    case LOAD_CREATE:
+    {
+      int bytes = LoadSize(client);
+      if ((status = BenchCommand(&client->cwd, "creat %s", name)) != STATUS_OK)
+        break;
+      *size = 0;
+      BenchCommand(&client->cwd, "open %s rw", name);
+      status = BenchCommand(&client->cwd, "write %s %d \"x\"", name, bytes);
+      BenchCommand(&client->cwd, "close %s", name);
+      if (status == STATUS_OK)
+        *size = bytes;
+      break;
+    }
+    case LOAD_APPEND:
+      BenchCommand(&client->cwd, "open %s rw", name);
+      BenchCommand(&client->cwd, "lseek %s %d", name, *size);
+      status = BenchCommand(&client->cwd, "write %s %d \"x\"", name,
+                            client->spec->append);
+      BenchCommand(&client->cwd, "close %s", name);
+      if (status == STATUS_OK)
+        *size += client->spec->append;
+      break;
+    case LOAD_READ:
+      BenchCommand(&client->cwd, "open %s r", name);
+      status = BenchCommand(&client->cwd, "read %s %d", name,
+                            (*size > 0) ? *size : 1);
+      BenchCommand(&client->cwd, "close %s", name);
+      break;
+    case LOAD_DELETE:
+      if ((status = BenchCommand(&client->cwd, "rm %s", name)) == STATUS_OK)
+        *size = -1;
+      break;
+  }
+  return status;
+}
 
-  // Write . and .. entries at new_cluster's data_offset
-  data_offset = ClusterNo_To_DataOffset(new_cluster);
-  //printf("Offset of newly allocated dir: %i\n", data_offset);
-  DIR_ENTRY OneDot = create_newfile(".");
-  DIR_ENTRY TwoDots = create_newfile("..");
+void* LoadClient(void* arg)
+// Ops land on a random slot. One that needs a file finding the slot empty
+// creates it instead, and a create finding it full appends, so the working
+// set fills up and stays full whatever the mix
+{
+  LOAD_CLIENT* client = arg;
+  OUT = fopen("/dev/null", "w");
+  TRACE_ACTIVE = 1; // Not recorded: the load command itself is
 
-  if (cluster_no != BOOT.BPB_RootClus) // If not starting in root
-  // SET DIR_FstClusHI and DIR_FstClusLO for .. to current dir's first cluster
-  // (which is actually cluster_no)
-    TwoDots = UpdateTwoDotDirectory(TwoDots, cluster_no);
+  int weight = 0;
+  for (int op = 0; op < LOAD_OPS; op++)
+    weight += client->spec->mix[op];
 
-  fseek(IMAGEFILE, data_offset, SEEK_SET);
-  fwrite(&OneDot, sizeof(OneDot), 1, IMAGEFILE);
-  fwrite(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
+  for (int i = 0; i < client->ops; i++)
+  {
+    int pick = rand_r(&client->seed) % weight, op = 0;
+    while (pick >= client->spec->mix[op])
+      pick -= client->spec->mix[op++];
+    int slot = rand_r(&client->seed) % client->spec->files;
+    if (client->sizes[slot] < 0)
+      op = LOAD_CREATE;
+    else if (op == LOAD_CREATE)
+      op = LOAD_APPEND;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (LoadOp(client, op, slot) != STATUS_OK)
+      client->failures++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    client->ns[client->done] = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                               end.tv_nsec - start.tv_nsec;
+    client->kind[client->done++] = op;
+  }
+  fclose(OUT);
+  return NULL;
 }
 
-void mv(char* dir1, char* dir2, uint32_t cluster_no)
-// Move file or dir -- mv FROM TO
+void LoadLayout(LOAD_CLIENT* clients, int count, unsigned long* files,
+                unsigned long* extents, unsigned long* free_extents)
 {
-  // Check if dir1 is . or ..
-  if (strcmp(dir1, ".") == 0 || strcmp(dir1, "..") == 0)
+  *files = *extents = *free_extents = 0;
+  for (int c = 0; c < count; c++)
   {
-    printf("%s cannot be moved into another directory.\n", dir1);
-    return;
+    NAMED_ENTRY* entries;
+    int n = ReadDirectory(clients[c].cwd, &entries);
+    for (int i = 0; i < n; i++)
+    {
+      uint32_t first = Get_Child_Cluster_No(entries[i].entry), chain;
+      if (entries[i].entry.DIR_Attr == 0x10 || first < 2)
+        continue; // . and .., or no data yet
+      (*files)++;
+      *extents += ChainExtents(first, &chain);
+    }
+    FreeDirectory(entries, n);
   }
-  // Check if dir 2 is . or ..
-  if (strcmp(dir2, ".") == 0)
-    return;
-  if (strcmp(dir2, "..") == 0)
+
+  int in_run = 0;
+  for (uint32_t cluster = 2; cluster < ClusterLimit(); cluster++)
   {
-    printf("Feature unsupported.\n");
-    return;
+    int free_cluster = NextClusterNo(cluster) == 0;
+    *free_extents += free_cluster && !in_run;
+    in_run = free_cluster;
   }
+}
 
-  // If file is open, close before moving
-  int entry_index = Get_OPENFILE_Entry(dir1);
-  if (entry_index != -1) // check if file is open
-    close(dir1, cluster_no);
+void LoadRow(const char* name, unsigned long long* ns, long count,
+             double seconds)
+{
+  qsort(ns, count, sizeof(ns[0]), CompareLatency);
+  unsigned long long total = 0;
+  for (long i = 0; i < count; i++)
+    total += ns[i];
+  fprintf(OUT, "%-8s %8ld %9.0f %9.1f %9.1f %9.1f %9.1f %9.1f", name, count,
+          (seconds > 0) ? count / seconds : 0.0, total / 1000.0 / count,
+          ns[(long) (0.5 * (count - 1))] / 1000.0,
+          ns[(long) (0.99 * (count - 1))] / 1000.0,
+          ns[(long) (0.999 * (count - 1))] / 1000.0, ns[count - 1] / 1000.0);
+}
 
-  // Check if dir1 exists in CWD
-  DIR_ENTRY to_move = Get_DIR_ENTRY(dir1, cluster_no);
-  if (to_move.DIR_Name[0] == 0x00) // If it does not, there is no entry to move
+void load(LOAD_SPEC* spec, uint32_t cluster_no)
+// Clients run in rounds of spec->ops operations between them; between
+// rounds, with every client stopped, the working set's extents per file
+// and the free space's extents are counted, so the table shows how the
+// image fragments as the run goes on. Latencies are exact, per operation
+// (a create is creat, open, write and close)
+{
+  if (Get_DIR_ENTRY("LOADWORK", cluster_no).DIR_Name[0] != 0x00)
   {
-    printf("%s not found in CWD.\n", dir1);
+    Error(STATUS_EXISTS, "Error. LOADWORK already exists.\n");
     return;
   }
 
-  // Check if dir2 exists in CWD
-  DIR_ENTRY destination = Get_DIR_ENTRY(dir2, cluster_no);
-
-  if (destination.DIR_Name[0] != 0x00 && destination.DIR_Attr == 0x10)
-  // If dir2 found in CWD and it is a directory
-  // Then move dir1 (a file OR another dir) to dir2
+  // SET UP -- LOADWORK/Cnn per client, made here where cluster_no is held
+  uint32_t cwd = cluster_no;
+  FILE* output = OUT;
+  OUT = fopen("/dev/null", "w");
+  int status = BenchCommand(&cwd, "mkdir LOADWORK");
+  uint32_t work = Get_Child_Cluster_No(Get_DIR_ENTRY("LOADWORK", cluster_no));
+  LOAD_CLIENT clients[LOAD_CLIENTS_MAX];
+  long per_client = (long) (spec->ops / spec->clients + 1) * spec->rounds;
+  for (int c = 0; c < spec->clients; c++)
   {
-    uint32_t new_cluster_no = cd(dir2, cluster_no);
-    DIR_ENTRY check = Get_DIR_ENTRY(dir1, new_cluster_no);
+    LOAD_CLIENT* client = &clients[c];
+    memset(client, 0, sizeof(*client));
+    client->spec = spec;
+    client->id = c;
+    client->seed = spec->seed * 7919 + c;
+    client->sizes = malloc(spec->files * sizeof(int));
+    for (int f = 0; f < spec->files; f++)
+      client->sizes[f] = -1;
+    client->ns = malloc(per_client * sizeof(unsigned long long));
+    client->kind = malloc(per_client);
+    char name[8];
+    snprintf(name, sizeof(name), "C%02d", c);
+    status |= BenchCommand(&cwd, "mkdir LOADWORK/%s", name);
+    client->cwd = Get_Child_Cluster_No(Get_DIR_ENTRY(name, work));
+  }
+  fclose(OUT);
+  OUT = output;
+  COMMAND_STATUS = STATUS_OK; // Reset by the commands run above
 
-    // Check if dir2 exists in child directory
-    if (check.DIR_Name[0] != 0x00)
+  if (status == STATUS_OK)
+  {
+    fprintf(OUT, "%d clients, %d rounds of %d ops, mix create:append:read:"
+            "delete %d:%d:%d:%d, %d files per client of %d-%d bytes (%s), "
+            "appends of %d\n", spec->clients, spec->rounds, spec->ops,
+            spec->mix[LOAD_CREATE], spec->mix[LOAD_APPEND],
+            spec->mix[LOAD_READ], spec->mix[LOAD_DELETE], spec->files,
+            spec->min_size, spec->max_size,
+            spec->log_sizes ? "log-uniform" : "uniform", spec->append);
+    fprintf(OUT, "%-8s %8s %9s %9s %9s %9s %9s %9s %7s %8s %9s\n", "ROUND",
+            "OPS", "OPS/S", "AVG_US", "P50_US", "P99_US", "P99.9_US",
+            "MAX_US", "FILES", "EXT/FILE", "FREE_EXT");
+
+    unsigned long long* all = malloc(per_client * spec->clients *
+                                     sizeof(unsigned long long));
+    double run_seconds = 0;
+    for (int round = 1; round <= spec->rounds; round++)
     {
-        cluster_no = cd("..", new_cluster_no);
-        printf("The name is already being used by another file.\n", dir2);
-        return;
+      pthread_t threads[LOAD_CLIENTS_MAX];
+      long first[LOAD_CLIENTS_MAX];
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int c = 0; c < spec->clients; c++)
+      {
+        clients[c].ops = spec->ops / spec->clients +
+                         (c < spec->ops % spec->clients);
+        first[c] = clients[c].done;
+        pthread_create(&threads[c], NULL, LoadClient, &clients[c]);
+      }
+      for (int c = 0; c < spec->clients; c++)
+        pthread_join(threads[c], NULL);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double seconds = (end.tv_sec - start.tv_sec) +
+                       (end.tv_nsec - start.tv_nsec) / 1e9;
+      run_seconds += seconds;
+
+      long count = 0;
+      for (int c = 0; c < spec->clients; c++)
+        for (long i = first[c]; i < clients[c].done; i++)
+          all[count++] = clients[c].ns[i];
+      unsigned long files, extents, free_extents;
+      LoadLayout(clients, spec->clients, &files, &extents, &free_extents);
+      char name[16];
+      snprintf(name, sizeof(name), "%d", round);
+      LoadRow(name, all, count, seconds);
+      fprintf(OUT, " %7lu %8.2f %9lu\n", files,
+              (files > 0) ? (double) extents / files : 0.0, free_extents);
     }
 
-    rm_DIR_ENTRY(dir1, cluster_no);
-    creat(dir1, new_cluster_no, to_move);
+    // PER OPERATION -- over the whole run
+    unsigned long failures = 0;
+    for (int c = 0; c < spec->clients; c++)
+      failures += clients[c].failures;
+    fprintf(OUT, "\n%-8s %8s %9s %9s %9s %9s %9s %9s\n", "OP", "OPS", "OPS/S",
+            "AVG_US", "P50_US", "P99_US", "P99.9_US", "MAX_US");
+    for (int op = 0; op <= LOAD_OPS; op++) // LOAD_OPS: every op
+    {
+      long count = 0;
+      for (int c = 0; c < spec->clients; c++)
+        for (long i = 0; i < clients[c].done; i++)
+          if (op == LOAD_OPS || clients[c].kind[i] == op)
+            all[count++] = clients[c].ns[i];
+      if (count == 0)
+        continue;
+      LoadRow((op == LOAD_OPS) ? "total" : LOAD_OP_NAMES[op], all, count,
+              run_seconds);
+      fprintf(OUT, "\n");
+    }
+    fprintf(OUT, "%lu failed operations\n", failures);
+    free(all);
+  }
 
-    if (to_move.DIR_Attr == 0x10)
-    // If moving a directory, need to update its .. entry to refelct new parent
+  // CLEAN UP
+  output = OUT;
+  OUT = fopen("/dev/null", "w");
+  for (int c = 0; c < spec->clients; c++)
+  {
+    if (!spec->keep)
     {
-      uint32_t child_cluster = cd(dir1, new_cluster_no);
-      DIR_ENTRY TwoDots = Get_DIR_ENTRY("..", child_cluster);
-      TwoDots = UpdateTwoDotDirectory(TwoDots, new_cluster_no);
-      int data_offset = Get_DIR_ENTRY_Offset("..", child_cluster);
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
-      fwrite(&TwoDots, sizeof(TwoDots), 1, IMAGEFILE);
-      cluster_no = cd("..", child_cluster);
+      BenchCommand(&cwd, "rm LOADWORK/C%02d/*", c);
+      BenchCommand(&cwd, "rmdir LOADWORK/C%02d", c);
     }
-    cluster_no = cd("..", new_cluster_no);
+    free(clients[c].sizes);
+    free(clients[c].ns);
+    free(clients[c].kind);
+  }
+  if (!spec->keep)
+    BenchCommand(&cwd, "rmdir LOADWORK");
+  fclose(OUT);
+  OUT = output;
+  COMMAND_STATUS = STATUS_OK;
+  if (status != STATUS_OK)
+    Error(status, "Error. Cannot create LOADWORK.\n");
+}
+
+//------------------------------INSTRUMENTATION---------------------------------
+
+#ifdef FAT_PERF
+const char* PERF_REGION_NAMES[] = { "reserved", "fat", "directory", "data" };
+
+void PerfIO(int write, size_t size, off_t offset)
+// Regions by offset: reserved sectors (and the boot sector read before
+// BOOT is known), the FATs, then the data region, which is file data inside
+// a PERF_FILE_DATA scope and directories outside
+{
+  off_t fat_start = (off_t) BOOT.BPB_RsvdSecCnt * BOOT.BPB_BytsPerSec;
+  int region = (offset < fat_start || fat_start == 0) ? PERF_RESERVED
+             : (offset < ClusterNo_To_DataOffset(2)) ? PERF_FAT
+             : (PERF_IN_FILE_DATA > 0) ? PERF_DATA : PERF_DIRECTORY;
+  if (write)
+  {
+    PERF_ADD(writes[region], 1);
+    PERF_ADD(bytes_written[region], size);
   }
-  else if (destination.DIR_Name[0] != 0x00)
-  // If dir2 found in CWD and it is a file that already exists
-    printf("The name is already being used by another file.\n", dir2);
   else
-  // If dir2 NOT FOUND in CWD, rename file
   {
-    strcpy(to_move.DIR_Name, dir2);
-    int data_offset = Get_DIR_ENTRY_Offset(dir1, cluster_no);
-    fseek(IMAGEFILE, data_offset, SEEK_SET);
-    fwrite(&to_move, sizeof(to_move), 1, IMAGEFILE);
+    PERF_ADD(reads[region], 1);
+    PERF_ADD(bytes_read[region], size);
   }
+  off_t last = __atomic_exchange_n(&PERF_NEXT_OFFSET, offset + (off_t) size,
+                                   __ATOMIC_RELAXED);
+  if (last != offset)
+    PERF_ADD(seeks[region], 1);
 }
 
-void open(char* file, char* mode, uint32_t cluster_no) // Opens FILE file in CWD,
-                    // and adds it to the OPENFILE_LIST,
-                    // open in modes r (read-only), w (write-only), rw, or wr
+int PerfEnterFileData(void)
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  int entry_index = Get_OPENFILE_Entry(file);
+  return ++PERF_IN_FILE_DATA;
+}
 
-  if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s not found in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
-    printf("Error. %s is a Directory.\n", file);
-  else if (ModeCheck(mode) == 1) // check for valid mode
-    printf("Invalid mode entered. Acceptable modes: r, w, rw, or wr.\n");
-  else if ((current.DIR_Attr == 0x01) && (mode != "r")) // check if read-only
-  // If file permission set to read only
-    printf("File permissions set to read-only. Retry opening w/ mode r.\n");
-  else if (entry_index != -1) // files not in list will return an index of -1
-    printf("File is already open.\n");
-  else
+void PerfLeaveFileData(int* scope)
+{
+  PERF_IN_FILE_DATA--;
+}
+
+void PerfCommand(COMMAND* command, struct timespec* start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  unsigned long long ns = (end.tv_sec - start->tv_sec) * 1000000000ULL +
+                          end.tv_nsec - start->tv_nsec;
+  unsigned long long us = ns / 1000;
+  int bucket = (us == 0) ? 0 : 63 - __builtin_clzll(us);
+  if (bucket >= PERF_BUCKETS)
+    bucket = PERF_BUCKETS - 1;
+
+  PERF_LATENCY* latency = &PERF_COMMANDS[command - COMMAND_TABLE];
+  __atomic_fetch_add(&latency->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->histogram[bucket], 1, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&latency->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&latency->max_ns, &max, ns,
+                         0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ; // max reloaded by the failed exchange
+}
+
+unsigned long long PerfPercentile(PERF_LATENCY* latency, double fraction)
+{
+  unsigned long long seen = 0;
+  for (int k = 0; k < PERF_BUCKETS; k++)
   {
-    // Get file cluster number specifed in dir entry
-    int file_cluster_no = Get_Child_Cluster_No(current);
-    AddToList(file_cluster_no, file, mode, 0);
+    seen += latency->histogram[k];
+    if (seen >= fraction * latency->calls)
+      return 2ULL << k;
   }
-
+  return 2ULL << (PERF_BUCKETS - 1);
 }
 
-void close(char* file, uint32_t cluster_no) // Close FILE file
+void perf(int json)
+// Counters are read without stopping other sessions, so totals taken while
+// commands run may be a few operations apart
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
+  unsigned long long total[5] = { 0 };
+  for (int r = 0; r < PERF_REGIONS; r++)
+  {
+    total[0] += PERF.reads[r];
+    total[1] += PERF.bytes_read[r];
+    total[2] += PERF.writes[r];
+    total[3] += PERF.bytes_written[r];
+    total[4] += PERF.seeks[r];
+  }
 
-  if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s not found in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
-    printf("Error. %s is a Directory.\n", file);
-  else // VALID -- remove from OPENFILE_LIST
+  if (json)
   {
-    // Get file cluster number specifed in dir entry
-    int file_cluster_no = Get_Child_Cluster_No(current);
+    fprintf(OUT, "{\"io\": {");
+    for (int r = 0; r < PERF_REGIONS; r++)
+      fprintf(OUT, "%s\"%s\": {\"reads\": %llu, \"bytes_read\": %llu, "
+              "\"writes\": %llu, \"bytes_written\": %llu, \"seeks\": %llu}",
+              (r > 0) ? ", " : "", PERF_REGION_NAMES[r], PERF.reads[r],
+              PERF.bytes_read[r], PERF.writes[r], PERF.bytes_written[r],
+              PERF.seeks[r]);
+    fprintf(OUT, "}, \"cache\": {\"hits\": %llu, \"misses\": %llu}, "
+            "\"fat_walked\": %llu, \"clusters_allocated\": %llu, "
+            "\"clusters_freed\": %llu, \"commands\": {", PERF.cache_hits,
+            PERF.cache_misses, PERF.fat_walked, PERF.allocated, PERF.freed);
+    int first = 1;
+    for (int i = 0; i < COMMAND_COUNT; i++)
+    {
+      PERF_LATENCY* latency = &PERF_COMMANDS[i];
+      if (latency->calls == 0)
+        continue;
+      fprintf(OUT, "%s", first ? "" : ", ");
+      JsonString(COMMAND_TABLE[i].name);
+      fprintf(OUT, ": {\"calls\": %llu, \"avg_us\": %.1f, \"p50_us\": %llu, "
+              "\"p99_us\": %llu, \"max_us\": %.1f, \"histogram_us\": [",
+              latency->calls, latency->total_ns / 1000.0 / latency->calls,
+              PerfPercentile(latency, 0.5), PerfPercentile(latency, 0.99),
+              latency->max_ns / 1000.0);
+      int first_bucket = 1;
+      for (int k = 0; k < PERF_BUCKETS; k++)
+        if (latency->histogram[k] > 0)
+        {
+          fprintf(OUT, "%s{\"min\": %llu, \"max\": %llu, \"count\": %llu}",
+                  first_bucket ? "" : ", ", (k == 0) ? 0 : 1ULL << k,
+                  (2ULL << k) - 1, latency->histogram[k]);
+          first_bucket = 0;
+        }
+      fprintf(OUT, "]}");
+      first = 0;
+    }
+    fprintf(OUT, "}}\n");
+    return;
+  }
 
-    if (RemoveFromList(file) != 0)
-      printf("%s is not open.\n", file);
+  fprintf(OUT, "%-10s %10s %14s %10s %14s %10s\n", "REGION", "READS",
+          "BYTES READ", "WRITES", "BYTES WRITTEN", "SEEKS");
+  for (int r = 0; r < PERF_REGIONS; r++)
+    fprintf(OUT, "%-10s %10llu %14llu %10llu %14llu %10llu\n",
+            PERF_REGION_NAMES[r], PERF.reads[r], PERF.bytes_read[r],
+            PERF.writes[r], PERF.bytes_written[r], PERF.seeks[r]);
+  fprintf(OUT, "%-10s %10llu %14llu %10llu %14llu %10llu\n", "total",
+          total[0], total[1], total[2], total[3], total[4]);
+  unsigned long long lookups = PERF.cache_hits + PERF.cache_misses;
+  fprintf(OUT, "Block cache: %llu hits, %llu misses (%.1f%% hit)\n",
+          PERF.cache_hits, PERF.cache_misses,
+          (lookups > 0) ? 100.0 * PERF.cache_hits / lookups : 0.0);
+  fprintf(OUT, "FAT entries walked: %llu, clusters allocated: %llu, "
+          "freed: %llu\n", PERF.fat_walked, PERF.allocated, PERF.freed);
+
+  fprintf(OUT, "%-10s %10s %10s %10s %10s %10s\n", "COMMAND", "CALLS",
+          "AVG US", "P50 US", "P99 US", "MAX US");
+  for (int i = 0; i < COMMAND_COUNT; i++)
+  {
+    PERF_LATENCY* latency = &PERF_COMMANDS[i];
+    if (latency->calls > 0)
+      fprintf(OUT, "%-10s %10llu %10.1f %10llu %10llu %10.1f\n",
+              COMMAND_TABLE[i].name, latency->calls,
+              latency->total_ns / 1000.0 / latency->calls,
+              PerfPercentile(latency, 0.5), PerfPercentile(latency, 0.99),
+              latency->max_ns / 1000.0);
   }
 }
+#endif
 
-void lseek(char* file, int offset, uint32_t cluster_no) // Set offset (in bytes)
-                                       // of FILENAME given CWD cluster_no
+void PerfDump(void)
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  int entry_index = Get_OPENFILE_Entry(file);
-
-  if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s not found in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
-    printf("Error. %s is a Directory.\n", file);
-  else if (offset > current.DIR_FileSize) // check if offset is too large
-    printf("Error. Offset entered is greater than file size.\n");
-  else if (entry_index == -1) // check if file is open
-    printf("Error. File is not open.\n");
-  else if ( strcmp(OPENFILE_LIST[entry_index].m, "w") == 0) // check mode
-    printf("Error. File not open for reading.\n");
-  else // VALID -- update offset
-    OPENFILE_LIST[entry_index].offset = offset;
+  if (PERF_PATH == NULL)
+    return;
+#ifdef FAT_PERF
+  FILE* dump = fopen(PERF_PATH, "w");
+  if (dump == NULL)
+  {
+    fprintf(stderr, "Cannot write %s\n", PERF_PATH);
+    return;
+  }
+  FILE* output = OUT;
+  OUT = dump;
+  perf(1);
+  OUT = output;
+  fclose(dump);
+#else
+  fprintf(stderr, "Built without instrumentation (make perf), %s not "
+          "written\n", PERF_PATH);
+#endif
 }
 
-void read(char* file, int size, uint32_t cluster_no)
-    // Read data from FILE file starting at stored offset in open file list
-    // for size bytes, print to screen
+//--------------------------------BATCH MODE------------------------------------
+
+#define BATCH_CHUNK (1 << 20) // stdin is read 1 MB at a time
+
+int OpenBatch(BATCH_READER* reader, const char* script)
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  int entry_index = Get_OPENFILE_Entry(file);
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = -1;
 
-  if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s does not exist in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
-    printf("Error. %s is a Directory.\n", file);
-  else if (entry_index == -1) // check if file is open
-    printf("Error. File is not open.\n");
-  else if ( strcmp(OPENFILE_LIST[entry_index].m, "w") == 0) // check mode
-    printf("Error. File not open for reading.\n");
-  else if (OPENFILE_LIST[entry_index].offset == current.DIR_FileSize)
-    printf("Offset set to end of file. Nothing left to read.\n");
-  else // VALID -- read file for size bytes starting at offset
+  if (script == NULL) // Stream stdin through one large buffer
   {
-    // Get 1st cluster_no of file
-    uint32_t first_cluster = OPENFILE_LIST[entry_index].first_cluster;
-    uint32_t cluster = first_cluster;
+    reader->fd = STDIN_FILENO;
+    reader->capacity = BATCH_CHUNK;
+    reader->data = malloc(reader->capacity);
+    return (reader->data == NULL) ? -1 : 0;
+  }
 
-    int offset = OPENFILE_LIST[entry_index].offset; // get file offset
+  // Map the whole script; lines are then found without any further reads
+  int fd = open(script, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat info;
+  if (fstat(fd, &info) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  reader->length = info.st_size;
+  if (reader->length > 0)
+  {
+    reader->data = mmap(NULL, reader->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (reader->data == MAP_FAILED)
+    {
+      close(fd);
+      return -1;
+    }
+    madvise(reader->data, reader->length, MADV_SEQUENTIAL);
+  }
+  close(fd); // The mapping stays valid
+  return 0;
+}
 
-    // Check if size entered is larger than what can be read, adjust if needed
-    int maximum_read = current.DIR_FileSize - offset;
-    if (size > maximum_read)
-      size = maximum_read;
+char* NextBatchLine(BATCH_READER* reader)
+{
+  if (reader->data == NULL)
+    return NULL; // Empty script
 
-    int given_size = size; // SAVE SIZE TO UPDATE OPENFILE_LIST ENTRY LATER
+  char* newline;
+  while (1)
+  {
+    newline = memchr(&reader->data[reader->position], '\n',
+      reader->length - reader->position);
+    if (newline != NULL || reader->fd < 0)
+      break;
 
-    // While offset is larger than bytes per cluster, advance clusters
-    while (offset > (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus))
+    // Streaming and no full line buffered: move the partial line to the
+    // front, grow the buffer if the line fills it, then read more
+    memmove(reader->data, &reader->data[reader->position],
+      reader->length - reader->position);
+    reader->length -= reader->position;
+    reader->position = 0;
+    if (reader->length == reader->capacity)
     {
-      cluster = NextClusterNo(cluster);
-      offset -= (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
+      reader->capacity *= 2;
+      reader->data = realloc(reader->data, reader->capacity);
     }
+    ssize_t got = read(reader->fd, &reader->data[reader->length],
+      reader->capacity - reader->length);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      reader->fd = -1; // EOF: what is left is the last, unterminated line
+    else
+      reader->length += got;
+  }
 
-    // Then, get data_offset from cluster
-    int data_offset = ClusterNo_To_DataOffset(cluster);
-    data_offset += offset;
-    fseek(IMAGEFILE, data_offset, SEEK_SET); // set IMAGEFILE to data offset
+  size_t end = (newline != NULL) ? (size_t) (newline - reader->data)
+                                 : reader->length;
+  if (newline == NULL && end == reader->position)
+    return NULL; // Nothing left
 
-    char buffer[size + 1]; // Allocate buffer, read IMAGEFILE into buffer
+  size_t length = end - reader->position;
+  if (length > 0 && reader->data[end - 1] == '\r')
+    length--; // Scripts written on Windows
+  if (length + 1 > reader->line_capacity)
+  {
+    reader->line_capacity = length + 1;
+    reader->line = realloc(reader->line, reader->line_capacity);
+  }
+  memcpy(reader->line, &reader->data[reader->position], length);
+  reader->line[length] = '\0';
 
-    while ((offset + size) > (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus))
-    // WHILE MORE THAN ONE CLUSTER LEFT TO BE READ
-    {
-      // READ TO END OF CLUSTER AND PRINT
-      int size_to_read = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
-      size_to_read -= offset;
-      fread(&buffer, size_to_read, 1, IMAGEFILE);
+  reader->position = (newline != NULL) ? end + 1 : end;
+  return reader->line;
+}
 
-      buffer[size_to_read] = '\0';
-      for (int i = 0; i < size_to_read; i++)
-        printf("%c", buffer[i]);
+int RunBatch(BATCH_READER* reader, int stop_on_error)
+{
+  // Status lines go to stderr, fully buffered so they cost no extra writes
+  static char status_buffer[65536];
+  setvbuf(stderr, status_buffer, _IOFBF, sizeof(status_buffer));
 
-      // THEN ADVANCE CLUSTER
-      cluster = NextClusterNo(cluster);
-      data_offset = ClusterNo_To_DataOffset(cluster);
-      fseek(IMAGEFILE, data_offset, SEEK_SET);
+  uint32_t CWD_Cluster_No = FIRST_CLUSTER;
+  int line_no = 0, commands = 0, failures = 0, result = 0;
+  char* line;
 
-      // UPDATE SIZE, OFFSET WILL BE 0 AFTER 1ST ITERATION
-      size -= ((BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus) - offset);
-      offset = 0;
+  while ((line = NextBatchLine(reader)) != NULL)
+  {
+    line_no++;
+    tokenlist tokens;
+    int valid = get_tokens(line, &tokens) == 0; // Else failed, not run
+    if (valid && (tokens.size == 0 || tokens.items[0][0] == '#'))
+      continue; // Blank or comment
+
+    commands++;
+    int exit_requested = valid ? ExecuteCommand(&tokens, &CWD_Cluster_No)
+                               : 0;
+    fprintf(stderr, "%d %d %s\n", line_no, COMMAND_STATUS, tokens.items[0]);
+
+    if (COMMAND_STATUS != STATUS_OK)
+    {
+      failures++;
+      if (stop_on_error)
+      {
+        result = COMMAND_STATUS;
+        break;
+      }
     }
+    if (exit_requested)
+      break;
+  }
 
-    // READ AND PRINT REMAINING
-    fread(&buffer, size, 1, IMAGEFILE);
-    buffer[size] = '\0';
-    for (int i = 0; i < size; i++)
-      printf("%c", buffer[i]);
+  fflush(OUT);
+  fprintf(stderr, "%d commands, %d failed\n", commands, failures);
+  fflush(stderr);
 
-    printf("\n");
+  if (reader->capacity > 0)
+    free(reader->data);
+  else if (reader->length > 0)
+    munmap(reader->data, reader->length);
+  free(reader->line);
 
-    // FINALLY, UPDATE OFFSET IN OPENFILE_LIST ENTRY
-    OPENFILE_LIST[entry_index].offset += given_size;
-  }
+  if (result == 0 && failures > 0)
+    result = 1;
+  return result;
 }
 
-void write(char* file, int size, char* string, uint32_t cluster_no)
-// Write to file FILENAME in CWD
-// ASSUMES STRING ALWAYS ENTERED IN QUOTES
+//--------------------------------DAEMON MODE-----------------------------------
+
+// PROTOCOL: a client sends one command per line, exactly as typed in the
+// shell. Every command gets one response frame: its output length in
+// decimal, a newline, then that many bytes of output.
+//   bread FILE OFFSET SIZE    -- frame holds the raw bytes of the range
+//   bwrite FILE OFFSET SIZE   -- SIZE raw bytes follow the command line
+
+int Serve(const char* socket_path)
+// Mount once, then serve any number of concurrent clients, one thread each.
+// FAT, block and directory lock state stays warm between commands
 {
-  //printf("String: %s\n", string);
+  signal(SIGPIPE, SIG_IGN); // A client hanging up must not kill the daemon
 
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  int entry_index = Get_OPENFILE_Entry(file);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+  {
+    fprintf(OUT, "Error. Cannot create socket.\n");
+    return 1;
+  }
 
-  if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s does not exist in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
-    printf("Error. %s is a Directory.\n", file);
-  else if (entry_index == -1) // check if file is open
-    printf("Error. File is not open.\n");
-  else if ( strcmp(OPENFILE_LIST[entry_index].m, "r") == 0) // check mode
-    printf("Error. File not open for writing.\n");
-  else // VALID -- read file for size bytes starting at offset
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path))
   {
-    // Adjust string to given size-----------------------------------
-    char to_write[size + 1];
+    fprintf(OUT, "Error. Socket path too long.\n");
+    return 1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  unlink(socket_path); // Remove a stale socket from an earlier run
+  if (bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+      listen(listener, 64) != 0)
+  {
+    fprintf(OUT, "Error. Cannot listen on %s.\n", socket_path);
+    return 1;
+  }
+  fprintf(OUT, "Serving on %s\n", socket_path);
+  fflush(OUT);
 
-    for (int i = 0; i < size + 1; i++)
+  while (1)
+  {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0)
     {
-      if (i <= strlen(string)) // Copy string to to_write[]
-      {
-        to_write[i] = string[i];
+      if (errno == EINTR)
         continue;
-      }
-      to_write[i] = '\0'; // If string is fully copied, fill rest w/ null chars
+      break;
     }
-    to_write[size] = '\0';
-    //printf("to_write string: %s\n", to_write);
 
-    // Get 1st cluster_no of file------------------------------------
-    uint32_t first_cluster = OPENFILE_LIST[entry_index].first_cluster;
-    uint32_t current_cluster = first_cluster;
-    int offset = OPENFILE_LIST[entry_index].offset;
-    int initial_offset = offset;
-    int initial_size = size;
-    int size_written = 0; // no. of bytes already written from string
+    SESSION* session = malloc(sizeof(SESSION));
+    session->fd = client;
+    session->cwd = FIRST_CLUSTER; // Every session starts in root
 
-    if (first_cluster == 0) // If cluster not yet allcated, must allocate now
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, SessionMain, session) != 0)
     {
-      // Find first available cluster
-      first_cluster = Find_Free_Cluster();
-      current_cluster = first_cluster;
-      if (first_cluster == -1) // NO MORE MEMORY
-        return;
-      OPENFILE_LIST[entry_index].first_cluster = first_cluster;
-      int data_offset = Get_DIR_ENTRY_Offset(file, cluster_no);
-      AllocateClusterToEmptyFile(current, data_offset, first_cluster);
+      close(client);
+      free(session);
+      continue;
     }
+    pthread_detach(thread);
+  }
 
-    int data_offset = ClusterNo_To_DataOffset(current_cluster);
-
-    // While offset is larger than bytes per cluster, advance clusters
-    while (offset > (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus))
-    {
-      current_cluster = NextClusterNo(current_cluster);
-      data_offset = ClusterNo_To_DataOffset(current_cluster);
-      offset -= (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
-    } // OFFSET SHOULD NOW BE < 512 bytes
+  close(listener);
+  unlink(socket_path);
+  return 0;
+}
 
-    // Determine if the file size is to be increased
-    if ((initial_offset + size) > current.DIR_FileSize)
-    {
-      // Determine how many new clusters need to be allocated
-      int current_clusters = current.DIR_FileSize /
-        (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
-      int final_clusters = (initial_offset + size) /
-        (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
-      int new_clusters = final_clusters - current_clusters;
+void* SessionMain(void* arg)
+{
+  SESSION* session = arg;
+  FILE* in = fdopen(session->fd, "r"); // Buffered command reader
+  TRACE_SESSION = __atomic_add_fetch(&TRACE_SESSIONS, 1, __ATOMIC_RELAXED);
 
-      if (new_clusters == 0) // If string fully written, end here
-      {
-        // Write size bytes
-        fseek(IMAGEFILE, data_offset + offset, SEEK_SET);
-        fwrite(&to_write, size, 1, IMAGEFILE);
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
 
-        // Update variables
-        UpdateFileSize(file, cluster_no, (initial_offset + initial_size));
-        OPENFILE_LIST[entry_index].offset = (initial_offset + initial_size);
-        return;
-      }
+  while ((length = getline(&line, &capacity, in)) > 0)
+  {
+    // Strip line ending
+    while (length > 0 && (line[length - 1] == '\n' ||
+                          line[length - 1] == '\r'))
+      line[--length] = '\0';
+
+    // Capture everything the command prints into this frame
+    char* output = NULL;
+    size_t output_length = 0;
+    OUT = open_memstream(&output, &output_length);
+
+    tokenlist tokens;
+    int valid = get_tokens(line, &tokens) == 0; // Else reported, not run
+
+    int exit_requested = 0;
+    if (tokens.size == 0) // Empty line, empty frame
+      ;
+    else if (strcmp(tokens.items[0], "bwrite") == 0)
+    {
+      // Always consume the payload, even if the command fails, so the
+      // stream stays in step with the client (which sends SIZE bytes
+      // whenever the line starts with bwrite FILE OFFSET SIZE)
+      int size = 0;
+      if (tokens.size >= 4)
+        sscanf(tokens.items[3], "%d", &size);
+      char* data = malloc(size > 0 ? size : 1);
+      if (size > 0 && fread(data, 1, size, in) != (size_t) size)
+        exit_requested = 1; // Client hung up mid-payload
+      else if (valid)
+        bwrite(&tokens, data, session->cwd);
+      free(data);
+    }
+    else if (!valid)
+      ;
+    else if (strcmp(tokens.items[0], "bread") == 0)
+      bread(&tokens, session->cwd);
+    else
+      exit_requested = ExecuteCommand(&tokens, &session->cwd);
 
-      // Else, 1 or more new clusters to allocate
-      // Write to end of current cluster
-      fseek(IMAGEFILE, data_offset + offset, SEEK_SET);
-      int bytes_to_write = BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus;
-      bytes_to_write -= offset;
-      if (bytes_to_write > size)
-        bytes_to_write = size;
-      fwrite(&to_write, bytes_to_write, 1, IMAGEFILE);
-      size_written+= bytes_to_write;
-      //printf("%s\n", to_write);
-
-      // UPDATE SIZE, OFFSET WILL BE 0 FROM HERE ON
-      size -= ((BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus) - offset);
-      //printf("Size written: %i\n", size_written);
-      //printf("Size left to write: %i\n", size);
-      offset = 0;
-
-      uint32_t next_cluster = 0;
-      while (new_clusters > 0)
-      {
-        // Find first available cluster
-        next_cluster = Find_Free_Cluster();
-        //printf("Next cluster: %i\n", next_cluster);
-        if (next_cluster == -1) // NO MORE MEMORY
-        {
-          OPENFILE_LIST[entry_index].offset = (initial_offset + initial_size
-                                                                     - size);
-          UpdateFileSize(file, cluster_no, (initial_offset + initial_size
-                                                                     - size));
-          return;
-        }
+    fclose(OUT);
+    SendResponse(session->fd, output, output_length);
+    free(output);
 
-        // Link current_cluster to next_cluster in FAT
-        UpdateClusterInFAT(current_cluster, next_cluster);
-        UpdateClusterInFAT(next_cluster, 0xFFFFFFFF);
+    if (exit_requested)
+      break;
+  }
 
-        // Advance current cluster, Postion IMAGEFILE to new cluster in Data Reg
-        current_cluster = NextClusterNo(current_cluster);
-        //printf("Advanced cluster no.: %i\n", current_cluster);
-        data_offset = ClusterNo_To_DataOffset(current_cluster);
-        fseek(IMAGEFILE, data_offset, SEEK_SET);
+  free(line);
+  fclose(in); // Also closes the socket
+  free(session);
 
-        if (new_clusters > 1)
-        {
-          fwrite(&to_write[size_written - 1],
-            (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus), 1, IMAGEFILE);
-          size_written += (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
-          size -= (BOOT.BPB_BytsPerSec * BOOT.BPB_SecPerClus);
-          //printf("Size written: %i\n", size_written);
-          //printf("Size left to write: %i\n", size);
-        }
-        if (new_clusters == 1)
-        {
-          fwrite(&to_write[size_written - 1], size, 1, IMAGEFILE);
-          size_written += size;
-          size -= size;
-          //printf("Size written: %i\n", size_written);
-          //printf("Size left to write: %i\n", size);
-        }
+  // The daemon has no clean exit, so save per session. Writers are drained
+  // first, so no change is in the image's mtime but not yet in the index
+  pthread_rwlock_wrlock(&SNAPSHOT_LOCK);
+  SaveSizeIndex();
+  pthread_rwlock_unlock(&SNAPSHOT_LOCK);
+  return NULL;
+}
 
-        // Adjust new_cluster variables
-        new_clusters--;
-      } // END OF WHILE LOOP
+void SendResponse(int fd, const char* output, size_t length)
+{
+  char header[32];
+  int header_length = snprintf(header, sizeof(header), "%zu\n", length);
 
-      // Update file size
-      UpdateFileSize(file, cluster_no, (initial_offset + initial_size));
-    } // END OF IF STATEMENT
-    else // Simple case -- no new clusters to allocate & size < file size
+  const char* parts[2] = { header, output };
+  size_t sizes[2] = { header_length, length };
+  for (int i = 0; i < 2; i++)
+  {
+    size_t sent = 0;
+    while (sent < sizes[i])
     {
-      // Write size bytes
-      fseek(IMAGEFILE, data_offset + offset, SEEK_SET);
-      fwrite(&to_write, size, 1, IMAGEFILE);
-      //printf("%s\n", to_write);
+      ssize_t n = write(fd, parts[i] + sent, sizes[i] - sent);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) // Client gone, drop the frame
+        return;
+      sent += n;
     }
-
-    // Update Offset
-    OPENFILE_LIST[entry_index].offset = (initial_offset + initial_size);
   }
 }
 
-void rm(char* file, uint32_t cluster_no)
-// Remove FILE file given CWD cluster_no
+void bread(tokenlist* tokens, uint32_t cluster_no)
+// bread FILE OFFSET SIZE -- raw bytes of a file range, no open needed
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  int entry_index = Get_OPENFILE_Entry(file);
+  if (tokens->size != 4)
+  {
+    Error(STATUS_USAGE, "Usage: bread [filename] [offset] [size]\n");
+    return;
+  }
+
+  int offset = 0, size = 0;
+  sscanf(tokens->items[2], "%d", &offset);
+  sscanf(tokens->items[3], "%d", &size);
+
+  // FILE may be a path, resolved as ExecuteCommand() does for commands
+  uint32_t dir;
+  if (ResolvePath(tokens->items[1], cluster_no, &dir, &tokens->items[1]) != 0)
+    return;
+
+  DirLock(dir, DIR_LOCK_READ);
+  DIR_ENTRY current = Get_DIR_ENTRY(tokens->items[1], dir);
 
   if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND, "%s does not exist in current working directory.\n",
+            tokens->items[1]);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", tokens->items[1]);
+  else if (offset < 0 || size < 0 || offset > current.DIR_FileSize)
+    Error(STATUS_INVALID, "Error. Offset entered is greater than file size.\n");
+  else // VALID -- read up to size bytes starting at offset
+  {
+    if (size > current.DIR_FileSize - offset)
+      size = current.DIR_FileSize - offset;
+
+    char* buffer = malloc(size + 1);
+    int size_read = ReadFileData(Get_Child_Cluster_No(current), offset,
+                                 buffer, size);
+    fwrite(buffer, 1, size_read, OUT);
+    free(buffer);
+  }
+  DirUnlock(dir);
+}
+
+void bwrite(tokenlist* tokens, char* data, uint32_t cluster_no)
+// bwrite FILE OFFSET SIZE -- write raw data (which may hold any byte,
+// including '\0') into an existing file, no open needed
+{
+  if (tokens->size != 4)
   {
-    printf("%s does not exist in current working directory.\n", file);
+    Error(STATUS_USAGE, "Usage: bwrite [filename] [offset] [size]\n");
     return;
   }
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
+
+  int offset = 0, size = 0;
+  sscanf(tokens->items[2], "%d", &offset);
+  sscanf(tokens->items[3], "%d", &size);
+  if (RO_MODE) // Not in the command table, so checked here
   {
-    printf("Error. %s is a Directory.\n", file);
+    Error(STATUS_INVALID, "Error. bwrite would change the image, which is "
+          "mounted read-only.\n");
     return;
   }
-  else if (entry_index != -1) // check if file is open, if it is, CLOSE IT
-    close(file, cluster_no);
 
+  pthread_rwlock_rdlock(&SNAPSHOT_LOCK); // Outside ExecuteCommand()
+  uint32_t dir;
+  if (ResolvePath(tokens->items[1], cluster_no, &dir, &tokens->items[1]) != 0)
+  {
+    pthread_rwlock_unlock(&SNAPSHOT_LOCK);
+    return;
+  }
+  DirLock(dir, DIR_LOCK_WRITE);
+  DIR_ENTRY current = Get_DIR_ENTRY(tokens->items[1], dir);
 
-  // Get 1st cluster_no of file
-  uint32_t first_cluster = Get_Child_Cluster_No(current);
-  uint32_t current_cluster = first_cluster;
+  if (current.DIR_Name[0] == 0x00) // check if file exists
+    Error(STATUS_NOT_FOUND, "%s does not exist in current working directory.\n",
+            tokens->items[1]);
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", tokens->items[1]);
+  else if (offset < 0 || size < 0 || offset > current.DIR_FileSize)
+    Error(STATUS_INVALID, "Error. Offset entered is greater than file size.\n");
+  else // VALID -- write size bytes starting at offset
+  {
+    uint32_t first_cluster = Get_Child_Cluster_No(current);
+    if (first_cluster == 0) // If cluster not yet allcated, must allocate now
+    {
+      first_cluster = Find_Free_Cluster(dir);
+      if (first_cluster == -1) // NO MORE MEMORY
+      {
+        DirUnlock(dir);
+        pthread_rwlock_unlock(&SNAPSHOT_LOCK);
+        return;
+      }
+      int data_offset = Get_DIR_ENTRY_Offset(tokens->items[1], dir);
+      AllocateClusterToEmptyFile(current, data_offset, first_cluster);
+    }
 
-  // Traverse FAT and deallocate all CLUSTERS---------------------------
+    int size_written = WriteFileData(first_cluster, offset, data, size);
+    if (offset + size_written > current.DIR_FileSize)
+      UpdateFileSize(tokens->items[1], dir, offset + size_written);
+    fprintf(OUT, "%i bytes written\n", size_written);
+  }
+  DirUnlock(dir);
+  pthread_rwlock_unlock(&SNAPSHOT_LOCK);
+}
 
-  uint32_t entry = 0x0; // Empty entry used to deallocate cluster
-  int next_cluster = current_cluster;
+//---------------------------TRACE RECORD AND REPLAY----------------------------
 
-  do {
-    next_cluster = NextClusterNo(current_cluster);
+#define TRACE_MISMATCHES_SHOWN 10 // Replay lists this many, counts the rest
 
-    if (next_cluster >= 0x0FFFFFF6)
-      break;
+int OpenTrace(const char* path)
+{
+  TRACE = fopen(path, "w");
+  if (TRACE == NULL)
+    return -1;
+  clock_gettime(CLOCK_MONOTONIC, &TRACE_START);
+  clock_gettime(CLOCK_REALTIME, &TRACE_WALL);
+  fprintf(TRACE, "# fat.x trace v1: start_ns latency_ns session status "
+          "length hash command\n");
+  fprintf(TRACE, "# wall %lld %ld\n", (long long) TRACE_WALL.tv_sec,
+          TRACE_WALL.tv_nsec);
+  fflush(TRACE);
+  return 0;
+}
+
+uint64_t HashOutput(const char* data, size_t length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+char* TraceLine(tokenlist* tokens)
+// Tokens holding a quote cannot be quoted again and are written as they are
+{
+  char* line = NULL;
+  size_t length = 0;
+  FILE* out = open_memstream(&line, &length);
+  for (int i = 0; i < tokens->size; i++)
+  {
+    const char* token = tokens->items[i];
+    int quote = token[0] == '\0' || strpbrk(token, " \t") != NULL;
+    fprintf(out, quote ? "%s\"%s\"" : "%s%s", (i > 0) ? " " : "", token);
+  }
+  fclose(out);
+  return line;
+}
 
-    // Calculate FAT offset (in bytes):
-    int FAT_Offset = ClusterNo_to_FATOffset(current_cluster);
+int TraceCommand(tokenlist* tokens, uint32_t* CWD)
+// The line is rebuilt before the command runs, since ResolvePath() cuts
+// path tokens in place. Output is captured, passed on unchanged, and kept
+// in the trace only as its length and hash
+{
+  char* line = TraceLine(tokens);
+  FILE* out = OUT;
+  char* output = NULL;
+  size_t length = 0;
+  OUT = open_memstream(&output, &length);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned long long offset = (start.tv_sec - TRACE_START.tv_sec) *
+                              1000000000ULL + start.tv_nsec -
+                              TRACE_START.tv_nsec;
+  TRACE_ACTIVE = 1;
+  TRACE_NOW = TraceClock(&TRACE_WALL, offset); // As replay will see it
+  int exit_requested = ExecuteCommand(tokens, CWD);
+  TRACE_NOW = 0;
+  TRACE_ACTIVE = 0;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fclose(OUT);
+  OUT = out;
+  fwrite(output, 1, length, OUT);
+
+  unsigned long long latency = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                               end.tv_nsec - start.tv_nsec;
+  pthread_mutex_lock(&TRACE_LOCK);
+  fprintf(TRACE, "%llu %llu %d %d %zu %016llx %s\n", offset, latency,
+          TRACE_SESSION, COMMAND_STATUS, length,
+          (unsigned long long) HashOutput(output, length), line);
+  fflush(TRACE); // The daemon has no clean exit
+  pthread_mutex_unlock(&TRACE_LOCK);
+
+  free(output);
+  free(line);
+  return exit_requested;
+}
 
-    fseek(IMAGEFILE, FAT_Offset, SEEK_SET);
-    fwrite(&entry, sizeof(entry), 1, IMAGEFILE); // Write to IMAGEFILE
+long LoadTrace(const char* path, TRACE_RECORD** records,
+               struct timespec* wall)
+{
+  FILE* in = fopen(path, "r");
+  if (in == NULL)
+    return -1;
+  memset(wall, 0, sizeof(*wall));
+
+  long count = 0, capacity = 1024;
+  *records = malloc(capacity * sizeof(TRACE_RECORD));
+  char* text = NULL;
+  size_t text_capacity = 0;
+  ssize_t length;
+  while ((length = getline(&text, &text_capacity, in)) > 0)
+  {
+    if (text[length - 1] == '\n')
+      text[--length] = '\0';
+    long long seconds;
+    if (sscanf(text, "# wall %lld %ld", &seconds, &wall->tv_nsec) == 2)
+      wall->tv_sec = seconds;
+    if (length == 0 || text[0] == '#')
+      continue;
 
-    current_cluster = next_cluster; // store next cluster
+    TRACE_RECORD* record = &(*records)[count];
+    unsigned long long hash;
+    int command = 0;
+    if (sscanf(text, "%llu %llu %d %d %zu %llx %n", &record->start_ns,
+               &record->latency_ns, &record->session, &record->status,
+               &record->length, &hash, &command) != 6 || command == 0)
+    {
+      fprintf(OUT, "%s: malformed record \"%s\"\n", path, text);
+      continue;
+    }
+    record->hash = hash;
+    record->line = strdup(&text[command]);
 
-  } while(1); // End loop if final cluster
+    if (++count == capacity)
+    {
+      capacity *= 2;
+      *records = realloc(*records, capacity * sizeof(TRACE_RECORD));
+    }
+  }
+  free(text);
+  fclose(in);
+  return count;
+}
 
-  // Deallocate final cluster
-  int FAT_Offset = ClusterNo_to_FATOffset(current_cluster);
-  fseek(IMAGEFILE, FAT_Offset, SEEK_SET);
-  fwrite(&entry, sizeof(entry), 1, IMAGEFILE); // Write to IMAGEFILE
+time_t TraceClock(const struct timespec* wall, unsigned long long start_ns)
+{
+  if (wall->tv_sec == 0) // Trace without a wall clock: use the real one
+    return 0;
+  return wall->tv_sec + (wall->tv_nsec + start_ns) / 1000000000ULL;
+}
 
-  // Remove the DIR_ENTRY from the CWD
-  rm_DIR_ENTRY(file, cluster_no);
+int CompareLatency(const void* a, const void* b)
+{
+  unsigned long long x = *(const unsigned long long*) a;
+  unsigned long long y = *(const unsigned long long*) b;
+  return (x > y) - (x < y);
 }
 
-void cp(char* file, char* dir, uint32_t cluster_no)
-// Copy file FILENAME to specified directory
+void PrintLatencies(const char* name, unsigned long long* ns, long count,
+                    double seconds)
+// Sorts ns. Percentiles are exact, in microseconds
 {
-  // Special case
-  if (strcmp(file, ".") == 0 || strcmp(file, "..") == 0)
+  qsort(ns, count, sizeof(ns[0]), CompareLatency);
+  double fractions[3] = { 0.5, 0.9, 0.99 };
+  fprintf(OUT, "%-9s %12.0f", name, (seconds > 0) ? count / seconds : 0.0);
+  for (int k = 0; k < 3; k++)
+    fprintf(OUT, " %10.1f", ns[(long) (fractions[k] * (count - 1))] / 1000.0);
+  fprintf(OUT, " %10.1f\n", ns[count - 1] / 1000.0);
+}
+
+int Replay(const char* trace, const char* path, int pace)
+// Commands run one at a time in recorded order, each in its own session's
+// working directory: as fast as possible, or with pace no earlier than they
+// started when recorded. The recorded image itself is never written; it
+// must be the image as it was before recording. Exit status 1 when any
+// command's status or output differs from the trace
+{
+  TRACE_RECORD* records;
+  struct timespec wall;
+  long count = LoadTrace(trace, &records, &wall);
+  if (count < 0)
   {
-    printf(". and .. cannot be copied\n", file);
-    return;
+    fprintf(OUT, "Cannot read trace %s\n", trace);
+    return 1;
+  }
+  if (count == 0)
+  {
+    fprintf(OUT, "%s: no commands recorded\n", trace);
+    free(records);
+    return 1;
   }
 
-  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
-  DIR_ENTRY destination = Get_DIR_ENTRY(dir, cluster_no);
-  int entry_index = Get_OPENFILE_Entry(file);
+  // FRESH COPY -- IMAGEFILE.replay, removed when done
+  char* copy = malloc(strlen(path) + 8);
+  sprintf(copy, "%s.replay", path);
+  int source = open(path, O_RDONLY);
+  int target = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  struct stat info;
+  int copied = source >= 0 && target >= 0 && fstat(source, &info) == 0 &&
+               CopyRange(source, 0, target, 0, info.st_size) == info.st_size;
+  if (source >= 0)
+    close(source);
+  if (target >= 0)
+    close(target);
+  if (!copied || MountImage(copy, 0) != 0)
+  {
+    fprintf(OUT, "Cannot copy %s to %s\n", path, copy);
+    unlink(copy);
+    return 1;
+  }
 
-  if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s does not exist in current working directory.\n", file);
-  else if (current.DIR_Attr == 0x10) // check if file is a dir
-    printf("Error. %s is a Directory.\n", file);
-  else if (destination.DIR_Name[0] != 0x00 && destination.DIR_Attr != 0x10)
-  // If destination exists and is a file, NOT a dir
-    printf("Error. Cannot copy to a file that already exists.\n", dir);
-  else if (entry_index != -1) // check if file is open, if it is, CLOSE IT
+  // Records are written as commands finish, so concurrent sessions leave
+  // start times slightly out of order
+  int sessions = 1;
+  unsigned long long first = records[0].start_ns, last = 0;
+  for (long i = 0; i < count; i++)
   {
-    close(file, cluster_no);
-    printf("Notice: file [%s] was closed before copying.\n", file);
+    if (records[i].session >= sessions)
+      sessions = records[i].session + 1;
+    if (records[i].start_ns < first)
+      first = records[i].start_ns;
+    if (records[i].start_ns + records[i].latency_ns > last)
+      last = records[i].start_ns + records[i].latency_ns;
   }
-  else if (destination.DIR_Name[0] != 0x00) // VALID CASE
-  // If destination exists in CWD and it IS a directory
-  // Copy file to destination
+  uint32_t* cwd = malloc(sessions * sizeof(uint32_t));
+  for (int k = 0; k < sessions; k++)
+    cwd[k] = FIRST_CLUSTER;
+  unsigned long long* recorded = malloc(count * sizeof(unsigned long long));
+  unsigned long long* replayed = malloc(count * sizeof(unsigned long long));
+
+  FILE* report = OUT;
+  long mismatches = 0;
+  struct timespec begin, start, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (long i = 0; i < count; i++)
   {
-    // Get first cluster of original file
-    uint32_t parent_cluster = Get_Child_Cluster_No(current);
-
-    // Change dir, write new DIR_ENTRY in child directory of name file
-    uint32_t new_cluster_no = cd(dir, cluster_no);
-    DIR_ENTRY check = Get_DIR_ENTRY(file, new_cluster_no);
-    if (check.DIR_Name[0] != 0x00)
+    TRACE_RECORD* record = &records[i];
+    if (pace) // Wait for the recorded start, relative to the first command
     {
-      printf("File %s already exists in dir %s\n", file, dir);
-      return;
+      unsigned long long due = record->start_ns - first;
+      struct timespec when = begin;
+      when.tv_sec += due / 1000000000ULL;
+      when.tv_nsec += due % 1000000000ULL;
+      if (when.tv_nsec >= 1000000000L)
+      {
+        when.tv_sec++;
+        when.tv_nsec -= 1000000000L;
+      }
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL)
+             == EINTR)
+        ;
     }
 
-    creat(file, new_cluster_no, create_newfile(file));
+    char* output = NULL;
+    size_t length = 0;
+    OUT = open_memstream(&output, &length);
+    tokenlist tokens; // record->line not needed again
+    int valid = get_tokens(record->line, &tokens) == 0;
+    TRACE_NOW = TraceClock(&wall, record->start_ns);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (valid && tokens.size > 0)
+      ExecuteCommand(&tokens, &cwd[record->session]); // exit ends nothing:
+                                     // later records may be other sessions
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    TRACE_NOW = 0;
+    fclose(OUT);
+    OUT = report;
+
+    recorded[i] = record->latency_ns;
+    replayed[i] = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                  end.tv_nsec - start.tv_nsec;
+    if (COMMAND_STATUS != record->status || length != record->length ||
+        HashOutput(output, length) != record->hash)
+    {
+      if (++mismatches <= TRACE_MISMATCHES_SHOWN)
+        fprintf(OUT, "Mismatch at command %ld (session %d, %s): status %d, "
+                "%zu bytes; recorded status %d, %zu bytes\n", i + 1,
+                record->session, (tokens.size > 0) ? tokens.items[0] : "",
+                COMMAND_STATUS, length, record->status, record->length);
+    }
+    free(output);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - begin.tv_sec) +
+                   (end.tv_nsec - begin.tv_nsec) / 1e9;
+  double recorded_seconds = (last - first) / 1e9;
+
+  if (mismatches > TRACE_MISMATCHES_SHOWN)
+    fprintf(OUT, "... %ld more mismatches\n",
+            mismatches - TRACE_MISMATCHES_SHOWN);
+  fprintf(OUT, "%ld commands, %d sessions, %ld mismatches, %.1f ms "
+          "(recorded %.1f ms)\n", count, sessions, mismatches, seconds * 1000,
+          recorded_seconds * 1000);
+  fprintf(OUT, "%-9s %12s %10s %10s %10s %10s\n", "RUN", "COMMANDS/S",
+          "P50_US", "P90_US", "P99_US", "MAX_US");
+  PrintLatencies("recorded", recorded, count, recorded_seconds);
+  PrintLatencies("replayed", replayed, count, seconds);
+
+  close(IMAGE_FD);
+  unlink(copy);
+  for (long i = 0; i < count; i++)
+    free(records[i].line);
+  free(records);
+  free(recorded);
+  free(replayed);
+  free(cwd);
+  free(copy);
+  return (mismatches > 0) ? 1 : 0;
+}
 
-    // Create buffer of appropriate file size and read to it
-    int new_size = current.DIR_FileSize;
-    //printf("File size is: %i\n", new_size);
-    char buffer[new_size + 1];
-    ReadToBuffer(buffer, new_size, parent_cluster);
+//--------------------------------CONCURRENCY-----------------------------------
 
-    // Write buffer into copied file
-    open(file, "w", new_cluster_no);
-    write(file, current.DIR_FileSize, buffer, new_cluster_no);
-    close(file, new_cluster_no);
+// Work handed to each stress() reader thread
+typedef struct{
 
-    // Return to previous directory
-    cd("..", new_cluster_no);
-  }
-  else // VALID CASE
-  // If destination does not exist, creat newfile and copy file contents to it
-  {
-    // Get first cluster of original file
-    uint32_t parent_cluster = Get_Child_Cluster_No(current);
+  uint32_t first_cluster; // first cluster of the file being read
+  int size; // file size in bytes
+  int passes; // times to read the whole file
+  long long bytes_read; // result -- bytes actually read
+} STRESS_ARG;
 
-    creat(dir, cluster_no, create_newfile(dir));
+void* StressReader(void* arg) // Thread body for stress()
+{
+  STRESS_ARG* work = arg;
+  char* buffer = malloc(work->size + 1);
 
-    // Create buffer of appropriate file size and read to it
-    int new_size = current.DIR_FileSize;
-    //printf("File size is: %i\n", new_size);
-    char buffer[new_size + 1];
-    ReadToBuffer(buffer, new_size, parent_cluster);
+  work->bytes_read = 0;
+  for (int i = 0; i < work->passes; i++)
+    work->bytes_read += ReadFileData(work->first_cluster, 0, buffer,
+                                     work->size);
 
-    // Write buffer into copied file
-    open(dir, "w", cluster_no);
-    write(dir, current.DIR_FileSize, buffer, cluster_no);
-    close(dir, cluster_no);
-  }
+  free(buffer);
+  return NULL;
 }
 
-//----------------------------EXTRA CREDIT FUNCTION-----------------------------
-
-void rmdir(char* dir, uint32_t cluster_no) // Remove dir DIRNAME from CWD
+void stress(char* file, int max_threads, uint32_t cluster_no)
+// Read FILE file from 1, 2, 4 ... max_threads threads at once and print the
+// aggregate throughput, showing how reads scale on the shared IMAGEFILE
 {
-  DIR_ENTRY current = Get_DIR_ENTRY(dir, cluster_no);
-  uint32_t first_cluster = Get_Child_Cluster_No(current);
+  DIR_ENTRY current = Get_DIR_ENTRY(file, cluster_no);
 
   if (current.DIR_Name[0] == 0x00) // check if file exists
-    printf("%s does not exist in current working directory.\n", dir);
-  else if (current.DIR_Attr != 0x10) // check if file is a dir
-    printf("Error. %s is not a Directory.\n", dir);
-  else if (IsDirEmpty(dir, first_cluster) == 1)
-    printf("Directory is not empty.\n");
-  else // VALID CASE
   {
-    // Traverse FAT and deallocate all clusters for child dir
-    uint32_t current_cluster = first_cluster;
+    Error(STATUS_NOT_FOUND,
+          "%s does not exist in current working directory.\n", file);
+    return;
+  }
+  else if (current.DIR_Attr == 0x10) // check if file is a dir
+  {
+    Error(STATUS_INVALID, "Error. %s is a Directory.\n", file);
+    return;
+  }
+  else if (current.DIR_FileSize == 0) // nothing to read
+  {
+    Error(STATUS_INVALID, "Error. %s is empty.\n", file);
+    return;
+  }
+  else if (max_threads < 1 || max_threads > 256) // check thread count
+  {
+    Error(STATUS_INVALID, "Error. Thread count must be between 1 and 256.\n");
+    return;
+  }
 
-    int data_offset = ClusterNo_to_FATOffset(cluster_no);
+  // Each thread reads about 32 MB so timings are not dominated by startup
+  int passes = (32 * 1024 * 1024) / current.DIR_FileSize;
+  if (passes < 1)
+    passes = 1;
 
-    while (NextClusterNo(current_cluster) < 0x0FFFFFF6)
+  pthread_t threads[max_threads];
+  STRESS_ARG work[max_threads];
+  double single_rate = 0;
+
+  fprintf(OUT, "%8s %12s %10s\n", "threads", "MB/s", "speedup");
+  // 1, 2, 4 ... threads, always finishing with exactly max_threads
+  for (int count = 1; count <= max_threads;
+       count = (count < max_threads && count * 2 > max_threads) ?
+               max_threads : count * 2)
+  {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < count; i++)
     {
-      int previous_cluster = current_cluster;
-      current_cluster = NextClusterNo(current_cluster);
-      UpdateClusterInFAT(previous_cluster, 0x00000000);
+      work[i].first_cluster = Get_Child_Cluster_No(current);
+      work[i].size = current.DIR_FileSize;
+      work[i].passes = passes;
+      pthread_create(&threads[i], NULL, StressReader, &work[i]);
     }
-    UpdateClusterInFAT(current_cluster, 0x00000000);
 
-    // Then delete the DIRENTRY from the current directory
-    rm_DIR_ENTRY(dir, cluster_no);
+    long long total = 0;
+    for (int i = 0; i < count; i++)
+    {
+      pthread_join(threads[i], NULL);
+      total += work[i].bytes_read;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    double rate = total / (1024.0 * 1024.0) / seconds;
+    if (count == 1)
+      single_rate = rate;
+
+    fprintf(OUT, "%8i %12.1f %9.2fx\n", count, rate, rate / single_rate);
   }
 }
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE // getline, fdopen
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// CLIENT FOR fat.x DAEMON MODE (./fat.x --serve SOCKET imagename)
+// Usage: ./fatc.x SOCKET [command ...]
+//   With a command, runs it and prints the result. Without one, reads
+//   commands from stdin, one per line. A "bwrite FILE OFFSET SIZE" line
+//   is followed by SIZE raw bytes, also taken from stdin.
+
+//--------------------------FUNCTION DECLARATIONS-------------------------------
+
+int Connect(const char* socket_path); // Connect to daemon, -1 on failure
+int SendCommand(int fd, const char* line); // Send one command line
+int SendPayload(int fd, FILE* source, long size); // Copy bwrite bytes
+int ReceiveResponse(FILE* replies); // Print one response frame to stdout
+long PayloadSize(const char* line); // SIZE of a bwrite line, else 0
+
+//------------------------------------MAIN--------------------------------------
+
+int main(int argc, const char * argv[])
+{
+  // CHECK FOR VALID USAGE
+  if (argc < 2)
+  {
+    printf("Usage: ./fatc.x socketpath [command ...]\n");
+    return 1; // Program failure
+  }
+
+  int fd = Connect(argv[1]);
+  if (fd < 0)
+  {
+    printf("Cannot connect to %s\n", argv[1]);
+    return 1;
+  }
+  FILE* replies = fdopen(dup(fd), "r");
+
+  // ONE-SHOT MODE -- command given as arguments
+  if (argc > 2)
+  {
+    char line[4096] = "";
+    for (int i = 2; i < argc; i++)
+    {
+      if (strlen(line) + strlen(argv[i]) + 2 > sizeof(line))
+      {
+        printf("Command too long.\n");
+        return 1;
+      }
+      if (i > 2)
+        strcat(line, " ");
+      strcat(line, argv[i]);
+    }
+
+    if (SendCommand(fd, line) != 0 ||
+        SendPayload(fd, stdin, PayloadSize(line)) != 0 ||
+        ReceiveResponse(replies) != 0)
+      return 1;
+    return 0;
+  }
+
+  // INTERACTIVE / SCRIPT MODE -- one command per line of stdin
+  int interactive = isatty(STDIN_FILENO);
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+
+  while (1)
+  {
+    if (interactive)
+    {
+      printf("> ");
+      fflush(stdout);
+    }
+    if ((length = getline(&line, &capacity, stdin)) <= 0)
+      break; // EOF
+
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+
+    if (SendCommand(fd, line) != 0 ||
+        SendPayload(fd, stdin, PayloadSize(line)) != 0 ||
+        ReceiveResponse(replies) != 0)
+      break; // Daemon went away
+
+    if (strcmp(line, "exit") == 0)
+      break;
+  }
+
+  free(line);
+  fclose(replies);
+  close(fd);
+  return 0;
+}
+
+//---------------------------FUNCTION DEFINITIONS-------------------------------
+
+int Connect(const char* socket_path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path))
+    return -1;
+  strcpy(address.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int SendCommand(int fd, const char* line)
+{
+  size_t length = strlen(line);
+  char* framed = malloc(length + 1);
+  memcpy(framed, line, length);
+  framed[length] = '\n'; // Commands are newline terminated
+
+  size_t sent = 0;
+  while (sent < length + 1)
+  {
+    ssize_t n = write(fd, framed + sent, length + 1 - sent);
+    if (n <= 0)
+    {
+      free(framed);
+      return -1;
+    }
+    sent += n;
+  }
+  free(framed);
+  return 0;
+}
+
+int SendPayload(int fd, FILE* source, long size)
+{
+  char buffer[65536];
+  while (size > 0)
+  {
+    size_t chunk = (size < (long) sizeof(buffer)) ? size : sizeof(buffer);
+    size_t got = fread(buffer, 1, chunk, source);
+    if (got < chunk) // Short input, pad so the daemon stays in step
+      memset(&buffer[got], 0, chunk - got);
+
+    size_t sent = 0;
+    while (sent < chunk)
+    {
+      ssize_t n = write(fd, buffer + sent, chunk - sent);
+      if (n <= 0)
+        return -1;
+      sent += n;
+    }
+    size -= chunk;
+  }
+  return 0;
+}
+
+int ReceiveResponse(FILE* replies)
+{
+  // Header: output length in decimal, then a newline
+  size_t length;
+  if (fscanf(replies, "%zu", &length) != 1 || fgetc(replies) != '\n')
+    return -1;
+
+  char buffer[65536];
+  while (length > 0)
+  {
+    size_t chunk = (length < sizeof(buffer)) ? length : sizeof(buffer);
+    size_t got = fread(buffer, 1, chunk, replies);
+    if (got == 0)
+      return -1;
+    fwrite(buffer, 1, got, stdout);
+    length -= got;
+  }
+  fflush(stdout);
+  return 0;
+}
+
+long PayloadSize(const char* line)
+// The line is split into words as the daemon's get_tokens() does: spaces
+// and tabs separate them, and a word starting with a quote runs to the
+// closing quote. Both sides then agree on when SIZE bytes follow
+{
+  char command[8] = "", size_word[32] = "";
+  const char* read = line;
+  int words = 0;
+  while (words < 4)
+  {
+    while (*read == ' ' || *read == '\t')
+      read++;
+    if (*read == '\0')
+      break;
+
+    // Only the command and SIZE are kept, cut to fit (a longer command
+    // cannot be bwrite)
+    char* word = (words == 0) ? command : (words == 3) ? size_word : NULL;
+    size_t capacity = (words == 0) ? sizeof(command) : sizeof(size_word);
+    size_t length = 0;
+    int quoted = (*read == '"');
+    if (quoted)
+      read++;
+    while (*read != '\0' && (quoted ? *read != '"'
+                                    : *read != ' ' && *read != '\t'))
+    {
+      if (word != NULL && length + 1 < capacity)
+        word[length++] = *read;
+      read++;
+    }
+    if (quoted && *read == '"')
+      read++;
+    if (word != NULL)
+      word[length] = '\0';
+    words++;
+  }
+
+  int size = 0; // An int, as the daemon reads it
+  if (words == 4 && strcmp(command, "bwrite") == 0)
+    sscanf(size_word, "%d", &size);
+  return (size > 0) ? size : 0;
+}
@@ -0,0 +1,415 @@
+#define _GNU_SOURCE // pwrite, ftruncate
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// FAT32 IMAGE GENERATOR FOR BENCHMARKS (see bench.sh, make bench)
+// Usage: ./mkimage.x [options] imagename
+//   -m MB        image size (default 64)
+//   -s BYTES     bytes per sector, 512 to 4096 (default 512)
+//   -c N         sectors per cluster, a power of two (default 1)
+//   -d N         subdirectories per directory (default 4)
+//   -l N         levels of subdirectories below the root (default 2)
+//   -f N         files per directory (default 16)
+//   -z MIN[-MAX] file size in bytes, drawn from MIN to MAX (default 4096)
+//   -F PERCENT   share of file clusters placed away from the cluster before
+//                them, taken from the end of the volume (default 0)
+//   -r SEED      random seed for sizes and fragmentation (default 1)
+//   -w           write file data; by default files are holes, so the image
+//                stays sparse and is built in a fraction of a second
+// Directories are named Dnnn and files Fnnnnn.DAT (8.3 names only), so
+// D000/D001/F00002.DAT is the third file of the second subdirectory of the
+// first directory in the root.
+
+//------------------------------------------------------------------------------
+
+typedef struct{
+
+  int bytes_per_sector, sectors_per_cluster;
+  long size_mb;
+  int fanout, levels, files;
+  long min_size, max_size;
+  int fragmentation; // percent
+  unsigned int seed;
+  int write_data;
+} OPTIONS;
+
+typedef struct{
+
+  int fd;
+  OPTIONS options;
+  uint32_t cluster_size, reserved, fat_sectors, clusters; // clusters: data
+                                                          // clusters + 2
+  uint32_t* fat; // the whole FAT, written to both copies at the end
+  uint32_t low, high; // next cluster from the front, last free at the back
+  long long directories, files, bytes;
+} IMAGE;
+
+#define RESERVED_SECTORS 32
+#define FIXED_DATE ((44 << 9) | (1 << 5) | 1) // 2024-01-01 as a FAT date
+
+//--------------------------FUNCTION DECLARATIONS-------------------------------
+
+int ParseOptions(int argc, const char* argv[], OPTIONS* options);
+                                       // 0 and the image path index, or -1
+int Layout(IMAGE* image); // Sector counts and FAT size, -1 if too small
+uint32_t TakeCluster(IMAGE* image, int far); // Next free cluster from the
+                                       // front (or the back), 0 when full
+uint32_t AllocateRun(IMAGE* image, uint32_t count); // count clusters in a
+                                       // row from the front, linked
+uint32_t AllocateFile(IMAGE* image, uint32_t count); // Chain, fragmented
+                                       // as the options ask
+off_t ClusterOffset(IMAGE* image, uint32_t cluster);
+void SetEntry(uint8_t* slot, const char* name, uint8_t attr,
+              uint32_t cluster, uint32_t size); // Fill one DIR_ENTRY
+int BuildDirectory(IMAGE* image, uint32_t cluster, uint32_t parent,
+                   int level); // Write a directory table and its subtree
+int WriteChain(IMAGE* image, uint32_t first, const uint8_t* data,
+               uint32_t size); // Write data along a chain
+int WriteMetadata(IMAGE* image); // Boot sectors, FSInfo and both FATs
+
+//------------------------------------MAIN--------------------------------------
+
+int main(int argc, const char* argv[])
+{
+  IMAGE image;
+  memset(&image, 0, sizeof(image));
+  int path = ParseOptions(argc, argv, &image.options);
+  if (path < 0)
+  {
+    printf("Usage: ./mkimage.x [-m MB] [-s sector] [-c sectors per cluster] "
+           "[-d fanout] [-l levels] [-f files] [-z min[-max]] [-F percent] "
+           "[-r seed] [-w] imagename\n");
+    return 1;
+  }
+  if (Layout(&image) != 0)
+  {
+    printf("Image too small for a FAT32 layout.\n");
+    return 1;
+  }
+
+  image.fd = open(argv[path], O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (image.fd < 0 ||
+      ftruncate(image.fd, image.options.size_mb * 1024 * 1024) != 0)
+  {
+    printf("Cannot create %s\n", argv[path]);
+    return 1;
+  }
+  srand(image.options.seed);
+
+  image.fat = calloc(image.clusters, sizeof(uint32_t));
+  image.fat[0] = 0x0FFFFFF8;
+  image.fat[1] = 0x0FFFFFFF;
+  image.low = 2;
+  image.high = image.clusters - 1;
+
+  // Root table first, so it sits at cluster 2 like a fresh format
+  uint32_t entries = 1 + image.options.files +
+                     ((image.options.levels > 0) ? image.options.fanout : 0);
+  uint32_t root = AllocateRun(&image, (entries * 32 + image.cluster_size - 1) /
+                                      image.cluster_size);
+  if (root == 0 || BuildDirectory(&image, root, 0, 0) != 0 ||
+      WriteMetadata(&image) != 0)
+  {
+    printf("Out of space: use a larger -m or a smaller tree.\n");
+    close(image.fd);
+    return 1;
+  }
+  close(image.fd);
+
+  printf("%s: %u clusters of %u bytes, %lld directories, %lld files, "
+         "%lld bytes in files, %u clusters free\n", argv[path],
+         image.clusters - 2, image.cluster_size, image.directories,
+         image.files, image.bytes, image.high + 1 - image.low);
+  return 0;
+}
+
+//---------------------------FUNCTION DEFINITIONS-------------------------------
+
+int ParseOptions(int argc, const char* argv[], OPTIONS* options)
+{
+  *options = (OPTIONS) { 512, 1, 64, 4, 2, 16, 4096, 4096, 0, 1, 0 };
+  int arg = 1;
+  for (; arg < argc - 1; arg++)
+  {
+    if (strcmp(argv[arg], "-w") == 0)
+    {
+      options->write_data = 1;
+      continue;
+    }
+    if (argv[arg][0] != '-' || argv[arg][2] != '\0' || arg + 2 >= argc)
+      return -1;
+    const char* value = argv[++arg];
+    switch (argv[arg - 1][1])
+    {
+      case 'm': options->size_mb = atol(value); break;
+      case 's': options->bytes_per_sector = atoi(value); break;
+      case 'c': options->sectors_per_cluster = atoi(value); break;
+      case 'd': options->fanout = atoi(value); break;
+      case 'l': options->levels = atoi(value); break;
+      case 'f': options->files = atoi(value); break;
+      case 'F': options->fragmentation = atoi(value); break;
+      case 'r': options->seed = atoi(value); break;
+      case 'z':
+        if (sscanf(value, "%ld-%ld", &options->min_size,
+                   &options->max_size) == 1)
+          options->max_size = options->min_size;
+        break;
+      default: return -1;
+    }
+  }
+
+  int sector = options->bytes_per_sector, cluster = options->sectors_per_cluster;
+  if (arg != argc - 1 || sector < 512 || sector > 4096 ||
+      (sector & (sector - 1)) != 0 || cluster < 1 || cluster > 128 ||
+      (cluster & (cluster - 1)) != 0 || options->size_mb < 1 ||
+      options->fanout < 0 || options->levels < 0 || options->files < 0 ||
+      options->files > 99999 || options->fanout > 999 ||
+      options->min_size < 0 || options->max_size < options->min_size ||
+      options->max_size > 0xFFFFFFFFL || options->fragmentation < 0 ||
+      options->fragmentation > 100)
+    return -1;
+  return arg;
+}
+
+int Layout(IMAGE* image)
+// Data clusters and FAT size depend on each other: size the FAT for every
+// sector after the reserved ones, then count what is left for data
+{
+  OPTIONS* options = &image->options;
+  uint64_t sectors = options->size_mb * 1024 * 1024 /
+                     options->bytes_per_sector;
+  image->cluster_size = options->bytes_per_sector *
+                        options->sectors_per_cluster;
+  image->reserved = RESERVED_SECTORS;
+  if (sectors > 0xFFFFFFFFULL || sectors < RESERVED_SECTORS + 16)
+    return -1;
+
+  uint64_t estimate = (sectors - RESERVED_SECTORS) /
+                      options->sectors_per_cluster + 2;
+  image->fat_sectors = (estimate * 4 + options->bytes_per_sector - 1) /
+                       options->bytes_per_sector;
+  if (RESERVED_SECTORS + 2ULL * image->fat_sectors >= sectors)
+    return -1;
+  image->clusters = (sectors - RESERVED_SECTORS - 2ULL * image->fat_sectors) /
+                    options->sectors_per_cluster + 2;
+  return (image->clusters > 16) ? 0 : -1;
+}
+
+uint32_t TakeCluster(IMAGE* image, int far)
+{
+  if (image->low > image->high)
+    return 0;
+  return far ? image->high-- : image->low++;
+}
+
+uint32_t AllocateRun(IMAGE* image, uint32_t count)
+{
+  uint32_t first = 0, previous = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t cluster = TakeCluster(image, 0);
+    if (cluster == 0)
+      return 0;
+    image->fat[cluster] = 0x0FFFFFFF;
+    if (previous != 0)
+      image->fat[previous] = cluster;
+    else
+      first = cluster;
+    previous = cluster;
+  }
+  return first;
+}
+
+uint32_t AllocateFile(IMAGE* image, uint32_t count)
+// The first cluster always comes from the front, next to the directory;
+// each later one is moved to the back with the -F probability
+{
+  uint32_t first = 0, previous = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    int far = (i > 0 && rand() % 100 < image->options.fragmentation);
+    uint32_t cluster = TakeCluster(image, far);
+    if (cluster == 0)
+      return 0;
+    image->fat[cluster] = 0x0FFFFFFF;
+    if (previous != 0)
+      image->fat[previous] = cluster;
+    else
+      first = cluster;
+    previous = cluster;
+  }
+  return first;
+}
+
+off_t ClusterOffset(IMAGE* image, uint32_t cluster)
+{
+  off_t first_data = image->reserved + 2 * (off_t) image->fat_sectors;
+  return (first_data + (off_t) (cluster - 2) *
+          image->options.sectors_per_cluster) * image->options.bytes_per_sector;
+}
+
+void SetEntry(uint8_t* slot, const char* name, uint8_t attr,
+              uint32_t cluster, uint32_t size)
+{
+  memset(slot, 0, 32);
+  memcpy(slot, name, 11); // DIR_Name, space padded 8.3
+  slot[11] = attr;
+  uint16_t date = FIXED_DATE;
+  memcpy(&slot[16], &date, 2); // DIR_CrtDate
+  memcpy(&slot[18], &date, 2); // DIR_LstAccDate
+  memcpy(&slot[24], &date, 2); // DIR_WrtDate
+  uint16_t high = cluster >> 16, low = cluster & 0xFFFF;
+  memcpy(&slot[20], &high, 2);
+  memcpy(&slot[26], &low, 2);
+  memcpy(&slot[28], &size, 4);
+}
+
+int BuildDirectory(IMAGE* image, uint32_t cluster, uint32_t parent, int level)
+// Table in memory, then each file's chain (right after the table), then
+// each subdirectory's table and subtree, depth first. The root (parent 0)
+// has no dot entries
+{
+  OPTIONS* options = &image->options;
+  int fanout = (level < options->levels) ? options->fanout : 0;
+  uint32_t entries = ((parent != 0) ? 2 : 1) + options->files + fanout;
+  uint32_t table_clusters = (entries * 32 + image->cluster_size - 1) /
+                            image->cluster_size;
+  uint8_t* table = calloc(table_clusters, image->cluster_size);
+  uint8_t* slot = table;
+  char name[24]; // 11 used, the rest keeps snprintf quiet
+  image->directories++;
+
+  if (parent != 0)
+  {
+    SetEntry(slot, ".          ", 0x10, cluster, 0);
+    SetEntry(slot + 32, "..         ", 0x10, (parent == 2) ? 0 : parent, 0);
+    slot += 64;
+  }
+  else
+  {
+    SetEntry(slot, "BENCH      ", 0x08, 0, 0); // Volume label
+    slot += 32;
+  }
+
+  uint8_t* data = NULL;
+  if (options->write_data)
+    data = malloc(options->max_size + 1);
+  int failed = 0;
+  for (int f = 0; f < options->files && !failed; f++, slot += 32)
+  {
+    long size = options->min_size;
+    if (options->max_size > options->min_size)
+      size += rand() % (options->max_size - options->min_size + 1);
+    uint32_t count = (size + image->cluster_size - 1) / image->cluster_size;
+    uint32_t first = AllocateFile(image, count);
+    if (count > 0 && first == 0)
+      failed = 1;
+    snprintf(name, sizeof(name), "F%05d  DAT", f);
+    SetEntry(slot, name, 0x20, first, size);
+    if (data != NULL && size > 0)
+    {
+      for (long i = 0; i < size; i++) // Readable, and different per file
+        data[i] = (i % 64 == 63) ? '\n' : 'a' + (f + i / 64) % 26;
+      failed |= WriteChain(image, first, data, size);
+    }
+    image->files++;
+    image->bytes += size;
+  }
+  free(data);
+
+  for (int d = 0; d < fanout && !failed; d++, slot += 32)
+  {
+    uint32_t sub_entries = 2 + options->files +
+                           ((level + 1 < options->levels) ? fanout : 0);
+    uint32_t sub = AllocateRun(image, (sub_entries * 32 + image->cluster_size
+                                       - 1) / image->cluster_size);
+    snprintf(name, sizeof(name), "D%03d       ", d);
+    SetEntry(slot, name, 0x10, sub, 0);
+    failed = (sub == 0) || BuildDirectory(image, sub, cluster, level + 1);
+  }
+
+  if (!failed)
+    failed = WriteChain(image, cluster, table,
+                        table_clusters * image->cluster_size);
+  free(table);
+  return failed ? -1 : 0;
+}
+
+int WriteChain(IMAGE* image, uint32_t first, const uint8_t* data,
+               uint32_t size)
+{
+  uint32_t done = 0;
+  for (uint32_t cluster = first; done < size && cluster >= 2 &&
+       cluster < 0x0FFFFFF8; cluster = image->fat[cluster])
+  {
+    uint32_t n = (size - done < image->cluster_size) ? size - done
+                                                     : image->cluster_size;
+    if (pwrite(image->fd, data + done, n, ClusterOffset(image, cluster)) !=
+        (ssize_t) n)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+int WriteMetadata(IMAGE* image)
+{
+  OPTIONS* options = &image->options;
+  int sector_size = options->bytes_per_sector;
+  uint8_t* sector = calloc(1, sector_size);
+
+  // BOOT SECTOR -- offsets as in fat.c's BPB
+  uint16_t u16;
+  uint32_t u32;
+  memcpy(sector, "\xEB\x58\x90" "MKIMAGE ", 11);
+  u16 = sector_size; memcpy(&sector[11], &u16, 2);
+  sector[13] = options->sectors_per_cluster;
+  u16 = image->reserved; memcpy(&sector[14], &u16, 2);
+  sector[16] = 2; // BPB_NumFATs
+  sector[21] = 0xF8; // BPB_Media
+  u16 = 63; memcpy(&sector[24], &u16, 2);
+  u16 = 255; memcpy(&sector[26], &u16, 2);
+  u32 = options->size_mb * 1024 * 1024 / sector_size;
+  memcpy(&sector[32], &u32, 4);
+  u32 = image->fat_sectors; memcpy(&sector[36], &u32, 4);
+  u32 = 2; memcpy(&sector[44], &u32, 4); // BPB_RootClus
+  u16 = 1; memcpy(&sector[48], &u16, 2); // BPB_FSInfo
+  u16 = 6; memcpy(&sector[50], &u16, 2); // BPB_BkBootSec
+  sector[64] = 0x80;
+  sector[66] = 0x29;
+  u32 = options->seed; memcpy(&sector[67], &u32, 4);
+  memcpy(&sector[71], "BENCH      FAT32   ", 19);
+  sector[510] = 0x55;
+  sector[511] = 0xAA;
+  if (pwrite(image->fd, sector, sector_size, 0) != sector_size ||
+      pwrite(image->fd, sector, sector_size, 6 * sector_size) != sector_size)
+    return -1;
+
+  // FSINFO -- free count and next free cluster
+  memset(sector, 0, sector_size);
+  u32 = 0x41615252; memcpy(&sector[0], &u32, 4);
+  u32 = 0x61417272; memcpy(&sector[484], &u32, 4);
+  u32 = image->high + 1 - image->low; memcpy(&sector[488], &u32, 4);
+  u32 = image->low; memcpy(&sector[492], &u32, 4);
+  u32 = 0xAA550000; memcpy(&sector[508], &u32, 4);
+  if (pwrite(image->fd, sector, sector_size, sector_size) != sector_size ||
+      pwrite(image->fd, sector, sector_size, 7 * sector_size) != sector_size)
+    return -1;
+  free(sector);
+
+  // BOTH FATS -- the tail past the last cluster stays zero (a hole)
+  size_t length = (size_t) image->clusters * 4;
+  for (int copy = 0; copy < 2; copy++)
+  {
+    off_t offset = (image->reserved + (off_t) copy * image->fat_sectors) *
+                   sector_size;
+    if (pwrite(image->fd, image->fat, length, offset) != (ssize_t) length)
+      return -1;
+  }
+  return 0;
+}
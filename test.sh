@@ -0,0 +1,309 @@
+#!/bin/sh
+# REGRESSION TESTS (make test)
+# Usage: ./test.sh
+#   Each test runs a batch script through fat.x (or fatc.x clients of a
+#   daemon) against a fresh image from mkimage.x and checks what it prints.
+#   Prints PASS or FAIL per test and exits 1 if any failed.
+
+WORK=${TMPDIR:-/tmp}/fattest.$$
+mkdir -p "$WORK" || exit 1
+trap 'rm -rf "$WORK"' EXIT
+chmod 755 "$WORK"
+cp fat.x "$WORK/fat.x" || exit 1
+cp fatc.x "$WORK/fatc.x" || exit 1
+FAILED=0
+
+# Run fat.x as someone file modes apply to: root reads mode 000 files
+as_user()
+{
+  if [ "$(id -u)" = 0 ]; then
+    setpriv --reuid=65534 --regid=65534 --clear-groups "$@"
+  else
+    "$@"
+  fi
+}
+
+# Image and batch script for test $1, the commands on stdin
+setup()
+{
+  ./mkimage.x -m 16 -d 0 -l 0 -f 4 "$WORK/$1.img" > /dev/null || exit 1
+  cat > "$WORK/$1.cmd"
+  chmod 666 "$WORK/$1.img"
+}
+
+# Start a daemon on $WORK/$1.img, serving on $WORK/$1.sock; DAEMON is its
+# pid. Options for fat.x may follow the name
+serve()
+{
+  name=$1
+  shift
+  rm -f "$WORK/$name.sock" # Left behind by a daemon that was killed
+  "$WORK/fat.x" "$@" --serve "$WORK/$name.sock" "$WORK/$name.img" \
+    > /dev/null 2>&1 &
+  DAEMON=$!
+  for i in $(seq 1 50); do
+    [ -S "$WORK/$name.sock" ] && return
+    sleep 0.1
+  done
+}
+
+# PASS if $WORK/$1.out holds every line given after the name, FAIL if not
+expect()
+{
+  name=$1
+  shift
+  for line in "$@"; do
+    if ! grep -qF -- "$line" "$WORK/$name.out"; then
+      echo "FAIL $name: missing \"$line\""
+      FAILED=1
+      return
+    fi
+  done
+  echo "PASS $name"
+}
+
+# IMPORT -- a host file that cannot be read leaves no entry and no chain
+mkdir -p "$WORK/host/sub"
+head -c 5000 /dev/urandom > "$WORK/host/good.bin"
+head -c 9000 /dev/urandom > "$WORK/host/secret.bin"
+head -c 3000 /dev/urandom > "$WORK/host/sub/locked.dat"
+chmod 000 "$WORK/host/secret.bin" "$WORK/host/sub/locked.dat"
+chmod 755 "$WORK/host" "$WORK/host/sub"
+setup import <<EOF
+import $WORK/host
+check
+open secret.bin r
+cd sub
+open locked.dat r
+EOF
+as_user "$WORK/fat.x" -b "$WORK/import.cmd" "$WORK/import.img" \
+  > "$WORK/import.out" 2>&1
+expect import "Could not copy $WORK/host/secret.bin, not imported." \
+  "Could not copy $WORK/host/sub/locked.dat, not imported." \
+  "Imported 1 files" "no problems found" \
+  "secret.bin not found" "locked.dat not found"
+
+# TOKENS -- a line over MAX_TOKENS (64) words fails whole, nothing removed
+{
+  for i in $(seq 1 70); do echo "creat F$i"; done
+  printf 'rm'
+  for i in $(seq 1 70); do printf ' F%d' "$i"; done
+  echo
+  echo "size F70"
+} | setup tokens
+"$WORK/fat.x" -b "$WORK/tokens.cmd" "$WORK/tokens.img" > "$WORK/tokens.out" \
+  2>&1
+expect tokens "Commands take at most 64 words." "71 1 rm" "72 0 size"
+
+# EXPORT-TAR -- paths over ustar's 255 bytes go in pax headers, and paths
+# too deep to walk fail the command
+LONG=$(printf 'd%.0s' $(seq 1 90))
+{
+  for i in $(seq 1 46); do echo "mkdir ${LONG}$i"; echo "cd ${LONG}$i"; done
+  echo "cd /"
+  echo "cd ${LONG}1/${LONG}2"
+  echo "creat file.txt"
+  echo "cd /"
+  echo "export-tar . $WORK/tar.tar"
+} | setup tar
+"$WORK/fat.x" -b "$WORK/tar.cmd" "$WORK/tar.img" > "$WORK/tar.out" 2>&1
+tar -tf "$WORK/tar.tar" >> "$WORK/tar.out" 2>&1
+expect tar "${LONG}1/${LONG}2/${LONG}3/" "${LONG}1/${LONG}2/file.txt" \
+  "${LONG}45 is nested too deep to export, skipped." "97 4 export-tar"
+
+# HANDLES -- an open file is known by its entry: same names in two
+# directories are two files, any case of a name is the same one, and a
+# handle follows its entry when compact moves it
+setup handles <<EOF
+mkdir a
+mkdir b
+creat a/x.txt
+creat b/x.txt
+open a/x.txt rw
+open b/x.txt rw
+write a/x.txt 5 "AAAAA"
+write b/x.txt 3 "BBB"
+lseek b/x.txt 0
+read b/x.txt 3
+close a/x.txt
+open A/X.TXT r
+read a/x.txt 5
+creat c1
+creat c2
+creat c3
+rm c1 c2
+open c3 rw
+compact
+write c3 4 "CCCC"
+lseek C3 0
+read c3 4
+check
+EOF
+"$WORK/fat.x" -b "$WORK/handles.cmd" "$WORK/handles.img" \
+  > "$WORK/handles.out" 2>&1
+expect handles "BBB" "AAAAA" "CCCC" "no problems found" "0 failed"
+
+# RM-OPEN -- rm closes the handle whatever case the file was opened by,
+# so a new file of the same name is not written through the stale one
+setup rmopen <<EOF
+creat A.TXT
+open a.txt rw
+write a.txt 10 "0123456789"
+rm A.TXT
+creat A.TXT
+write a.txt 5 "ZZZZZ"
+creat B.TXT
+open b.txt rw
+rm B*
+creat B.TXT
+write b.txt 5 "ZZZZZ"
+check
+EOF
+"$WORK/fat.x" -b "$WORK/rmopen.cmd" "$WORK/rmopen.img" \
+  > "$WORK/rmopen.out" 2>&1
+expect rmopen "6 4 write" "11 4 write" "no problems found"
+
+# SESSIONS -- daemon clients each open and write a file of the same name
+# in their own directory at the same time, without sharing a handle
+setup sessions < /dev/null
+serve sessions
+for n in 1 2 3 4; do
+  {
+    echo "mkdir S$n"
+    echo "cd S$n"
+    echo "creat f.txt"
+    echo "open f.txt rw"
+    for i in $(seq 1 20); do echo "write f.txt 4 \"S$n.$i\""; done
+    echo "lseek f.txt 0"
+    echo "read f.txt 8"
+  } | "$WORK/fatc.x" "$WORK/sessions.sock" > "$WORK/sessions.$n" 2>&1 &
+  eval "CLIENT$n=\$!"
+done
+wait $CLIENT1 $CLIENT2 $CLIENT3 $CLIENT4
+kill $DAEMON
+wait $DAEMON 2> /dev/null
+cat "$WORK"/sessions.[1-4] > "$WORK/sessions.out"
+echo check | "$WORK/fat.x" "$WORK/sessions.img" >> "$WORK/sessions.out" 2>&1
+expect sessions "S1.1S1.2" "S2.1S2.2" "S3.1S3.2" "S4.1S4.2" \
+  "no problems found"
+
+# BREAD-BWRITE -- raw transfers take paths like every other command
+setup braw < /dev/null
+serve braw
+{
+  printf 'mkdir d\ncreat d/f.bin\nbwrite d/f.bin 0 6\nHELLO!'
+  printf 'bread /d/f.bin 0 6\nmkdir e\ncd e\n'
+  printf 'bwrite ../d/f.bin 2 3\nxyzbread /d/f.bin 0 6\n'
+} | "$WORK/fatc.x" "$WORK/braw.sock" > "$WORK/braw.out" 2>&1
+kill $DAEMON
+wait $DAEMON 2> /dev/null
+expect braw "6 bytes written" "HELLO!" "3 bytes written" "HExyz!"
+
+# PAYLOAD -- fatc sends bwrite bytes on the daemon's reading of the line:
+# quoted names, leading blanks and tabs (a client out of step hangs, so
+# it is timed out)
+setup payload < /dev/null
+serve payload
+{
+  printf 'creat "my file"\n'
+  printf '  bwrite "my file" 0 4\nabcd'
+  printf '\tbwrite\t"my file" 4 2\nef'
+  printf 'bread "my file" 0 6\n'
+} | timeout 10 "$WORK/fatc.x" "$WORK/payload.sock" > "$WORK/payload.out" \
+  2>&1
+kill $DAEMON
+wait $DAEMON 2> /dev/null
+expect payload "4 bytes written" "2 bytes written" "abcdef"
+
+# RAM-DU -- under --ram the size index is saved only with the image it
+# describes: a session's changes that were never synced leave it alone,
+# synced ones are in both. du from the index must match a walk of a copy
+setup ramdu < /dev/null
+echo du | "$WORK/fat.x" -s "$WORK/ramdu.img" > /dev/null 2>&1
+for step in lost synced; do
+  serve ramdu --ram
+  {
+    echo "mkdir $step"
+    echo "creat $step/f"
+    echo "open $step/f w"
+    echo "write $step/f 5000 \"x\""
+    [ $step = synced ] && echo sync
+  } | "$WORK/fatc.x" "$WORK/ramdu.sock" > /dev/null 2>&1
+  sleep 1 # The session ends (and saves) after its last response is sent
+  kill $DAEMON
+  wait $DAEMON 2> /dev/null
+  cp "$WORK/ramdu.img" "$WORK/ramdu.walk.img"
+  echo du | "$WORK/fat.x" "$WORK/ramdu.img" > "$WORK/ramdu.$step.index" \
+    2> /dev/null
+  echo du | "$WORK/fat.x" "$WORK/ramdu.walk.img" > "$WORK/ramdu.$step.walk" \
+    2> /dev/null
+  if cmp -s "$WORK/ramdu.$step.index" "$WORK/ramdu.$step.walk"; then
+    echo "du matches after $step" >> "$WORK/ramdu.out"
+  fi
+done
+cat "$WORK/ramdu.synced.walk" >> "$WORK/ramdu.out"
+expect ramdu "du matches after lost" "du matches after synced" \
+  "in 5 files and 1 directories"
+
+# REPLAY -- a recorded batch replays against the image it started from
+# with the same output, ls -l file times included: they come from the wall
+# clock in the trace header, so moving it a year back breaks only ls -l
+setup replay <<EOF
+mkdir d
+creat d/f.txt
+open d/f.txt rw
+write d/f.txt 5 "hello"
+ls -l d
+EOF
+cp "$WORK/replay.img" "$WORK/replay.base.img"
+"$WORK/fat.x" --record "$WORK/replay.trace" -b "$WORK/replay.cmd" \
+  "$WORK/replay.img" > /dev/null 2>&1
+"$WORK/fat.x" --replay "$WORK/replay.trace" "$WORK/replay.base.img" \
+  > "$WORK/replay.out" 2>&1
+awk '$2 == "wall" { $3 -= 366 * 86400 } { print }' "$WORK/replay.trace" \
+  > "$WORK/replay.moved.trace"
+"$WORK/fat.x" --replay "$WORK/replay.moved.trace" "$WORK/replay.base.img" \
+  >> "$WORK/replay.out" 2>&1
+expect replay "5 commands, 1 sessions, 0 mismatches" \
+  "Mismatch at command 5 (session 0, ls)" \
+  "5 commands, 1 sessions, 1 mismatches"
+
+# DAEMON-DU -- concurrent sessions creating, writing and removing files
+# keep the size index in step with the image: du from the index matches a
+# walk of a copy, and check finds nothing wrong
+setup daemondu < /dev/null
+echo du | "$WORK/fat.x" -s "$WORK/daemondu.img" > /dev/null 2>&1
+serve daemondu
+for n in 1 2 3 4; do
+  {
+    echo "mkdir D$n"
+    echo "cd D$n"
+    for i in $(seq 1 15); do
+      echo "creat f$i"
+      echo "open f$i w"
+      echo "write f$i $((i * 700)) \"D$n\""
+      echo "close f$i"
+    done
+    echo "rm f1 f2 f3"
+    echo "mv f4 g4"
+  } | timeout 60 "$WORK/fatc.x" "$WORK/daemondu.sock" > /dev/null 2>&1 &
+  eval "CLIENT$n=\$!"
+done
+wait $CLIENT1 $CLIENT2 $CLIENT3 $CLIENT4
+sleep 1 # Sessions save the index after their last response is sent
+kill $DAEMON
+wait $DAEMON 2> /dev/null
+cp "$WORK/daemondu.img" "$WORK/daemondu.walk.img"
+echo du | "$WORK/fat.x" "$WORK/daemondu.img" > "$WORK/daemondu.index" \
+  2> /dev/null
+echo du | "$WORK/fat.x" "$WORK/daemondu.walk.img" > "$WORK/daemondu.walk" \
+  2> /dev/null
+if cmp -s "$WORK/daemondu.index" "$WORK/daemondu.walk"; then
+  echo "du matches" > "$WORK/daemondu.out"
+fi
+cat "$WORK/daemondu.walk" >> "$WORK/daemondu.out"
+echo check | "$WORK/fat.x" "$WORK/daemondu.img" >> "$WORK/daemondu.out" 2>&1
+expect daemondu "du matches" "in 52 files and 4 directories" \
+  "no problems found"
+
+exit $FAILED